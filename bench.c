@@ -0,0 +1,262 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright (c) 2021 Amol Surati
+
+// Throughput of each stage of the assembler, over synthetic sources of
+// 1K to 10M instructions.
+//
+// gcc -O2 -o bench bench.c
+// ./bench [-j] [-r reps] [-n max] [-g num]
+//
+// -j prints JSON instead of CSV, -r keeps the fastest of reps runs, -n
+// stops after the size max, and -g writes the source of num instructions
+// to stdout instead.
+//
+// verify and encode are each timed as one loop over the program. scan,
+// parse and select take turns on each line, so their loop is timed as a
+// whole, and shared out by the TSC cycles that each spent.
+
+#define QAS_NO_MAIN
+#include "qas.c"
+
+#include <stdarg.h>
+
+// The stages that assemble() goes through.
+static const enum stage g_stages[] = {
+	STAGE_SCAN,
+	STAGE_PARSE,
+	STAGE_SELECT,
+	STAGE_VERIFY,
+	STAGE_ENCODE,
+};
+
+struct source {
+	char				*buf;
+	int				size;
+	int				max_size;
+	int				num_instrs;
+	int				num_labels;
+};
+
+static uint32_t g_seed;
+
+static
+uint32_t rand_next(uint32_t n)
+{
+	g_seed = g_seed * 1664525u + 1013904223u;
+	return (g_seed >> 8) % n;
+}
+
+static
+void emit(struct source *src, const char *fmt, ...)
+{
+	va_list args;
+	int n;
+
+	if (src->max_size - src->size < 128) {
+		src->max_size *= 2;
+		src->buf = realloc(src->buf, src->max_size);
+		assert(src->buf);
+	}
+
+	va_start(args, fmt);
+	n = vsnprintf(&src->buf[src->size], src->max_size - src->size, fmt,
+		      args);
+	va_end(args);
+	src->size += n;
+}
+
+// A label every 8 or so instructions. Branches go to a label at most 64
+// labels away, in either direction; each is followed by its 3 delay slots.
+// Roughly 55% ALU, 13% li, 8% branches, 6% semaphores and 12% signals.
+static
+void gen_instr(struct source *src, int num_instrs)
+{
+	static const char *alu2[] = {
+		"fadd r0, r1, r2 fmul r3, r1, a%d",
+		"add a%d, r0, r1 mul24 r1, r2, r3",
+		"sub r1, b%d, r1 v8min r2, r1, r1 sf",
+		"v8adds r0, r0, r1 v8asrot3 r1, r2, r3",
+		"fsub.z r0, r1, a%d fmul.nz r2, r0, r0",
+	};
+	static const char *alu1[] = {
+		"addi r0, r0, -1 sf",
+		"shl r0, r1, 8",
+		"and a%d, r0, 0xff",
+		"or tmu0_s, a%d, a%d",
+		"fmax r1, r4, r1 ur8a",
+		"add a%d, a0, r1 pa8888",
+	};
+	static const char *sigs[] = {
+		"fadd r0, r4, r1 ldtmu0",
+		"ldtmu1",
+		"ts",
+		"add r0, r1, r2 lda",
+		"usb",
+	};
+	static const char *conds[] = {"a", "z", "nz", "zl", "nc"};
+	uint32_t k, n, lo, target;
+
+	if (src->num_instrs && rand_next(8) == 0)
+		emit(src, "L%d:\n", src->num_labels++);
+
+	// a31 and b31 are the scratch registers.
+	k = rand_next(100);
+	n = rand_next(31);
+	if (k < 40) {
+		emit(src, "\t");
+		emit(src, alu2[rand_next(5)], n);
+	} else if (k < 55) {
+		emit(src, "\t");
+		emit(src, alu1[rand_next(6)], n, n);
+	} else if (k < 68) {
+		emit(src, "\t%s a%d, -, 0x%x",
+		     rand_next(2) ? "li" : "liu", n, rand_next(1 << 24));
+	} else if (k < 76 && num_instrs - src->num_instrs > 4) {
+		// gen_source() defines the labels up to num_instrs / 8.
+		lo = src->num_labels > 64 ? src->num_labels - 64 : 0;
+		target = lo + rand_next(128);
+		if (target > (uint32_t)num_instrs / 8)
+			target = num_instrs / 8;
+		emit(src, "\tb.%s L%d;\n\t;\n\t;\n\t;\n",
+		     conds[rand_next(5)], target);
+		src->num_instrs += 4;
+		return;
+	} else if (k < 82) {
+		emit(src, "\t%s -, -, %d", rand_next(2) ? "semup" : "semdn",
+		     n & 15);
+	} else if (k < 94) {
+		emit(src, "\t%s", sigs[rand_next(5)]);
+	} else {
+		emit(src, "\t");
+	}
+	emit(src, ";\n");
+	++src->num_instrs;
+}
+
+static
+void gen_source(struct source *src, int num_instrs)
+{
+	src->size = 0;
+	src->num_instrs = src->num_labels = 0;
+	g_seed = num_instrs;
+
+	emit(src, "# %d instructions\n.scratch a31, b31;\nstart:\n",
+	     num_instrs);
+	while (src->num_instrs < num_instrs)
+		gen_instr(src, num_instrs);
+
+	// Define every label that the branches may have referred to.
+	while (src->num_labels <= num_instrs / 8) {
+		emit(src, "L%d:\n", src->num_labels++);
+		emit(src, "\t;\n");
+		++src->num_instrs;
+	}
+}
+
+static
+void print_result(const struct source *src, const struct stage_clock *best,
+		  char json, char first)
+{
+	double ns, mbps;
+	enum stage s;
+	int i;
+
+	for (i = 0; i < NUM_ARR(g_stages); ++i) {
+		s = g_stages[i];
+		ns = best[s].ns;
+		mbps = ns ? src->size * 1e3 / ns : 0;
+		if (json) {
+			printf("%s\n  {\"instrs\": %d, \"bytes\": %d, "
+			       "\"stage\": \"%s\", \"ns\": %llu, "
+			       "\"cycles\": %llu, \"ns_per_instr\": %.2f, "
+			       "\"mb_per_s\": %.1f}",
+			       first && i == 0 ? "" : ",", src->num_instrs,
+			       src->size, stage_name(s),
+			       (unsigned long long)best[s].ns,
+			       (unsigned long long)best[s].cycles,
+			       ns / src->num_instrs, mbps);
+		} else {
+			printf("%d,%d,%s,%llu,%llu,%.2f,%.1f\n",
+			       src->num_instrs, src->size, stage_name(s),
+			       (unsigned long long)best[s].ns,
+			       (unsigned long long)best[s].cycles,
+			       ns / src->num_instrs, mbps);
+		}
+	}
+	fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+	int reps, max, gen, n, r, i, err;
+	struct stage_clock best[NUM_STAGES];
+	struct source src;
+	struct program prog;
+	char json, first;
+
+	json = 0;
+	reps = 3;
+	max = 10000000;
+	gen = 0;
+	for (i = 1; i < argc; ++i) {
+		if (!strcmp(argv[i], "-j"))
+			json = 1;
+		else if (!strcmp(argv[i], "-r") && i + 1 < argc)
+			reps = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-n") && i + 1 < argc)
+			max = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-g") && i + 1 < argc)
+			gen = atoi(argv[++i]);
+		else
+			break;
+	}
+	if (i != argc || reps < 1) {
+		printf("Usage: %s [-j] [-r reps] [-n max] [-g num]\n", argv[0]);
+		return -EINVAL;
+	}
+
+	memset(&src, 0, sizeof(src));
+	src.max_size = 4096;
+	src.buf = malloc(src.max_size);
+	assert(src.buf);
+
+	if (gen) {
+		gen_source(&src, gen);
+		fwrite(src.buf, 1, src.size, stdout);
+		return ESUCC;
+	}
+
+	show_stats = 1;
+	memset(&prog, 0, sizeof(prog));
+
+	if (json)
+		printf("[");
+	else
+		printf("instrs,bytes,stage,ns,cycles,ns_per_instr,mb_per_s\n");
+
+	first = 1;
+	for (n = 1000; n <= max; n *= 10) {
+		gen_source(&src, n);
+
+		// Keep the fastest run of each stage.
+		for (r = 0; r < reps; ++r) {
+			memset(stage_times, 0, sizeof(stage_times));
+			err = assemble(&prog, src.buf, src.size);
+			if (err) {
+				fprintf(stderr, "%d instructions: error %d\n",
+					n, err);
+				return err;
+			}
+			for (i = 0; i < NUM_STAGES; ++i) {
+				if (r == 0 || stage_times[i].ns < best[i].ns)
+					best[i] = stage_times[i];
+			}
+		}
+		print_result(&src, best, json, first);
+		first = 0;
+	}
+
+	if (json)
+		printf("\n]\n");
+	return ESUCC;
+}
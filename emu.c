@@ -0,0 +1,2507 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright (c) 2021 Amol Surati
+
+// Executes encoded QPU code on the host.
+//
+// Each instruction is translated once, when the code is loaded, into a
+// pre-decoded form: its fields unpacked, its ops bound to 16-lane kernels,
+// its small immediate expanded and its writes classified. Execution then
+// dispatches through the translated form. The kernels are plain loops over
+// the lanes, which the compiler turns into AVX2 or AVX-512 code with
+// -O3 -march=native.
+//
+// With emu_set_jit(), the runs of instructions that touch nothing outside
+// their QPU are further translated, as they are first reached, into x86-64
+// AVX2 code, as described with it below.
+
+#include <math.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <sys/mman.h>
+#endif
+
+#include "bits.h"
+#include "emu.h"
+
+// Field positions within the 64-bit instruction.
+#define DEC_MUL_B_POS			0
+#define DEC_MUL_A_POS			3
+#define DEC_ADD_B_POS			6
+#define DEC_ADD_A_POS			9
+#define DEC_RADDR_B_POS			12
+#define DEC_RADDR_A_POS			18
+#define DEC_OP_ADD_POS			24
+#define DEC_OP_MUL_POS			29
+#define DEC_WADDR_MUL_POS		32
+#define DEC_WADDR_ADD_POS		38
+#define DEC_WS_POS			44
+#define DEC_SF_POS			45
+#define DEC_COND_MUL_POS		46
+#define DEC_COND_ADD_POS		49
+#define DEC_PACK_POS			52
+#define DEC_PM_POS			56
+#define DEC_UNPACK_POS			57
+#define DEC_SIG_POS			60
+#define DEC_IMM_POS			0
+#define DEC_BR_RADDR_A_POS		45
+#define DEC_BR_REG_POS			50
+#define DEC_BR_REL_POS			51
+#define DEC_BR_COND_POS			52
+#define DEC_MUL_B_BITS			3
+#define DEC_MUL_A_BITS			3
+#define DEC_ADD_B_BITS			3
+#define DEC_ADD_A_BITS			3
+#define DEC_RADDR_B_BITS		6
+#define DEC_RADDR_A_BITS		6
+#define DEC_OP_ADD_BITS			5
+#define DEC_OP_MUL_BITS			3
+#define DEC_WADDR_MUL_BITS		6
+#define DEC_WADDR_ADD_BITS		6
+#define DEC_WS_BITS			1
+#define DEC_SF_BITS			1
+#define DEC_COND_MUL_BITS		3
+#define DEC_COND_ADD_BITS		3
+#define DEC_PACK_BITS			4
+#define DEC_PM_BITS			1
+#define DEC_UNPACK_BITS			3
+#define DEC_SIG_BITS			4
+#define DEC_IMM_BITS			32
+#define DEC_BR_RADDR_A_BITS		5
+#define DEC_BR_REG_BITS			1
+#define DEC_BR_REL_BITS			1
+#define DEC_BR_COND_BITS		4
+
+enum sig {
+	SIG_BREAK,
+	SIG_NONE,
+	SIG_THRD_SWITCH,
+	SIG_PROG_END,
+	SIG_WAIT_SB,
+	SIG_UNLOCK_SB,
+	SIG_LAST_THRD_SWITCH,
+	SIG_COVERAGE,
+	SIG_COLOUR,
+	SIG_COLOUR_PROG_END,
+	SIG_LD_TMU0,
+	SIG_LD_TMU1,
+	SIG_LD_ALPHA,
+	SIG_SIMM,
+	SIG_LI,
+	SIG_BR,
+};
+
+enum instr_type {
+	IT_ALU,
+	IT_LI,
+	IT_SEM,
+	IT_BR,
+	IT_INVALID,
+};
+
+// Where a result goes.
+enum write_kind {
+	WK_NOP,
+	WK_RF,
+	WK_ACC,
+	WK_IO,
+};
+
+enum {
+	RADDR_UNIFORM			= 32,
+	RADDR_ELEM_QPU_NUM		= 38,
+	RADDR_VPM			= 48,
+	RADDR_VPM_BUSY			= 49,
+	RADDR_VPM_WAIT			= 50,
+	RADDR_MUTEX			= 51,
+	WADDR_R5			= 37,
+	WADDR_HOST_INT			= 38,
+	WADDR_NOP			= 39,
+	WADDR_UNIFORM_ADDR		= 40,
+	WADDR_VPM			= 48,
+	WADDR_VPM_SETUP			= 49,
+	WADDR_VPM_ADDR			= 50,
+	WADDR_MUTEX			= 51,
+	WADDR_SFU_RECIP			= 52,
+	WADDR_SFU_LOG			= 55,
+	WADDR_TMU0_S			= 56,
+};
+
+typedef void (*emu_op)(union emu_vec *d, const union emu_vec *a,
+		       const union emu_vec *b);
+
+struct emu_instr {
+	emu_op				op[2];		// add, mul
+	uint32_t			imm;
+	const char			*invalid;
+
+	uint8_t				type;
+	uint8_t				sig;
+	uint8_t				code[2];
+	uint8_t				live[2];	// Produces a result.
+	uint8_t				cond[2];
+	uint8_t				waddr[2];
+	uint8_t				file[2];
+	uint8_t				wk[2];
+	uint8_t				read[2];
+	uint8_t				mutex;		// Reads mtx_acq.
+	uint8_t				uniforms;	// Reads of uni_rd.
+	uint8_t				raddr_a;
+	uint8_t				raddr_b;
+	uint8_t				mux[4];
+	uint8_t				sf;
+	uint8_t				pm;
+	uint8_t				pack;
+	uint8_t				unpack;		// Or the li type.
+	uint8_t				unpack_mask;
+	int8_t				rotate;		// 0 for r5.
+	uint8_t				br_cond;
+	uint8_t				br_rel;
+	uint8_t				br_reg;
+};
+
+union bits32 {
+	uint32_t			u;
+	float				f;
+};
+
+#define EMU_OP(name, expr)						\
+static									\
+void op_##name(union emu_vec *d, const union emu_vec *a,		\
+	       const union emu_vec *b)					\
+{									\
+	int i;								\
+									\
+	(void)b;							\
+	for (i = 0; i < EMU_LANES; ++i)					\
+		expr;							\
+}
+
+static inline
+uint32_t v8_adds(uint32_t a, uint32_t b)
+{
+	uint32_t r, s;
+	int i;
+
+	r = 0;
+	for (i = 0; i < 32; i += 8) {
+		s = ((a >> i) & 0xff) + ((b >> i) & 0xff);
+		r |= (s > 0xff ? 0xff : s) << i;
+	}
+	return r;
+}
+
+static inline
+uint32_t v8_subs(uint32_t a, uint32_t b)
+{
+	int32_t s;
+	uint32_t r;
+	int i;
+
+	r = 0;
+	for (i = 0; i < 32; i += 8) {
+		s = (int32_t)((a >> i) & 0xff) - (int32_t)((b >> i) & 0xff);
+		r |= (uint32_t)(s < 0 ? 0 : s) << i;
+	}
+	return r;
+}
+
+// a * b / 255, rounded.
+static inline
+uint32_t v8_muld(uint32_t a, uint32_t b)
+{
+	uint32_t r, t;
+	int i;
+
+	r = 0;
+	for (i = 0; i < 32; i += 8) {
+		t = ((a >> i) & 0xff) * ((b >> i) & 0xff) + 128;
+		r |= ((t + (t >> 8)) >> 8) << i;
+	}
+	return r;
+}
+
+static inline
+uint32_t v8_min(uint32_t a, uint32_t b)
+{
+	uint32_t r, x, y;
+	int i;
+
+	r = 0;
+	for (i = 0; i < 32; i += 8) {
+		x = (a >> i) & 0xff;
+		y = (b >> i) & 0xff;
+		r |= (x < y ? x : y) << i;
+	}
+	return r;
+}
+
+static inline
+uint32_t v8_max(uint32_t a, uint32_t b)
+{
+	uint32_t r, x, y;
+	int i;
+
+	r = 0;
+	for (i = 0; i < 32; i += 8) {
+		x = (a >> i) & 0xff;
+		y = (b >> i) & 0xff;
+		r |= (x > y ? x : y) << i;
+	}
+	return r;
+}
+
+// Out of range conversions give 0.
+static inline
+int32_t f_to_i(float f)
+{
+	return f > -2147483648.0f && f < 2147483648.0f ? (int32_t)f : 0;
+}
+
+EMU_OP(fadd,	d->f[i] = a->f[i] + b->f[i])
+EMU_OP(fsub,	d->f[i] = a->f[i] - b->f[i])
+EMU_OP(fmin,	d->f[i] = a->f[i] < b->f[i] ? a->f[i] : b->f[i])
+EMU_OP(fmax,	d->f[i] = a->f[i] > b->f[i] ? a->f[i] : b->f[i])
+EMU_OP(fminabs,	d->f[i] = fminf(fabsf(a->f[i]), fabsf(b->f[i])))
+EMU_OP(fmaxabs,	d->f[i] = fmaxf(fabsf(a->f[i]), fabsf(b->f[i])))
+EMU_OP(ftoi,	d->i[i] = f_to_i(a->f[i]))
+EMU_OP(itof,	d->f[i] = (float)a->i[i])
+EMU_OP(add,	d->u[i] = a->u[i] + b->u[i])
+EMU_OP(sub,	d->u[i] = a->u[i] - b->u[i])
+EMU_OP(shr,	d->u[i] = a->u[i] >> (b->u[i] & 31))
+EMU_OP(asr,	d->i[i] = a->i[i] >> (b->u[i] & 31))
+EMU_OP(ror,	d->u[i] = a->u[i] >> (b->u[i] & 31) |
+			  a->u[i] << ((32 - (b->u[i] & 31)) & 31))
+EMU_OP(shl,	d->u[i] = a->u[i] << (b->u[i] & 31))
+EMU_OP(min,	d->i[i] = a->i[i] < b->i[i] ? a->i[i] : b->i[i])
+EMU_OP(max,	d->i[i] = a->i[i] > b->i[i] ? a->i[i] : b->i[i])
+EMU_OP(and,	d->u[i] = a->u[i] & b->u[i])
+EMU_OP(or,	d->u[i] = a->u[i] | b->u[i])
+EMU_OP(xor,	d->u[i] = a->u[i] ^ b->u[i])
+EMU_OP(not,	d->u[i] = ~a->u[i])
+EMU_OP(clz,	d->u[i] = a->u[i] ? __builtin_clz(a->u[i]) : 32)
+EMU_OP(v8adds,	d->u[i] = v8_adds(a->u[i], b->u[i]))
+EMU_OP(v8subs,	d->u[i] = v8_subs(a->u[i], b->u[i]))
+EMU_OP(fmul,	d->f[i] = a->f[i] * b->f[i])
+EMU_OP(mul24,	d->u[i] = (a->u[i] & 0xffffff) * (b->u[i] & 0xffffff))
+EMU_OP(v8muld,	d->u[i] = v8_muld(a->u[i], b->u[i]))
+EMU_OP(v8min,	d->u[i] = v8_min(a->u[i], b->u[i]))
+EMU_OP(v8max,	d->u[i] = v8_max(a->u[i], b->u[i]))
+
+// Indexed by the op_add and op_mul fields; NULL for nop and reserved.
+static
+const emu_op g_add_ops[32] = {
+	[1]	= op_fadd,
+	[2]	= op_fsub,
+	[3]	= op_fmin,
+	[4]	= op_fmax,
+	[5]	= op_fminabs,
+	[6]	= op_fmaxabs,
+	[7]	= op_ftoi,
+	[8]	= op_itof,
+	[12]	= op_add,
+	[13]	= op_sub,
+	[14]	= op_shr,
+	[15]	= op_asr,
+	[16]	= op_ror,
+	[17]	= op_shl,
+	[18]	= op_min,
+	[19]	= op_max,
+	[20]	= op_and,
+	[21]	= op_or,
+	[22]	= op_xor,
+	[23]	= op_not,
+	[24]	= op_clz,
+	[30]	= op_v8adds,
+	[31]	= op_v8subs,
+};
+
+static
+const emu_op g_mul_ops[8] = {
+	[1]	= op_fmul,
+	[2]	= op_mul24,
+	[3]	= op_v8muld,
+	[4]	= op_v8min,
+	[5]	= op_v8max,
+	[6]	= op_v8adds,
+	[7]	= op_v8subs,
+};
+
+// Whether the op reads, or writes, floats. These decide the float or the
+// integer form of the unpacks and the regfile A packs.
+static inline
+int is_float_in(int alu, int code)
+{
+	return alu ? code == 1 : code >= 1 && code <= 7;
+}
+
+static inline
+int is_float_out(int alu, int code)
+{
+	return alu ? code == 1 : (code >= 1 && code <= 6) || code == 8;
+}
+
+static
+uint32_t simm_value(int n)
+{
+	union bits32 v;
+
+	if (n < 16)
+		return n;
+	if (n < 32)
+		return n - 32;
+	if (n < 40)
+		v.f = 1 << (n - 32);
+	else
+		v.f = 1.0f / (1 << (48 - n));
+	return v.u;
+}
+
+static
+uint32_t half_to_float(uint32_t h)
+{
+	uint32_t s, e, m;
+	union bits32 v;
+
+	s = (h & 0x8000) << 16;
+	e = (h >> 10) & 0x1f;
+	m = h & 0x3ff;
+	if (e == 0) {
+		v.f = ldexpf(m, -24);
+		return v.u | s;
+	}
+	if (e == 0x1f)
+		return s | 0x7f800000 | m << 13;
+	return s | (e + 112) << 23 | m << 13;
+}
+
+// Truncates; denormals flush to zero.
+static
+uint32_t float_to_half(uint32_t f)
+{
+	uint32_t s, m;
+	int e;
+
+	s = (f >> 16) & 0x8000;
+	e = (int)((f >> 23) & 0xff) - 112;
+	m = (f >> 13) & 0x3ff;
+	if ((f & 0x7fffffff) > 0x7f800000)
+		return s | 0x7e00;
+	if (e >= 0x1f)
+		return s | 0x7c00;
+	if (e <= 0)
+		return s;
+	return s | e << 10 | m;
+}
+
+static inline
+uint32_t float_to_colour(uint32_t f)
+{
+	union bits32 v;
+
+	v.u = f;
+	if (!(v.f > 0))
+		return 0;
+	if (v.f >= 1)
+		return 0xff;
+	return (uint32_t)(v.f * 255 + 0.5f);
+}
+
+static inline
+int32_t clamp(int32_t v, int32_t lo, int32_t hi)
+{
+	return v < lo ? lo : v > hi ? hi : v;
+}
+
+static
+uint32_t unpack_lane(uint32_t v, int code, int is_float)
+{
+	union bits32 c;
+	uint32_t b;
+
+	switch (code) {
+	case 1:
+		return is_float ? half_to_float(v & 0xffff) :
+			(uint32_t)(int16_t)v;
+	case 2:
+		return is_float ? half_to_float(v >> 16) :
+			(uint32_t)(int16_t)(v >> 16);
+	case 3:
+		return (v >> 24) * 0x01010101u;
+	default:
+		b = (v >> ((code - 4) * 8)) & 0xff;
+		if (!is_float)
+			return b;
+		c.f = b / 255.0f;
+		return c.u;
+	}
+}
+
+// The regfile A pack. The 16 and 8-bit forms write only their half or
+// byte.
+static
+uint32_t pack_a_lane(uint32_t v, uint32_t old, int code, int is_float)
+{
+	uint32_t h;
+	int sh;
+
+	switch (code) {
+	case 1:
+	case 2:
+		h = is_float ? float_to_half(v) : v & 0xffff;
+		break;
+	case 9:
+	case 10:
+		h = is_float ? float_to_half(v) :
+			(uint32_t)clamp(v, -32768, 32767) & 0xffff;
+		break;
+	case 3:
+		return (v & 0xff) * 0x01010101u;
+	case 11:
+		return clamp(v, 0, 255) * 0x01010101u;
+	case 4:
+	case 5:
+	case 6:
+	case 7:
+		sh = (code - 4) * 8;
+		return (old & ~(0xffu << sh)) | (v & 0xff) << sh;
+	case 12:
+	case 13:
+	case 14:
+	case 15:
+		sh = (code - 12) * 8;
+		return (old & ~(0xffu << sh)) |
+			(uint32_t)clamp(v, 0, 255) << sh;
+	default:
+		return v;
+	}
+
+	if (code == 1 || code == 9)
+		return (old & 0xffff0000) | h;
+	return (old & 0xffff) | h << 16;
+}
+
+// The mul pack converts a float to an 8-bit colour.
+static
+uint32_t pack_mul_lane(uint32_t v, uint32_t old, int code)
+{
+	uint32_t c;
+	int sh;
+
+	c = float_to_colour(v);
+	if (code == 3)
+		return c * 0x01010101u;
+	sh = (code - 4) * 8;
+	return (old & ~(0xffu << sh)) | c << sh;
+}
+
+static
+int write_kind(int waddr)
+{
+	if (waddr < 32)
+		return WK_RF;
+	if (waddr < 36)
+		return WK_ACC;
+	if (waddr == WADDR_NOP)
+		return WK_NOP;
+	return WK_IO;
+}
+
+// A raddr is read if it has side effects, or if a mux selects it.
+static
+int needs_read(int raddr, int used)
+{
+	if (raddr == WADDR_NOP)
+		return 0;
+	return raddr >= 32 || used;
+}
+
+static
+void translate_alu(struct emu_instr *in, uint64_t w)
+{
+	int i, k, used[2];
+
+	in->type = IT_ALU;
+	in->code[0] = bits_get(w, DEC_OP_ADD);
+	in->code[1] = bits_get(w, DEC_OP_MUL);
+	in->op[0] = g_add_ops[in->code[0]];
+	in->op[1] = g_mul_ops[in->code[1]];
+	if (in->code[0] && !in->op[0])
+		in->invalid = "reserved add op";
+	in->live[0] = in->op[0] != NULL;
+	in->live[1] = in->op[1] != NULL;
+
+	in->raddr_a = bits_get(w, DEC_RADDR_A);
+	in->raddr_b = bits_get(w, DEC_RADDR_B);
+	in->mux[0] = bits_get(w, DEC_ADD_A);
+	in->mux[1] = bits_get(w, DEC_ADD_B);
+	in->mux[2] = bits_get(w, DEC_MUL_A);
+	in->mux[3] = bits_get(w, DEC_MUL_B);
+
+	used[0] = used[1] = 0;
+	for (i = 0; i < 4; ++i) {
+		if (!in->live[i >> 1])
+			continue;
+		used[0] |= in->mux[i] == 6;
+		used[1] |= in->mux[i] == 7;
+	}
+	in->read[0] = needs_read(in->raddr_a, used[0]);
+	in->read[1] = needs_read(in->raddr_b, used[1]);
+
+	if (in->sig == SIG_SIMM) {
+		in->read[1] = 0;
+		if (in->raddr_b < 48)
+			in->imm = simm_value(in->raddr_b);
+		else
+			in->rotate = in->raddr_b - 48;
+	}
+	in->mutex = (in->read[0] && in->raddr_a == RADDR_MUTEX) ||
+		(in->read[1] && in->raddr_b == RADDR_MUTEX);
+	in->uniforms = (in->read[0] && in->raddr_a == RADDR_UNIFORM) +
+		(in->read[1] && in->raddr_b == RADDR_UNIFORM);
+
+	if (in->pm && in->pack && (in->pack < 3 || in->pack > 7))
+		in->invalid = "reserved mul pack";
+
+	// Only the regfile A reads, or the r4 reads, are unpacked.
+	for (i = 0; i < 4 && in->unpack; ++i) {
+		k = in->pm ? in->mux[i] == 4 :
+			in->mux[i] == 6 && in->raddr_a < 32;
+		if (k && in->live[i >> 1])
+			in->unpack_mask |= 1 << i;
+	}
+}
+
+static
+void translate(struct emu_instr *in, uint64_t w)
+{
+	int ws, i;
+
+	memset(in, 0, sizeof(*in));
+	in->sig = bits_get(w, DEC_SIG);
+	in->rotate = -1;
+
+	ws = bits_get(w, DEC_WS);
+	in->waddr[0] = bits_get(w, DEC_WADDR_ADD);
+	in->waddr[1] = bits_get(w, DEC_WADDR_MUL);
+	in->file[0] = ws;
+	in->file[1] = !ws;
+	for (i = 0; i < 2; ++i)
+		in->wk[i] = write_kind(in->waddr[i]);
+
+	if (in->sig == SIG_BR) {
+		// The link address is written unconditionally.
+		in->type = IT_BR;
+		in->live[0] = in->live[1] = 1;
+		in->cond[0] = in->cond[1] = 1;
+		in->imm = bits_get(w, DEC_IMM);
+		in->raddr_a = bits_get(w, DEC_BR_RADDR_A);
+		in->br_cond = bits_get(w, DEC_BR_COND);
+		in->br_rel = bits_get(w, DEC_BR_REL);
+		in->br_reg = bits_get(w, DEC_BR_REG);
+		if (in->br_cond > 11 && in->br_cond != 15)
+			in->invalid = "reserved branch condition";
+		goto done;
+	}
+
+	in->cond[0] = bits_get(w, DEC_COND_ADD);
+	in->cond[1] = bits_get(w, DEC_COND_MUL);
+	in->sf = bits_get(w, DEC_SF);
+	in->pm = bits_get(w, DEC_PM);
+	in->pack = bits_get(w, DEC_PACK);
+	in->unpack = bits_get(w, DEC_UNPACK);
+
+	if (in->sig == SIG_LI) {
+		in->type = in->unpack == 4 ? IT_SEM : IT_LI;
+		in->live[0] = in->live[1] = 1;
+		in->imm = bits_get(w, DEC_IMM);
+		if (in->unpack != 0 && in->unpack != 1 && in->unpack != 3 &&
+		    in->unpack != 4)
+			in->invalid = "reserved load immediate type";
+		if (in->pm && in->pack && (in->pack < 3 || in->pack > 7))
+			in->invalid = "reserved mul pack";
+		goto done;
+	}
+
+	translate_alu(in, w);
+done:
+	if (in->invalid)
+		in->type = IT_INVALID;
+}
+
+static inline
+int load32(const struct emu *e, uint32_t addr, uint32_t *val)
+{
+	addr -= e->mem_base;
+	if (e->mem_size < 4 || addr > e->mem_size - 4 || (addr & 3))
+		return -EINVAL;
+	memcpy(val, &e->mem[addr], 4);
+	return ESUCC;
+}
+
+// The cycle at which the line holding addr is available. The L2 is 4-way
+// set associative, with LRU replacement.
+static
+uint64_t mem_ready(struct emu *e, uint32_t addr)
+{
+	const struct emu_timing *t;
+	uint64_t start, *used, *ready;
+	uint32_t line, *tags;
+	int w, victim;
+
+	if (!e->timed)
+		return 0;
+
+	t = &e->timing;
+	line = addr / EMU_L2_LINE;
+	tags = NULL;
+	used = ready = NULL;
+	victim = 0;
+	if (e->l2_sets) {
+		w = (line % e->l2_sets) * EMU_L2_WAYS;
+		tags = &e->l2_tags[w];
+		used = &e->l2_used[w];
+		ready = &e->l2_ready[w];
+		for (w = 0; w < EMU_L2_WAYS; ++w) {
+			// The tags are offset by one; 0 is an empty way.
+			if (tags[w] == line + 1) {
+				++e->l2_hits;
+				used[w] = e->cycle;
+				start = e->cycle + t->l2_latency;
+				return start > ready[w] ? start : ready[w];
+			}
+			if (used[w] < used[victim])
+				victim = w;
+		}
+	}
+
+	++e->l2_misses;
+	start = e->cycle > e->bus_free ? e->cycle : e->bus_free;
+	e->bus_free = start;
+	if (t->bytes_per_cycle)
+		e->bus_free += (EMU_L2_LINE + t->bytes_per_cycle - 1) /
+			t->bytes_per_cycle;
+	start = e->bus_free + t->mem_latency;
+	if (tags) {
+		tags[victim] = line + 1;
+		used[victim] = e->cycle;
+		ready[victim] = start;
+	}
+	return start;
+}
+
+static inline
+int store32(struct emu *e, uint32_t addr, uint32_t val)
+{
+	addr -= e->mem_base;
+	if (e->mem_size < 4 || addr > e->mem_size - 4 || (addr & 3))
+		return -EINVAL;
+	memcpy(&e->mem[addr], &val, 4);
+	return ESUCC;
+}
+
+static inline
+void broadcast(union emu_vec *d, uint32_t v)
+{
+	int i;
+
+	for (i = 0; i < EMU_LANES; ++i)
+		d->u[i] = v;
+}
+
+// Element i of the vector at a 32-bit VPM address: a row for the
+// horizontal accesses, and a column of 16 rows for the vertical ones.
+static inline
+uint32_t *vpm_elem(struct emu *e, int addr, int horiz, int i)
+{
+	if (horiz)
+		return &e->vpm[addr & (EMU_VPM_ROWS - 1)][i];
+	return &e->vpm[((addr >> 4) & 3) * EMU_LANES + i][addr & 15];
+}
+
+// The generic block setup: num 23:20 (reads only), stride 17:12, horiz
+// 11, laned 10, size 9:8 and addr 7:0.
+static
+int vpm_setup(struct emu_qpu *q, struct emu_vpm_access *a, uint32_t v,
+	      int is_rd)
+{
+	if (((v >> 8) & 3) != 2) {
+		q->fault = "only 32-bit VPM accesses are supported";
+		return -EINVAL;
+	}
+
+	a->addr = v & 0xff;
+	a->stride = (v >> 12) & 0x3f;
+	if (a->stride == 0)
+		a->stride = 64;
+	a->horiz = (v >> 11) & 1;
+	a->num = 0;
+	if (is_rd) {
+		a->num = (v >> 20) & 15;
+		if (a->num == 0)
+			a->num = 16;
+	}
+	return ESUCC;
+}
+
+static
+int vpm_read(struct emu_qpu *q, union emu_vec *d)
+{
+	struct emu_vpm_access *a;
+	int i;
+
+	a = &q->vpm_rd;
+	if (a->num == 0) {
+		q->fault = "VPM read beyond its setup";
+		return -EINVAL;
+	}
+
+	for (i = 0; i < EMU_LANES; ++i)
+		d->u[i] = *vpm_elem(q->emu, a->addr, a->horiz, i);
+	a->addr += a->stride;
+	--a->num;
+	return ESUCC;
+}
+
+static
+int vpm_write(struct emu_qpu *q, const union emu_vec *v, const uint32_t *m)
+{
+	struct emu_vpm_access *a;
+	int i;
+
+	a = &q->vpm_wr;
+	if (a->stride == 0) {
+		q->fault = "VPM write without a setup";
+		return -EINVAL;
+	}
+
+	for (i = 0; i < EMU_LANES; ++i) {
+		if (m[i])
+			*vpm_elem(q->emu, a->addr, a->horiz, i) = v->u[i];
+	}
+	a->addr += a->stride;
+	return ESUCC;
+}
+
+// The DMA store, from the basic setup: units 29:23, depth 22:16, horiz 14,
+// the VPM y 13:7 and x 6:3, and modew 2:0. The stride setup gives the
+// bytes between the units in memory.
+static
+int vdw_store(struct emu_qpu *q, uint32_t addr)
+{
+	uint32_t s, units, depth, u, i, x, y, row, col;
+	struct emu *e;
+
+	e = q->emu;
+	s = q->vdw_setup;
+	if ((s >> 30) != 2) {
+		q->fault = "DMA store without a setup";
+		return -EINVAL;
+	}
+	if (s & 7) {
+		q->fault = "only 32-bit DMA is supported";
+		return -EINVAL;
+	}
+
+	units = (s >> 23) & 0x7f;
+	depth = (s >> 16) & 0x7f;
+	units = units ? units : 128;
+	depth = depth ? depth : 128;
+	y = (s >> 7) & 0x7f;
+	x = (s >> 3) & 15;
+	for (u = 0; u < units; ++u) {
+		for (i = 0; i < depth; ++i) {
+			row = (s >> 14) & 1 ? y + u : y + i;
+			col = (s >> 14) & 1 ? x + i : x + u;
+			if (store32(e, addr, e->vpm[row & (EMU_VPM_ROWS - 1)]
+				    [col & 15])) {
+				q->fault = "DMA store out of range";
+				return -EINVAL;
+			}
+			addr += 4;
+		}
+		addr += q->vdw_stride;
+	}
+	return ESUCC;
+}
+
+// The DMA load: modew 30:28, mpitch 27:24, rowlen 23:20, nrows 19:16,
+// vpitch 15:12, vert 11, and the VPM y 10:4 and x 3:0. The pitch in memory
+// is 8 << mpitch, or that of the extended setup if mpitch is 0.
+static
+int vdr_load(struct emu_qpu *q, uint32_t addr)
+{
+	uint32_t s, pitch, rowlen, nrows, vpitch, r, i, x, y, row, col;
+	struct emu *e;
+
+	e = q->emu;
+	s = q->vdr_setup;
+	if (!(s >> 31)) {
+		q->fault = "DMA load without a setup";
+		return -EINVAL;
+	}
+	if ((s >> 28) & 7) {
+		q->fault = "only 32-bit DMA is supported";
+		return -EINVAL;
+	}
+
+	pitch = (s >> 24) & 15;
+	pitch = pitch ? 8u << pitch : q->vdr_pitch;
+	rowlen = (s >> 20) & 15;
+	nrows = (s >> 16) & 15;
+	vpitch = (s >> 12) & 15;
+	rowlen = rowlen ? rowlen : 16;
+	nrows = nrows ? nrows : 16;
+	vpitch = vpitch ? vpitch : 16;
+	y = (s >> 4) & 0x7f;
+	x = s & 15;
+	for (r = 0; r < nrows; ++r) {
+		for (i = 0; i < rowlen; ++i) {
+			row = (s >> 11) & 1 ? y + i : y + r * vpitch;
+			col = (s >> 11) & 1 ? x + r * vpitch : x + i;
+			if (load32(e, addr + r * pitch + i * 4,
+				   &e->vpm[row & (EMU_VPM_ROWS - 1)][col & 15])) {
+				q->fault = "DMA load out of range";
+				return -EINVAL;
+			}
+		}
+	}
+	return ESUCC;
+}
+
+// vpm_rd_setup takes the generic read setups, and the DMA load setups,
+// which have bit 31 set. 0b1001 in 31:28 marks the extended pitch.
+static
+int write_vpm_rd_setup(struct emu_qpu *q, uint32_t v)
+{
+	if (!(v >> 31))
+		return vpm_setup(q, &q->vpm_rd, v, 1);
+	if ((v >> 28) == 9)
+		q->vdr_pitch = v & 0x1fff;
+	else
+		q->vdr_setup = v;
+	return ESUCC;
+}
+
+// vpm_wr_setup takes the generic write setups, with 0 in 31:30, and the
+// DMA store basic and stride setups, with 2 and 3.
+static
+int write_vpm_wr_setup(struct emu_qpu *q, uint32_t v)
+{
+	switch (v >> 30) {
+	case 0:
+		return vpm_setup(q, &q->vpm_wr, v, 0);
+	case 2:
+		q->vdw_setup = v;
+		return ESUCC;
+	case 3:
+		q->vdw_stride = v & 0x1fff;
+		return ESUCC;
+	default:
+		q->fault = "reserved VPM write setup";
+		return -EINVAL;
+	}
+}
+
+static
+int read_raddr(struct emu_qpu *q, int file, int raddr, union emu_vec *d)
+{
+	uint32_t v;
+	int i;
+
+	if (raddr < 32) {
+		*d = q->rf[file][raddr];
+		return ESUCC;
+	}
+
+	switch (raddr) {
+	case RADDR_UNIFORM:
+		if (load32(q->emu, q->uni_addr, &v)) {
+			q->fault = "uniform read out of range";
+			return -EINVAL;
+		}
+		q->uni_addr += 4;
+		broadcast(d, v);
+		return ESUCC;
+	case RADDR_ELEM_QPU_NUM:
+		for (i = 0; i < EMU_LANES; ++i)
+			d->u[i] = file ? (uint32_t)q->num : (uint32_t)i;
+		return ESUCC;
+	case RADDR_VPM:
+		return vpm_read(q, d);
+	case 41:	// x_px_coord, y_px_coord
+	case 42:	// ms_flags, rev_flag
+	case RADDR_MUTEX:
+		broadcast(d, 0);
+		return ESUCC;
+	case RADDR_VPM_BUSY:
+	case RADDR_VPM_WAIT:
+		// The DMA completes as soon as it starts.
+		broadcast(d, 0);
+		return ESUCC;
+	default:
+		q->fault = "unsupported read of an IO register";
+		return -EINVAL;
+	}
+}
+
+enum {
+	LANES_NONE,
+	LANES_SOME,
+	LANES_ALL,
+};
+
+// Which lanes the cond selects. The mask is left alone for LANES_ALL, so
+// that the unconditional writes are plain copies.
+static inline
+int cond_mask(const struct emu_qpu *q, int cond, uint32_t *m)
+{
+	uint32_t any;
+	int i;
+
+	switch (cond) {
+	case 0:
+		return LANES_NONE;
+	case 1:
+		return LANES_ALL;
+	case 2:	memcpy(m, q->z, sizeof(q->z)); break;
+	case 4:	memcpy(m, q->n, sizeof(q->n)); break;
+	case 6:	memcpy(m, q->c, sizeof(q->c)); break;
+	case 3:
+		for (i = 0; i < EMU_LANES; ++i)
+			m[i] = ~q->z[i];
+		break;
+	case 5:
+		for (i = 0; i < EMU_LANES; ++i)
+			m[i] = ~q->n[i];
+		break;
+	default:
+		for (i = 0; i < EMU_LANES; ++i)
+			m[i] = ~q->c[i];
+		break;
+	}
+
+	any = 0;
+	for (i = 0; i < EMU_LANES; ++i)
+		any |= m[i];
+	return any ? LANES_SOME : LANES_NONE;
+}
+
+// C is the carry of add, the borrow of sub, and a > b for the min/max
+// ops; it is clear otherwise.
+static
+void set_carry(struct emu_qpu *q, int code, const union emu_vec *a,
+	       const union emu_vec *b)
+{
+	uint32_t *c;
+	int i;
+
+	c = q->c;
+	switch (code) {
+	case 3:
+	case 4:
+		for (i = 0; i < EMU_LANES; ++i)
+			c[i] = -(uint32_t)(a->f[i] > b->f[i]);
+		break;
+	case 5:
+	case 6:
+		for (i = 0; i < EMU_LANES; ++i)
+			c[i] = -(uint32_t)(fabsf(a->f[i]) > fabsf(b->f[i]));
+		break;
+	case 12:
+		for (i = 0; i < EMU_LANES; ++i)
+			c[i] = -(uint32_t)(a->u[i] + b->u[i] < a->u[i]);
+		break;
+	case 13:
+		for (i = 0; i < EMU_LANES; ++i)
+			c[i] = -(uint32_t)(a->u[i] < b->u[i]);
+		break;
+	case 18:
+	case 19:
+		for (i = 0; i < EMU_LANES; ++i)
+			c[i] = -(uint32_t)(a->i[i] > b->i[i]);
+		break;
+	default:
+		memset(c, 0, sizeof(q->c));
+		break;
+	}
+}
+
+// The flags come from the add result, unless the add ALU is a nop or
+// never writes.
+static
+void set_flags(struct emu_qpu *q, const struct emu_instr *in,
+	       const union emu_vec **src)
+{
+	const union emu_vec *r;
+	int alu, i;
+
+	alu = in->live[0] && in->cond[0] ? 0 : 1;
+	if (!in->live[alu])
+		return;
+
+	r = &q->res[alu];
+	for (i = 0; i < EMU_LANES; ++i) {
+		q->z[i] = r->u[i] ? 0 : ~0u;
+		q->n[i] = r->i[i] >> 31;
+	}
+	if (alu == 0 && src)
+		set_carry(q, in->code[0], src[0], src[1]);
+	else
+		memset(q->c, 0, sizeof(q->c));
+}
+
+static
+void apply_unpack(struct emu_qpu *q, const struct emu_instr *in,
+		  const union emu_vec **src)
+{
+	union emu_vec *d;
+	int k, i, is_float;
+
+	for (k = 0; k < 4; ++k) {
+		if (!((in->unpack_mask >> k) & 1))
+			continue;
+		d = &q->tmp[k];
+		is_float = in->pm || is_float_in(k >> 1, in->code[k >> 1]);
+		for (i = 0; i < EMU_LANES; ++i)
+			d->u[i] = unpack_lane(src[k]->u[i], in->unpack,
+					      is_float);
+		src[k] = d;
+	}
+}
+
+// The full-vector rotate of the mul inputs, by r5 or by a constant.
+static
+void apply_rotate(struct emu_qpu *q, const struct emu_instr *in,
+		  const union emu_vec **src)
+{
+	union emu_vec *d;
+	int k, i, n;
+
+	n = in->rotate ? in->rotate : (int)(q->reg[5].u[0] & 15);
+	for (k = 2; k < 4; ++k) {
+		d = &q->tmp[k];
+		for (i = 0; i < EMU_LANES; ++i)
+			d->u[(i + n) & 15] = src[k]->u[i];
+		src[k] = d;
+	}
+}
+
+static
+union emu_vec *dst_vec(struct emu_qpu *q, const struct emu_instr *in,
+		       int alu)
+{
+	if (in->wk[alu] == WK_RF)
+		return &q->rf[(int)in->file[alu]][in->waddr[alu]];
+	if (in->wk[alu] == WK_ACC)
+		return &q->reg[in->waddr[alu] - 32];
+	return NULL;
+}
+
+static
+void apply_pack(struct emu_qpu *q, const struct emu_instr *in)
+{
+	const union emu_vec *old;
+	union emu_vec *r;
+	int alu, i, is_float;
+
+	if (in->pm) {
+		r = &q->res[1];
+		old = dst_vec(q, in, 1);
+		for (i = 0; i < EMU_LANES; ++i)
+			r->u[i] = pack_mul_lane(r->u[i], old ? old->u[i] : 0,
+						in->pack);
+		return;
+	}
+
+	// Whichever ALU writes to regfile A.
+	alu = in->file[0] == 0 ? 0 : 1;
+	if (in->wk[alu] != WK_RF)
+		return;
+	r = &q->res[alu];
+	old = dst_vec(q, in, alu);
+	is_float = in->type == IT_ALU && is_float_out(alu, in->code[alu]);
+	for (i = 0; i < EMU_LANES; ++i)
+		r->u[i] = pack_a_lane(r->u[i], old->u[i], in->pack, is_float);
+}
+
+static
+int write_sfu(struct emu_qpu *q, int waddr, const union emu_vec *v)
+{
+	int i;
+
+	for (i = 0; i < EMU_LANES; ++i) {
+		switch (waddr) {
+		case WADDR_SFU_RECIP:
+			q->sfu.f[i] = 1.0f / v->f[i];
+			break;
+		case WADDR_SFU_RECIP + 1:
+			q->sfu.f[i] = 1.0f / sqrtf(v->f[i]);
+			break;
+		case WADDR_SFU_RECIP + 2:
+			q->sfu.f[i] = exp2f(v->f[i]);
+			break;
+		default:
+			q->sfu.f[i] = log2f(v->f[i]);
+			break;
+		}
+	}
+
+	// r4 holds the result two instructions later.
+	q->sfu_countdown = 2;
+	return ESUCC;
+}
+
+// Only the general memory lookups, with just the s parameter written, are
+// supported.
+static
+int write_tmu(struct emu_qpu *q, int waddr, const union emu_vec *v,
+	      const uint32_t *m)
+{
+	struct emu_tmu *t;
+	union emu_vec *d;
+	struct emu *e;
+	uint64_t ready;
+	int i, j;
+
+	t = &q->tmu[(waddr - WADDR_TMU0_S) >> 2];
+	if ((waddr - WADDR_TMU0_S) & 3) {
+		t->params = 1;
+		return ESUCC;
+	}
+
+	if (t->params) {
+		q->fault = "texture lookups are not supported";
+		return -EINVAL;
+	}
+	e = q->emu;
+	if (t->num == (e->timed ? e->timing.tmu_fifo : EMU_TMU_FIFO)) {
+		q->fault = "TMU FIFO overflow";
+		return -EINVAL;
+	}
+
+	j = (t->head + t->num) % EMU_TMU_FIFO;
+	d = &t->fifo[j];
+	t->issued[j] = e->cycle;
+	t->ready[j] = 0;
+	for (i = 0; i < EMU_LANES; ++i) {
+		d->u[i] = 0;
+		if (!m[i])
+			continue;
+		if (load32(e, v->u[i], &d->u[i])) {
+			q->fault = "TMU load out of range";
+			return -EINVAL;
+		}
+		ready = mem_ready(e, v->u[i]);
+		if (ready > t->ready[j])
+			t->ready[j] = ready;
+	}
+	++t->num;
+	return ESUCC;
+}
+
+static
+int write_io(struct emu_qpu *q, int file, int waddr, const union emu_vec *v,
+	     const uint32_t *m)
+{
+	union emu_vec *r5;
+	int i, j;
+
+	if (waddr >= WADDR_TMU0_S)
+		return write_tmu(q, waddr, v, m);
+	if (waddr >= WADDR_SFU_RECIP && waddr <= WADDR_SFU_LOG)
+		return write_sfu(q, waddr, v);
+
+	switch (waddr) {
+	case 36:	// tmu_noswap
+	case 41:	// quad_x, quad_y
+	case 42:	// ms_flags, rev_flag
+		return ESUCC;
+	case WADDR_R5:
+		// Regfile A replicates pixel 0 of each quad, regfile B, the
+		// element 0.
+		r5 = &q->reg[5];
+		for (i = 0; i < EMU_LANES; ++i) {
+			j = file ? 0 : i & ~3;
+			if (m[j])
+				r5->u[i] = v->u[j];
+		}
+		return ESUCC;
+	case WADDR_HOST_INT:
+		q->host_int = 1;
+		return ESUCC;
+	case WADDR_UNIFORM_ADDR:
+		q->uni_addr = v->u[0];
+		return ESUCC;
+	case WADDR_VPM:
+		return vpm_write(q, v, m);
+	case WADDR_VPM_SETUP:
+		if (file)
+			return write_vpm_wr_setup(q, v->u[0]);
+		return write_vpm_rd_setup(q, v->u[0]);
+	case WADDR_VPM_ADDR:
+		if (file)
+			return vdw_store(q, v->u[0]);
+		return vdr_load(q, v->u[0]);
+	case WADDR_MUTEX:
+		if (q->emu->mutex_owner != q->num) {
+			q->fault = "mutex released without holding it";
+			return -EINVAL;
+		}
+		q->emu->mutex_owner = -1;
+		return ESUCC;
+	default:
+		q->fault = "unsupported write to an IO register";
+		return -EINVAL;
+	}
+}
+
+static
+int write_result(struct emu_qpu *q, const struct emu_instr *in, int alu,
+		 int lanes, uint32_t *m)
+{
+	const union emu_vec *v;
+	union emu_vec *d;
+	int i;
+
+	v = &q->res[alu];
+	d = dst_vec(q, in, alu);
+	if (d && lanes == LANES_ALL) {
+		*d = *v;
+		return ESUCC;
+	}
+
+	if (lanes == LANES_ALL) {
+		for (i = 0; i < EMU_LANES; ++i)
+			m[i] = ~0u;
+	}
+	if (d == NULL) {
+		if (in->wk[alu] == WK_NOP)
+			return ESUCC;
+		return write_io(q, in->file[alu], in->waddr[alu], v, m);
+	}
+
+	for (i = 0; i < EMU_LANES; ++i)
+		d->u[i] = (v->u[i] & m[i]) | (d->u[i] & ~m[i]);
+	return ESUCC;
+}
+
+// The conditions see the flags from before the instruction; the writes
+// happen after all the reads.
+static
+int commit(struct emu_qpu *q, const struct emu_instr *in,
+	   const union emu_vec **src)
+{
+	uint32_t mask[2][EMU_LANES] __attribute__((aligned(64)));
+	int lanes[2], i;
+
+	for (i = 0; i < 2; ++i) {
+		lanes[i] = LANES_NONE;
+		if (in->live[i])
+			lanes[i] = cond_mask(q, in->cond[i], mask[i]);
+	}
+	if (in->sf)
+		set_flags(q, in, src);
+	if (in->pack)
+		apply_pack(q, in);
+
+	for (i = 0; i < 2; ++i) {
+		if (lanes[i] != LANES_NONE &&
+		    write_result(q, in, i, lanes[i], mask[i]))
+			return -EINVAL;
+	}
+	return ESUCC;
+}
+
+static
+enum emu_status exec_signal(struct emu_qpu *q, const struct emu_instr *in)
+{
+	struct emu_tmu *t;
+
+	switch (in->sig) {
+	case SIG_BREAK:
+		q->fault = "breakpoint";
+		return EMU_FAULT;
+	case SIG_PROG_END:
+		// Two delay slots follow.
+		q->end_countdown = 3;
+		return EMU_RUNNING;
+	case SIG_LD_TMU0:
+	case SIG_LD_TMU1:
+		t = &q->tmu[in->sig - SIG_LD_TMU0];
+		if (t->num == 0) {
+			q->fault = "TMU load with an empty FIFO";
+			return EMU_FAULT;
+		}
+		q->reg[4] = t->fifo[t->head];
+		++q->tmu_loads;
+		q->tmu_lead += q->emu->cycle - t->issued[t->head];
+		if (t->ready[t->head] > t->issued[t->head])
+			q->tmu_latency += t->ready[t->head] - t->issued[t->head];
+		t->head = (t->head + 1) % EMU_TMU_FIFO;
+		--t->num;
+		return EMU_RUNNING;
+	case SIG_COVERAGE:
+	case SIG_COLOUR:
+	case SIG_COLOUR_PROG_END:
+	case SIG_LD_ALPHA:
+		q->fault = "unsupported signal";
+		return EMU_FAULT;
+	default:
+		return EMU_RUNNING;
+	}
+}
+
+// When timed, an ldtmu waits for its data, and a uni_rd for the line
+// holding its uniform. The stream keeps a single line.
+static
+int stalls(struct emu_qpu *q, const struct emu_instr *in)
+{
+	struct emu_tmu *t;
+	struct emu *e;
+	uint32_t line;
+
+	e = q->emu;
+	if (in->sig == SIG_LD_TMU0 || in->sig == SIG_LD_TMU1) {
+		t = &q->tmu[in->sig - SIG_LD_TMU0];
+		if (t->num && t->ready[t->head] > e->cycle) {
+			q->block = EMU_BLOCK_TMU;
+			return 1;
+		}
+	}
+
+	if (in->uniforms) {
+		line = (q->uni_addr + 4 * (in->uniforms - 1)) / EMU_L2_LINE;
+		if (line != q->uni_line) {
+			q->uni_line = line;
+			q->uni_ready = mem_ready(e, line * EMU_L2_LINE);
+		}
+		if (q->uni_ready > e->cycle) {
+			q->block = EMU_BLOCK_UNIFORM;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static
+enum emu_status exec_alu(struct emu_qpu *q, const struct emu_instr *in)
+{
+	const union emu_vec *src[4];
+	struct emu *e;
+	int i;
+
+	// The stalls and the mutex are checked before any reads, so that a
+	// blocked instruction has no effects.
+	e = q->emu;
+	if (e->timed && stalls(q, in))
+		return EMU_BLOCKED;
+	if (in->mutex) {
+		if (e->mutex_owner >= 0 && e->mutex_owner != q->num) {
+			q->block = EMU_BLOCK_MUTEX;
+			return EMU_BLOCKED;
+		}
+		e->mutex_owner = q->num;
+	}
+
+	if (in->read[0] && read_raddr(q, 0, in->raddr_a, &q->reg[6]))
+		return EMU_FAULT;
+	if (in->read[1] && read_raddr(q, 1, in->raddr_b, &q->reg[7]))
+		return EMU_FAULT;
+	if (in->sig == SIG_SIMM && in->rotate < 0)
+		broadcast(&q->reg[7], in->imm);
+
+	for (i = 0; i < 4; ++i)
+		src[i] = &q->reg[in->mux[i]];
+	if (in->unpack_mask)
+		apply_unpack(q, in, src);
+	if (in->rotate >= 0)
+		apply_rotate(q, in, src);
+
+	for (i = 0; i < 2; ++i) {
+		if (in->op[i])
+			in->op[i](&q->res[i], src[2 * i], src[2 * i + 1]);
+	}
+
+	if (commit(q, in, src))
+		return EMU_FAULT;
+	return exec_signal(q, in);
+}
+
+// lis and liu load a 2-bit value per element: bit i of the immediate
+// is its LSB, bit i + 16, its MSB.
+static
+enum emu_status exec_load_imm(struct emu_qpu *q, const struct emu_instr *in)
+{
+	int *sem, i;
+	uint32_t b;
+
+	if (in->type == IT_SEM) {
+		q->block = EMU_BLOCK_SEM;
+		sem = &q->emu->sems[in->imm & 15];
+		if (in->imm & 16) {
+			if (*sem == 0)
+				return EMU_BLOCKED;
+			--*sem;
+		} else {
+			if (*sem == 15)
+				return EMU_BLOCKED;
+			++*sem;
+		}
+	}
+
+	for (i = 0; i < EMU_LANES; ++i) {
+		b = ((in->imm >> i) & 1) | ((in->imm >> (i + 15)) & 2);
+		switch (in->unpack) {
+		case 1:
+			q->res[0].i[i] = (int32_t)(b ^ 2) - 2;
+			break;
+		case 3:
+			q->res[0].u[i] = b;
+			break;
+		default:
+			q->res[0].u[i] = in->imm;
+			break;
+		}
+	}
+	q->res[1] = q->res[0];
+
+	if (commit(q, in, NULL))
+		return EMU_FAULT;
+	return EMU_RUNNING;
+}
+
+static
+int branch_taken(const struct emu_qpu *q, int cond)
+{
+	const uint32_t *f;
+	uint32_t any, all;
+	int i;
+
+	if (cond == 15)
+		return 1;
+
+	f = cond < 4 ? q->z : cond < 8 ? q->n : q->c;
+	any = 0;
+	all = ~0u;
+	for (i = 0; i < EMU_LANES; ++i) {
+		any |= f[i];
+		all &= f[i];
+	}
+
+	// All set, all clear, any set, any clear.
+	switch (cond & 3) {
+	case 0:		return all != 0;
+	case 1:		return any == 0;
+	case 2:		return any != 0;
+	default:	return all == 0;
+	}
+}
+
+// The target is relative to the instruction after the 3 delay slots, which
+// is also the link address.
+static
+enum emu_status exec_branch(struct emu_qpu *q, const struct emu_instr *in)
+{
+	uint32_t link, target;
+
+	link = (q->pc + 4) * 8;
+	target = in->imm;
+	if (in->br_rel)
+		target += link;
+	if (in->br_reg)
+		target += q->rf[0][in->raddr_a].u[0];
+
+	if (branch_taken(q, in->br_cond)) {
+		if ((target & 7) || target / 8 >= (uint32_t)q->emu->num_instrs) {
+			q->fault = "branch target out of range";
+			return EMU_FAULT;
+		}
+		q->br_target = target / 8;
+		q->br_countdown = 4;
+	}
+
+	broadcast(&q->res[0], link);
+	q->res[1] = q->res[0];
+	if (commit(q, in, NULL))
+		return EMU_FAULT;
+	return EMU_RUNNING;
+}
+
+static inline
+enum emu_status step(struct emu_qpu *q)
+{
+	const struct emu_instr *in;
+	enum emu_status s;
+
+	if (q->pc >= q->emu->num_instrs) {
+		q->fault = "ran past the end of the code";
+		return EMU_FAULT;
+	}
+
+	in = &q->emu->code[q->pc];
+	switch (in->type) {
+	case IT_ALU:
+		s = exec_alu(q, in);
+		break;
+	case IT_LI:
+	case IT_SEM:
+		s = exec_load_imm(q, in);
+		break;
+	case IT_BR:
+		s = exec_branch(q, in);
+		break;
+	default:
+		q->fault = in->invalid;
+		return EMU_FAULT;
+	}
+
+	// A blocked instruction is retried; it has had no effects.
+	if (s != EMU_RUNNING)
+		return s;
+
+	++q->num_executed;
+	++q->pc;
+	if (q->sfu_countdown && --q->sfu_countdown == 0)
+		q->reg[4] = q->sfu;
+	if (q->br_countdown && --q->br_countdown == 0)
+		q->pc = q->br_target;
+	if (q->end_countdown && --q->end_countdown == 0)
+		return EMU_DONE;
+	return EMU_RUNNING;
+}
+
+enum emu_status emu_step(struct emu_qpu *q)
+{
+	return step(q);
+}
+
+#if defined(__x86_64__)
+// The translation to host code. A block is a run of instructions that
+// touch only the registers and the flags of their QPU: the ALU ops without
+// unpack, pack or rotate, reading the regfiles or small immediates, li,
+// and the branches to an immediate target, along with their delay slots.
+// Each instruction becomes AVX2 code, on a vector as two ymm registers;
+// the state stays in the emu_qpu. The rest go to the interpreter, as does
+// any entry into a block while a countdown runs. A block has no effects
+// that the other QPUs can see, so it runs all at once, and its QPU then
+// idles for the rest of its cycles.
+
+#define JIT_CODE_SIZE			(64 << 20)
+#define JIT_MAX_BLOCK			256
+
+typedef int (*jit_fn)(struct emu_qpu *q, const union emu_vec *pool);
+
+struct jit_block {
+	jit_fn				fn;
+	int				len;	// 0 if untried, -1 if none.
+};
+
+struct emu_jit {
+	struct jit_block		*blocks;
+	uint8_t				*code;
+	size_t				code_used;
+
+	// The constants that the code loads, addressed through rsi.
+	union emu_vec			*pool;
+	int				pool_num;
+	int				pool_max;
+
+	// The block being emitted.
+	uint8_t				*buf;
+	size_t				buf_len;
+	size_t				buf_max;
+	int				err;
+};
+
+// An operand in memory: the QPU in rdi, or the pool in rsi.
+struct jit_mem {
+	int				base;
+	int32_t				disp;
+};
+
+enum {
+	X_RSI				= 6,
+	X_RDI				= 7,
+};
+
+// The VEX map (0F, 0F38 or 0F3A), prefix (none, 66, F3 or F2) and
+// opcode of the 256-bit forms.
+#define VEX(map, pp, op)		((map) << 10 | (pp) << 8 | (op))
+
+enum {
+	V_ADDPS				= VEX(1, 0, 0x58),
+	V_MULPS				= VEX(1, 0, 0x59),
+	V_CVTDQ2PS			= VEX(1, 0, 0x5b),
+	V_CVTTPS2DQ			= VEX(1, 2, 0x5b),
+	V_SUBPS				= VEX(1, 0, 0x5c),
+	V_MINPS				= VEX(1, 0, 0x5d),
+	V_MAXPS				= VEX(1, 0, 0x5f),
+	V_PCMPGTD			= VEX(1, 1, 0x66),
+	V_MOVDQU_LD			= VEX(1, 2, 0x6f),
+	V_PSRAD_IMM			= VEX(1, 1, 0x72),
+	V_PCMPEQD			= VEX(1, 1, 0x76),
+	V_MOVDQU_ST			= VEX(1, 2, 0x7f),
+	V_CMPPS				= VEX(1, 0, 0xc2),
+	V_PSUBUSB			= VEX(1, 1, 0xd8),
+	V_PMINUB			= VEX(1, 1, 0xda),
+	V_PAND				= VEX(1, 1, 0xdb),
+	V_PADDUSB			= VEX(1, 1, 0xdc),
+	V_PMAXUB			= VEX(1, 1, 0xde),
+	V_POR				= VEX(1, 1, 0xeb),
+	V_PXOR				= VEX(1, 1, 0xef),
+	V_PSUBD				= VEX(1, 1, 0xfa),
+	V_PADDD				= VEX(1, 1, 0xfe),
+	V_PTEST				= VEX(2, 1, 0x17),
+	V_PMINSD			= VEX(2, 1, 0x39),
+	V_PMAXSD			= VEX(2, 1, 0x3d),
+	V_PMAXUD			= VEX(2, 1, 0x3f),
+	V_PMULLD			= VEX(2, 1, 0x40),
+	V_PSRLVD			= VEX(2, 1, 0x45),
+	V_PSRAVD			= VEX(2, 1, 0x46),
+	V_PSLLVD			= VEX(2, 1, 0x47),
+	V_BLENDVPS			= VEX(3, 1, 0x4a),
+};
+
+// The vcmpps predicates.
+enum {
+	CMP_LT_OQ			= 0x11,
+	CMP_GT_OQ			= 0x1e,
+};
+
+// The ops that are a single instruction, by the op_add and op_mul fields.
+static
+const uint16_t g_jit_add_ops[32] = {
+	[1]	= V_ADDPS,
+	[2]	= V_SUBPS,
+	[3]	= V_MINPS,
+	[4]	= V_MAXPS,
+	[12]	= V_PADDD,
+	[13]	= V_PSUBD,
+	[18]	= V_PMINSD,
+	[19]	= V_PMAXSD,
+	[20]	= V_PAND,
+	[21]	= V_POR,
+	[22]	= V_PXOR,
+	[30]	= V_PADDUSB,
+	[31]	= V_PSUBUSB,
+};
+
+static
+const uint16_t g_jit_mul_ops[8] = {
+	[1]	= V_MULPS,
+	[4]	= V_PMINUB,
+	[5]	= V_PMAXUB,
+	[6]	= V_PADDUSB,
+	[7]	= V_PSUBUSB,
+};
+
+static
+void emit(struct emu_jit *j, const void *b, int n)
+{
+	uint8_t *p;
+	size_t max;
+
+	if (j->buf_len + n > j->buf_max) {
+		max = j->buf_max ? j->buf_max * 2 : 4096;
+		p = realloc(j->buf, max);
+		if (p == NULL) {
+			j->err = -ENOMEM;
+			return;
+		}
+		j->buf = p;
+		j->buf_max = max;
+	}
+	memcpy(&j->buf[j->buf_len], b, n);
+	j->buf_len += n;
+}
+
+static inline
+void emit8(struct emu_jit *j, uint8_t v)
+{
+	emit(j, &v, 1);
+}
+
+static inline
+void emit32(struct emu_jit *j, uint32_t v)
+{
+	emit(j, &v, 4);
+}
+
+// The 3-byte VEX prefix and the opcode, with W0 and L1.
+static
+void emit_vex(struct emu_jit *j, int ins, int r, int v, int b)
+{
+	uint8_t p[4];
+
+	p[0] = 0xc4;
+	p[1] = (~r & 8) << 4 | 0x40 | (~b & 8) << 2 | ins >> 10;
+	p[2] = (~v & 15) << 3 | 4 | ((ins >> 8) & 3);
+	p[3] = ins;
+	emit(j, p, 4);
+}
+
+// ymm r = ins(ymm v, ymm b).
+static
+void emit_rr(struct emu_jit *j, int ins, int r, int v, int b)
+{
+	emit_vex(j, ins, r, v, b);
+	emit8(j, 0xc0 | (r & 7) << 3 | (b & 7));
+}
+
+// ymm r = ins(ymm v, m), for a half of the vector.
+static
+void emit_rm(struct emu_jit *j, int ins, int r, int v, struct jit_mem m,
+	     int half)
+{
+	emit_vex(j, ins, r, v, 0);
+	emit8(j, 0x80 | (r & 7) << 3 | m.base);
+	emit32(j, m.disp + half * 32);
+}
+
+static inline
+void emit_load(struct emu_jit *j, int r, struct jit_mem m, int half)
+{
+	emit_rm(j, V_MOVDQU_LD, r, 0, m, half);
+}
+
+static inline
+void emit_store(struct emu_jit *j, int r, struct jit_mem m, int half)
+{
+	emit_rm(j, V_MOVDQU_ST, r, 0, m, half);
+}
+
+static inline
+void emit_ones(struct emu_jit *j, int r)
+{
+	emit_rr(j, V_PCMPEQD, r, r, r);
+}
+
+static inline
+struct jit_mem qpu_mem(size_t off)
+{
+	struct jit_mem m;
+
+	m.base = X_RDI;
+	m.disp = off;
+	return m;
+}
+
+static
+struct jit_mem pool_vec(struct emu_jit *j, const union emu_vec *v)
+{
+	union emu_vec *pool;
+	struct jit_mem m;
+	int i;
+
+	for (i = 0; i < j->pool_num; ++i) {
+		if (!memcmp(&j->pool[i], v, sizeof(*v)))
+			break;
+	}
+	if (i == j->pool_max) {
+		// Kept aligned, unlike a realloc.
+		j->pool_max = j->pool_max ? j->pool_max * 2 : 64;
+		pool = aligned_alloc(64, j->pool_max * sizeof(*pool));
+		if (pool == NULL) {
+			j->err = -ENOMEM;
+			i = 0;
+			goto done;
+		}
+		if (j->pool_num)
+			memcpy(pool, j->pool, j->pool_num * sizeof(*pool));
+		free(j->pool);
+		j->pool = pool;
+	}
+	if (i == j->pool_num)
+		j->pool[j->pool_num++] = *v;
+done:
+	m.base = X_RSI;
+	m.disp = i * sizeof(*v);
+	return m;
+}
+
+static
+struct jit_mem pool_u32(struct emu_jit *j, uint32_t u)
+{
+	union emu_vec v;
+
+	broadcast(&v, u);
+	return pool_vec(j, &v);
+}
+
+static inline
+struct jit_mem rf_mem(int file, int raddr)
+{
+	return qpu_mem(offsetof(struct emu_qpu, rf) +
+		       (file * 32 + raddr) * sizeof(union emu_vec));
+}
+
+static inline
+struct jit_mem reg_mem(int n)
+{
+	return qpu_mem(offsetof(struct emu_qpu, reg) +
+		       n * sizeof(union emu_vec));
+}
+
+static inline
+struct jit_mem dst_mem(const struct emu_instr *in, int alu)
+{
+	if (in->wk[alu] == WK_RF)
+		return rf_mem(in->file[alu], in->waddr[alu]);
+	return reg_mem(in->waddr[alu] - 32);
+}
+
+// The flag that a cond, or a branch cond, tests.
+static inline
+struct jit_mem flag_mem(int cond, int is_br)
+{
+	if (is_br)
+		cond = cond < 4 ? 2 : cond < 8 ? 4 : 6;
+	if (cond < 4)
+		return qpu_mem(offsetof(struct emu_qpu, z));
+	if (cond < 6)
+		return qpu_mem(offsetof(struct emu_qpu, n));
+	return qpu_mem(offsetof(struct emu_qpu, c));
+}
+
+static
+struct jit_mem mux_mem(struct emu_jit *j, const struct emu_instr *in,
+		       int mux)
+{
+	if (mux == 6 && in->read[0])
+		return rf_mem(0, in->raddr_a);
+	if (mux == 7 && in->sig == SIG_SIMM)
+		return pool_u32(j, in->imm);
+	if (mux == 7 && in->read[1])
+		return rf_mem(1, in->raddr_b);
+	return reg_mem(mux);
+}
+
+static
+int jit_covers_op(int alu, int code)
+{
+	if (alu)
+		return g_jit_mul_ops[code] || code == 2;
+	if (g_jit_add_ops[code])
+		return 1;
+	// fminabs and fmaxabs keep the NaN rules of fminf and fmaxf.
+	return code == 7 || code == 8 || (code >= 14 && code <= 17) ||
+		code == 23;
+}
+
+// The branch target, or -1 if it is not known, or is out of range.
+static
+int jit_target(const struct emu *e, const struct emu_instr *in, int pc)
+{
+	uint32_t target;
+
+	if (in->br_reg)
+		return -1;
+	target = in->imm;
+	if (in->br_rel)
+		target += (pc + 4) * 8;
+	if ((target & 7) || target / 8 >= (uint32_t)e->num_instrs)
+		return -1;
+	return target / 8;
+}
+
+static
+int jit_covers(const struct emu *e, const struct emu_instr *in, int pc)
+{
+	int i;
+
+	switch (in->type) {
+	case IT_ALU:
+		if (in->sig != SIG_NONE && in->sig != SIG_SIMM &&
+		    (in->sig < SIG_THRD_SWITCH ||
+		     in->sig > SIG_LAST_THRD_SWITCH || in->sig == SIG_PROG_END))
+			return 0;
+		if (in->rotate >= 0 || in->unpack_mask || in->pack)
+			return 0;
+		if ((in->read[0] && in->raddr_a >= 32) ||
+		    (in->read[1] && in->raddr_b >= 32))
+			return 0;
+		for (i = 0; i < 2; ++i) {
+			if (in->live[i] && !jit_covers_op(i, in->code[i]))
+				return 0;
+		}
+		break;
+	case IT_LI:
+		if (in->pack)
+			return 0;
+		break;
+	case IT_BR:
+		if (jit_target(e, in, pc) < 0)
+			return 0;
+		break;
+	default:
+		return 0;
+	}
+
+	for (i = 0; i < 2; ++i) {
+		if (in->live[i] && in->cond[i] && in->wk[i] == WK_IO)
+			return 0;
+	}
+	return 1;
+}
+
+// ymm d = op(ymm a, ymm b), with ymm6-8 as scratch.
+static
+void emit_op(struct emu_jit *j, int alu, int code, int d, int a, int b)
+{
+	struct jit_mem m;
+	int ins;
+
+	ins = alu ? g_jit_mul_ops[code] : g_jit_add_ops[code];
+	if (ins) {
+		emit_rr(j, ins, d, a, b);
+		return;
+	}
+
+	if (alu) {
+		// mul24
+		m = pool_u32(j, 0xffffff);
+		emit_rm(j, V_PAND, 6, a, m, 0);
+		emit_rm(j, V_PAND, 7, b, m, 0);
+		emit_rr(j, V_PMULLD, d, 6, 7);
+		return;
+	}
+
+	switch (code) {
+	case 7:
+		// Out of range, vcvttps2dq gives 0x80000000, rather than 0.
+		emit_rm(j, V_CMPPS, 6, a, pool_u32(j, 0xcf000000), 0);
+		emit8(j, CMP_GT_OQ);
+		emit_rm(j, V_CMPPS, 7, a, pool_u32(j, 0x4f000000), 0);
+		emit8(j, CMP_LT_OQ);
+		emit_rr(j, V_CVTTPS2DQ, d, 0, a);
+		emit_rr(j, V_PAND, d, d, 6);
+		emit_rr(j, V_PAND, d, d, 7);
+		break;
+	case 8:
+		emit_rr(j, V_CVTDQ2PS, d, 0, a);
+		break;
+	case 14:
+	case 15:
+	case 17:
+		emit_rm(j, V_PAND, 6, b, pool_u32(j, 31), 0);
+		ins = code == 14 ? V_PSRLVD : code == 15 ? V_PSRAVD : V_PSLLVD;
+		emit_rr(j, ins, d, a, 6);
+		break;
+	case 16:
+		// vpsllvd by 32 gives 0, as the ror by 0 needs.
+		emit_rm(j, V_PAND, 6, b, pool_u32(j, 31), 0);
+		emit_rr(j, V_PSRLVD, 7, a, 6);
+		emit_load(j, 8, pool_u32(j, 32), 0);
+		emit_rr(j, V_PSUBD, 8, 8, 6);
+		emit_rr(j, V_PSLLVD, 8, a, 8);
+		emit_rr(j, V_POR, d, 7, 8);
+		break;
+	default:
+		// not
+		emit_ones(j, 6);
+		emit_rr(j, V_PXOR, d, a, 6);
+		break;
+	}
+}
+
+// ymm c = the carry of the add op, from its inputs in ymm0-1 and its
+// result in ymm4; as set_carry().
+static
+void emit_carry(struct emu_jit *j, int code, int c)
+{
+	switch (code) {
+	case 3:
+	case 4:
+		emit_rr(j, V_CMPPS, c, 0, 1);
+		emit8(j, CMP_GT_OQ);
+		break;
+	case 12:
+	case 13:
+		// The unsigned a + b < a, and a < b.
+		if (code == 12)
+			emit_rr(j, V_PMAXUD, c, 4, 0);
+		else
+			emit_rr(j, V_PMAXUD, c, 0, 1);
+		emit_rr(j, V_PCMPEQD, c, c, code == 12 ? 4 : 0);
+		emit_ones(j, 6);
+		emit_rr(j, V_PXOR, c, c, 6);
+		break;
+	case 18:
+	case 19:
+		emit_rr(j, V_PCMPGTD, c, 0, 1);
+		break;
+	default:
+		emit_rr(j, V_PXOR, c, c, c);
+		break;
+	}
+}
+
+// Half of an instruction: the lanes are independent, as there is no
+// rotate. The add and mul inputs go to ymm0-3, their results to ymm4-5.
+static
+void emit_instr(struct emu_jit *j, const struct emu_instr *in, int pc,
+		int half)
+{
+	union emu_vec v;
+	uint32_t b;
+	int i, alu;
+
+	if (in->type == IT_ALU) {
+		for (i = 0; i < 4; ++i) {
+			if (!in->live[i >> 1])
+				continue;
+			emit_load(j, i, mux_mem(j, in, in->mux[i]), half);
+		}
+		for (i = 0; i < 2; ++i) {
+			if (in->live[i])
+				emit_op(j, i, in->code[i], 4 + i, 2 * i,
+					2 * i + 1);
+		}
+
+		// The interpreter leaves the reads in r6 and r7.
+		if (in->read[0]) {
+			emit_load(j, 6, rf_mem(0, in->raddr_a), half);
+			emit_store(j, 6, reg_mem(6), half);
+		}
+		if (in->read[1] || in->sig == SIG_SIMM) {
+			emit_load(j, 7, mux_mem(j, in, 7), half);
+			emit_store(j, 7, reg_mem(7), half);
+		}
+	} else {
+		// li, as exec_load_imm(), or the link address.
+		for (i = 0; i < EMU_LANES; ++i) {
+			b = ((in->imm >> i) & 1) | ((in->imm >> (i + 15)) & 2);
+			if (in->type == IT_BR)
+				v.u[i] = (pc + 4) * 8;
+			else if (in->unpack == 1)
+				v.i[i] = (int32_t)(b ^ 2) - 2;
+			else if (in->unpack == 3)
+				v.u[i] = b;
+			else
+				v.u[i] = in->imm;
+		}
+		emit_load(j, 4, pool_vec(j, &v), half);
+		emit_load(j, 5, pool_vec(j, &v), half);
+	}
+
+	// The conds see the flags from before the instruction, so the
+	// writes come first.
+	for (i = 0; i < 2; ++i) {
+		if (!in->live[i] || !in->cond[i] || in->wk[i] == WK_NOP)
+			continue;
+		if (in->cond[i] == 1) {
+			emit_store(j, 4 + i, dst_mem(in, i), half);
+			continue;
+		}
+
+		// The even conds write where the flag is set, the odd ones
+		// where it is clear.
+		emit_load(j, 6, flag_mem(in->cond[i], 0), half);
+		emit_load(j, 7, dst_mem(in, i), half);
+		if (in->cond[i] & 1)
+			emit_rr(j, V_BLENDVPS, 7, 4 + i, 7);
+		else
+			emit_rr(j, V_BLENDVPS, 7, 7, 4 + i);
+		emit8(j, 6 << 4);
+		emit_store(j, 7, dst_mem(in, i), half);
+	}
+
+	// As set_flags().
+	if (!in->sf)
+		return;
+	alu = in->live[0] && in->cond[0] ? 0 : 1;
+	if (!in->live[alu])
+		return;
+	emit_rr(j, V_PXOR, 6, 6, 6);
+	emit_rr(j, V_PCMPEQD, 7, 4 + alu, 6);
+	emit_store(j, 7, flag_mem(2, 0), half);
+	emit_rr(j, V_PSRAD_IMM, 4, 7, 4 + alu);
+	emit8(j, 31);
+	emit_store(j, 7, flag_mem(4, 0), half);
+	if (in->type == IT_ALU && alu == 0)
+		emit_carry(j, in->code[0], 8);
+	else
+		emit_rr(j, V_PXOR, 8, 8, 8);
+	emit_store(j, 8, flag_mem(6, 0), half);
+}
+
+// Leaves the pc after the delay slots in eax, for the end of the block.
+static
+void emit_branch(struct emu_jit *j, const struct emu *e,
+		 const struct emu_instr *in, int pc)
+{
+	static const uint8_t cmov[4] = {0x42, 0x44, 0x45, 0x43};
+	int cond;
+
+	cond = in->br_cond;
+	emit8(j, 0xb8);		// mov eax, imm32
+	emit32(j, cond == 15 ? jit_target(e, in, pc) : pc + 4);
+	if (cond == 15)
+		return;
+
+	// CF is set if all the lanes have the flag; ZF, if none has.
+	emit_load(j, 6, flag_mem(cond, 1), 0);
+	emit_load(j, 7, flag_mem(cond, 1), 1);
+	if ((cond & 3) == 0 || (cond & 3) == 3) {
+		emit_rr(j, V_PAND, 6, 6, 7);
+		emit_ones(j, 7);
+	} else {
+		emit_rr(j, V_POR, 6, 6, 7);
+		emit_rr(j, V_POR, 7, 6, 6);
+	}
+	emit_rr(j, V_PTEST, 6, 0, 7);
+
+	emit8(j, 0xb9);		// mov ecx, imm32
+	emit32(j, jit_target(e, in, pc));
+	emit8(j, 0x0f);		// cmovcc eax, ecx
+	emit8(j, cmov[cond & 3]);
+	emit8(j, 0xc1);
+}
+
+// Translates the block at pc, if there is one.
+static
+int translate_block(struct emu *e, int pc)
+{
+	static const uint8_t ret[4] = {0xc5, 0xf8, 0x77, 0xc3};
+	struct jit_block *b;
+	struct emu_jit *j;
+	int end, br, i, h;
+	size_t len;
+
+	j = e->jit;
+	b = &j->blocks[pc];
+	b->len = -1;
+
+	// A branch ends the block, and its delay slots must be in it.
+	br = 0;
+	for (end = pc; end < e->num_instrs && end - pc < JIT_MAX_BLOCK; ++end) {
+		if (!jit_covers(e, &e->code[end], end))
+			break;
+		if (e->code[end].type != IT_BR)
+			continue;
+		for (i = 1; i < 4 && end + i < e->num_instrs; ++i) {
+			if (e->code[end + i].type == IT_BR ||
+			    !jit_covers(e, &e->code[end + i], end + i))
+				break;
+		}
+		br = i == 4;
+		break;
+	}
+	if (end == pc)
+		return -EINVAL;
+
+	j->buf_len = 0;
+	j->err = ESUCC;
+	for (i = pc; i < end + (br ? 4 : 0); ++i) {
+		for (h = 0; h < 2; ++h)
+			emit_instr(j, &e->code[i], i, h);
+		if (i == end)
+			emit_branch(j, e, &e->code[i], i);
+	}
+	if (!br) {
+		emit8(j, 0xb8);
+		emit32(j, end);
+	}
+	emit(j, ret, sizeof(ret));	// vzeroupper; ret
+	if (j->err)
+		return j->err;
+
+	len = (j->buf_len + 15) & ~(size_t)15;
+	if (j->code_used + len > JIT_CODE_SIZE)
+		return -ENOMEM;
+	if (mprotect(j->code, JIT_CODE_SIZE, PROT_READ | PROT_WRITE))
+		return -errno;
+	memcpy(&j->code[j->code_used], j->buf, j->buf_len);
+	if (mprotect(j->code, JIT_CODE_SIZE, PROT_READ | PROT_EXEC))
+		return -errno;
+
+	b->fn = (jit_fn)(void *)&j->code[j->code_used];
+	b->len = end - pc + (br ? 4 : 0);
+	j->code_used += len;
+	return ESUCC;
+}
+
+// Runs the block at the pc, if it fits in the cycles left. Returns its
+// length, or 0.
+static inline
+int run_block(struct emu_qpu *q, uint64_t cycles_left)
+{
+	struct jit_block *b;
+	struct emu *e;
+
+	e = q->emu;
+	if (e->jit == NULL || q->br_countdown || q->sfu_countdown ||
+	    q->end_countdown || q->pc >= e->num_instrs)
+		return 0;
+
+	b = &e->jit->blocks[q->pc];
+	if (b->len == 0)
+		translate_block(e, q->pc);
+	if (b->len < 0 || (uint64_t)b->len > cycles_left)
+		return 0;
+
+	q->pc = b->fn(q, e->jit->pool);
+	q->num_executed += b->len;
+	q->num_host += b->len;
+	return b->len;
+}
+
+static
+void free_jit(struct emu *e)
+{
+	struct emu_jit *j;
+
+	j = e->jit;
+	if (j == NULL)
+		return;
+	if (j->code)
+		munmap(j->code, JIT_CODE_SIZE);
+	free(j->blocks);
+	free(j->pool);
+	free(j->buf);
+	free(j);
+	e->jit = NULL;
+}
+
+int emu_set_jit(struct emu *e)
+{
+	struct emu_jit *j;
+
+	if (!__builtin_cpu_supports("avx2"))
+		return -ENOTSUP;
+
+	free_jit(e);
+	j = calloc(1, sizeof(*j));
+	if (j == NULL)
+		return -ENOMEM;
+	e->jit = j;
+	j->blocks = calloc(e->num_instrs + 1, sizeof(*j->blocks));
+	j->code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_EXEC,
+		       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (j->code == MAP_FAILED)
+		j->code = NULL;
+	if (j->blocks == NULL || j->code == NULL) {
+		free_jit(e);
+		return -ENOMEM;
+	}
+	return ESUCC;
+}
+#else
+static inline
+int run_block(struct emu_qpu *q, uint64_t cycles_left)
+{
+	(void)q;
+	(void)cycles_left;
+	return 0;
+}
+
+static
+void free_jit(struct emu *e)
+{
+	(void)e;
+}
+
+int emu_set_jit(struct emu *e)
+{
+	(void)e;
+	return -ENOTSUP;
+}
+#endif
+
+enum emu_status emu_run(struct emu_qpu *q, uint64_t max_instrs)
+{
+	enum emu_status s;
+	int n;
+
+	s = EMU_RUNNING;
+	while (s == EMU_RUNNING && max_instrs) {
+		n = run_block(q, max_instrs);
+		if (n == 0) {
+			s = step(q);
+			n = 1;
+		}
+		q->emu->cycle += n;
+		max_instrs -= n;
+	}
+	return s;
+}
+
+static
+int waiting_on_memory(const struct emu_qpu *qpus, int num)
+{
+	int i;
+
+	for (i = 0; i < num; ++i) {
+		if (qpus[i].status == EMU_BLOCKED &&
+		    (qpus[i].block == EMU_BLOCK_TMU ||
+		     qpus[i].block == EMU_BLOCK_UNIFORM))
+			return 1;
+	}
+	return 0;
+}
+
+// The cycles that every running QPU spends in a host block, which the lock
+// step can skip.
+static
+int busy_cycles(struct emu_qpu *qpus, int num)
+{
+	int i, n;
+
+	n = -1;
+	for (i = 0; i < num; ++i) {
+		if (qpus[i].status == EMU_DONE)
+			continue;
+		if (n < 0 || qpus[i].busy < n)
+			n = qpus[i].busy;
+	}
+	if (n <= 0)
+		return 0;
+	for (i = 0; i < num; ++i)
+		qpus[i].busy -= qpus[i].status == EMU_DONE ? 0 : n;
+	return n;
+}
+
+// Runs the QPUs in lock step, each issuing one instruction per cycle, in
+// the order of their numbers. A QPU that cannot issue idles for the
+// cycle. Stops at the first fault, or when no QPU can make progress; at a
+// fault, a QPU within a host block has already run it to its end.
+enum emu_status emu_run_qpus(struct emu_qpu *qpus, int num,
+			     uint64_t max_cycles, uint64_t *out_cycles)
+{
+	enum emu_status s;
+	struct emu_qpu *q;
+	int i, num_running, progress;
+	uint64_t cycle;
+
+	num_running = 0;
+	for (i = 0; i < num; ++i) {
+		num_running += qpus[i].status != EMU_DONE;
+		qpus[i].block = EMU_BLOCK_NONE;
+	}
+
+	s = EMU_RUNNING;
+	for (cycle = 0; num_running && cycle < max_cycles; ++cycle) {
+		qpus[0].emu->cycle = cycle;
+		progress = 0;
+		for (i = 0; i < num; ++i) {
+			q = &qpus[i];
+			if (q->status == EMU_DONE)
+				continue;
+
+			// A host block ran ahead; its cycles are spent.
+			if (q->busy) {
+				--q->busy;
+				progress = 1;
+				continue;
+			}
+			q->busy = run_block(q, max_cycles - cycle);
+			if (q->busy) {
+				--q->busy;
+				progress = 1;
+				q->block = EMU_BLOCK_NONE;
+				continue;
+			}
+
+			q->status = step(q);
+			if (q->status == EMU_FAULT) {
+				s = EMU_FAULT;
+				goto done;
+			}
+			if (q->status == EMU_BLOCKED) {
+				++q->idle[q->block];
+				continue;
+			}
+
+			progress = 1;
+			q->block = EMU_BLOCK_NONE;
+			if (q->status == EMU_DONE) {
+				q->end_cycle = cycle + 1;
+				--num_running;
+			}
+		}
+
+		// Waits on memory resolve by themselves.
+		if (!progress && !waiting_on_memory(qpus, num)) {
+			s = EMU_BLOCKED;
+			break;
+		}
+		cycle += busy_cycles(qpus, num);
+	}
+	if (num_running == 0)
+		s = EMU_DONE;
+done:
+	*out_cycles = cycle;
+	return s;
+}
+
+void emu_reset_qpu(struct emu *e, struct emu_qpu *q, int num,
+		   uint32_t uni_addr)
+{
+	memset(q, 0, sizeof(*q));
+	q->emu = e;
+	q->num = num;
+	q->uni_addr = uni_addr;
+	q->uni_line = ~0u;
+}
+
+int emu_init(struct emu *e, const uint64_t *code, int num_instrs,
+	     uint8_t *mem, uint32_t mem_base, uint32_t mem_size)
+{
+	int i;
+
+	memset(e, 0, sizeof(*e));
+	e->code = malloc((num_instrs + 1) * sizeof(*e->code));
+	if (e->code == NULL)
+		return -ENOMEM;
+
+	for (i = 0; i < num_instrs; ++i)
+		translate(&e->code[i], code[i]);
+	e->num_instrs = num_instrs;
+	e->mutex_owner = -1;
+	e->mem = mem;
+	e->mem_base = mem_base;
+	e->mem_size = mem_size;
+	return ESUCC;
+}
+
+int emu_set_timing(struct emu *e, const struct emu_timing *t)
+{
+	int n;
+
+	if (t->tmu_fifo < 1 || t->tmu_fifo > EMU_TMU_FIFO)
+		return -EINVAL;
+
+	n = t->l2_size / (EMU_L2_LINE * EMU_L2_WAYS);
+	if (t->l2_size && n == 0)
+		return -EINVAL;
+
+	free(e->l2_tags);
+	free(e->l2_ready);
+	free(e->l2_used);
+	e->l2_tags = calloc(n * EMU_L2_WAYS + 1, sizeof(*e->l2_tags));
+	e->l2_ready = calloc(n * EMU_L2_WAYS + 1, sizeof(*e->l2_ready));
+	e->l2_used = calloc(n * EMU_L2_WAYS + 1, sizeof(*e->l2_used));
+	if (!e->l2_tags || !e->l2_ready || !e->l2_used)
+		return -ENOMEM;
+
+	e->timing = *t;
+	e->l2_sets = n;
+	e->timed = 1;
+	return ESUCC;
+}
+
+void emu_free(struct emu *e)
+{
+	free_jit(e);
+	free(e->l2_tags);
+	free(e->l2_ready);
+	free(e->l2_used);
+	e->l2_tags = NULL;
+	e->l2_ready = e->l2_used = NULL;
+	free(e->code);
+	e->code = NULL;
+	e->num_instrs = 0;
+}
@@ -0,0 +1,170 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright (c) 2021 Amol Surati
+
+#ifndef EMU_H
+#define EMU_H
+
+#include <stdint.h>
+#include <errno.h>
+
+#ifndef ESUCC
+#define ESUCC				0
+#endif
+
+#define EMU_LANES			16
+#define EMU_TMU_FIFO			8
+#define EMU_NUM_SEMS			16
+#define EMU_VPM_ROWS			64
+#define EMU_L2_LINE			64
+#define EMU_L2_WAYS			4
+
+union emu_vec {
+	uint32_t			u[EMU_LANES];
+	int32_t				i[EMU_LANES];
+	float				f[EMU_LANES];
+} __attribute__((aligned(64)));
+
+enum emu_status {
+	EMU_RUNNING,
+	EMU_DONE,
+	EMU_BLOCKED,
+	EMU_FAULT,
+};
+
+// Why a QPU could not issue its instruction.
+enum emu_block {
+	EMU_BLOCK_NONE,
+	EMU_BLOCK_SEM,
+	EMU_BLOCK_MUTEX,
+	EMU_BLOCK_TMU,		// ldtmu before the data arrived.
+	EMU_BLOCK_UNIFORM,	// uni_rd before the uniforms arrived.
+	EMU_NUM_BLOCKS,
+};
+
+struct emu_instr;
+struct emu_jit;
+
+struct emu_tmu {
+	union emu_vec			fifo[EMU_TMU_FIFO];
+	uint64_t			issued[EMU_TMU_FIFO];
+	uint64_t			ready[EMU_TMU_FIFO];
+	int				head;
+	int				num;
+	int				params;	// t, r, b written.
+};
+
+// A generic block access of the VPM, 32-bit wide.
+struct emu_vpm_access {
+	int				addr;
+	int				stride;
+	int				num;	// Reads left.
+	char				horiz;
+};
+
+// The memory timing. A load that misses in the L2 waits for the memory
+// bus, for the transfer of its line, and then for mem_latency. A hit waits
+// for l2_latency, or for the line if it is still on its way.
+struct emu_timing {
+	uint32_t			mem_latency;
+	uint32_t			l2_latency;
+	uint32_t			bytes_per_cycle;
+	uint32_t			l2_size;	// 0 for no L2.
+	int				tmu_fifo;	// Requests per TMU.
+};
+
+// The state shared by the QPUs: the translated code, the memory as seen
+// over the bus, the semaphores, the mutex and the VPM.
+struct emu {
+	struct emu_instr		*code;
+	int				num_instrs;
+	struct emu_jit			*jit;	// NULL if only interpreted.
+
+	uint8_t				*mem;
+	uint32_t			mem_base;
+	uint32_t			mem_size;
+
+	int				sems[EMU_NUM_SEMS];
+	int				mutex_owner;	// -1 if free.
+	uint32_t			vpm[EMU_VPM_ROWS][EMU_LANES];
+
+	// Loads complete at once unless timed.
+	char				timed;
+	struct emu_timing		timing;
+	uint64_t			cycle;
+	uint64_t			bus_free;
+	uint32_t			*l2_tags;
+	uint64_t			*l2_ready;
+	uint64_t			*l2_used;
+	int				l2_sets;
+	uint64_t			l2_hits;
+	uint64_t			l2_misses;
+};
+
+struct emu_qpu {
+	// r0-r5, then the values read through raddr_a and raddr_b, so that
+	// the muxes index this directly.
+	union emu_vec			reg[8];
+	union emu_vec			rf[2][32];
+
+	// Operands after unpack or rotate, and the ALU results.
+	union emu_vec			tmp[4];
+	union emu_vec			res[2];
+	union emu_vec			sfu;
+
+	// Per-lane flags, 0 or ~0.
+	uint32_t			z[EMU_LANES];
+	uint32_t			n[EMU_LANES];
+	uint32_t			c[EMU_LANES];
+
+	struct emu_tmu			tmu[2];
+	uint32_t			uni_addr;
+	uint32_t			uni_line;
+	uint64_t			uni_ready;
+
+	struct emu_vpm_access		vpm_rd;
+	struct emu_vpm_access		vpm_wr;
+	uint32_t			vdr_setup;
+	uint32_t			vdr_pitch;
+	uint32_t			vdw_setup;
+	uint32_t			vdw_stride;
+
+	int				num;
+	int				pc;
+	int				br_target;
+	char				br_countdown;
+	char				end_countdown;
+	char				sfu_countdown;
+	char				host_int;
+
+	// Under emu_run_qpus(), the cycles spent blocked, and the cycle at
+	// which the QPU finished.
+	enum emu_status			status;
+	enum emu_block			block;
+	uint64_t			idle[EMU_NUM_BLOCKS];
+	uint64_t			end_cycle;
+	int				busy;	// Cycles left of a host block.
+
+	// The TMU loads, the sum of the cycles each took to arrive, and the
+	// sum of the cycles from each request to its ldtmu.
+	uint64_t			tmu_loads;
+	uint64_t			tmu_latency;
+	uint64_t			tmu_lead;
+
+	uint64_t			num_executed;
+	uint64_t			num_host;	// Run as host code.
+	const char			*fault;
+	struct emu			*emu;
+};
+
+int emu_init(struct emu *e, const uint64_t *code, int num_instrs,
+	     uint8_t *mem, uint32_t mem_base, uint32_t mem_size);
+void emu_free(struct emu *e);
+int emu_set_timing(struct emu *e, const struct emu_timing *t);
+int emu_set_jit(struct emu *e);
+void emu_reset_qpu(struct emu *e, struct emu_qpu *q, int num,
+		   uint32_t uni_addr);
+enum emu_status emu_step(struct emu_qpu *q);
+enum emu_status emu_run(struct emu_qpu *q, uint64_t max_instrs);
+enum emu_status emu_run_qpus(struct emu_qpu *qpus, int num,
+			     uint64_t max_cycles, uint64_t *out_cycles);
+#endif
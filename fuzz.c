@@ -0,0 +1,936 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright (c) 2021 Amol Surati
+
+// Fuzzing harness.
+//
+// An input that starts with a 0 byte holds the choices for a short program
+// of valid instructions, built from the tables below. The words that such
+// a program assembles to are decoded independently of qas.h, and must
+// match the choices bit for bit. Any other input is source text, which
+// must assemble, or fail, without tripping the sanitizers or an assert.
+//
+// clang -g -O1 -fsanitize=fuzzer,address,undefined -DQAS_LIBFUZZER
+//	-o fuzz fuzz.c
+// gcc -g -O1 -fsanitize=address,undefined -o fuzz fuzz.c
+// ./fuzz [-n iters] [file...]
+//
+// Without libFuzzer, the files are run once each (as with AFL's @@), or,
+// if there are none, iters random inputs are.
+
+#define QAS_NO_MAIN
+#include "qas.c"
+
+#define MAX_PROG_INSTRS			8
+#define MAX_TEXT			4096
+
+enum field {
+	F_SIG,
+	F_UNPACK,
+	F_PM,
+	F_PACK,
+	F_COND_ADD,
+	F_COND_MUL,
+	F_SF,
+	F_WS,
+	F_WADDR_ADD,
+	F_WADDR_MUL,
+	F_OP_MUL,
+	F_OP_ADD,
+	F_RADDR_A,
+	F_RADDR_B,
+	F_ADD_A,
+	F_ADD_B,
+	F_MUL_A,
+	F_MUL_B,
+	F_IMM,
+	F_BR_COND,
+	F_BR_REL,
+	F_BR_REG,
+	F_BR_RADDR_A,
+	NUM_FIELDS,
+};
+
+struct field_info {
+	enum field			field;
+	int				pos;	// In the 64-bit word.
+	int				bits;
+};
+
+// The three instruction formats of the VideoCore IV QPU.
+static const struct field_info g_alu_layout[] = {
+	{F_SIG,		60,	4},
+	{F_UNPACK,	57,	3},
+	{F_PM,		56,	1},
+	{F_PACK,	52,	4},
+	{F_COND_ADD,	49,	3},
+	{F_COND_MUL,	46,	3},
+	{F_SF,		45,	1},
+	{F_WS,		44,	1},
+	{F_WADDR_ADD,	38,	6},
+	{F_WADDR_MUL,	32,	6},
+	{F_OP_MUL,	29,	3},
+	{F_OP_ADD,	24,	5},
+	{F_RADDR_A,	18,	6},
+	{F_RADDR_B,	12,	6},
+	{F_ADD_A,	9,	3},
+	{F_ADD_B,	6,	3},
+	{F_MUL_A,	3,	3},
+	{F_MUL_B,	0,	3},
+};
+
+static const struct field_info g_li_layout[] = {
+	{F_SIG,		60,	4},
+	{F_UNPACK,	57,	3},
+	{F_PM,		56,	1},
+	{F_PACK,	52,	4},
+	{F_COND_ADD,	49,	3},
+	{F_COND_MUL,	46,	3},
+	{F_SF,		45,	1},
+	{F_WS,		44,	1},
+	{F_WADDR_ADD,	38,	6},
+	{F_WADDR_MUL,	32,	6},
+	{F_IMM,		0,	32},
+};
+
+static const struct field_info g_br_layout[] = {
+	{F_SIG,		60,	4},
+	{F_BR_COND,	52,	4},
+	{F_BR_REL,	51,	1},
+	{F_BR_REG,	50,	1},
+	{F_BR_RADDR_A,	45,	5},
+	{F_WS,		44,	1},
+	{F_WADDR_ADD,	38,	6},
+	{F_WADDR_MUL,	32,	6},
+	{F_IMM,		0,	32},
+};
+
+#define SIG_NONE			1
+#define SIG_SIMM			13
+#define SIG_LI				14
+#define SIG_BR				15
+
+#define WADDR_NOP			39
+#define RADDR_NOP			39
+
+// The names of the field values, as the source spells them.
+static const char *g_add_ops[32] = {
+	[1] = "fadd",	[2] = "fsub",	[3] = "fmin",	[4] = "fmax",
+	[5] = "fminabs", [6] = "fmaxabs", [7] = "ftoi", [8] = "itof",
+	[12] = "add",	[13] = "sub",	[14] = "shr",	[15] = "asr",
+	[16] = "ror",	[17] = "shl",	[18] = "min",	[19] = "max",
+	[20] = "and",	[21] = "or",	[22] = "xor",	[23] = "not",
+	[24] = "clz",	[30] = "v8adds", [31] = "v8subs",
+};
+
+// v8adds (6) is only reachable through the rotates.
+static const char *g_mul_ops[8] = {
+	[1] = "fmul",	[2] = "mul24",	[3] = "v8muld",	[4] = "v8min",
+	[5] = "v8max",
+};
+
+static const char *g_conds[8] = {
+	"x", "a", "z", "nz", "n", "nn", "c", "nc",
+};
+
+static const char *g_br_conds[16] = {
+	"zl", "nzl", "z", "nz", "nl", "nnl", "n", "nn",
+	"cl", "ncl", "c", "nc", [15] = "a",
+};
+
+static const char *g_sigs[16] = {
+	[0] = "brk",	[2] = "ts",	[3] = "pe",	[4] = "wsb",
+	[5] = "usb",	[6] = "lts",	[7] = "cvr",	[8] = "clr",
+	[9] = "clrpe",	[10] = "ldtmu0", [11] = "ldtmu1", [12] = "lda",
+};
+
+static const char *g_simms[48] = {
+	"0", "1", "2", "3", "4", "5", "6", "7",
+	"8", "9", "10", "11", "12", "13", "14", "15",
+	"-16", "-15", "-14", "-13", "-12", "-11", "-10", "-9",
+	"-8", "-7", "-6", "-5", "-4", "-3", "-2", "-1",
+	"1f", "2f", "4f", "8f", "16f", "32f", "64f", "128f",
+	"i256f", "i128f", "i64f", "i32f", "i16f", "i8f", "i4f", "i2f",
+};
+
+// [pm][value]
+static const char *g_packs[2][16] = {
+	{
+		NULL, "pa16a", "pa16b", "pa8888",
+		"pa8a", "pa8b", "pa8c", "pa8d",
+		"pa32s", "pa16as", "pa16bs", "pa8888s",
+		"pa8as", "pa8bs", "pa8cs", "pa8ds",
+	}, {
+		[3] = "pm8888", [4] = "pm8a", [5] = "pm8b", [6] = "pm8c",
+		[7] = "pm8d",
+	},
+};
+
+static const char *g_unpacks[2][8] = {
+	{NULL, "ua16a", "ua16b", "ua8dr", "ua8a", "ua8b", "ua8c", "ua8d"},
+	{NULL, "ur16a", "ur16b", "ur8dr", "ur8a", "ur8b", "ur8c", "ur8d"},
+};
+
+static const char *g_accs[6] = {"r0", "r1", "r2", "r3", "r4", "r5"};
+
+// [file][addr]; file 0 is A, 1 is B. The register files are filled in
+// by init_names().
+static const char *g_raddrs[2][64] = {
+	{
+		[32] = "uni_rd", [35] = "vary_rd", [38] = "ele_num",
+		[39] = "-", [41] = "x_px_coord", [42] = "ms_flags",
+		[48] = "vpm_rd", [49] = "vpm_ld_busy", [50] = "vpm_ld_wait",
+		[51] = "mtx_acq",
+	}, {
+		[32] = "uni_rd", [35] = "vary_rd", [38] = "qpu_num",
+		[39] = "-", [41] = "y_px_coord", [42] = "rev_flag",
+		[48] = "vpm_rd", [49] = "vpm_st_busy", [50] = "vpm_st_wait",
+		[51] = "mtx_acq",
+	},
+};
+
+#define WADDRS_COMMON							\
+	[32] = "r0", [33] = "r1", [34] = "r2", [35] = "r3",		\
+	[36] = "tmu_noswap", [37] = "r5", [38] = "host_int",		\
+	[39] = "-", [40] = "uni_addr", [43] = "tlb_stencil",		\
+	[44] = "tlb_z", [45] = "tlb_clr_ms", [46] = "tlb_clr_all",	\
+	[47] = "tlb_amask", [48] = "vpm_wr", [51] = "mtx_rel",		\
+	[52] = "sfu_recip", [53] = "sfu_rsqrt", [54] = "sfu_exp",	\
+	[55] = "sfu_log", [56] = "tmu0_s", [57] = "tmu0_t",		\
+	[58] = "tmu0_r", [59] = "tmu0_b", [60] = "tmu1_s",		\
+	[61] = "tmu1_t", [62] = "tmu1_r", [63] = "tmu1_b"
+
+static const char *g_waddrs[2][64] = {
+	{
+		WADDRS_COMMON,
+		[41] = "quad_x", [42] = "ms_flags", [49] = "vpm_rd_setup",
+		[50] = "vpm_ld_addr",
+	}, {
+		WADDRS_COMMON,
+		[41] = "quad_y", [42] = "rev_flag", [49] = "vpm_wr_setup",
+		[50] = "vpm_st_addr",
+	},
+};
+
+static char g_regfile_names[2][32][16];
+
+static
+void init_names(void)
+{
+	int f, i;
+
+	for (f = 0; f < 2; ++f) {
+		for (i = 0; i < 32; ++i) {
+			snprintf(g_regfile_names[f][i], 16, "%c%d", "ab"[f], i);
+			g_raddrs[f][i] = g_waddrs[f][i] = g_regfile_names[f][i];
+		}
+	}
+}
+
+// The choices an input makes. Once it runs out, every choice is 0.
+struct choices {
+	const uint8_t			*p;
+	size_t				n;
+};
+
+static
+unsigned choose(struct choices *c, unsigned n)
+{
+	unsigned v;
+
+	if (c->n == 0)
+		return 0;
+	v = *c->p++;
+	--c->n;
+	if (n > 256 && c->n) {
+		v = (v << 8) | *c->p++;
+		--c->n;
+	}
+	return v % n;
+}
+
+// A choice among the non-NULL entries of names[num].
+static
+int choose_name(struct choices *c, const char **names, int num)
+{
+	int i, n;
+
+	n = choose(c, num);
+	for (i = 0; i < num; ++i, n = (n + 1) % num) {
+		if (names[n])
+			return n;
+	}
+	return -1;
+}
+
+// What an instruction must decode to. The fields in care must match
+// exactly. The register names are compared after decoding, since the
+// assembler is free to pick the regfile of a register that is in both,
+// and ws with it.
+struct expect {
+	uint32_t			v[NUM_FIELDS];
+	uint32_t			care;
+	const char			*dst[2];
+	const char			*src[4];
+	char				is_alu;
+};
+
+struct gen {
+	struct choices			c;
+	char				text[MAX_TEXT];
+	int				len;
+	struct expect			e[MAX_PROG_INSTRS];
+	int				num_instrs;
+};
+
+static
+void emit(struct gen *g, const char *str)
+{
+	int n;
+
+	n = strlen(str);
+	if (g->len + n >= MAX_TEXT)
+		n = MAX_TEXT - 1 - g->len;
+	memcpy(&g->text[g->len], str, n);
+	g->len += n;
+	g->text[g->len] = 0;
+}
+
+static
+void expect(struct expect *e, enum field f, uint32_t v)
+{
+	e->v[f] = v;
+	e->care |= 1u << f;
+}
+
+// A dst in the file the unit writes to; ws picks the file.
+static
+int choose_waddr(struct choices *c, int file)
+{
+	return choose_name(c, g_waddrs[file], 64);
+}
+
+static
+void gen_cond(struct gen *g, int *cond)
+{
+	*cond = choose(&g->c, 8);
+	if (*cond == 1 && choose(&g->c, 2))
+		return;
+	emit(g, ".");
+	emit(g, g_conds[*cond]);
+}
+
+// The conditions of an op with a nop dst become never, unless it reads an
+// IO register or sets the flags.
+static
+int effective_cond(int cond, int waddr, const int *reads_io, int sets_flags)
+{
+	if (waddr == WADDR_NOP && !reads_io[0] && !reads_io[1] && !sets_flags)
+		return 0;
+	return cond;
+}
+
+static
+void gen_alu(struct gen *g, struct expect *e)
+{
+	struct choices *c;
+	int has[2], cond[2], waddr[2], mux[4], reads_io[4], op[2];
+	int ws, mode, raddr_a, raddr_b, simm, rot, sig, pm, pack, unpack;
+	int i, u, file, any_b, sf;
+	char buf[64];
+
+	c = &g->c;
+	e->is_alu = 1;
+
+	u = choose(c, 4);
+	has[0] = u != 2 && u != 3;
+	has[1] = u != 1 && u != 3;
+	ws = choose(c, 2);
+
+	// 0: raddr_b reads regfile B, 1: small immediate, 2: mul rotate.
+	mode = choose(c, 3);
+	if (mode == 2 && !has[1])
+		mode = 0;
+
+	raddr_a = raddr_b = -1;
+	do {
+		raddr_a = choose_name(c, g_raddrs[0], 64);
+	} while (raddr_a == RADDR_NOP);
+	do {
+		raddr_b = choose_name(c, g_raddrs[1], 64);
+	} while (raddr_b == RADDR_NOP);
+	simm = choose(c, 48);
+	rot = choose(c, 16);
+
+	// The mux values first.
+	any_b = 0;
+	for (i = 0; i < 4; ++i) {
+		mux[i] = 0;
+		reads_io[i] = 0;
+		if (!has[i / 2])
+			continue;
+		mux[i] = choose(c, 8);
+		if (mode == 2 && (mux[i] == 7 || (i >= 2 && mux[i] > 3)))
+			mux[i] = choose(c, 4);
+		if (mux[i] == 6)
+			reads_io[i] = raddr_a > 31;
+		if (mux[i] == 7)
+			reads_io[i] = mode == 0 && raddr_b > 31;
+		any_b |= mux[i] == 7;
+	}
+	if (mode == 1 && !any_b)
+		mode = 0;
+
+	for (u = 0; u < 2; ++u) {
+		op[u] = 0;
+		cond[u] = 0;
+		waddr[u] = WADDR_NOP;
+		e->dst[u] = "-";
+		e->src[2 * u] = e->src[2 * u + 1] = "r0";
+		if (!has[u])
+			continue;
+
+		if (u == 0) {
+			op[0] = choose_name(c, g_add_ops, 32);
+			emit(g, g_add_ops[op[0]]);
+		} else if (mode == 2) {
+			op[1] = 6;
+			if (rot == 0)
+				snprintf(buf, sizeof(buf), "v8asrotr5");
+			else
+				snprintf(buf, sizeof(buf), "v8asrot%d", rot);
+			emit(g, buf);
+		} else {
+			op[1] = choose_name(c, g_mul_ops, 8);
+			emit(g, g_mul_ops[op[1]]);
+		}
+
+		// Either spelling of an op reads a small immediate the same.
+		if (mode == 1 && (mux[2 * u] == 7 || mux[2 * u + 1] == 7) &&
+		    choose(c, 2))
+			emit(g, "i");
+
+		gen_cond(g, &cond[u]);
+
+		// add writes to A, and mul to B, unless ws is set.
+		file = u ^ ws;
+		waddr[u] = choose_waddr(c, file);
+		e->dst[u] = g_waddrs[file][waddr[u]];
+		emit(g, " ");
+		emit(g, e->dst[u]);
+
+		for (i = 2 * u; i < 2 * u + 2; ++i) {
+			if (mux[i] < 6)
+				e->src[i] = g_accs[mux[i]];
+			else if (mux[i] == 6)
+				e->src[i] = g_raddrs[0][raddr_a];
+			else if (mode == 1)
+				e->src[i] = g_simms[simm];
+			else
+				e->src[i] = g_raddrs[1][raddr_b];
+			emit(g, ", ");
+			emit(g, e->src[i]);
+		}
+		emit(g, " ");
+	}
+
+	// Explicit signals don't mix with small immediates.
+	sig = SIG_NONE;
+	if (mode != 0)
+		sig = SIG_SIMM;
+	else if (choose(c, 3) == 0)
+		sig = choose_name(c, g_sigs, 16);
+	if (mode == 0 && sig != SIG_NONE) {
+		emit(g, g_sigs[sig]);
+		emit(g, " ");
+	}
+
+	sf = choose(c, 4) == 0;
+	if (sf)
+		emit(g, "sf ");
+
+	pm = choose(c, 2);
+	unpack = choose(c, 3) == 0 ? choose(c, 8) : 0;
+	pack = choose(c, 3) == 0 ? choose_name(c, g_packs[pm], 16) : 0;
+	if (unpack) {
+		emit(g, g_unpacks[pm][unpack]);
+		emit(g, " ");
+	}
+	if (pack) {
+		emit(g, g_packs[pm][pack]);
+		emit(g, " ");
+	}
+	if (!unpack && !pack)
+		pm = 0;
+	emit(g, ";\n");
+
+	expect(e, F_SIG, sig);
+	expect(e, F_UNPACK, unpack);
+	expect(e, F_PM, pm);
+	expect(e, F_PACK, pack);
+	expect(e, F_SF, sf);
+	expect(e, F_OP_ADD, op[0]);
+	expect(e, F_OP_MUL, op[1]);
+	expect(e, F_COND_ADD, effective_cond(cond[0], waddr[0], &reads_io[0],
+					       sf && has[0]));
+	expect(e, F_COND_MUL, effective_cond(cond[1], waddr[1], &reads_io[2],
+					       sf && !has[0]));
+	if (mode == 2)
+		expect(e, F_RADDR_B, 48 + rot);
+}
+
+// li, lis, liu, and the semaphores.
+static
+void gen_load_imm(struct gen *g, struct expect *e)
+{
+	static const char *names[] = {"li", "lis", NULL, "liu", "semup"};
+	// Floats with a leading or trailing . that the tokenizer splits on,
+	// and the symbols of gen_program() that are named as ops.
+	static const struct {
+		const char			*text;
+		uint32_t			bits;
+	} exprs[] = {
+		{".5",		0x3f000000},
+		{"2.",		0x40000000},
+		{".25*4",	0x3f800000},
+		{"-.5",		0xbf000000},
+		{"(1.+.5)",	0x3fc00000},
+		{"1 + or",	4},
+		{"or - b",	0xfffffffe},
+		{"2 * sf",	4},
+		{"(sf)",	2},
+	};
+	struct choices *c;
+	int type, ws, cond[2], waddr[2], u, file, pm, pack, sf, reads_io[2];
+	int k;
+	uint32_t imm;
+	char buf[64];
+
+	c = &g->c;
+	memset(reads_io, 0, sizeof(reads_io));
+	type = choose_name(c, names, 5);
+	ws = choose(c, 2);
+
+	if (type == 4) {
+		// The sem number, and bit 4 for down.
+		imm = choose(c, 32);
+		snprintf(buf, sizeof(buf), "%s -, -, %u;\n",
+			 imm & 16 ? "semdn" : "semup", imm & 15);
+		emit(g, buf);
+		expect(e, F_SIG, SIG_LI);
+		expect(e, F_UNPACK, type);
+		expect(e, F_PM, 0);
+		expect(e, F_PACK, 0);
+		expect(e, F_COND_ADD, 0);
+		expect(e, F_COND_MUL, 0);
+		expect(e, F_SF, 0);
+		expect(e, F_IMM, imm);
+		e->dst[0] = e->dst[1] = "-";
+		return;
+	}
+
+	emit(g, names[type]);
+	cond[0] = cond[1] = 1;
+	if (choose(c, 2)) {
+		gen_cond(g, &cond[0]);
+		cond[1] = choose(c, 8);
+		emit(g, ".");
+		emit(g, g_conds[cond[1]]);
+	}
+
+	for (u = 0; u < 2; ++u) {
+		file = u ^ ws;
+		waddr[u] = choose_waddr(c, file);
+		e->dst[u] = g_waddrs[file][waddr[u]];
+		emit(g, u ? ", " : " ");
+		emit(g, e->dst[u]);
+	}
+
+	k = choose(c, 4 * NUM_ARR(exprs));
+	if (k < NUM_ARR(exprs)) {
+		imm = exprs[k].bits;
+		snprintf(buf, sizeof(buf), ", %s ", exprs[k].text);
+	} else {
+		imm = choose(c, 256) << 24 | choose(c, 65536) << 8 |
+			choose(c, 256);
+		snprintf(buf, sizeof(buf), ", 0x%x ", imm);
+	}
+	emit(g, buf);
+
+	sf = choose(c, 4) == 0;
+	if (sf)
+		emit(g, "sf ");
+	pm = choose(c, 2);
+	pack = choose(c, 3) == 0 ? choose_name(c, g_packs[pm], 16) : 0;
+	if (pack) {
+		emit(g, g_packs[pm][pack]);
+		emit(g, " ");
+	} else {
+		pm = 0;
+	}
+	emit(g, ";\n");
+
+	expect(e, F_SIG, SIG_LI);
+	expect(e, F_UNPACK, type);
+	expect(e, F_PM, pm);
+	expect(e, F_PACK, pack);
+	expect(e, F_SF, sf);
+	expect(e, F_COND_ADD, effective_cond(cond[0], waddr[0], reads_io, sf));
+	expect(e, F_COND_MUL, effective_cond(cond[1], waddr[1], reads_io, 0));
+	expect(e, F_IMM, imm);
+}
+
+static
+void gen_branch(struct gen *g, struct expect *e, int ix, int num_instrs)
+{
+	struct choices *c;
+	int cond, is_bl, file, waddr, target;
+	char buf[64];
+
+	c = &g->c;
+	is_bl = choose(c, 2);
+	emit(g, is_bl ? "bl" : "b");
+
+	cond = 15;
+	if (choose(c, 2)) {
+		cond = choose_name(c, g_br_conds, 16);
+		emit(g, ".");
+		emit(g, g_br_conds[cond]);
+	}
+	emit(g, " ");
+
+	e->dst[0] = e->dst[1] = "-";
+	if (is_bl) {
+		file = choose(c, 2);
+		waddr = choose_waddr(c, file);
+		e->dst[0] = g_waddrs[file][waddr];
+		emit(g, e->dst[0]);
+		emit(g, ", ");
+	}
+
+	target = choose(c, num_instrs + 32);
+	if (target < num_instrs) {
+		snprintf(buf, sizeof(buf), "L%d;\n", target);
+		expect(e, F_BR_REL, 1);
+		expect(e, F_BR_REG, 0);
+		expect(e, F_BR_RADDR_A, 0);
+		expect(e, F_IMM, (uint32_t)(target * 8 - (ix * 8 + 32)));
+	} else {
+		target -= num_instrs;
+		snprintf(buf, sizeof(buf), "a%d;\n", target);
+		expect(e, F_BR_REL, 0);
+		expect(e, F_BR_REG, 1);
+		expect(e, F_BR_RADDR_A, target);
+		expect(e, F_IMM, 0);
+	}
+	emit(g, buf);
+	expect(e, F_SIG, SIG_BR);
+	expect(e, F_BR_COND, cond);
+}
+
+static
+void gen_program(struct gen *g)
+{
+	char buf[32];
+	int i, k;
+
+	g->len = 0;
+	g->text[0] = 0;
+	emit(g, ".set or, 3;\n.set b, 5;\n.set sf, 2;\n");
+	g->num_instrs = 1 + choose(&g->c, MAX_PROG_INSTRS);
+	for (i = 0; i < g->num_instrs; ++i) {
+		memset(&g->e[i], 0, sizeof(g->e[i]));
+		snprintf(buf, sizeof(buf), "L%d:\n\t", i);
+		emit(g, buf);
+
+		k = choose(&g->c, 8);
+		if (k < 5)
+			gen_alu(g, &g->e[i]);
+		else if (k < 7)
+			gen_load_imm(g, &g->e[i]);
+		else
+			gen_branch(g, &g->e[i], i, g->num_instrs);
+	}
+}
+
+// Split the word into fields, and put them back together. Returns -EINVAL
+// if any bit lies outside of the fields of its format.
+static
+int decode(uint64_t word, uint32_t *v)
+{
+	const struct field_info *layout;
+	int i, num;
+	uint64_t mask, back;
+
+	switch (word >> 60) {
+	case SIG_LI:
+		layout = g_li_layout;
+		num = NUM_ARR(g_li_layout);
+		break;
+	case SIG_BR:
+		layout = g_br_layout;
+		num = NUM_ARR(g_br_layout);
+		break;
+	default:
+		layout = g_alu_layout;
+		num = NUM_ARR(g_alu_layout);
+		break;
+	}
+
+	memset(v, 0, NUM_FIELDS * sizeof(*v));
+	back = 0;
+	for (i = 0; i < num; ++i) {
+		mask = (1ull << layout[i].bits) - 1;
+		v[layout[i].field] = (word >> layout[i].pos) & mask;
+		back |= (uint64_t)v[layout[i].field] << layout[i].pos;
+	}
+	return back == word ? ESUCC : -EINVAL;
+}
+
+static
+const char *src_name(const uint32_t *v, int mux)
+{
+	if (mux < 6)
+		return g_accs[mux];
+	if (mux == 6)
+		return g_raddrs[0][v[F_RADDR_A]];
+	if (v[F_SIG] == SIG_SIMM)
+		return v[F_RADDR_B] < 48 ? g_simms[v[F_RADDR_B]] : NULL;
+	return g_raddrs[1][v[F_RADDR_B]];
+}
+
+static
+int same_name(const char *a, const char *b)
+{
+	return a && b && !strcmp(a, b);
+}
+
+static
+void fail(const struct gen *g, int ix, uint64_t word, const char *what)
+{
+	fprintf(stderr, "mismatch: %s at instruction %d (0x%016llx)\n%s",
+		what, ix, (unsigned long long)word, g->text);
+	abort();
+}
+
+static
+void check_instr(const struct gen *g, int ix, uint64_t word)
+{
+	const struct expect *e;
+	uint32_t v[NUM_FIELDS];
+	int i, ws, a_read, b_read;
+
+	e = &g->e[ix];
+	if (decode(word, v))
+		fail(g, ix, word, "stray bits");
+
+	for (i = 0; i < NUM_FIELDS; ++i) {
+		if ((e->care & (1u << i)) && v[i] != e->v[i])
+			fail(g, ix, word, "field");
+	}
+
+	ws = v[F_WS];
+	if (!same_name(g_waddrs[ws][v[F_WADDR_ADD]], e->dst[0]) ||
+	    !same_name(g_waddrs[!ws][v[F_WADDR_MUL]], e->dst[1]))
+		fail(g, ix, word, "dst");
+
+	if (!e->is_alu)
+		return;
+
+	a_read = b_read = 0;
+	for (i = 0; i < 4; ++i) {
+		if (!same_name(src_name(v, v[F_ADD_A + i]), e->src[i]))
+			fail(g, ix, word, "src");
+		a_read |= v[F_ADD_A + i] == 6;
+		b_read |= v[F_ADD_A + i] == 7;
+	}
+
+	// A port that no mux reads stays a nop.
+	if (!a_read && v[F_RADDR_A] != RADDR_NOP)
+		fail(g, ix, word, "raddr_a");
+	if (!b_read && !(e->care & (1u << F_RADDR_B)) &&
+	    v[F_RADDR_B] != RADDR_NOP)
+		fail(g, ix, word, "raddr_b");
+}
+
+static struct program g_prog;
+
+static
+void run_program(struct choices *c)
+{
+	static struct gen g;
+	uint64_t word;
+	int i;
+
+	g.c = *c;
+	gen_program(&g);
+
+	// A combination the assembler rejects (port conflicts, pack without
+	// a matching read or write, etc.) is fine; a wrong encoding is not.
+	if (assemble(&g_prog, g.text, g.len))
+		return;
+	if (g_prog.num_encoded != g.num_instrs)
+		fail(&g, g_prog.num_encoded, 0, "count");
+
+	for (i = 0; i < g.num_instrs; ++i) {
+		word = (uint64_t)g_prog.instrs[i].hi << 32 |
+			g_prog.instrs[i].lo;
+		check_instr(&g, i, word);
+	}
+}
+
+static
+void run_text(const uint8_t *data, size_t size)
+{
+	uint32_t v[NUM_FIELDS];
+	uint64_t word;
+	int i;
+
+	if (size > INT32_MAX)
+		return;
+	if (assemble(&g_prog, (const char *)data, size))
+		return;
+
+	for (i = 0; i < g_prog.num_encoded; ++i) {
+		word = (uint64_t)g_prog.instrs[i].hi << 32 |
+			g_prog.instrs[i].lo;
+		if (decode(word, v)) {
+			fprintf(stderr, "stray bits at instruction %d\n", i);
+			abort();
+		}
+	}
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	struct choices c;
+
+	if (g_raddrs[0][0] == NULL)
+		init_names();
+
+	if (size && data[0] == 0) {
+		c.p = data + 1;
+		c.n = size - 1;
+		run_program(&c);
+	} else {
+		run_text(data, size);
+	}
+	return 0;
+}
+
+#ifndef QAS_LIBFUZZER
+static uint32_t g_seed = 1;
+
+static
+uint32_t rand_next(void)
+{
+	g_seed = g_seed * 1664525u + 1013904223u;
+	return g_seed >> 8;
+}
+
+// Random text is put together from the words the assembler knows, so
+// that it gets past the tokenizer now and then.
+static
+size_t random_text(uint8_t *buf, size_t max)
+{
+	static const char *puncts[] = {
+		" ", ", ", ";\n", ":\n", ".", "#\n", "\t", "0x1f", "-1",
+		"L0", "L1", ".set", ".scratch", "(", ")", "+", "<<", "1.5",
+	};
+	const char *w;
+	size_t len, n;
+	int k;
+
+	len = 0;
+	for (k = rand_next() % 32; k >= 0; --k) {
+		switch (rand_next() % 5) {
+		case 0:
+			w = g_op_info[rand_next() % NUM_ARR(g_op_info)].name;
+			break;
+		case 1:
+			w = g_src_reg_info[rand_next() %
+					   NUM_ARR(g_src_reg_info)].name;
+			break;
+		case 2:
+			w = g_dst_reg_info[rand_next() %
+					   NUM_ARR(g_dst_reg_info)].name;
+			break;
+		case 3:
+			w = g_cc_info[rand_next() % NUM_ARR(g_cc_info)].name;
+			break;
+		default:
+			w = puncts[rand_next() % NUM_ARR(puncts)];
+			break;
+		}
+		n = strlen(w);
+		if (len + n > max)
+			break;
+		memcpy(&buf[len], w, n);
+		len += n;
+	}
+	return len;
+}
+
+static
+int run_file(const char *path)
+{
+	uint8_t *buf;
+	long size;
+	FILE *f;
+
+	f = fopen(path, "rb");
+	if (f == NULL)
+		return errno;
+	fseek(f, 0, SEEK_END);
+	size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	buf = malloc(size + 1);
+	if (buf == NULL)
+		return ENOMEM;
+	size = fread(buf, 1, size, f);
+	fclose(f);
+
+	LLVMFuzzerTestOneInput(buf, size);
+	free(buf);
+	return ESUCC;
+}
+
+int main(int argc, char **argv)
+{
+	uint8_t buf[512];
+	long iters, i, accepted;
+	size_t size, j;
+	int err, a;
+
+	iters = 1000000;
+	a = 1;
+	if (argc > 2 && !strcmp(argv[1], "-n")) {
+		iters = atol(argv[2]);
+		a = 3;
+	}
+
+	if (a < argc) {
+		for (; a < argc; ++a) {
+			err = run_file(argv[a]);
+			if (err)
+				return err;
+		}
+		return ESUCC;
+	}
+
+	accepted = 0;
+	for (i = 0; i < iters; ++i) {
+		if (i & 1) {
+			size = 1 + rand_next() % 128;
+			buf[0] = 0;
+			for (j = 1; j < size; ++j)
+				buf[j] = rand_next();
+		} else {
+			size = random_text(buf, sizeof(buf));
+		}
+		LLVMFuzzerTestOneInput(buf, size);
+		accepted += g_prog.num_encoded > 0;
+	}
+	printf("%ld inputs, %ld assembled\n", iters, accepted);
+	return ESUCC;
+}
+#endif
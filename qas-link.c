@@ -0,0 +1,460 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright (c) 2021 Amol Surati
+
+// Links the objects of qas -c into a program.
+//
+// gcc -O2 -o qas-link qas-link.c
+// ./qas-link [-m] main.o lib.o ... > prog.out
+//
+// The program starts with the first routine of the first object. Only
+// the routines that it reaches through the branches are kept, and each is
+// placed after the first routine that branches to it, so that callers and
+// callees share the cache lines. -m prints the layout, and the routines
+// dropped, to stderr. The output is that of qas, for qas-run.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#define ESUCC				0
+
+#define SIG_PROG_END			3
+#define SIG_COLOUR_PROG_END		9
+#define SIG_BR				15
+#define COND_BR_ALWAYS			15
+
+struct global {
+	char				*name;
+	int				ix;
+};
+
+// A branch at ix, to target of the same object, or to name.
+struct reloc {
+	int				ix;
+	int				target;
+	char				*name;
+};
+
+struct object {
+	const char			*path;
+	uint64_t			*code;
+	char				**src;
+	int				num_instrs;
+	struct global			*globals;
+	int				num_globals;
+	struct reloc			*relocs;
+	int				num_relocs;
+	int				*unit_of;	// Per instruction.
+};
+
+// Routines that are moved as a whole: from a global label to the next,
+// joined to the next when they fall through into it.
+struct unit {
+	int				obj;
+	int				start;
+	int				end;
+	const char			*name;
+	int				pc;		// -1 if dropped.
+};
+
+static struct object *objs;
+static int num_objs;
+static struct unit *units;
+static int num_units;
+static int num_placed;
+
+static
+void *grow(void *p, int num, int *max, size_t size)
+{
+	if (num < *max)
+		return p;
+	*max = *max ? *max * 2 : 16;
+	p = realloc(p, *max * size);
+	if (p == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(ENOMEM);
+	}
+	return p;
+}
+
+// The lines of qas -c: ".global name ix", ".reloc ix name",
+// ".reloc ix @target", and "0x<lo>, 0x<hi>, // source".
+static
+int read_object(const char *path, struct object *o)
+{
+	int max_instrs, max_globals, max_relocs, ix, n;
+	unsigned int lo, hi;
+	char line[4096], name[256], *p;
+	struct reloc *r;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (f == NULL)
+		return -errno;
+
+	memset(o, 0, sizeof(*o));
+	o->path = path;
+	max_instrs = max_globals = max_relocs = 0;
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, " .global %255s %d", name, &ix) == 2) {
+			o->globals = grow(o->globals, o->num_globals,
+					  &max_globals, sizeof(*o->globals));
+			o->globals[o->num_globals].name = strdup(name);
+			o->globals[o->num_globals++].ix = ix;
+		} else if (sscanf(line, " .reloc %d %255s", &ix, name) == 2) {
+			o->relocs = grow(o->relocs, o->num_relocs,
+					 &max_relocs, sizeof(*o->relocs));
+			r = &o->relocs[o->num_relocs++];
+			r->ix = ix;
+			r->target = -1;
+			r->name = NULL;
+			if (name[0] == '@')
+				r->target = atoi(&name[1]);
+			else
+				r->name = strdup(name);
+		} else if (sscanf(line, " 0x%x, 0x%x,", &lo, &hi) == 2) {
+			if (o->num_instrs == max_instrs) {
+				n = max_instrs;
+				o->code = grow(o->code, o->num_instrs, &n,
+					       sizeof(*o->code));
+				o->src = grow(o->src, o->num_instrs,
+					      &max_instrs, sizeof(*o->src));
+			}
+			o->code[o->num_instrs] = (uint64_t)hi << 32 | lo;
+			p = strstr(line, "// ");
+			p = strdup(p ? p + 3 : "\n");
+			p[strcspn(p, "\n")] = 0;
+			o->src[o->num_instrs++] = p;
+		}
+	}
+	fclose(f);
+
+	for (n = 0; n < o->num_globals; ++n) {
+		if (o->globals[n].ix < 0 || o->globals[n].ix >= o->num_instrs)
+			return -EINVAL;
+	}
+	for (n = 0; n < o->num_relocs; ++n) {
+		ix = o->relocs[n].target;
+		if (o->relocs[n].ix < 0 || o->relocs[n].ix >= o->num_instrs ||
+		    (o->relocs[n].name == NULL &&
+		     (ix < 0 || ix >= o->num_instrs)))
+			return -EINVAL;
+	}
+	return ESUCC;
+}
+
+// Does the code in [start, end) end with an unconditional branch and its
+// 3 delay slots, or with a program end and its 2?
+static
+int ends_routine(const uint64_t *code, int start, int end)
+{
+	int sig;
+
+	if (end - start >= 4) {
+		sig = code[end - 4] >> 60;
+		if (sig == SIG_BR &&
+		    ((code[end - 4] >> 52) & 15) == COND_BR_ALWAYS)
+			return 1;
+	}
+	if (end - start >= 3) {
+		sig = code[end - 3] >> 60;
+		if (sig == SIG_PROG_END || sig == SIG_COLOUR_PROG_END)
+			return 1;
+	}
+	return 0;
+}
+
+static
+int cmp_int(const void *a, const void *b)
+{
+	return *(const int *)a - *(const int *)b;
+}
+
+static
+void split_units(int obj, int *max_units)
+{
+	struct object *o;
+	struct unit *u;
+	int *starts, num, i, j;
+
+	o = &objs[obj];
+	starts = malloc((o->num_globals + 1) * sizeof(*starts));
+	o->unit_of = malloc(o->num_instrs * sizeof(*o->unit_of));
+	if (starts == NULL || o->unit_of == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(ENOMEM);
+	}
+
+	starts[0] = 0;
+	for (i = 0; i < o->num_globals; ++i)
+		starts[i + 1] = o->globals[i].ix;
+	qsort(starts, o->num_globals + 1, sizeof(*starts), cmp_int);
+
+	for (i = num = 0; i <= o->num_globals; ++i) {
+		if (num && starts[i] == starts[num - 1])
+			continue;
+		starts[num++] = starts[i];
+	}
+
+	u = NULL;
+	for (i = 0; i < num; ++i) {
+		// A routine that falls through stays with the next.
+		if (u && !ends_routine(o->code, u->start, starts[i])) {
+			u->end = i + 1 < num ? starts[i + 1] : o->num_instrs;
+			continue;
+		}
+		units = grow(units, num_units, max_units, sizeof(*units));
+		u = &units[num_units++];
+		u->obj = obj;
+		u->start = starts[i];
+		u->end = i + 1 < num ? starts[i + 1] : o->num_instrs;
+		u->name = NULL;
+		u->pc = -1;
+		for (j = 0; j < o->num_globals; ++j) {
+			if (o->globals[j].ix == u->start)
+				u->name = o->globals[j].name;
+		}
+	}
+
+	for (i = 0; i < num_units; ++i) {
+		if (units[i].obj != obj)
+			continue;
+		for (j = units[i].start; j < units[i].end; ++j)
+			o->unit_of[j] = i;
+	}
+	free(starts);
+}
+
+static
+const struct global *find_global(const char *name, int *obj)
+{
+	int i, j;
+
+	for (i = 0; i < num_objs; ++i) {
+		for (j = 0; j < objs[i].num_globals; ++j) {
+			if (strcmp(objs[i].globals[j].name, name))
+				continue;
+			*obj = i;
+			return &objs[i].globals[j];
+		}
+	}
+	return NULL;
+}
+
+// Resolve the names into the object and the index of their targets.
+// Returns the number of undefined names.
+static
+int resolve(int **target_obj)
+{
+	const struct global *g;
+	struct object *o;
+	int i, j, k, num;
+
+	num = 0;
+	for (i = 0; i < num_objs; ++i) {
+		o = &objs[i];
+		target_obj[i] = malloc((o->num_relocs + 1) * sizeof(int));
+		if (target_obj[i] == NULL) {
+			fprintf(stderr, "out of memory\n");
+			exit(ENOMEM);
+		}
+		for (j = 0; j < o->num_relocs; ++j) {
+			target_obj[i][j] = i;
+			if (o->relocs[j].name == NULL)
+				continue;
+			g = find_global(o->relocs[j].name, &k);
+			if (g == NULL) {
+				fprintf(stderr, "%s: undefined %s\n",
+					o->path, o->relocs[j].name);
+				++num;
+				continue;
+			}
+			target_obj[i][j] = k;
+			o->relocs[j].target = g->ix;
+		}
+	}
+	return num;
+}
+
+static
+int check_globals(void)
+{
+	int i, j, k, l;
+
+	for (i = 0; i < num_objs; ++i) {
+		for (j = 0; j < objs[i].num_globals; ++j) {
+			for (k = i; k < num_objs; ++k) {
+				for (l = k == i ? j + 1 : 0;
+				     l < objs[k].num_globals; ++l) {
+					if (strcmp(objs[i].globals[j].name,
+						   objs[k].globals[l].name))
+						continue;
+					fprintf(stderr, "%s: %s redefined\n",
+						objs[k].path,
+						objs[k].globals[l].name);
+					return -EINVAL;
+				}
+			}
+		}
+	}
+	return ESUCC;
+}
+
+// Depth first, in the order of the branches: each routine follows the
+// first one to reach it.
+static
+void place(int u, int **target_obj, int *pc)
+{
+	const struct object *o;
+	const struct reloc *r;
+	int i, t;
+
+	units[u].pc = *pc;
+	*pc += (units[u].end - units[u].start) * 8;
+	++num_placed;
+
+	o = &objs[units[u].obj];
+	for (i = 0; i < o->num_relocs; ++i) {
+		r = &o->relocs[i];
+		if (r->ix < units[u].start || r->ix >= units[u].end)
+			continue;
+		t = objs[target_obj[units[u].obj][i]].unit_of[r->target];
+		if (units[t].pc < 0)
+			place(t, target_obj, pc);
+	}
+}
+
+// The target is relative to the pc of the fourth instruction after the
+// branch.
+static
+void relocate(int **target_obj)
+{
+	const struct object *o;
+	const struct reloc *r;
+	const struct unit *u, *t;
+	int i, j, to, pc, target;
+
+	for (i = 0; i < num_objs; ++i) {
+		o = &objs[i];
+		for (j = 0; j < o->num_relocs; ++j) {
+			r = &o->relocs[j];
+			u = &units[o->unit_of[r->ix]];
+			if (u->pc < 0)
+				continue;
+			to = target_obj[i][j];
+			t = &units[objs[to].unit_of[r->target]];
+			pc = u->pc + (r->ix - u->start) * 8;
+			target = t->pc + (r->target - t->start) * 8;
+			o->code[r->ix] &= ~0xffffffffull;
+			o->code[r->ix] |= (uint32_t)(target - (pc + 4 * 8));
+		}
+	}
+}
+
+static
+int cmp_pc(const void *a, const void *b)
+{
+	return units[*(const int *)a].pc - units[*(const int *)b].pc;
+}
+
+static
+void print_unit_name(const struct unit *u)
+{
+	if (u->name)
+		fprintf(stderr, "%s", u->name);
+	else
+		fprintf(stderr, "%s:%d", objs[u->obj].path, u->start);
+}
+
+static
+void print_map(void)
+{
+	const struct unit *u;
+	int i;
+
+	for (i = 0; i < num_units; ++i) {
+		u = &units[i];
+		if (u->pc >= 0)
+			continue;
+		fprintf(stderr, "dropped ");
+		print_unit_name(u);
+		fprintf(stderr, ", %d instrs\n", u->end - u->start);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	int i, j, err, pc, show_map, max_units, *order, **target_obj;
+	const struct object *o;
+	const struct unit *u;
+
+	show_map = 0;
+	for (i = 1; i < argc && argv[i][0] == '-'; ++i) {
+		if (strcmp(argv[i], "-m"))
+			break;
+		show_map = 1;
+	}
+	if (i == argc || argv[i][0] == '-') {
+		printf("Usage: %s [-m] main.o lib.o ...\n", argv[0]);
+		return -EINVAL;
+	}
+
+	num_objs = argc - i;
+	objs = calloc(num_objs, sizeof(*objs));
+	target_obj = calloc(num_objs, sizeof(*target_obj));
+	if (objs == NULL || target_obj == NULL)
+		return -ENOMEM;
+
+	max_units = 0;
+	for (j = 0; j < num_objs; ++j) {
+		err = read_object(argv[i + j], &objs[j]);
+		if (err) {
+			fprintf(stderr, "%s: error %d\n", argv[i + j], err);
+			return err;
+		}
+		split_units(j, &max_units);
+	}
+	if (num_units == 0 || objs[0].num_instrs == 0) {
+		fprintf(stderr, "%s: no instructions\n", objs[0].path);
+		return -EINVAL;
+	}
+
+	err = check_globals();
+	if (err)
+		return err;
+	if (resolve(target_obj))
+		return -EINVAL;
+
+	pc = 0;
+	place(0, target_obj, &pc);
+	relocate(target_obj);
+
+	order = malloc(num_units * sizeof(*order));
+	if (order == NULL)
+		return -ENOMEM;
+	for (i = j = 0; i < num_units; ++i) {
+		if (units[i].pc >= 0)
+			order[j++] = i;
+	}
+	qsort(order, num_placed, sizeof(*order), cmp_pc);
+
+	for (i = 0; i < num_placed; ++i) {
+		u = &units[order[i]];
+		o = &objs[u->obj];
+		if (show_map) {
+			fprintf(stderr, "%6x ", u->pc);
+			print_unit_name(u);
+			fprintf(stderr, ", %d instrs\n", u->end - u->start);
+		}
+		for (j = u->start; j < u->end; ++j)
+			printf("0x%08x, 0x%08x, // %s\n", (uint32_t)o->code[j],
+			       (uint32_t)(o->code[j] >> 32), o->src[j]);
+	}
+	printf("done\n");
+
+	if (show_map)
+		print_map();
+	return ESUCC;
+}
@@ -0,0 +1,448 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright (c) 2021 Amol Surati
+
+// Runs the output of qas on the host.
+//
+// gcc -O3 -march=native -o qas-run qas-run.c emu.c -lm
+// ./qas-run [-m size] [-l addr:file] [-u u0,u1,... | -U file]
+//	     [-d addr:count] [-q num] [-T timing] [-n max] [-i] [-r] [-s]
+//	     prog.out
+//
+// The memory of size bytes, 1MB by default, starts at bus address 0. -l
+// loads a file into it, -u or -U place the uniforms, from the list or
+// from the file, at its top, and -d dumps count words once the program
+// ends. -q runs the program on num QPUs in lock step, sharing the memory,
+// the uniforms, the semaphores, the mutex and the VPM. -n stops after max
+// cycles, -r prints the accumulators at the end, and -s prints the time
+// taken, and the cycles each QPU spent blocked, to stderr.
+//
+// The code runs as AVX2 host code where it can, if the host has AVX2; -i
+// only interprets it.
+//
+// -T times the TMU loads and the uniform reads. timing is a list of
+// key=value, with the keys mem (the latency of a miss, in cycles), l2 (of
+// a hit), bw (bytes per cycle of the memory bus), l2size (in bytes, 0 for
+// none), and fifo (requests per TMU).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "emu.h"
+
+#define MAX_LOADS			16
+#define MAX_QPUS			16
+
+struct load {
+	uint32_t			addr;
+	const char			*path;
+};
+
+// qas prints an instruction per line, as "0x<lo>, 0x<hi>,".
+static
+int read_program(const char *path, uint64_t **out_code, int *out_num)
+{
+	unsigned int lo, hi;
+	uint64_t *code;
+	char line[4096];
+	int num, max;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (f == NULL)
+		return -errno;
+
+	code = NULL;
+	num = max = 0;
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, " 0x%x, 0x%x,", &lo, &hi) != 2)
+			continue;
+		if (num == max) {
+			max = max ? max * 2 : 256;
+			code = realloc(code, max * sizeof(*code));
+			if (code == NULL) {
+				fclose(f);
+				return -ENOMEM;
+			}
+		}
+		code[num++] = (uint64_t)hi << 32 | lo;
+	}
+	fclose(f);
+
+	*out_code = code;
+	*out_num = num;
+	return ESUCC;
+}
+
+static
+int load_file(uint8_t *mem, uint32_t size, const struct load *l)
+{
+	FILE *f;
+	long len;
+	int err;
+
+	f = fopen(l->path, "rb");
+	if (f == NULL)
+		return -errno;
+
+	err = ESUCC;
+	fseek(f, 0, SEEK_END);
+	len = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	if (len < 0 || l->addr > size || (uint32_t)len > size - l->addr)
+		err = -EINVAL;
+	else if (fread(&mem[l->addr], 1, len, f) != (size_t)len)
+		err = -EIO;
+	fclose(f);
+	return err;
+}
+
+// Places the contents of the file at the top of the memory. Returns the
+// address of the uniforms, or 0.
+static
+uint32_t load_uniforms(uint8_t *mem, uint32_t size, const char *path)
+{
+	struct load l;
+	FILE *f;
+	long len;
+
+	f = fopen(path, "rb");
+	if (f == NULL)
+		return 0;
+	fseek(f, 0, SEEK_END);
+	len = ftell(f);
+	fclose(f);
+	if (len <= 0 || (uint32_t)len > size)
+		return 0;
+
+	l.addr = (size - len) & ~3u;
+	l.path = path;
+	return load_file(mem, size, &l) ? 0 : l.addr;
+}
+
+// Returns the address of the uniforms.
+static
+uint32_t place_uniforms(uint8_t *mem, uint32_t size, const char *list)
+{
+	uint32_t addr, v;
+	const char *p;
+	char *end;
+	int num;
+
+	num = 1;
+	for (p = list; *p; ++p)
+		num += *p == ',';
+	addr = (size - num * 4) & ~3u;
+
+	p = list;
+	for (num = 0; ; ++num) {
+		v = strtoul(p, &end, 0);
+		memcpy(&mem[addr + num * 4], &v, 4);
+		if (*end != ',')
+			break;
+		p = end + 1;
+	}
+	return addr;
+}
+
+static
+void print_accs(const struct emu_qpu *q)
+{
+	int i, j;
+
+	for (i = 0; i < 6; ++i) {
+		printf("r%d:", i);
+		for (j = 0; j < EMU_LANES; ++j)
+			printf(" %08x", q->reg[i].u[j]);
+		printf("\n");
+	}
+}
+
+static
+void print_qpus(const struct emu_qpu *qpus, int num, uint64_t cycles)
+{
+	const struct emu_qpu *q;
+	uint64_t idle;
+	int i;
+
+	fprintf(stderr, "qpu %12s %12s %12s %12s %12s %12s %6s\n", "instrs",
+		"end_cycle", "sem_idle", "mutex_idle", "tmu_stall",
+		"uni_stall", "idle%");
+	for (i = 0; i < num; ++i) {
+		q = &qpus[i];
+		idle = q->idle[EMU_BLOCK_SEM] + q->idle[EMU_BLOCK_MUTEX] +
+			q->idle[EMU_BLOCK_TMU] + q->idle[EMU_BLOCK_UNIFORM];
+		fprintf(stderr, "%3d %12llu %12llu %12llu %12llu %12llu %12llu "
+			"%6.1f\n", i, (unsigned long long)q->num_executed,
+			(unsigned long long)q->end_cycle,
+			(unsigned long long)q->idle[EMU_BLOCK_SEM],
+			(unsigned long long)q->idle[EMU_BLOCK_MUTEX],
+			(unsigned long long)q->idle[EMU_BLOCK_TMU],
+			(unsigned long long)q->idle[EMU_BLOCK_UNIFORM],
+			cycles ? 100.0 * idle / cycles : 0);
+	}
+}
+
+static
+int parse_timing(struct emu_timing *t, char *spec)
+{
+	static const char *keys[] = {"mem", "l2", "bw", "l2size", "fifo"};
+	uint32_t *vals[] = {
+		&t->mem_latency, &t->l2_latency, &t->bytes_per_cycle,
+		&t->l2_size, NULL,
+	};
+	char *tok, *eq;
+	int i;
+
+	t->mem_latency = 100;
+	t->l2_latency = 20;
+	t->bytes_per_cycle = 8;
+	t->l2_size = 128 * 1024;
+	t->tmu_fifo = EMU_TMU_FIFO;
+	for (tok = strtok(spec, ","); tok; tok = strtok(NULL, ",")) {
+		eq = strchr(tok, '=');
+		if (eq == NULL)
+			return -EINVAL;
+		*eq = 0;
+		for (i = 0; i < 5; ++i) {
+			if (strcmp(tok, keys[i]))
+				continue;
+			if (vals[i])
+				*vals[i] = strtoul(eq + 1, NULL, 0);
+			else
+				t->tmu_fifo = atoi(eq + 1);
+			break;
+		}
+		if (i == 5)
+			return -EINVAL;
+	}
+	if (t->tmu_fifo < 1 || t->tmu_fifo > EMU_TMU_FIFO)
+		return -EINVAL;
+	return ESUCC;
+}
+
+// The loads arrive latency cycles after their request on average. The lead
+// is the number of cycles from a request to its ldtmu, less the stalls.
+static
+void print_timing(const struct emu *e, const struct emu_qpu *qpus, int num)
+{
+	uint64_t loads, latency, lead, stall;
+	int i;
+
+	loads = latency = lead = stall = 0;
+	for (i = 0; i < num; ++i) {
+		loads += qpus[i].tmu_loads;
+		latency += qpus[i].tmu_latency;
+		lead += qpus[i].tmu_lead;
+		stall += qpus[i].idle[EMU_BLOCK_TMU];
+	}
+
+	fprintf(stderr, "l2: %llu hits, %llu misses\n",
+		(unsigned long long)e->l2_hits,
+		(unsigned long long)e->l2_misses);
+	if (loads == 0)
+		return;
+	fprintf(stderr, "tmu: %llu loads, latency %.1f, lead %.1f, "
+		"stall %.1f cycles per load\n", (unsigned long long)loads,
+		(double)latency / loads, (double)(lead - stall) / loads,
+		(double)stall / loads);
+	if (stall)
+		fprintf(stderr, "tmu: issue the loads at least %.0f cycles "
+			"ahead of their ldtmu\n", (double)latency / loads);
+}
+
+static
+void dump(const uint8_t *mem, uint32_t size, uint32_t addr, uint32_t count)
+{
+	uint32_t i, v;
+
+	for (i = 0; i < count && addr + i * 4 + 4 <= size; ++i) {
+		if (i % 8 == 0)
+			printf("%s%08x:", i ? "\n" : "", addr + i * 4);
+		memcpy(&v, &mem[addr + i * 4], 4);
+		printf(" %08x", v);
+	}
+	printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+	static struct emu_qpu qpus[MAX_QPUS];
+	struct load loads[MAX_LOADS];
+	uint32_t mem_size, uni_addr, dump_addr, dump_count;
+	unsigned long long max;
+	uint64_t cycles, num_executed, num_host;
+	const char *uniforms, *uniforms_path;
+	struct emu_timing timing;
+	struct timespec t0, t1;
+	enum emu_status s;
+	struct emu emu;
+	uint64_t *code;
+	uint8_t *mem;
+	int num_loads, num_instrs, num_qpus, i, err;
+	char show_time, show_accs, timed, interp;
+	double ns;
+
+	mem_size = 1 << 20;
+	code = NULL;
+	num_instrs = 0;
+	uniforms = uniforms_path = NULL;
+	timed = 0;
+	dump_count = 0;
+	dump_addr = 0;
+	max = ~0ull;
+	num_loads = 0;
+	num_qpus = 1;
+	show_time = show_accs = interp = 0;
+	for (i = 1; i < argc - 1; ++i) {
+		if (!strcmp(argv[i], "-m") && i + 2 < argc) {
+			mem_size = strtoul(argv[++i], NULL, 0);
+		} else if (!strcmp(argv[i], "-l") && i + 2 < argc &&
+			   num_loads < MAX_LOADS) {
+			loads[num_loads].addr = strtoul(argv[++i], NULL, 0);
+			loads[num_loads].path = strchr(argv[i], ':');
+			if (loads[num_loads].path == NULL)
+				break;
+			++loads[num_loads++].path;
+		} else if (!strcmp(argv[i], "-u") && i + 2 < argc) {
+			uniforms = argv[++i];
+		} else if (!strcmp(argv[i], "-U") && i + 2 < argc) {
+			uniforms_path = argv[++i];
+		} else if (!strcmp(argv[i], "-T") && i + 2 < argc) {
+			if (parse_timing(&timing, argv[++i]))
+				break;
+			timed = 1;
+		} else if (!strcmp(argv[i], "-d") && i + 2 < argc) {
+			dump_addr = strtoul(argv[++i], NULL, 0);
+			if (strchr(argv[i], ':') == NULL)
+				break;
+			dump_count = strtoul(strchr(argv[i], ':') + 1, NULL, 0);
+		} else if (!strcmp(argv[i], "-q") && i + 2 < argc) {
+			num_qpus = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "-n") && i + 2 < argc) {
+			max = strtoull(argv[++i], NULL, 0);
+		} else if (!strcmp(argv[i], "-i")) {
+			interp = 1;
+		} else if (!strcmp(argv[i], "-r")) {
+			show_accs = 1;
+		} else if (!strcmp(argv[i], "-s")) {
+			show_time = 1;
+		} else {
+			break;
+		}
+	}
+	if (i != argc - 1 || mem_size < 4 || num_qpus < 1 ||
+	    num_qpus > MAX_QPUS) {
+		printf("Usage: %s [-m size] [-l addr:file] [-u u0,u1,... | "
+		       "-U file] [-d addr:count] [-q num] [-T timing] [-n max] "
+		       "[-i] [-r] [-s] prog.out\n", argv[0]);
+		return -EINVAL;
+	}
+
+	err = read_program(argv[i], &code, &num_instrs);
+	if (err) {
+		fprintf(stderr, "%s: error %d\n", argv[i], err);
+		return err;
+	}
+
+	mem = calloc(mem_size, 1);
+	if (mem == NULL)
+		return -ENOMEM;
+	for (i = 0; i < num_loads; ++i) {
+		err = load_file(mem, mem_size, &loads[i]);
+		if (err) {
+			fprintf(stderr, "%s: error %d\n", loads[i].path, err);
+			return err;
+		}
+	}
+	uni_addr = 0;
+	if (uniforms) {
+		uni_addr = place_uniforms(mem, mem_size, uniforms);
+	} else if (uniforms_path) {
+		uni_addr = load_uniforms(mem, mem_size, uniforms_path);
+		if (uni_addr == 0) {
+			fprintf(stderr, "%s: error %d\n", uniforms_path, -EINVAL);
+			return -EINVAL;
+		}
+	}
+
+	err = emu_init(&emu, code, num_instrs, mem, 0, mem_size);
+	if (err)
+		return err;
+	if (timed) {
+		err = emu_set_timing(&emu, &timing);
+		if (err)
+			return err;
+	}
+	if (!interp) {
+		err = emu_set_jit(&emu);
+		if (err && err != -ENOTSUP)
+			return err;
+	}
+	for (i = 0; i < num_qpus; ++i)
+		emu_reset_qpu(&emu, &qpus[i], i, uni_addr);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	s = emu_run_qpus(qpus, num_qpus, max, &cycles);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	err = ESUCC;
+	switch (s) {
+	case EMU_DONE:
+		printf("done\n");
+		break;
+	case EMU_RUNNING:
+		printf("stopped at cycle %llu\n", (unsigned long long)cycles);
+		break;
+	case EMU_BLOCKED:
+		printf("deadlock at cycle %llu\n", (unsigned long long)cycles);
+		err = -EDEADLK;
+		break;
+	default:
+		err = -EINVAL;
+		break;
+	}
+
+	for (i = 0; i < num_qpus; ++i) {
+		if (qpus[i].status == EMU_FAULT)
+			printf("qpu %d: fault at pc %x: %s\n", i, qpus[i].pc * 8,
+			       qpus[i].fault);
+		else if (s == EMU_BLOCKED && qpus[i].status == EMU_BLOCKED)
+			printf("qpu %d: blocked on the %s at pc %x\n", i,
+			       qpus[i].block == EMU_BLOCK_SEM ? "semaphore" :
+			       qpus[i].block == EMU_BLOCK_MUTEX ? "mutex" :
+			       "memory", qpus[i].pc * 8);
+	}
+
+	for (i = 0; show_accs && i < num_qpus; ++i) {
+		if (num_qpus > 1)
+			printf("qpu %d:\n", i);
+		print_accs(&qpus[i]);
+	}
+	if (dump_count)
+		dump(mem, mem_size, dump_addr, dump_count);
+
+	if (show_time && emu.timed)
+		print_timing(&emu, qpus, num_qpus);
+	if (show_time) {
+		num_executed = num_host = 0;
+		for (i = 0; i < num_qpus; ++i) {
+			num_executed += qpus[i].num_executed;
+			num_host += qpus[i].num_host;
+		}
+		ns = (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+		fprintf(stderr, "%llu instructions, %llu as host code, "
+			"%llu cycles, %.0f ns, %.2f ns/instr\n",
+			(unsigned long long)num_executed,
+			(unsigned long long)num_host,
+			(unsigned long long)cycles, ns,
+			num_executed ? ns / num_executed : 0);
+		print_qpus(qpus, num_qpus, cycles);
+	}
+
+	emu_free(&emu);
+	free(mem);
+	free(code);
+	return err;
+}
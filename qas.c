@@ -2,11 +2,14 @@
 // Copyright (c) 2021 Amol Surati
 
 #include <assert.h>
+#include <stdarg.h>
 #include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
 #include <stdio.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "qas.h"
 
@@ -28,30 +31,273 @@
 // b.cc label
 // bl.cc adst,label
 
-static int token_start[MAX_TOKENS];
-static int token_end[MAX_TOKENS];
-static int num_tokens;
+// Time spent in each stage, for --stats.
+enum stage {
+	STAGE_READ,
+	STAGE_SCAN,
+	STAGE_PARSE,
+	STAGE_SELECT,
+	STAGE_VERIFY,
+	STAGE_ENCODE,
+	STAGE_OUTPUT,
+	NUM_STAGES,
+};
+
+static inline
+const char *stage_name(enum stage s)
+{
+	static const char *names[NUM_STAGES] = {
+		"read",
+		"scan",
+		"parse",
+		"select",
+		"verify",
+		"encode",
+		"output",
+	};
+
+	return names[s];
+}
+
+struct stage_clock {
+	uint64_t			ns;
+	uint64_t			cycles;
+};
+
+static struct stage_clock stage_times[NUM_STAGES];
+static char show_stats;
+
+// Counters; compiled in only with -DQAS_STATS.
+enum stat {
+	STAT_TOKENS,
+	STAT_OP_PROBES,		// parse_op_code()
+	STAT_REG_PROBES,	// parse_reg()
+	STAT_LABEL_PROBES,	// find_label()
+	STAT_ALLOCS,
+	STAT_OUTPUT_BYTES,
+	NUM_STATS,
+};
+
+#ifdef QAS_STATS
+static uint64_t stats[NUM_STATS];
+#define stat_add(s, n)			(stats[s] += (n))
+#else
+#define stat_add(s, n)			((void)(n))
+#endif
+
+static
+uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Reference cycles of the TSC, where there is one.
+static inline
+uint64_t now_cycles(void)
+{
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	return __builtin_ia32_rdtsc();
+#else
+	return 0;
+#endif
+}
+
+static inline
+void stage_start(struct stage_clock *c)
+{
+	if (!show_stats) {
+		c->ns = c->cycles = 0;
+		return;
+	}
+	c->ns = now_ns();
+	c->cycles = now_cycles();
+}
+
+static inline
+void stage_stop(const struct stage_clock *c, enum stage s)
+{
+	if (!show_stats)
+		return;
+	stage_times[s].ns += now_ns() - c->ns;
+	stage_times[s].cycles += now_cycles() - c->cycles;
+}
+
+// The stages that take turns instruction by instruction are timed by
+// the TSC alone, as a clock_gettime() per call costs more than most of
+// the calls. The ns of the whole span are then shared out by the cycles
+// of each stage. Without a TSC, the span counts as parse.
+struct stage_span {
+	struct stage_clock		clock;
+	uint64_t			cycles[NUM_STAGES];
+};
+
+static inline
+void tick_start(struct stage_clock *c)
+{
+	c->cycles = show_stats ? now_cycles() : 0;
+}
+
+// Ends the stage, and starts the clock of the next one.
+static inline
+void tick_lap(struct stage_clock *c, enum stage s)
+{
+	uint64_t t;
+
+	if (!show_stats)
+		return;
+	t = now_cycles();
+	stage_times[s].cycles += t - c->cycles;
+	c->cycles = t;
+}
+
+static
+void span_start(struct stage_span *sp)
+{
+	int i;
+
+	stage_start(&sp->clock);
+	for (i = 0; i < NUM_STAGES; ++i)
+		sp->cycles[i] = stage_times[i].cycles;
+}
+
+static
+void span_stop(const struct stage_span *sp)
+{
+	uint64_t ns, cycles, d;
+	int i;
+
+	if (!show_stats)
+		return;
+	ns = now_ns() - sp->clock.ns;
+	cycles = now_cycles() - sp->clock.cycles;
+	if (cycles == 0) {
+		stage_times[STAGE_PARSE].ns += ns;
+		return;
+	}
+	for (i = 0; i < NUM_STAGES; ++i) {
+		d = stage_times[i].cycles - sp->cycles[i];
+		stage_times[i].ns += (uint64_t)((double)ns * d / cycles);
+	}
+}
+
+// How much main() prints to stdout. The harnesses leave it at quiet.
+enum verbosity {
+	VERBOSITY_QUIET,	// -q: nothing.
+	VERBOSITY_NORMAL,	// The encoded instructions.
+	VERBOSITY_TOKENS,	// -v: and the tokens of each, as parsed.
+};
+
+static enum verbosity verbosity;
+
+// The text for stdout is batched here, and written when the buffer fills,
+// or by out_flush().
+#define OUT_SIZE			(64 * 1024)
+
+static char out_buf[OUT_SIZE];
+static int out_len;
+
+static
+void out_flush(void)
+{
+	fwrite(out_buf, 1, out_len, stdout);
+	out_len = 0;
+}
 
 static
-void get_token(struct instr *in, char *out)
+void out_write(const char *s, int n)
+{
+	stat_add(STAT_OUTPUT_BYTES, n);
+	if (out_len + n > OUT_SIZE)
+		out_flush();
+	if (n > OUT_SIZE) {
+		fwrite(s, 1, n, stdout);
+		return;
+	}
+	memcpy(&out_buf[out_len], s, n);
+	out_len += n;
+}
+
+static inline
+void out_str(const char *s)
+{
+	out_write(s, strlen(s));
+}
+
+// 0x and 8 hex digits.
+static inline
+void out_hex(uint32_t v)
 {
-	int ts, te, t, len;
+	static const char digits[] = "0123456789abcdef";
+	char s[10];
+	int i;
+
+	s[0] = '0';
+	s[1] = 'x';
+	for (i = 9; i > 1; --i, v >>= 4)
+		s[i] = digits[v & 15];
+	out_write(s, sizeof(s));
+}
+
+static
+void out_printf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
 
-	t = in->curr_token++;
+static
+void out_printf(const char *fmt, ...)
+{
+	char s[256];
+	va_list args;
+	int n;
+
+	va_start(args, fmt);
+	n = vsnprintf(s, sizeof(s), fmt, args);
+	va_end(args);
+	if (n > 0)
+		out_write(s, n < (int)sizeof(s) ? n : (int)sizeof(s) - 1);
+}
 
-	assert(t < num_tokens);
+// The tokens of the current instruction. The vector only grows, and is
+// reused for every instruction.
+static struct token *tokens;
+static int num_tokens;
+static int max_tokens;
 
-	ts = token_start[t];
-	te = token_end[t];
+static
+int grow_tokens(void)
+{
+	int num;
+	struct token *p;
+
+	num = max_tokens ? max_tokens * 2 : 64;
+	p = realloc(tokens, num * sizeof(*p));
+	stat_add(STAT_ALLOCS, 1);
+	if (p == NULL)
+		return -ENOMEM;
+	tokens = p;
+	max_tokens = num;
+	return ESUCC;
+}
 
-	len = te - ts;
-	assert(len < 128);
+// The tokens always end with a ;. Past the end, the ; repeats, so that
+// the parsers fail on malformed input instead of reading beyond.
+static
+const struct token *peek_token(const struct instr *in)
+{
+	if (in->curr_token < num_tokens)
+		return &tokens[in->curr_token];
+	return &tokens[num_tokens - 1];
+}
 
-	if (len > 127)
-		len = 127;
+static
+const struct token *get_token(struct instr *in)
+{
+	const struct token *tok;
 
-	memcpy(out, &in->buf[ts], len);
-	out[len] = 0;
+	tok = peek_token(in);
+	++in->curr_token;
+	return tok;
 }
 
 static
@@ -60,6 +306,7 @@ void parse_nop(struct instr *in)
 	struct op *op;
 
 	in->pack = OP_PACK_NOP;
+	in->unpack = OP_UNPACK_NOP;
 	in->sig = OP_SIG_NONE;
 
 	op = &in->op;
@@ -72,59 +319,313 @@ void parse_nop(struct instr *in)
 }
 
 static
-int parse_cc(const char *str, enum cc *out)
+uint32_t hash_token(const struct token *tok)
 {
-	int i, num;
+	uint32_t h;
+	int i;
+
+	// FNV-1a
+	h = 2166136261u;
+	for (i = 0; i < tok->len; ++i)
+		h = (h ^ (unsigned char)tok->str[i]) * 16777619u;
+	return h;
+}
 
-	num = NUM_ARR(g_cc_info);
-	for (i = 0; i < num; ++i) {
-		if (!strcmp(g_cc_info[i].name, str))
-			break;
+// The names of the ccs, the ops and the regs, hashed on first use. A name
+// can be in more than one of the tables; within one, the first entry wins.
+enum name_kind {
+	NAME_CC,
+	NAME_OP,
+	NAME_SRC_REG,
+	NAME_DST_REG,
+};
+
+// At least twice the number of names.
+#define NAME_SLOTS			1024
+
+struct name_slot {
+	const char			*name;
+	int				len;
+	enum name_kind			kind;
+	int				ix;	// Into the table of the kind.
+};
+
+static struct name_slot name_slots[NAME_SLOTS];
+static const char *cc_names[CC_ALL_NC + 1];
+static const char *op_names[OP_SIG_BR + 1];
+static char names_indexed;
+
+static
+uint32_t hash_name(const struct token *tok, enum name_kind kind)
+{
+	return (hash_token(tok) ^ kind * 0x9e3779b9u) & (NAME_SLOTS - 1);
+}
+
+static
+void add_name(const char *name, enum name_kind kind, int ix)
+{
+	struct name_slot *slot;
+	struct token tok;
+	uint32_t h;
+
+	tok.str = name;
+	tok.len = strlen(name);
+	h = hash_name(&tok, kind);
+	for (; name_slots[h].name; h = (h + 1) & (NAME_SLOTS - 1)) {
+		slot = &name_slots[h];
+		if (slot->kind == kind && token_is(&tok, slot->name))
+			return;
+	}
+
+	slot = &name_slots[h];
+	slot->name = name;
+	slot->len = tok.len;
+	slot->kind = kind;
+	slot->ix = ix;
+}
+
+static
+void index_names(void)
+{
+	enum cc code;
+	int i;
+
+	for (i = 0; i < NUM_ARR(g_cc_info); ++i) {
+		add_name(g_cc_info[i].name, NAME_CC, i);
+		code = g_cc_info[i].code;
+		if (cc_names[code] == NULL)
+			cc_names[code] = g_cc_info[i].name;
+	}
+	for (i = 0; i < NUM_ARR(g_op_info); ++i) {
+		add_name(g_op_info[i].name, NAME_OP, i);
+		if (op_names[g_op_info[i].code] == NULL)
+			op_names[g_op_info[i].code] = g_op_info[i].name;
 	}
+	for (i = 0; i < NUM_ARR(g_src_reg_info); ++i)
+		add_name(g_src_reg_info[i].name, NAME_SRC_REG, i);
+	for (i = 0; i < NUM_ARR(g_dst_reg_info); ++i)
+		add_name(g_dst_reg_info[i].name, NAME_DST_REG, i);
+	names_indexed = 1;
+}
+
+// Returns the index into the table of the kind, or -1.
+static
+int find_name(const struct token *tok, enum name_kind kind, int *probes)
+{
+	const struct name_slot *slot;
+	uint32_t h;
+
+	if (!names_indexed)
+		index_names();
+
+	h = hash_name(tok, kind);
+	for (; name_slots[h].name; h = (h + 1) & (NAME_SLOTS - 1)) {
+		slot = &name_slots[h];
+		++*probes;
+		if (slot->kind == kind && slot->len == tok->len &&
+		    !memcmp(slot->name, tok->str, tok->len))
+			return slot->ix;
+	}
+	return -1;
+}
+
+static
+int parse_cc(const struct token *tok, enum cc *out)
+{
+	int i, probes;
 
-	if (i == num)
+	probes = 0;
+	i = find_name(tok, NAME_CC, &probes);
+	if (i < 0)
 		return -EINVAL;
 	*out = g_cc_info[i].code;
 	return ESUCC;
 }
 
 static
-int parse_op_code(const char *str, enum op_code *out)
+const char *cc_name(enum cc code)
+{
+	if (!names_indexed)
+		index_names();
+	return cc_names[code] ? cc_names[code] : "?";
+}
+
+static
+const char *op_name(enum op_code code)
+{
+	if (!names_indexed)
+		index_names();
+	return op_names[code] ? op_names[code] : "?";
+}
+
+// The name of the reg in the source; RF_AB matches either regfile.
+static
+const char *reg_name(const struct reg *r, char is_src)
 {
+	const struct reg_info *ri;
 	int i, num;
 
-	num = NUM_ARR(g_op_info);
+	ri = is_src ? g_src_reg_info : g_dst_reg_info;
+	num = is_src ? NUM_ARR(g_src_reg_info) : NUM_ARR(g_dst_reg_info);
 	for (i = 0; i < num; ++i) {
-		if (!strcmp(g_op_info[i].name, str))
-			break;
+		if (ri[i].num != r->num)
+			continue;
+		if (ri[i].rf == r->rf ||
+		    (ri[i].rf == RF_AB && r->rf < RF_AB) ||
+		    (r->rf == RF_AB && ri[i].rf < RF_AB))
+			return ri[i].name;
+	}
+	return "?";
+}
+
+// Appends to the n chars of s; returns the new length.
+static
+int append(char *s, int size, int n, const char *fmt, ...)
+{
+	va_list ap;
+	int k;
+
+	if (n >= size - 1)
+		return n;
+	va_start(ap, fmt);
+	k = vsnprintf(s + n, size - n, fmt, ap);
+	va_end(ap);
+	return k < size - n ? n + k : size - 1;
+}
+
+static
+int append_src(char *s, int size, int n, const struct reg *r)
+{
+	if (r->rf == RF_EXPR)
+		return append(s, size, n, ", %.*s", r->expr.len, r->expr.str);
+	if (r->rf == RF_IMM)
+		return append(s, size, n, ", 0x%x", r->num);
+	return append(s, size, n, ", %s", reg_name(r, 1));
+}
+
+// The instruction as it is encoded, in the syntax of the source.
+static
+int format_instr(const struct instr *in, char *s, int size)
+{
+	const struct op *op;
+	int i, n;
+
+	op = &in->op;
+	n = 0;
+	s[0] = 0;
+	if (in->sig == OP_SIG_BR) {
+		n = append(s, size, n, "%s", op_name(op->code[0]));
+		if (op->cc[0] != CC_ALWAYS)
+			n = append(s, size, n, ".%s", cc_name(op->cc[0]));
+		if (op->code[0] == OP_BR_BL)
+			n = append(s, size, n, " %s,",
+				   reg_name(&op->dst[0], 0));
+		if (op->src_label.str)
+			return append(s, size, n, " %.*s", op->src_label.len,
+				      op->src_label.str);
+		return append(s, size, n, " %s", reg_name(&op->src[0], 1));
+	}
+
+	if (in->sig == OP_SIG_LI) {
+		n = append(s, size, n, "%s", op_name(op->code[0]));
+		// The cond of a - dst does not matter.
+		if ((op->cc[0] != CC_ALWAYS && op->dst[0].num != 39) ||
+		    (op->cc[1] != CC_ALWAYS && op->dst[1].num != 39))
+			n = append(s, size, n, ".%s.%s", cc_name(op->cc[0]),
+				   cc_name(op->cc[1]));
+		n = append(s, size, n, " %s, %s, 0x%x",
+			   reg_name(&op->dst[0], 0),
+			   reg_name(&op->dst[1], 0), in->lo);
+	}
+
+	for (i = 0; i < 2 && in->sig != OP_SIG_LI; ++i) {
+		if (op->code[i] == OP_NOP)
+			continue;
+		n = append(s, size, n, "%s%s", n ? " " : "",
+			   op_name(op->code[i]));
+		if (op->cc[i] != CC_ALWAYS)
+			n = append(s, size, n, ".%s", cc_name(op->cc[i]));
+		n = append(s, size, n, " %s", reg_name(&op->dst[i], 0));
+		n = append_src(s, size, n, &op->src[2 * i]);
+		n = append_src(s, size, n, &op->src[2 * i + 1]);
+	}
+	if (in->sig >= OP_SIG_BREAK && in->sig <= OP_SIG_LD_ALPHA &&
+	    in->sig != OP_SIG_NONE)
+		n = append(s, size, n, "%s%s", n ? " " : "",
+			   op_name(in->sig));
+	if (in->sf)
+		n = append(s, size, n, "%s%s", n ? " " : "",
+			   op_name(OP_FLAGS_SF));
+	if (in->unpack != OP_UNPACK_NOP)
+		n = append(s, size, n, " %s", op_name(in->unpack));
+	if (in->pack != OP_PACK_NOP)
+		n = append(s, size, n, " %s", op_name(in->pack));
+	if (n == 0)
+		n = append(s, size, n, "nop");
+	return n;
+}
+
+// The note on an instruction that does not match its source: a branch that
+// --layout inverted, with the condition and the target now; an li or a
+// nop that select_imms() or --if-convert placed, which has no source; or
+// an instr that --if-convert or --cse rewrote, as it is now. Returns its
+// length, 0 if none.
+static
+int instr_note(const struct instr *in, char *s, int size)
+{
+	int n;
+
+	if (in->inverted)
+		n = snprintf(s, size, "  # inverted: %s.%s %.*s",
+			     in->op.code[0] == OP_BR_BL ? "bl" : "b",
+			     cc_name(in->op.cc[0]), in->op.src_label.len,
+			     in->op.src_label.str);
+	else if (in->inserted)
+		n = append(s, size, format_instr(in, s, size),
+			   ";  # inserted");
+	else if (in->converted || in->rewritten) {
+		n = append(s, size, 0, "  # %s%s%s: ",
+			   in->converted ? "if-converted" : "",
+			   in->converted && in->rewritten ? ", " : "",
+			   in->rewritten ? "cse" : "");
+		n += format_instr(in, s + n, size - n);
+	} else {
+		return 0;
 	}
-	assert(i < num);
-	if (i == num)
+	return n < size ? n : size - 1;
+}
+
+static
+int parse_op_code(const struct token *tok, enum op_code *out)
+{
+	int i, probes;
+
+	probes = 0;
+	i = find_name(tok, NAME_OP, &probes);
+	stat_add(STAT_OP_PROBES, probes);
+	if (i < 0)
 		return -EINVAL;
 	*out = g_op_info[i].code;
 	return ESUCC;
 }
 
 static
-int parse_reg(const char *str, char is_src, struct reg *out)
+int parse_reg(const struct token *tok, char is_src, struct reg *out)
 {
-	int num, i;
 	const struct reg_info *ri;
+	int i, probes;
 
+	probes = 0;
 	if (is_src) {
 		ri = g_src_reg_info;
-		num = NUM_ARR(g_src_reg_info);
+		i = find_name(tok, NAME_SRC_REG, &probes);
 	} else {
 		ri = g_dst_reg_info;
-		num = NUM_ARR(g_dst_reg_info);
-	}
-
-	for (i = 0; i < num; ++i) {
-		if (!strcmp(ri[i].name, str))
-			break;
+		i = find_name(tok, NAME_DST_REG, &probes);
 	}
+	stat_add(STAT_REG_PROBES, probes);
 
-	if (i == num)
+	if (i < 0)
 		return -EINVAL;
 
 	out->rf = ri[i].rf;
@@ -133,955 +634,7462 @@ int parse_reg(const char *str, char is_src, struct reg *out)
 }
 
 static inline
-int parse_src_reg(const char *str, struct reg *out)
+int parse_src_reg(const struct token *tok, struct reg *out)
+{
+	return parse_reg(tok, 1, out);
+}
+
+static inline
+int parse_dst_reg(const struct token *tok, struct reg *out)
 {
-	return parse_reg(str, 1, out);
+	return parse_reg(tok, 0, out);
 }
 
+// The value of a constant expression. Floats stay floats until the
+// expression is folded.
+struct value {
+	char				is_float;
+	uint32_t			i;
+	float				f;
+};
+
+// Symbols defined with .set name, expr;
+struct sym {
+	struct token			name;
+	struct token			expr;
+	struct value			val;
+	char				state;	// 0: new, 1: busy, 2: done
+};
+
+static struct sym *syms;
+static int num_syms;
+static int max_syms;
+
+// State of the expression evaluator. [p, end) is yet to be consumed.
+struct eval {
+	const char			*p;
+	const char			*end;
+	const struct instr		*ins;
+	int				num_instrs;
+	int				depth;
+};
+
+#define MAX_EVAL_DEPTH			64
+
 static inline
-int parse_dst_reg(const char *str, struct reg *out)
+int char_class(char c)
 {
-	return parse_reg(str, 0, out);
+	return g_char_class[(unsigned char)c];
 }
 
 static
-int parse_num(const char *str, char is_hex, int *out)
+int is_name(const struct token *tok)
 {
-	int num, len, i;
+	int i;
 
-	len = strlen(str);
-	num = 0;
-	if (!is_hex) {
-		for (i = 0; i < len; ++i) {
-			if (!isdigit(str[i]))
-				return -EINVAL;
-			num *= 10;
-			num += str[i] - '0';
-		}
-	} else {
-		for (i = 0; i < len; ++i) {
-			if (!is_hex_digit(str[i]))
-				return -EINVAL;
-			num <<= 4;
-			if (str[i] >= 'a' && str[i] <= 'f')
-				num += 10 + str[i] - 'a';
-			else
-				num += str[i] - '0';
-		}
+	if (!(char_class(tok->str[0]) & CH_ALPHA))
+		return 0;
+	for (i = 1; i < tok->len; ++i) {
+		if (!(char_class(tok->str[i]) & (CH_ALPHA | CH_DIGIT)))
+			return 0;
 	}
-	*out = num;
-	return ESUCC;
+	return 1;
 }
 
 static
-int parse_src_imm(const char *str, struct reg *out)
+struct sym *find_sym(const struct token *name)
 {
-	char is_hex;
-	int num, err;
-
-	if (!isdigit(str[0]))
-		return -EINVAL;
+	int i;
 
-	is_hex = 0;
-	if (!strncmp(str, "0x", 2))
-		is_hex = 1;
+	for (i = 0; i < num_syms; ++i) {
+		if (token_eq(&syms[i].name, name))
+			return &syms[i];
+	}
+	return NULL;
+}
 
-	if (is_hex)
-		err = parse_num(&str[2], is_hex, &num);
-	else
-		err = parse_num(str, is_hex, &num);
-	if (err)
-		return err;
+// Labels, hashed by name, once the pcs settle; see index_labels().
+struct label_slot {
+	struct token			label;
+	int				ix;	// Of the instruction.
+	int				pc;
+};
 
-	out->rf = RF_IMM;
-	out->num = num;
-	return ESUCC;
-}
+static struct label_slot *label_slots;
+static uint32_t label_mask;
+static int num_labels;
 
+// Rehash the labels into a table of size slots.
 static
-int parse_op_signals(struct instr *in, enum op_code code)
+int resize_labels(uint32_t size)
 {
-	// Can't have more than one signals.
-	if (in->sig != OP_SIG_NONE)
-		return -EINVAL;
-	in->sig = code;
+	struct label_slot *slots, *old;
+	uint32_t i, h, old_size;
+
+	slots = calloc(size, sizeof(*slots));
+	stat_add(STAT_ALLOCS, 1);
+	if (slots == NULL)
+		return -ENOMEM;
+
+	old = label_slots;
+	old_size = old ? label_mask + 1 : 0;
+	label_slots = slots;
+	label_mask = size - 1;
+	for (i = 0; i < old_size; ++i) {
+		if (old[i].label.str == NULL)
+			continue;
+		h = hash_token(&old[i].label) & label_mask;
+		while (slots[h].label.str)
+			h = (h + 1) & label_mask;
+		slots[h] = old[i];
+	}
+	free(old);
 	return ESUCC;
 }
 
+// The first instruction that carries a label wins. The table is kept at
+// most half full.
 static
-int parse_op_pack(struct instr *in, enum op_code code)
+int add_label(const struct token *label, int ix, int pc)
 {
-	// Can't have more than one pack specifiers.
-	if (in->pack != OP_PACK_NOP)
-		return -EINVAL;
-	if (code >= OP_PACK_MUL_8888 && code <= OP_PACK_MUL_8D)
-		in->pm = 1;
-	in->pack = code;
+	uint32_t h, size;
+	int err;
+
+	size = label_slots ? label_mask + 1 : 0;
+	if (2 * (uint32_t)(num_labels + 1) > size) {
+		err = resize_labels(size ? 2 * size : 16);
+		if (err)
+			return err;
+	}
+
+	h = hash_token(label) & label_mask;
+	while (label_slots[h].label.str &&
+	       !token_eq(&label_slots[h].label, label))
+		h = (h + 1) & label_mask;
+	if (label_slots[h].label.str)
+		return ESUCC;
+	label_slots[h].label = *label;
+	label_slots[h].ix = ix;
+	label_slots[h].pc = pc;
+	++num_labels;
 	return ESUCC;
 }
 
+// Must be called once the instructions no longer move.
 static
-int parse_op_flags(struct instr *in, enum op_code code)
+int index_labels(const struct instr *ins, int num_instrs)
 {
-	if (code == OP_FLAGS_SF)
-		in->sf = 1;
-	else
-		return -EINVAL;
+	uint32_t size;
+	int i, j, n, err;
+
+	n = 0;
+	for (i = 0; i < num_instrs; ++i)
+		n += ins[i].num_labels;
+
+	for (size = 16; size < 2 * (uint32_t)(n + 1); size *= 2)
+		;
+
+	free(label_slots);
+	label_slots = NULL;
+	num_labels = 0;
+	err = resize_labels(size);
+	if (err)
+		return err;
+
+	for (i = 0; i < num_instrs; ++i) {
+		for (j = 0; j < ins[i].num_labels; ++j) {
+			err = add_label(&ins[i].labels[j], i, ins[i].pc);
+			if (err)
+				return err;
+		}
+	}
 	return ESUCC;
 }
 
+// Returns the slot of the label, or NULL.
 static
-void print_tokens(const char *buf)
+const struct label_slot *lookup_label(const struct instr *ins,
+				      const struct token *label)
 {
-	int i, ts, te, j;
+	uint32_t h;
 
-	for (i = 0; i < num_tokens; ++i) {
-		ts = token_start[i];
-		te = token_end[i];
-		printf("\'");
-		for (j = ts; j < te; ++j)
-			printf("%c", buf[j]);
-		printf ("\'");
-		if (i != num_tokens - 1)
-			printf("    ");
+	if (ins == NULL || label_slots == NULL)
+		return NULL;
+
+	h = hash_token(label) & label_mask;
+	for (; label_slots[h].label.str; h = (h + 1) & label_mask) {
+		stat_add(STAT_LABEL_PROBES, 1);
+		if (token_eq(&label_slots[h].label, label))
+			return &label_slots[h];
 	}
-	printf("\n");
+	return NULL;
 }
 
+// Returns the index of the instruction that carries the label, or -1.
 static
-int parse_op_load_imm(struct instr *in, int code)
+int find_label(const struct instr *ins, const struct token *label)
 {
-	int err;
-	struct op *op;
-	static char token[128];
-
-	in->sig = OP_SIG_LI;
-
-	op = &in->op;
-	op->cc[0] = op->cc[1] = CC_ALWAYS;
-	op->code[0] = code;
+	const struct label_slot *s;
 
-	switch (op->code[0]) {
-	case OP_IMM_LI:
-		in->unpack = 0;
-		break;
-	case OP_IMM_LIS:
-		in->unpack = 1;
-		break;
-	case OP_IMM_LIU:
-		in->unpack = 3;
-		break;
-	case OP_SEM_SEMUP:
-	case OP_SEM_SEMDN:
-		in->unpack = 4;
-		break;
-	default:
-		return -EINVAL;
-	}
+	s = lookup_label(ins, label);
+	return s ? s->ix : -1;
+}
 
-	// A condition code follows.
-	get_token(in, token);
-	err = parse_cc(token, &op->cc[0]);
-	if (!err) {
-		// If there was one cc, another should follow too.
-		get_token(in, token);
-		err = parse_cc(token, &op->cc[1]);
-		if (err)
-			return err;
-		get_token(in, token);
+// The index of the next label named in the expression from *p on, or -1
+// at its end.
+static
+int expr_label(const struct instr *ins, const struct token *expr,
+	       const char **p)
+{
+	struct token name;
+	const char *end;
+	int t;
+
+	end = expr->str + expr->len;
+	while (*p < end) {
+		if (!isalnum(**p) && **p != '_') {
+			++*p;
+			continue;
+		}
+		name.str = *p;
+		while (*p < end && (isalnum(**p) || **p == '_'))
+			++*p;
+		name.len = *p - name.str;
+		if (isdigit(name.str[0]))
+			continue;
+		t = find_label(ins, &name);
+		if (t >= 0)
+			return t;
 	}
+	return -1;
+}
 
-	// A dst register follows
-	err = parse_dst_reg(token, &op->dst[0]);
-	if (err)
-		return err;
-
-	// A dst register follows
-	get_token(in, token);
-	err = parse_dst_reg(token, &op->dst[1]);
-	if (err)
-		return err;
+static
+uint32_t float_bits(float f)
+{
+	uint32_t v;
 
-	// An immediate (not small immediate) src follows
-	get_token(in, token);
-	return parse_src_imm(token, &op->src[0]);
+	memcpy(&v, &f, sizeof(v));
+	return v;
 }
 
 static
-int parse_op_branch(struct instr *in, enum op_code code)
+uint32_t value_bits(const struct value *v)
 {
-	int err;
-	struct op *op;
-	static char token[128];
+	return v->is_float ? float_bits(v->f) : v->i;
+}
 
-	in->sig = OP_SIG_BR;
+static
+void eval_skip_space(struct eval *e)
+{
+	while (e->p < e->end && isspace(*e->p))
+		++e->p;
+}
 
-	op = &in->op;
-	op->code[0] = code;
-	op->cc[0] = CC_ALWAYS;
+static
+int eval_number(struct eval *e, struct value *out)
+{
+	const char *p;
+	char *q;
+	uint64_t num;
+	int c;
 
-	// A condition code follows.
-	get_token(in, token);
-	err = parse_cc(token, &op->cc[0]);
-	if (!err)
-		get_token(in, token);
+	p = e->p;
+	num = 0;
+	out->is_float = 0;
 
-	// Branch with Link needs a dst register to save the return address.
-	if (op->code[0] == OP_BR_BL) {
-		// A dst register follows
-		err = parse_dst_reg(token, &op->dst[0]);
-		if (err)
-			return err;
-		get_token(in, token);
+	if (e->end - p > 2 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) {
+		for (p += 2; p < e->end && is_hex_digit(*p); ++p) {
+			c = tolower(*p);
+			num <<= 4;
+			num += isdigit(c) ? c - '0' : 10 + c - 'a';
+			if (num > UINT32_MAX)
+				return -EINVAL;
+		}
+		if (p == e->p + 2)
+			return -EINVAL;
+		e->p = p;
+		out->i = num;
+		return ESUCC;
 	}
 
-	// A src label follows, or a RF_A register [0-31] follows.
-	err = parse_src_reg(token, &op->src[0]);
-	if (err) {
-		// Perhaps a label?
-		op->src_label = malloc(strlen(token) + 1);
-		strcpy(op->src_label, token);
+	for (; p < e->end && isdigit(*p); ++p) {
+		num = num * 10 + *p - '0';
+		if (num > UINT32_MAX)
+			return -EINVAL;
+	}
+
+	// Floats. The expression is always followed by a ; in the buffer,
+	// so strtof can't run past it.
+	if (p < e->end && (*p == '.' || *p == 'e' || *p == 'E')) {
+		out->is_float = 1;
+		out->f = strtof(e->p, &q);
+		if (q > e->end)
+			return -EINVAL;
+		p = q;
 	}
+
+	e->p = p;
+	out->i = num;
 	return ESUCC;
 }
 
+static int eval_expr(struct eval *e, int min_prec, struct value *out);
+
 static
-int parse_op_add_mul(struct instr *in, enum op_code code, int op_ix)
+int eval_sym(struct eval *e, struct sym *sym, struct value *out)
 {
+	struct eval se;
 	int err;
-	static char token[128];
-	struct op *op;
-	enum cc cc;
 
-	op = &in->op;
+	if (sym->state == 2)
+		goto done;
 
-	op->code[op_ix] = code;
-	op->cc[op_ix] = CC_ALWAYS;
+	// Recursive definition.
+	if (sym->state == 1)
+		return -EINVAL;
 
-	// Does a condition code follow?
-	get_token(in, token);
-	err = parse_cc(token, &cc);
+	se = *e;
+	se.p = sym->expr.str;
+	se.end = sym->expr.str + sym->expr.len;
+
+	sym->state = 1;
+	err = eval_expr(&se, 1, &sym->val);
 	if (!err) {
-		// Parsed a condition code.
-		op->cc[op_ix] = cc;
-		get_token(in, token);
+		eval_skip_space(&se);
+		if (se.p != se.end)
+			err = -EINVAL;
 	}
-
-	// A dst register follows
-	err = parse_dst_reg(token, &op->dst[op_ix]);
+	sym->state = err ? 0 : 2;
 	if (err)
 		return err;
+done:
+	*out = sym->val;
+	return ESUCC;
+}
 
-	// A src reg follows
-	get_token(in, token);
-	err = parse_src_reg(token, &op->src[op_ix * 2]);
-	if (err)
-		return err;
+static
+int eval_name(struct eval *e, struct value *out)
+{
+	const struct label_slot *label;
+	struct token name;
+	struct sym *sym;
+
+	name.str = e->p;
+	while (e->p < e->end && (char_class(*e->p) & (CH_ALPHA | CH_DIGIT)))
+		++e->p;
+	name.len = e->p - name.str;
+
+	sym = find_sym(&name);
+	if (sym)
+		return eval_sym(e, sym, out);
+
+	// Labels evaluate to their pc.
+	label = lookup_label(e->ins, &name);
+	if (label == NULL)
+		return -ENOENT;
+	out->is_float = 0;
+	out->i = label->pc;
+	return ESUCC;
+}
 
-	// A src reg follows
-	get_token(in, token);
-	err = parse_src_reg(token, &op->src[op_ix * 2 + 1]);
+static
+int eval_unary(struct eval *e, struct value *out)
+{
+	int err;
+	char c;
+
+	eval_skip_space(e);
+	if (e->p == e->end || e->depth == MAX_EVAL_DEPTH)
+		return -EINVAL;
+
+	c = *e->p;
+	if (char_class(c) & CH_DIGIT)
+		return eval_number(e, out);
+	if (c == '.' && e->end - e->p > 1 && (char_class(e->p[1]) & CH_DIGIT))
+		return eval_number(e, out);
+	if (char_class(c) & CH_ALPHA)
+		return eval_name(e, out);
+
+	++e->p;
+	++e->depth;
+	err = -EINVAL;
+	switch (c) {
+	case '(':
+		err = eval_expr(e, 1, out);
+		if (err)
+			break;
+		eval_skip_space(e);
+		if (e->p == e->end || *e->p != ')')
+			return -EINVAL;
+		++e->p;
+		break;
+	case '+':
+		err = eval_unary(e, out);
+		break;
+	case '-':
+		err = eval_unary(e, out);
+		if (err)
+			break;
+		if (out->is_float)
+			out->f = -out->f;
+		else
+			out->i = -out->i;
+		break;
+	case '~':
+		err = eval_unary(e, out);
+		if (err)
+			break;
+		if (out->is_float)
+			return -EINVAL;
+		out->i = ~out->i;
+		break;
+	default:
+		break;
+	}
+	--e->depth;
 	return err;
 }
 
+// Binary operators; << and >> are returned as 'l' and 'r'.
 static
-int parse_op_add(struct instr *in, enum op_code code)
+int eval_peek_op(struct eval *e, int *len)
 {
-	return parse_op_add_mul(in, code, 0);
+	char c;
+
+	eval_skip_space(e);
+	if (e->p == e->end)
+		return 0;
+
+	c = *e->p;
+	*len = 1;
+	switch (c) {
+	case '|': case '^': case '&':
+	case '+': case '-':
+	case '*': case '/': case '%':
+		return c;
+	case '<':
+	case '>':
+		if (e->end - e->p < 2 || e->p[1] != c)
+			return 0;
+		*len = 2;
+		return c == '<' ? 'l' : 'r';
+	default:
+		return 0;
+	}
 }
 
+// C precedence; higher binds tighter.
 static
-int parse_op_mul(struct instr *in, enum op_code code)
+int eval_prec(int op)
 {
-	return parse_op_add_mul(in, code, 1);
+	switch (op) {
+	case '|':			return 1;
+	case '^':			return 2;
+	case '&':			return 3;
+	case 'l': case 'r':		return 4;
+	case '+': case '-':		return 5;
+	case '*': case '/': case '%':	return 6;
+	default:			return 0;
+	}
 }
 
 static
-int parse_op_add_simm(struct instr *in, enum op_code code)
+int eval_float_op(int op, float a, float b, struct value *out)
 {
-	in->sig = OP_SIG_SIMM;
-	return parse_op_add_mul(in, code, 0);
+	out->is_float = 1;
+	switch (op) {
+	case '+':	out->f = a + b; break;
+	case '-':	out->f = a - b; break;
+	case '*':	out->f = a * b; break;
+	case '/':	out->f = a / b; break;
+	default:	return -EINVAL;
+	}
+	return ESUCC;
 }
 
+// Integer arithmetic wraps around at 32 bits; >> is arithmetic.
 static
-int parse_op_mul_simm(struct instr *in, enum op_code code)
+int eval_int_op(int op, uint32_t a, uint32_t b, struct value *out)
 {
-	in->sig = OP_SIG_SIMM;
-	return parse_op_add_mul(in, code, 1);
+	int32_t sa, sb;
+
+	sa = a;
+	sb = b;
+	out->is_float = 0;
+	switch (op) {
+	case '|':	out->i = a | b; break;
+	case '^':	out->i = a ^ b; break;
+	case '&':	out->i = a & b; break;
+	case 'l':	out->i = b > 31 ? 0 : a << b; break;
+	case 'r':
+		if (b > 31)
+			b = 31;
+		out->i = a >> b;
+		if (sa < 0 && b)
+			out->i |= ~(UINT32_MAX >> b);
+		break;
+	case '+':	out->i = a + b; break;
+	case '-':	out->i = a - b; break;
+	case '*':	out->i = a * b; break;
+	case '/':
+	case '%':
+		if (b == 0)
+			return -EINVAL;
+		if (sb == -1)
+			out->i = op == '/' ? -a : 0;
+		else
+			out->i = op == '/' ? sa / sb : sa % sb;
+		break;
+	default:
+		return -EINVAL;
+	}
+	return ESUCC;
 }
 
 static
-int parse(struct instr *in)
+int eval_expr(struct eval *e, int min_prec, struct value *out)
 {
-	enum op_code code;
-	int err, is_op_add, is_op_li;
-	static char token[128];
-
-	// Default is a NOP.
-	parse_nop(in);
+	int err, op, prec, len;
+	struct value rhs;
+	float a, b;
 
-	get_token(in, token);
-	if (!strcmp(token, ";"))
-		return ESUCC;
-	err = parse_op_code(token, &code);
+	err = eval_unary(e, out);
 	if (err)
 		return err;
 
-	err = -EINVAL;
-	if (code >= OP_ADD_FADD && code <= OP_ADD_V8SUBS) {
-		is_op_add = 1;
-		err = parse_op_add(in, code);
-	} else if (code >= OP_MUL_FMUL && code <= OP_MUL_V8MAX) {
-		goto check_mul;
-	} else if (code >= OP_ADD_FADDI && code <= OP_ADD_V8SUBSI) {
-		is_op_add = 1;
-		err = parse_op_add_simm(in, code);
-	} else if (code >= OP_MUL_FMULI && code <= OP_MUL_V8MAXI) {
-		goto check_mul;
-	} else if (code >= OP_MUL_V8ADDS_ROTR5 && code <= OP_MUL_V8ADDS_ROT15) {
-		goto check_mul;
-	} else if (code >= OP_BR_B && code <= OP_BR_BL) {
-		err = parse_op_branch(in, code);
-	} else if ((code >= OP_IMM_LI && code <= OP_IMM_LIU) ||
-		   (code >= OP_SEM_SEMUP && code <= OP_SEM_SEMDN)) {
-		is_op_li = 1;
-		err = parse_op_load_imm(in, code);
-	} else if (code >= OP_SIG_BREAK && code <= OP_SIG_LD_ALPHA) {
-		goto check_sigs;
-	} else if (code >= OP_FLAGS_SF && code <= OP_FLAGS_SF) {
-		goto check_flags;
-	}
+	for (;;) {
+		op = eval_peek_op(e, &len);
+		prec = eval_prec(op);
+		if (op == 0 || prec < min_prec)
+			return ESUCC;
+		e->p += len;
 
-	if (err)
-		return err;
+		err = eval_expr(e, prec + 1, &rhs);
+		if (err)
+			return err;
 
-	// Are we at the end of the instruction?
-	get_token(in, token);
-	if (!strcmp(token, ";"))
-		return ESUCC;
-	err = parse_op_code(token, &code);
-	if (err)
-		return err;
+		if (!out->is_float && !rhs.is_float) {
+			err = eval_int_op(op, out->i, rhs.i, out);
+		} else {
+			a = out->is_float ? out->f : (int32_t)out->i;
+			b = rhs.is_float ? rhs.f : (int32_t)rhs.i;
+			err = eval_float_op(op, a, b, out);
+		}
+		if (err)
+			return err;
+	}
+}
 
-	if (is_op_add)
-		goto check_mul;
-	else if (is_op_li)
-		goto check_flags;
-	else
-		return -EINVAL;
+// The value that a small immediate encoding reads as.
+static
+uint32_t simm_bits(int num)
+{
+	if (num < 16)
+		return num;
+	if (num < 32)
+		return num - 32;
+	if (num < 40)
+		return float_bits(1 << (num - 32));
+	return float_bits(1.0f / (1 << (48 - num)));
+}
 
-check_mul:
-	// mul, signals, flags, unpack, and pack
-	err = -EINVAL;
-	if (code >= OP_MUL_FMUL && code <= OP_MUL_V8MAX)
-		err = parse_op_mul(in, code);
-	else if (code >= OP_MUL_FMULI && code <= OP_MUL_V8MAXI)
-		err = parse_op_mul_simm(in, code);
-	else if (code >= OP_MUL_V8ADDS_ROTR5 && code <= OP_MUL_V8ADDS_ROT15)
-		err = parse_op_mul_simm(in, code);
-	else
-		goto check_sigs;
-	if (err)
-		return err;
+// Fold a constant expression into the 32 bits of its value. Floats fold
+// to their IEEE-754 single precision bits.
+static
+int eval(const struct token *expr, const struct instr *ins, int num_instrs,
+	 uint32_t *out)
+{
+	struct eval e;
+	struct value v;
+	struct reg reg;
+	int err;
 
-	get_token(in, token);
-	if (!strcmp(token, ";"))
+	// The names of the small immediates, like 2f, read as their values.
+	if (!parse_src_reg(expr, &reg) && reg.rf == RF_SIMM) {
+		*out = simm_bits(reg.num);
 		return ESUCC;
-	err = parse_op_code(token, &code);
-	if (err)
-		return err;
-check_sigs:
-	// signals, flags, unpack, and pack
-	err = -EINVAL;
-	if (code >= OP_SIG_BREAK && code <= OP_SIG_LD_ALPHA)
-		err = parse_op_signals(in, code);
-	else
-		goto check_flags;
-	if (err)
-		return err;
+	}
 
-	get_token(in, token);
-	if (!strcmp(token, ";"))
-		return ESUCC;
-	err = parse_op_code(token, &code);
-	if (err)
-		return err;
-check_flags:
-	// flags, unpack, and pack
-	err = -EINVAL;
-	if (code >= OP_FLAGS_SF && code <= OP_FLAGS_SF)
-		err = parse_op_flags(in, code);
-	else
-		goto check_unpack;
+	e.p = expr->str;
+	e.end = expr->str + expr->len;
+	e.ins = ins;
+	e.num_instrs = num_instrs;
+	e.depth = 0;
 
-	get_token(in, token);
-	if (!strcmp(token, ";"))
-		return ESUCC;
-	err = parse_op_code(token, &code);
-	if (err)
-		return err;
-check_unpack:
-	// unpack, and pack.
-	// Nothing here at the moment.
-	goto check_pack;
-check_pack:
-	err = -EINVAL;
-	if (code >= OP_PACK_NOP && code <= OP_PACK_MUL_8D)
-		err = parse_op_pack(in, code);
+	err = eval_expr(&e, 1, &v);
 	if (err)
 		return err;
 
-	get_token(in, token);
-	if (!strcmp(token, ";"))
-		return ESUCC;
-	return -EINVAL;
+	eval_skip_space(&e);
+	if (e.p != e.end)
+		return -EINVAL;
+	*out = value_bits(&v);
+	return ESUCC;
 }
 
+// Returns the small immediate encoding that reads as val, or -1.
 static
-void resolve_dst_regs(struct instr *in)
+int find_simm(uint32_t val)
 {
-	struct op *op;
-
-	op = &in->op;
-	in->ws = 0;
-	if (op->dst[0].rf == RF_B || op->dst[1].rf == RF_A)
-		in->ws = 1;
+	int i;
 
-	if (in->ws) {
-		op->dst[0].rf = RF_B;
-		op->dst[1].rf = RF_A;
-	} else {
-		op->dst[0].rf = RF_A;
-		op->dst[1].rf = RF_B;
+	for (i = 0; i < 48; ++i) {
+		if (simm_bits(i) == val)
+			return i;
 	}
+	return -1;
 }
 
 static
-int verify_branch(struct instr *in, const struct instr *ins, int num_instrs)
+int resolve_src_expr(struct reg *src, const struct instr *ins,
+		     int num_instrs)
 {
-	struct op *op;
-	int i, j;
-	const struct instr *t;
+	uint32_t val;
+	int err;
 
-	op = &in->op;
-	resolve_dst_regs(in);
+	err = eval(&src->expr, ins, num_instrs, &val);
+	if (err)
+		return err;
+	src->rf = RF_IMM;
+	src->num = val;
+	return ESUCC;
+}
 
-	if (op->src_label == NULL) {
-		// The register should be RF_A [0-31].
-		if (op->src[0].rf != RF_A || op->src[0].num > 31)
-			return -EINVAL;
-		return ESUCC;
-	}
+// A src expression of an ALU op must fold to a small immediate.
+static
+int resolve_src_simm(struct reg *src, const struct instr *ins,
+		     int num_instrs)
+{
+	int err, num;
 
-	// Else, check if there is a target instruction.
-	for (i = 0; i < num_instrs; ++i) {
-		t = &ins[i];
-		for (j = 0; j < t->num_labels; ++j) {
-			if (!strcmp(op->src_label, t->labels[j]))
-				break;
-		}
-		if (j < t->num_labels)
-			break;
-	}
+	err = resolve_src_expr(src, ins, num_instrs);
+	if (err)
+		return err;
 
-	// Non-existent label.
-	if (i == num_instrs)
+	num = find_simm(src->num);
+	if (num < 0)
 		return -EINVAL;
-
-	op->src[0].rf = RF_IMM;
-	op->src[0].num = t->pc - (in->pc + 4 * 8);
+	src->rf = RF_SIMM;
+	src->num = num;
 	return ESUCC;
 }
 
+// Does the text end with an operand, and not with an operator?
 static
-int verify_alu(struct instr *in)
+int ends_operand(const char *p, const char *end)
 {
-	struct op *op;
-	enum op_code code;
-	uint64_t mask[6], t;
-	int is_io_reg, i;
-
-
-	resolve_dst_regs(in);
+	while (end > p && isspace(end[-1]))
+		--end;
+	if (end > p && end[-1] == '.')
+		--end;
+	return end > p &&
+		(isalnum(end[-1]) || end[-1] == '_' || end[-1] == ')');
+}
 
-	op = &in->op;
+// The expression extends from the operand separator up to the ; or up to
+// the first of the trailing signals, flags, unpack and pack. A name that
+// follows an operator is an operand, even if it is also an op. The span
+// is taken from the line, and not from the tokens, as the . of a float is
+// a separator to the tokenizer.
+static
+int parse_src_expr(struct instr *in, struct reg *out)
+{
+	const struct token *first, *stop;
+	const char *p, *end;
+	enum op_code code;
 
-	// ALUs do not deal with branch condition codes.
-	if (op->cc[0] >= CC_ALL_Z || op->cc[1] >= CC_ALL_Z)
+	first = get_token(in);
+	if (token_is(first, ";"))
 		return -EINVAL;
 
-	// Behaviour is undefined if both ALUs write to the same accumulator
-	// or IO register.
-	if (op->dst[0].num == op->dst[1].num &&
-	    op->dst[0].num > 31 && op->dst[0].num != 39)
-		return -EINVAL;
+	// A name or a register always precedes the expression.
+	p = first[-1].str + first[-1].len;
+	while (isspace(*p))
+		++p;
+	if (*p == ',')
+		++p;
+	while (isspace(*p))
+		++p;
 
-	memset(mask, 0, sizeof(mask));
-	for (i = 0; i < 4; ++i) {
-		if (op->src[i].rf == RF_IMM)
-			continue;
-		mask[op->src[i].rf] |= 1ul << op->src[i].num;
+	for (;;) {
+		stop = peek_token(in);
+		if (token_is(stop, ";"))
+			break;
+		if (!parse_op_code(stop, &code) && code >= OP_SIG_BREAK &&
+		    code <= OP_UNPACK_R4_8D && ends_operand(p, stop->str))
+			break;
+		get_token(in);
 	}
 
-	code = op->code[1];
+	// A . glued to a trailing token goes with it, as in 2.sf.
+	end = stop->str;
+	if (!token_is(stop, ";") && end[-1] == '.')
+		--end;
+	while (end > p && (isspace(end[-1]) || end[-1] == ','))
+		--end;
 
-	// If mul output is to be rotated, there shouldn't be any small
-	// immediates, or anyone reading from RF_B.
-	if (code >= OP_MUL_V8ADDS_ROTR5 && code <= OP_MUL_V8ADDS_ROT15 &&
-	    (mask[RF_SIMM] || mask[RF_B]))
-		return -EINVAL;
+	out->rf = RF_EXPR;
+	out->expr.str = p;
+	out->expr.len = end - p;
+	return ESUCC;
+}
 
-	// If mul output is to be rotated, the sources must be from RF_ACC,
-	// r0-r3.
-	if (code >= OP_MUL_V8ADDS_ROTR5 && code <= OP_MUL_V8ADDS_ROT15 &&
-	    (op->src[2].rf != RF_ACC || op->src[3].rf != RF_ACC))
+// .set name, expr;
+static
+int parse_set(struct instr *in)
+{
+	const struct token *token, *name;
+	struct reg expr;
+	struct sym *sym;
+	int err, num;
+
+	// A symbol can't be redefined.
+	name = get_token(in);
+	if (!is_name(name) || find_sym(name))
 		return -EINVAL;
 
-	// If there are small immediate sources, they should be same.
-	if (count_ones(mask[RF_SIMM]) > 1)
+	err = parse_src_expr(in, &expr);
+	if (err)
+		return err;
+	token = get_token(in);
+	if (!token_is(token, ";"))
 		return -EINVAL;
 
-	// If there are small immediate sources, or, if mul output is to be
-	// rotated, any RF_AB source must be converted to RF_A.
-	if (code >= OP_MUL_V8ADDS_ROTR5 && code <= OP_MUL_V8ADDS_ROT15 &&
-	    mask[RF_SIMM]) {
-		for (i = 0; i < 4; ++i) {
-			if (op->src[i].rf != RF_AB)
-				continue;
-			op->src[i].rf = RF_A;
-			t = 1ul << op->src[i].num;
-			mask[RF_A] |= t;
-		}
+	if (num_syms == max_syms) {
+		num = max_syms ? max_syms * 2 : 16;
+		sym = realloc(syms, num * sizeof(*sym));
+		stat_add(STAT_ALLOCS, 1);
+		if (sym == NULL)
+			return -ENOMEM;
+		syms = sym;
+		max_syms = num;
 	}
 
-	// If there are RF_A sources, they should be same.
-	// Similarly for RF_B sources.
-	if (count_ones(mask[RF_A]) > 1)
-		return -EINVAL;
-	if (count_ones(mask[RF_B]) > 1)
-		return -EINVAL;
-
-	// If there are RF_AB sources, try to resolve them.
-	for (i = 0; i < 4; ++i) {
-		if (op->src[i].rf != RF_AB)
-			continue;
-
-		t = 1ul << op->src[i].num;
-
-		// Try resolving with RF_A, then RF_B.
-		if (mask[RF_A] & t)
-			op->src[i].rf = RF_A;
-		else if (mask[RF_B] & t)
-			op->src[i].rf = RF_B;
-	}
+	sym = &syms[num_syms++];
+	memset(sym, 0, sizeof(*sym));
+	sym->name = *name;
+	sym->expr = expr.expr;
+	return ESUCC;
+}
 
-	for (i = 0; i < 4; ++i) {
-		if (op->src[i].rf != RF_AB)
-			continue;
+static
+int parse_op_signals(struct instr *in, enum op_code code)
+{
+	// Can't have more than one signals.
+	if (in->sig != OP_SIG_NONE)
+		return -EINVAL;
+	in->sig = code;
+	return ESUCC;
+}
 
-		t = 1ul << op->src[i].num;
+static inline
+int is_pack_mul(enum op_code code)
+{
+	return code >= OP_PACK_MUL_8888 && code <= OP_PACK_MUL_8D;
+}
 
-		// Try resolving with RF_A if RF_A is unused, or same.
-		if (!mask[RF_A] || (mask[RF_A] & t)) {
-			op->src[i].rf = RF_A;
-			mask[RF_A] |= t;
-			continue;
-		}
+static inline
+int is_unpack_r4(enum op_code code)
+{
+	return code >= OP_UNPACK_R4_16A && code <= OP_UNPACK_R4_8D;
+}
 
-		// Try resolving with RF_B if RF_B is unused, or same,
-		if (!mask[RF_B] || (mask[RF_B] & t)) {
-			op->src[i].rf = RF_B;
-			mask[RF_B] |= t;
-			continue;
-		}
+// The unpack precedes the pack. Both share the pm bit: with pm set, the mul
+// output is packed and r4 is unpacked; else, the regfile A write is packed
+// and the regfile A read is unpacked.
+static
+int parse_op_unpack(struct instr *in, enum op_code code)
+{
+	// Load immediates use the unpack field for their type.
+	if (in->sig == OP_SIG_LI)
+		return -EINVAL;
+	in->pm = is_unpack_r4(code);
+	in->unpack = code;
+	return ESUCC;
+}
 
-		// Can't be resolved.
+static
+int parse_op_pack(struct instr *in, enum op_code code)
+{
+	// Can't have more than one pack specifiers.
+	if (in->pack != OP_PACK_NOP)
 		return -EINVAL;
-	}
+	if (in->unpack != OP_UNPACK_NOP &&
+	    is_unpack_r4(in->unpack) != is_pack_mul(code))
+		return -EINVAL;
+	in->pm = is_pack_mul(code);
+	in->pack = code;
+	return ESUCC;
+}
 
-	// If the dst is NOP and the sources are not IO registers, change
-	// the cc to CC_NEVER.
-	is_io_reg = 0;
-	is_io_reg |=
-		(op->src[0].rf == RF_A || op->src[0].rf == RF_B) &&
-		(op->src[0].num > 31);
-	is_io_reg |=
-		(op->src[1].rf == RF_A || op->src[1].rf == RF_B) &&
-		(op->src[1].num > 31);
-	if (op->dst[0].num == 39 && !is_io_reg)
-		op->cc[0] = CC_NEVER;
+static
+int parse_op_flags(struct instr *in, enum op_code code)
+{
+	if (code == OP_FLAGS_SF)
+		in->sf = 1;
+	else
+		return -EINVAL;
+	return ESUCC;
+}
 
-	is_io_reg = 0;
-	is_io_reg |=
-		(op->src[2].rf == RF_A || op->src[2].rf == RF_B) &&
-		(op->src[2].num > 31);
-	is_io_reg |=
-		(op->src[3].rf == RF_A || op->src[3].rf == RF_B) &&
-		(op->src[3].num > 31);
-	if (op->dst[1].num == 39 && !is_io_reg)
-		op->cc[1] = CC_NEVER;
+static
+void print_tokens(void)
+{
+	int i;
 
-	return ESUCC;
+	for (i = 0; i < num_tokens; ++i) {
+		out_write("\'", 1);
+		out_write(tokens[i].str, tokens[i].len);
+		out_write("\'", 1);
+		if (i != num_tokens - 1)
+			out_write("    ", 4);
+	}
+	out_write("\n", 1);
 }
 
 static
-int verify_load_imm(struct instr *in)
+int parse_op_load_imm(struct instr *in, int code)
 {
+	int err;
 	struct op *op;
+	const struct token *token;
 
-	resolve_dst_regs(in);
+	in->sig = OP_SIG_LI;
 
 	op = &in->op;
+	op->cc[0] = op->cc[1] = CC_ALWAYS;
+	op->code[0] = code;
+	if (encode_load_imm_type(code) < 0)
+		return -EINVAL;
 
-	// If any dst is a NOP, change cc to CC_NEVER
-	if (op->dst[0].num == 39)
-		op->cc[0] = CC_NEVER;
-	if (op->dst[1].num == 39)
-		op->cc[1] = CC_NEVER;
+	// A condition code follows.
+	token = get_token(in);
+	err = parse_cc(token, &op->cc[0]);
+	if (!err) {
+		// If there was one cc, another should follow too.
+		token = get_token(in);
+		err = parse_cc(token, &op->cc[1]);
+		if (err)
+			return err;
+		token = get_token(in);
+	}
 
-	// Semaphore num should be in range.
-	if ((op->code[0] >= OP_SEM_SEMUP && op->code[0] <= OP_SEM_SEMDN) &&
-	    (op->src[0].num < 0 || op->src[0].num > 15))
-		return -EINVAL;
-	return ESUCC;
+	// A dst register follows
+	err = parse_dst_reg(token, &op->dst[0]);
+	if (err)
+		return err;
+
+	// A dst register follows
+	token = get_token(in);
+	err = parse_dst_reg(token, &op->dst[1]);
+	if (err)
+		return err;
+
+	// An immediate (not small immediate) src follows
+	return parse_src_expr(in, &op->src[0]);
 }
 
 static
-int verify(struct instr *in, const struct instr *ins, int num_instrs)
+int parse_op_branch(struct instr *in, enum op_code code)
 {
 	int err;
-	enum op_code code;
 	struct op *op;
+	const struct token *token;
+
+	in->sig = OP_SIG_BR;
 
 	op = &in->op;
-	code = op->code[0];
+	op->code[0] = code;
+	op->cc[0] = CC_ALWAYS;
 
-	err = -EINVAL;
-	if ((code == OP_NOP) ||
-	    (code >= OP_ADD_FADD && code <= OP_ADD_V8SUBS) ||
-	    (code >= OP_ADD_FADDI && code <= OP_ADD_V8SUBSI)) {
-		err = verify_alu(in);
-	} else if (code >= OP_BR_B && code <= OP_BR_BL) {
-		err = verify_branch(in, ins, num_instrs);
-	} else if ((code >= OP_IMM_LI && code <= OP_IMM_LIU) ||
-		   (code >= OP_SEM_SEMUP && code <= OP_SEM_SEMDN)) {
-		err = verify_load_imm(in);
+	// A condition code follows.
+	token = get_token(in);
+	err = parse_cc(token, &op->cc[0]);
+	if (!err)
+		token = get_token(in);
+
+	// Branch with Link needs a dst register to save the return address.
+	if (op->code[0] == OP_BR_BL) {
+		// A dst register follows
+		err = parse_dst_reg(token, &op->dst[0]);
+		if (err)
+			return err;
+		token = get_token(in);
 	}
-	return err;
+
+	// A src label follows, or a RF_A register [0-31] follows.
+	err = parse_src_reg(token, &op->src[0]);
+	if (err) {
+		// Perhaps a label?
+		op->src_label = *token;
+	}
+	return ESUCC;
 }
 
 static
-int encode_load_imm(struct instr *in)
+int is_simm_op(enum op_code code)
 {
-	int esig, ecc[2], epack;
-	unsigned int val;
-	struct op *op;
-
-	op = &in->op;
+	return (code >= OP_ADD_FADDI && code <= OP_ADD_V8SUBSI) ||
+		(code >= OP_MUL_FMULI && code <= OP_MUL_V8MAXI);
+}
 
-	epack = encode_pack(in->pack);
-	esig = encode_sig(in->sig);
-	ecc[0] = encode_cond(op->cc[0]);
-	ecc[1] = encode_cond(op->cc[1]);
+// A src of an ALU op is a register, or a constant expression without
+// whitespace. The constants of the ops that take a small immediate must
+// fold to one; for the other ops, select_imms() decides where the
+// constant comes from.
+static
+int parse_src_operand(enum op_code code, const struct token *tok,
+		      struct reg *out)
+{
+	int err;
 
-	if (esig < 0 || ecc[0] < 0 || ecc[1] < 0 || epack < 0)
+	if (token_is(tok, ";"))
 		return -EINVAL;
 
-	val = 0;
-	val |= bits_set(ENC_SIG, esig);
-	val |= bits_set(ENC_UNPACK, in->unpack);
-	val |= bits_set(ENC_PACK, epack);
-	val |= bits_set(ENC_COND_ADD, ecc[0]);
-	val |= bits_set(ENC_COND_MUL, ecc[1]);
-	val |= bits_set(ENC_WADDR_ADD, op->dst[0].num);
-	val |= bits_set(ENC_WADDR_MUL, op->dst[1].num);
-	if (in->pm)
-		val |= bits_on(ENC_PM);
-	if (in->sf)
-		val |= bits_on(ENC_SF);
-	if (in->ws)
-		val |= bits_on(ENC_WS);
-	in->hi = val;
-	in->lo = op->src[0].num;
+	err = parse_src_reg(tok, out);
+	if (!err && (out->rf != RF_SIMM || is_simm_op(code)))
+		return ESUCC;
+
+	out->rf = RF_EXPR;
+	out->expr = *tok;
 	return ESUCC;
 }
 
 static
-int encode_branch(struct instr *in)
+int parse_op_add_mul(struct instr *in, enum op_code code, int op_ix)
 {
+	int err;
+	const struct token *token;
 	struct op *op;
-	int ecc, esig;
-	unsigned int val;
+	enum cc cc;
 
 	op = &in->op;
 
-	esig = encode_sig(in->sig);
-	ecc = encode_cond_br(op->cc[0]);
+	op->code[op_ix] = code;
+	op->cc[op_ix] = CC_ALWAYS;
 
-	if (esig < 0 || ecc < 0)
+	// Does a condition code follow?
+	token = get_token(in);
+	err = parse_cc(token, &cc);
+	if (!err) {
+		// Parsed a condition code.
+		op->cc[op_ix] = cc;
+		token = get_token(in);
+	}
+
+	// A dst register follows
+	err = parse_dst_reg(token, &op->dst[op_ix]);
+	if (err)
+		return err;
+
+	// A src reg follows
+	token = get_token(in);
+	err = parse_src_operand(code, token, &op->src[op_ix * 2]);
+	if (err)
+		return err;
+
+	// A src reg follows
+	token = get_token(in);
+	err = parse_src_operand(code, token, &op->src[op_ix * 2 + 1]);
+	return err;
+}
+
+static
+int parse_op_add(struct instr *in, enum op_code code)
+{
+	return parse_op_add_mul(in, code, 0);
+}
+
+static
+int parse_op_mul(struct instr *in, enum op_code code)
+{
+	return parse_op_add_mul(in, code, 1);
+}
+
+static
+int parse_op_add_simm(struct instr *in, enum op_code code)
+{
+	in->sig = OP_SIG_SIMM;
+	return parse_op_add_mul(in, code, 0);
+}
+
+static
+int parse_op_mul_simm(struct instr *in, enum op_code code)
+{
+	in->sig = OP_SIG_SIMM;
+	return parse_op_add_mul(in, code, 1);
+}
+
+static
+int parse(struct instr *in)
+{
+	enum op_code code;
+	int err, is_op_add, is_op_li;
+	const struct token *token;
+
+	// Default is a NOP.
+	parse_nop(in);
+	is_op_add = is_op_li = 0;
+
+	token = get_token(in);
+	if (token_is(token, ";"))
+		return ESUCC;
+	err = parse_op_code(token, &code);
+	if (err)
+		return err;
+
+	err = -EINVAL;
+	if (code >= OP_ADD_FADD && code <= OP_ADD_V8SUBS) {
+		is_op_add = 1;
+		err = parse_op_add(in, code);
+	} else if (code >= OP_MUL_FMUL && code <= OP_MUL_V8MAX) {
+		goto check_mul;
+	} else if (code >= OP_ADD_FADDI && code <= OP_ADD_V8SUBSI) {
+		is_op_add = 1;
+		err = parse_op_add_simm(in, code);
+	} else if (code >= OP_MUL_FMULI && code <= OP_MUL_V8MAXI) {
+		goto check_mul;
+	} else if (code >= OP_MUL_V8ADDS_ROTR5 && code <= OP_MUL_V8ADDS_ROT15) {
+		goto check_mul;
+	} else if (code >= OP_BR_B && code <= OP_BR_BL) {
+		err = parse_op_branch(in, code);
+	} else if ((code >= OP_IMM_LI && code <= OP_IMM_LIU) ||
+		   (code >= OP_SEM_SEMUP && code <= OP_SEM_SEMDN)) {
+		is_op_li = 1;
+		err = parse_op_load_imm(in, code);
+	} else if (code >= OP_SIG_BREAK && code <= OP_SIG_LD_ALPHA) {
+		goto check_sigs;
+	} else if (code >= OP_FLAGS_SF && code <= OP_FLAGS_SF) {
+		goto check_flags;
+	}
+
+	if (err)
+		return err;
+
+	// Are we at the end of the instruction?
+	token = get_token(in);
+	if (token_is(token, ";"))
+		return ESUCC;
+	err = parse_op_code(token, &code);
+	if (err)
+		return err;
+
+	if (is_op_add)
+		goto check_mul;
+	else if (is_op_li)
+		goto check_flags;
+	else
 		return -EINVAL;
 
-	val = 0;
-	if (op->src_label == NULL) {
-		// Jump to register.
-		val |= bits_on(ENC_BR_REG);
-		val |= bits_set(ENC_BR_RADDR_A, op->src[0].num);
+check_mul:
+	// mul, signals, flags, unpack, and pack
+	err = -EINVAL;
+	if (code >= OP_MUL_FMUL && code <= OP_MUL_V8MAX)
+		err = parse_op_mul(in, code);
+	else if (code >= OP_MUL_FMULI && code <= OP_MUL_V8MAXI)
+		err = parse_op_mul_simm(in, code);
+	else if (code >= OP_MUL_V8ADDS_ROTR5 && code <= OP_MUL_V8ADDS_ROT15)
+		err = parse_op_mul_simm(in, code);
+	else
+		goto check_sigs;
+	if (err)
+		return err;
+
+	token = get_token(in);
+	if (token_is(token, ";"))
+		return ESUCC;
+	err = parse_op_code(token, &code);
+	if (err)
+		return err;
+check_sigs:
+	// signals, flags, unpack, and pack
+	err = -EINVAL;
+	if (code >= OP_SIG_BREAK && code <= OP_SIG_LD_ALPHA)
+		err = parse_op_signals(in, code);
+	else
+		goto check_flags;
+	if (err)
+		return err;
+
+	token = get_token(in);
+	if (token_is(token, ";"))
+		return ESUCC;
+	err = parse_op_code(token, &code);
+	if (err)
+		return err;
+check_flags:
+	// flags, unpack, and pack
+	err = -EINVAL;
+	if (code >= OP_FLAGS_SF && code <= OP_FLAGS_SF)
+		err = parse_op_flags(in, code);
+	else
+		goto check_unpack;
+
+	token = get_token(in);
+	if (token_is(token, ";"))
+		return ESUCC;
+	err = parse_op_code(token, &code);
+	if (err)
+		return err;
+check_unpack:
+	// unpack, and pack.
+	err = -EINVAL;
+	if (code >= OP_UNPACK_A_16A && code <= OP_UNPACK_R4_8D)
+		err = parse_op_unpack(in, code);
+	else
+		goto check_pack;
+	if (err)
+		return err;
+
+	token = get_token(in);
+	if (token_is(token, ";"))
+		return ESUCC;
+	err = parse_op_code(token, &code);
+	if (err)
+		return err;
+check_pack:
+	err = -EINVAL;
+	if (code >= OP_PACK_MUL_8888 && code <= OP_PACK_A_8D_SAT)
+		err = parse_op_pack(in, code);
+	if (err)
+		return err;
+
+	token = get_token(in);
+	if (token_is(token, ";"))
+		return ESUCC;
+	return -EINVAL;
+}
+
+// Registers that the assembler may clobber to hold constants that can't be
+// small immediates; see .scratch. Each remembers the constant it holds.
+#define MAX_SCRATCH			4
+
+struct scratch {
+	struct reg			reg;	// As a src.
+	uint32_t			val;
+	char				valid;
+};
+
+static struct scratch scratch[MAX_SCRATCH];
+static int num_scratch;
+
+// Instructions left until the return address of the last bl. The callee
+// may have clobbered the scratch registers.
+static int bl_countdown;
+
+// The loops that hold an li of select_imms(), by the index of their head;
+// see hoist_loop_consts(). A loop is the last label, and a branch back to
+// it with no branch between. The li of the instrs just past the loop may
+// still go into it, so a loop with none yet keeps its end, past the
+// branch.
+static int *loop_heads;
+static int num_loop_heads;
+static int max_loop_heads;
+static int last_head;
+static int loop_end;
+static char loop_has_li;
+
+static
+void invalidate_scratch(void)
+{
+	int i;
+
+	for (i = 0; i < num_scratch; ++i)
+		scratch[i].valid = 0;
+}
+
+static
+void scratch_to_dst(const struct reg *src, struct reg *dst)
+{
+	*dst = *src;
+	if (src->rf == RF_ACC) {
+		dst->rf = RF_AB;
+		dst->num = 32 + src->num;
+	}
+}
+
+static
+int is_scratch_dst(int s, const struct reg *dst)
+{
+	struct reg t;
+
+	scratch_to_dst(&scratch[s].reg, &t);
+	return dst->num == t.num && (dst->rf == t.rf || t.rf == RF_AB);
+}
+
+static
+int is_scratch_src(int s, const struct reg *src)
+{
+	return src->rf == scratch[s].reg.rf && src->num == scratch[s].reg.num;
+}
+
+// .scratch reg, ...; Only a0-a31, b0-b31 and r0-r3 qualify.
+static
+int parse_scratch(struct instr *in)
+{
+	const struct token *token;
+	struct reg reg;
+	int err, n;
+
+	n = 0;
+	for (;;) {
+		token = get_token(in);
+		if (token_is(token, ";"))
+			break;
+		if (n == MAX_SCRATCH)
+			return -EINVAL;
+
+		err = parse_src_reg(token, &reg);
+		if (err)
+			return err;
+		if ((reg.rf != RF_A && reg.rf != RF_B && reg.rf != RF_ACC) ||
+		    reg.num > 31 || (reg.rf == RF_ACC && reg.num > 3))
+			return -EINVAL;
+
+		memset(&scratch[n], 0, sizeof(scratch[n]));
+		scratch[n++].reg = reg;
+	}
+	num_scratch = n;
+	return ESUCC;
+}
+
+// The labels exported with .global name, ...; for the objects of -c.
+static struct token *globals;
+static int num_globals;
+static int max_globals;
+
+// Branches to labels not defined in the source are left to qas-link.
+static char object_mode;
+
+static
+int parse_global(struct instr *in)
+{
+	const struct token *token;
+	struct token *g;
+	int num;
+
+	for (;;) {
+		token = get_token(in);
+		if (token_is(token, ";"))
+			break;
+		if (!is_name(token))
+			return -EINVAL;
+
+		if (num_globals == max_globals) {
+			num = max_globals ? max_globals * 2 : 16;
+			g = realloc(globals, num * sizeof(*g));
+			stat_add(STAT_ALLOCS, 1);
+			if (g == NULL)
+				return -ENOMEM;
+			globals = g;
+			max_globals = num;
+		}
+		globals[num_globals++] = *token;
+	}
+	return ESUCC;
+}
+
+static
+int parse_directive(struct instr *in)
+{
+	const struct token *token;
+
+	token = get_token(in);
+	if (token_is(token, "set"))
+		return parse_set(in);
+	if (token_is(token, "scratch"))
+		return parse_scratch(in);
+	if (token_is(token, "global"))
+		return parse_global(in);
+	return -EINVAL;
+}
+
+// Can raddr_a and raddr_b serve the regfile reads of op? A small
+// immediate, or a v8 rotation, keeps raddr_b busy.
+static
+int can_read_srcs(const struct op *op, char b_busy)
+{
+	int i, a, b, n, ab[4], num_ab;
+
+	a = b = -1;
+	num_ab = 0;
+	for (i = 0; i < 4; ++i) {
+		n = op->src[i].num;
+		switch (op->src[i].rf) {
+		case RF_A:
+			if (a >= 0 && a != n)
+				return 0;
+			a = n;
+			break;
+		case RF_B:
+			if (b_busy || (b >= 0 && b != n))
+				return 0;
+			b = n;
+			break;
+		case RF_AB:
+			ab[num_ab++] = n;
+			break;
+		default:
+			break;
+		}
+	}
+
+	// Each RF_AB read shares a port, or takes a free one.
+	for (i = 0; i < num_ab; ++i) {
+		n = ab[i];
+		if (n == a || n == b)
+			continue;
+		if (a < 0)
+			a = n;
+		else if (!b_busy && b < 0)
+			b = n;
+		else
+			return 0;
+	}
+	return 1;
+}
+
+// Where a constant src comes from.
+#define IMM_SIMM			-1	// Else, an index into scratch[].
+
+struct imm_choice {
+	int				src[4];
+	int				load;	// Bitmask of scratch[] to li.
+	int				hoist;	// Where its li go.
+	char				nop;	// After the li.
+	int				cost;
+};
+
+struct imm_state {
+	struct instr			*in;
+	const struct instr		*ins;
+	int				hoist;	// Where the li go.
+	int				early;	// An instr further back, or -1.
+	int				num_instrs;
+	int				is_const;	// Bitmask of src[].
+	int				is_known;	// Bitmask of src[].
+	uint32_t			val[4];
+	int				simm;	// -1, or the fixed simm.
+	char				simm_ok;
+	char				rotate;
+	struct imm_choice		curr;
+	struct imm_choice		best;
+};
+
+// Does any instruction in [from, to) read or write scratch s?
+static
+int is_scratch_used(const struct instr *ins, int from, int to, int s)
+{
+	int i, j;
+
+	for (i = from; i < to; ++i) {
+		for (j = 0; j < 4; ++j) {
+			if (ins[i].op.src[j].rf != RF_EXPR &&
+			    is_scratch_src(s, &ins[i].op.src[j]))
+				return 1;
+		}
+		if (is_scratch_dst(s, &ins[i].op.dst[0]) ||
+		    is_scratch_dst(s, &ins[i].op.dst[1]))
+			return 1;
+	}
+	return 0;
+}
+
+static
+void rate_imm_choice(struct imm_state *st)
+{
+	struct imm_choice *c;
+	struct op op;
+	int i, j, s, simm, cost, acc;
+	uint32_t val;
+
+	c = &st->curr;
+	op = st->in->op;
+	simm = st->simm;
+	c->load = cost = 0;
+
+	for (i = 0; i < 4; ++i) {
+		if (!(st->is_const & (1 << i)))
+			continue;
+
+		s = c->src[i];
+		if (s == IMM_SIMM) {
+			if (!st->simm_ok || !(st->is_known & (1 << i)))
+				return;
+			j = find_simm(st->val[i]);
+			if (j < 0 || (simm >= 0 && simm != j))
+				return;
+			simm = j;
+			op.src[i].rf = RF_SIMM;
+			op.src[i].num = j;
+			continue;
+		}
+
+		// Srcs sharing a scratch must be the same constant.
+		for (j = 0; j < i; ++j) {
+			if (!(st->is_const & (1 << j)) || c->src[j] != s)
+				continue;
+			if (!(st->is_known & (1 << i)) ||
+			    !(st->is_known & (1 << j)) ||
+			    st->val[i] != st->val[j])
+				return;
+		}
+
+		// A regfile A unpack would apply to the constant too.
+		if (scratch[s].reg.rf == RF_A &&
+		    st->in->unpack >= OP_UNPACK_A_16A &&
+		    st->in->unpack <= OP_UNPACK_A_8D)
+			return;
+
+		op.src[i] = scratch[s].reg;
+		val = st->val[i];
+		if ((st->is_known & (1 << i)) && scratch[s].valid &&
+		    scratch[s].val == val)
+			continue;
+		if (c->load & (1 << s))
+			continue;
+		c->load |= 1 << s;
+		cost += 2 + scratch[s].valid;
+	}
+
+	// A regfile write can't be read by the next instruction. An li of an
+	// accumulator between the li and the reader will do, else the li go
+	// an instruction further back, else a nop follows them.
+	acc = 0;
+	for (s = 0; s < num_scratch; ++s) {
+		if (scratch[s].reg.rf == RF_ACC)
+			acc |= 1 << s;
+	}
+	c->hoist = st->hoist;
+	c->nop = 0;
+	if (c->load && !(c->load & acc) && st->hoist == st->num_instrs) {
+		c->hoist = st->early;
+		for (s = 0; s < num_scratch && c->hoist >= 0; ++s) {
+			if ((c->load & (1 << s)) &&
+			    is_scratch_used(st->ins, c->hoist, st->num_instrs,
+					    s))
+				c->hoist = -1;
+		}
+		if (c->hoist < 0) {
+			c->hoist = st->hoist;
+			c->nop = 1;
+			cost += 2;
+		}
+	}
+
+	// A hoisted li must not disturb the instructions it skips.
+	for (s = 0; s < num_scratch; ++s) {
+		if ((c->load & (1 << s)) &&
+		    is_scratch_used(st->ins, c->hoist, st->num_instrs, s))
+			return;
+	}
+
+	if (!can_read_srcs(&op, simm >= 0 || st->rotate ||
+			   st->in->sig == OP_SIG_SIMM))
+		return;
+
+	c->cost = cost;
+	if (st->best.cost < 0 || cost < st->best.cost)
+		st->best = *c;
+}
+
+static
+void try_imm_choices(struct imm_state *st, int i)
+{
+	int s;
+
+	if (i == 4) {
+		rate_imm_choice(st);
+		return;
+	}
+
+	if (!(st->is_const & (1 << i))) {
+		try_imm_choices(st, i + 1);
+		return;
+	}
+
+	for (s = IMM_SIMM; s < num_scratch; ++s) {
+		st->curr.src[i] = s;
+		try_imm_choices(st, i + 1);
+	}
+}
+
+// The instructions that run after a branch, or a program end, before it
+// takes effect.
+static inline
+int delay_slots(const struct instr *in)
+{
+	if (in->sig == OP_SIG_BR)
+		return 3;
+	if (in->sig == OP_SIG_PROG_END || in->sig == OP_SIG_COLOUR_PROG_END)
+		return 2;
+	return 0;
+}
+
+// Where would an li for the instruction at ix go? Not into the delay slots
+// of a branch, or of a program end, but ahead of the branch. No li for a
+// later instruction goes any further back.
+static
+int hoist_point(const struct instr *ins, int ix)
+{
+	int h, i, slots;
+
+	h = ix;
+	for (i = ix - 1; i >= 0 && i >= h - 3; --i) {
+		slots = delay_slots(&ins[i]);
+		if (i + slots >= h)
+			h = i;
+	}
+	return h;
+}
+
+static
+int find_hoist(const struct instr *ins, int ix)
+{
+	int h, i;
+
+	h = hoist_point(ins, ix);
+
+	// Can't skip over any labels.
+	for (i = h + 1; i <= ix; ++i) {
+		if (ins[i].num_labels)
+			return -1;
+	}
+	return h;
+}
+
+// Makes room for an instruction at h, and returns it as a nop.
+static
+struct instr *insert_instr(struct instr *ins, int *num_instrs, int h)
+{
+	struct instr *in;
+	int i;
+
+	memmove(&ins[h + 1], &ins[h], (*num_instrs + 1 - h) * sizeof(*ins));
+	++*num_instrs;
+
+	in = &ins[h];
+	memset(in, 0, sizeof(*in));
+	parse_nop(in);
+	in->buf = ins[h + 1].buf;
+	in->inserted = 1;
+
+	// The instruction now begins the block.
+	in->labels = ins[h + 1].labels;
+	in->num_labels = ins[h + 1].num_labels;
+	ins[h + 1].labels = NULL;
+	ins[h + 1].num_labels = 0;
+
+	in->pc = ins[h + 1].pc;
+	for (i = h + 1; i <= *num_instrs; ++i)
+		ins[i].pc = ins[i - 1].pc + 8;
+	return in;
+}
+
+static
+void insert_load_imm(struct instr *ins, int *num_instrs, int h, int s,
+		     const struct reg *src)
+{
+	struct instr *li;
+
+	li = insert_instr(ins, num_instrs, h);
+	li->sig = OP_SIG_LI;
+	li->op.code[0] = OP_IMM_LI;
+	li->op.cc[0] = CC_ALWAYS;
+	scratch_to_dst(&scratch[s].reg, &li->op.dst[0]);
+	li->op.src[0] = *src;
+}
+
+static
+int add_loop_head(void)
+{
+	int size, *heads;
+
+	if (num_loop_heads == max_loop_heads) {
+		size = max_loop_heads ? 2 * max_loop_heads : 16;
+		heads = realloc(loop_heads, size * sizeof(*heads));
+		stat_add(STAT_ALLOCS, 1);
+		if (heads == NULL)
+			return -ENOMEM;
+		loop_heads = heads;
+		max_loop_heads = size;
+	}
+	loop_heads[num_loop_heads++] = last_head;
+	last_head = -1;
+	loop_end = 0;
+	return ESUCC;
+}
+
+// The branch ends the loop, if it goes back to the head.
+static
+int end_loop(const struct instr *ins, int ix)
+{
+	const struct instr *t, *br;
+	int i;
+
+	br = &ins[ix];
+	if (last_head < 0 || loop_end || br->sig != OP_SIG_BR ||
+	    br->op.src_label.str == NULL)
+		goto done;
+	t = &ins[last_head];
+	for (i = 0; i < t->num_labels; ++i) {
+		if (token_eq(&t->labels[i], &br->op.src_label))
+			break;
+	}
+	if (i == t->num_labels)
+		goto done;
+	if (loop_has_li)
+		return add_loop_head();
+	loop_end = ix + 1;
+	return ESUCC;
+done:
+	last_head = -1;
+	loop_end = 0;
+	return ESUCC;
+}
+
+// Decide where each constant src of the ALU instruction at ins[*num_instrs]
+// comes from: a small immediate, a scratch register that already holds
+// it, or a scratch register loaded by an li placed ahead. The choice
+// with the fewest li wins, as long as raddr_a and raddr_b can serve all
+// the reads. Constants that depend on labels are not known until the
+// pcs settle, and always take an li.
+static
+int select_imms(struct instr *ins, int *num_instrs)
+{
+	struct imm_state st;
+	struct instr *in;
+	struct op *op;
+	struct reg imm;
+	enum op_code code;
+	int i, s, h, acc, err;
+	uint32_t val;
+
+	in = &ins[*num_instrs];
+	op = &in->op;
+	code = op->code[0];
+
+	if (in->num_labels) {
+		invalidate_scratch();
+		last_head = *num_instrs;
+		loop_end = 0;
+		loop_has_li = 0;
+	}
+	if (bl_countdown && --bl_countdown == 0)
+		invalidate_scratch();
+
+	if (code != OP_NOP &&
+	    !(code >= OP_ADD_FADD && code <= OP_ADD_V8SUBS) &&
+	    !(code >= OP_ADD_FADDI && code <= OP_ADD_V8SUBSI))
+		goto done;
+
+	memset(&st, 0, sizeof(st));
+	st.in = in;
+	st.ins = ins;
+	st.num_instrs = *num_instrs;
+	st.simm = -1;
+	st.simm_ok = in->sig == OP_SIG_NONE || in->sig == OP_SIG_SIMM;
+	st.best.cost = -1;
+
+	code = op->code[1];
+	st.rotate = code >= OP_MUL_V8ADDS_ROTR5 && code <= OP_MUL_V8ADDS_ROT15;
+
+	for (i = 0; i < 4; ++i) {
+		if (op->src[i].rf == RF_SIMM) {
+			st.simm = op->src[i].num;
+			continue;
+		}
+		if (op->src[i].rf != RF_EXPR)
+			continue;
+
+		// The small immediate that an *i op asks for is fixed.
+		err = eval(&op->src[i].expr, NULL, 0, &val);
+		if (err && err != -ENOENT)
+			return err;
+		if (is_simm_op(op->code[i / 2])) {
+			if (err || find_simm(val) < 0)
+				st.simm_ok = 0;
+			else
+				st.simm = find_simm(val);
+			continue;
+		}
+
+		st.is_const |= 1 << i;
+		if (err)
+			continue;
+		st.is_known |= 1 << i;
+		st.val[i] = val;
+	}
+
+	if (!st.is_const)
+		goto done;
+
+	st.hoist = find_hoist(ins, *num_instrs);
+	if (st.hoist < 0)
+		return -EINVAL;
+	st.early = -1;
+	if (st.hoist == *num_instrs && st.hoist && !in->num_labels)
+		st.early = find_hoist(ins, st.hoist - 1);
+	for (i = st.early; i >= 0 && i < st.hoist; ++i) {
+		if (ins[i].sig == OP_SIG_BR && ins[i].op.code[0] == OP_BR_BL)
+			st.early = -1;
+	}
+
+	try_imm_choices(&st, 0);
+	if (st.best.cost < 0)
+		return -EINVAL;
+
+	// The li of the regfiles first, away from the reader.
+	h = st.best.hoist;
+	for (acc = 0; acc < 2; ++acc) {
+		for (i = 0; i < 4; ++i) {
+			s = st.best.src[i];
+			if (!(st.is_const & (1 << i)) || s == IMM_SIMM ||
+			    !(st.best.load & (1 << s)) ||
+			    (scratch[s].reg.rf == RF_ACC) != acc)
+				continue;
+			st.best.load &= ~(1 << s);
+			imm = op->src[i];
+			if (st.is_known & (1 << i)) {
+				imm.rf = RF_IMM;
+				imm.num = st.val[i];
+			}
+			if (h < loop_end) {
+				err = add_loop_head();
+				if (err)
+					return err;
+			}
+			insert_load_imm(ins, num_instrs, h++, s, &imm);
+			loop_has_li = 1;
+			in = &ins[*num_instrs];
+			op = &in->op;
+			scratch[s].valid = (st.is_known >> i) & 1;
+			scratch[s].val = st.val[i];
+		}
+	}
+	if (st.best.nop) {
+		insert_instr(ins, num_instrs, h);
+		in = &ins[*num_instrs];
+		op = &in->op;
+	}
+
+	for (i = 0; i < 4; ++i) {
+		if (!(st.is_const & (1 << i)))
+			continue;
+
+		s = st.best.src[i];
+		if (s == IMM_SIMM) {
+			in->sig = OP_SIG_SIMM;
+			op->src[i].rf = RF_SIMM;
+			op->src[i].num = find_simm(st.val[i]);
+			continue;
+		}
+		op->src[i] = scratch[s].reg;
+	}
+done:
+	in = &ins[*num_instrs];
+	for (s = 0; s < num_scratch; ++s) {
+		if (is_scratch_dst(s, &in->op.dst[0]) ||
+		    is_scratch_dst(s, &in->op.dst[1]))
+			scratch[s].valid = 0;
+	}
+	if (in->op.code[0] == OP_BR_BL)
+		bl_countdown = 4;
+	if (delay_slots(in))
+		return end_loop(ins, *num_instrs);
+	return ESUCC;
+}
+
+// The registers that the instructions read and write.
+#define USE_ACC(n)			(1u << (n))	// r0-r5.
+#define USE_FLAGS			(1u << 6)
+#define USE_TMU				(1u << 7)	// A request.
+#define USE_IO				(1u << 8)	// Any other IO.
+
+struct reg_use {
+	uint64_t			rf;		// A, then B.
+	uint32_t			other;
+};
+
+static
+void use_src(const struct reg *r, struct reg_use *u)
+{
+	if (r->rf == RF_SIMM || r->rf == RF_IMM || r->rf == RF_EXPR)
+		return;
+	if (r->rf == RF_ACC)
+		u->other |= USE_ACC(r->num);
+	else if ((r->rf == RF_A || r->rf == RF_B) && r->num < 32)
+		u->rf |= 1ull << (r->num + 32 * r->rf);
+	else if (r->num != 38 && r->num != 39)	// ele_num, qpu_num, -.
+		u->other |= USE_IO;
+}
+
+static
+void use_dst(const struct reg *r, struct reg_use *u)
+{
+	if (r->num < 32)
+		u->rf |= 1ull << (r->num + 32 * (r->rf == RF_B));
+	else if (r->num < 36)
+		u->other |= USE_ACC(r->num - 32);
+	else if (r->num == 37)
+		u->other |= USE_ACC(5);
+	else if (r->num >= 52 && r->num < 56)	// The SFU.
+		u->other |= USE_ACC(4) | USE_IO;
+	else if (r->num >= 56)
+		u->other |= USE_TMU;
+	else if (r->num != 39)
+		u->other |= USE_IO;
+}
+
+// The registers that the instruction reads and writes. Returns 1 if all
+// the writes are unconditional.
+static
+int reg_uses(const struct instr *in, struct reg_use *rd, struct reg_use *wr)
+{
+	const struct op *op;
+	int i, j, full;
+
+	op = &in->op;
+	memset(rd, 0, sizeof(*rd));
+	memset(wr, 0, sizeof(*wr));
+	full = 1;
+
+	if (in->sig == OP_SIG_BR) {
+		if (op->src_label.str == NULL)
+			use_src(&op->src[0], rd);
+		if (op->cc[0] != CC_ALWAYS)
+			rd->other |= USE_FLAGS;
+		if (op->code[0] == OP_BR_BL)
+			use_dst(&op->dst[0], wr);
+		return full;
+	}
+
+	if (in->sig == OP_SIG_LD_TMU0 || in->sig == OP_SIG_LD_TMU1)
+		wr->other |= USE_ACC(4) | USE_IO;
+	else if (in->sig != OP_SIG_NONE && in->sig != OP_SIG_SIMM &&
+		 in->sig != OP_SIG_LI)
+		wr->other |= USE_IO;
+	if (in->sig == OP_SIG_LI &&
+	    (op->code[0] == OP_SEM_SEMUP || op->code[0] == OP_SEM_SEMDN))
+		wr->other |= USE_IO;
+	if (in->sf)
+		wr->other |= USE_FLAGS;
+
+	for (i = 0; i < 2; ++i) {
+		if ((in->sig != OP_SIG_LI && op->code[i] == OP_NOP) ||
+		    op->cc[i] == CC_NEVER)
+			continue;
+		if (op->cc[i] != CC_ALWAYS) {
+			rd->other |= USE_FLAGS;
+			full = 0;
+		}
+		use_dst(&op->dst[i], wr);
+		if (in->sig == OP_SIG_LI)
+			continue;
+		for (j = 2 * i; j < 2 * i + 2; ++j) {
+			use_src(&op->src[j], rd);
+			// A rotation by r5.
+			if (op->src[j].rf == RF_SIMM && op->src[j].num >= 48)
+				rd->other |= USE_IO;
+		}
+	}
+	return full;
+}
+
+static
+int uses_overlap(const struct reg_use *a, const struct reg_use *b)
+{
+	return (a->rf & b->rf) || (a->other & b->other);
+}
+
+static
+void add_uses(struct reg_use *a, const struct reg_use *b)
+{
+	a->rf |= b->rf;
+	a->other |= b->other;
+}
+
+// Must the second instruction wait for a regfile write of the first?
+static
+int is_rf_hazard(const struct instr *a, const struct instr *b)
+{
+	struct reg_use rd, wr, t;
+
+	reg_uses(a, &t, &wr);
+	reg_uses(b, &rd, &t);
+	return (wr.rf & rd.rf) != 0;
+}
+
+static
+int is_thread_switch(const struct instr *in)
+{
+	return in->sig == OP_SIG_THRD_SWITCH ||
+		in->sig == OP_SIG_LAST_THRD_SWITCH;
+}
+
+// The constants of the loops, after parsing. select_imms() forgets what
+// the scratch registers hold at each label, so the li that it places in a
+// loop run in each iteration. Such an li goes ahead of the loop instead,
+// if nothing else in the loop writes its scratch, or reads it before the
+// li, and if the loop does not switch threads while it holds an
+// accumulator. The nop placed after the li may go along. The loops are
+// those that plan_pipeline() would take: one block, which only falling
+// through, and the branch that closes it, enter.
+#define MAX_HOISTED			(2 * MAX_SCRATCH)
+
+// The li, and the nops, of the loop at [t, br] that can go ahead of it.
+static
+int pick_loop_li(const struct instr *ins, int t, int br, char ts, char nops,
+		 int *ix)
+{
+	struct reg_use rd, wr, lwr, all_wr, all_rd;
+	int e, i, k, h;
+
+	e = br + 3;
+	h = 0;
+	for (k = t; k < br && h < MAX_HOISTED; ++k) {
+		if (!ins[k].inserted || ins[k].sig != OP_SIG_LI)
+			continue;
+		reg_uses(&ins[k], &rd, &lwr);
+		if (ts && lwr.other)
+			continue;
+		memset(&all_wr, 0, sizeof(all_wr));
+		memset(&all_rd, 0, sizeof(all_rd));
+		for (i = t; i <= e; ++i) {
+			if (i == k)
+				continue;
+			reg_uses(&ins[i], &rd, &wr);
+			add_uses(&all_wr, &wr);
+			if (i < k)
+				add_uses(&all_rd, &rd);
+		}
+		if (uses_overlap(&lwr, &all_wr) || uses_overlap(&lwr, &all_rd))
+			continue;
+		ix[h++] = k;
+		if (nops && k + 1 < br && ins[k + 1].inserted &&
+		    ins[k + 1].sig == OP_SIG_NONE)
+			ix[h++] = ++k;
+	}
+	return h;
+}
+
+// Would the instrs that are left next to each other wait for a regfile
+// write of the one before? So would the last delay slot and the new head.
+static
+int is_hoist_hazard(const struct instr *ins, int t, int br, const int *ix,
+		    int h)
+{
+	int i, j, prev;
+
+	prev = -1;
+	for (i = t, j = 0; i <= br; ++i) {
+		if (j < h && ix[j] == i) {
+			++j;
+			continue;
+		}
+		if (prev < 0 && i != t && is_rf_hazard(&ins[br + 3], &ins[i]))
+			return 1;
+		if (prev < 0 && is_rf_hazard(&ins[ix[h - 1]], &ins[i]))
+			return 1;
+		if (prev >= 0 && i != prev + 1 &&
+		    is_rf_hazard(&ins[prev], &ins[i]))
+			return 1;
+		prev = i;
+	}
+	return 0;
+}
+
+// The loop from the head at t, if the labels of no other branch, nor of
+// any expression, name the head.
+static
+int hoist_loop_li(struct instr *ins, int n, int t, const int *refs)
+{
+	struct instr moved[MAX_HOISTED];
+	struct token *labels;
+	int br, i, j, k, h, pc, num_labels, ix[MAX_HOISTED];
+	int nops;
+	char ts;
+
+	if (refs[t] > 1)
+		return 0;
+	ts = 0;
+	for (br = t; br < n && !delay_slots(&ins[br]); ++br) {
+		if (br > t && ins[br].num_labels)
+			return 0;
+		ts |= is_thread_switch(&ins[br]);
+	}
+	if (br + 3 >= n || (br > t && ins[br].num_labels) ||
+	    ins[br].sig != OP_SIG_BR || ins[br].op.src_label.str == NULL ||
+	    find_label(ins, &ins[br].op.src_label) != t)
+		return 0;
+	for (i = br + 1; i <= br + 3; ++i) {
+		if (delay_slots(&ins[i]) || ins[i].num_labels)
+			return 0;
+		ts |= is_thread_switch(&ins[i]);
+	}
+	for (i = t - 3; i < t; ++i) {
+		if (i >= 0 && i + delay_slots(&ins[i]) >= t)
+			return 0;
+	}
+
+	// Along with the nops, else without them.
+	for (nops = 1; nops >= 0; --nops) {
+		h = pick_loop_li(ins, t, br, ts, nops, ix);
+		if (h == 0)
+			return 0;
+		if (!is_hoist_hazard(ins, t, br, ix, h))
+			break;
+	}
+	if (nops < 0)
+		return 0;
+
+	// The li first, and then the rest of the loop, with its labels.
+	labels = ins[t].labels;
+	num_labels = ins[t].num_labels;
+	ins[t].labels = NULL;
+	ins[t].num_labels = 0;
+	pc = ins[t].pc;
+	for (j = 0; j < h; ++j)
+		moved[j] = ins[ix[j]];
+	for (i = k = br - 1, j = h - 1; i >= t; --i) {
+		if (j >= 0 && ix[j] == i)
+			--j;
+		else
+			ins[k--] = ins[i];
+	}
+	for (j = 0; j < h; ++j)
+		ins[t + j] = moved[j];
+	ins[t + h].labels = labels;
+	ins[t + h].num_labels = num_labels;
+	for (i = t; i < br; ++i)
+		ins[i].pc = pc + (i - t) * 8;
+	return h;
+}
+
+static inline
+int hoist_loop_consts(struct instr *ins, int n)
+{
+	struct stage_clock c;
+	const char *p;
+	int i, j, t, err, *refs;
+
+	if (num_loop_heads == 0)
+		return ESUCC;
+
+	// Only the labels of the heads are looked up.
+	stage_start(&c);
+	free(label_slots);
+	label_slots = NULL;
+	num_labels = 0;
+	for (i = 0; i < num_loop_heads; ++i) {
+		t = loop_heads[i];
+		for (j = 0; j < ins[t].num_labels; ++j) {
+			err = add_label(&ins[t].labels[j], t, ins[t].pc);
+			if (err)
+				return err;
+		}
+	}
+	refs = calloc(n, sizeof(*refs));
+	stat_add(STAT_ALLOCS, 1);
+	if (refs == NULL)
+		return -ENOMEM;
+
+	// The branches to each head, and the names of it in the
+	// expressions, as a branch through a reg may go there.
+	for (i = 0; i < n; ++i) {
+		if (ins[i].sig == OP_SIG_BR && ins[i].op.src_label.str) {
+			t = find_label(ins, &ins[i].op.src_label);
+			if (t >= 0)
+				++refs[t];
+		}
+		for (j = 0; j < 4; ++j) {
+			if (ins[i].op.src[j].rf != RF_EXPR)
+				continue;
+			p = ins[i].op.src[j].expr.str;
+			while ((t = expr_label(ins, &ins[i].op.src[j].expr,
+					       &p)) >= 0)
+				refs[t] += 2;
+		}
+	}
+	for (i = 0; i < num_syms; ++i) {
+		p = syms[i].expr.str;
+		while ((t = expr_label(ins, &syms[i].expr, &p)) >= 0)
+			refs[t] += 2;
+	}
+
+	// The loops are apart, as none holds another branch.
+	for (i = 0; i < num_loop_heads; ++i)
+		hoist_loop_li(ins, n, loop_heads[i], refs);
+	free(refs);
+	free(label_slots);
+	label_slots = NULL;
+	num_labels = 0;
+	stage_stop(&c, STAGE_SELECT);
+	return ESUCC;
+}
+
+static
+int resolve_dst_regs(struct instr *in)
+{
+	struct op *op;
+
+	op = &in->op;
+
+	// Both ALUs cannot write to the same regfile.
+	if ((op->dst[0].rf == RF_A && op->dst[1].rf == RF_A) ||
+	    (op->dst[0].rf == RF_B && op->dst[1].rf == RF_B))
+		return -EINVAL;
+
+	in->ws = 0;
+	if (op->dst[0].rf == RF_B || op->dst[1].rf == RF_A)
+		in->ws = 1;
+
+	if (in->ws) {
+		op->dst[0].rf = RF_B;
+		op->dst[1].rf = RF_A;
+	} else {
+		op->dst[0].rf = RF_A;
+		op->dst[1].rf = RF_B;
+	}
+	return ESUCC;
+}
+
+// A regfile A pack needs a write to regfile A, and a mul pack, a mul op.
+// An unpack needs a read from regfile A, or from r4.
+static
+int verify_pack(const struct instr *in)
+{
+	const struct op *op;
+	const struct reg *dst;
+	int i, a, r4;
+
+	op = &in->op;
+	if (is_pack_mul(in->pack)) {
+		if (in->sig != OP_SIG_LI && op->code[1] == OP_NOP)
+			return -EINVAL;
+	} else if (in->pack != OP_PACK_NOP) {
+		dst = &op->dst[(int)in->ws];
+		if (dst->rf != RF_A || dst->num > 31 ||
+		    op->cc[(int)in->ws] == CC_NEVER)
+			return -EINVAL;
+	}
+
+	if (in->unpack == OP_UNPACK_NOP)
+		return ESUCC;
+
+	a = r4 = 0;
+	for (i = 0; i < 4; ++i) {
+		a |= op->src[i].rf == RF_A && op->src[i].num < 32;
+		r4 |= op->src[i].rf == RF_ACC && op->src[i].num == 4;
+	}
+	if (is_unpack_r4(in->unpack) ? !r4 : !a)
+		return -EINVAL;
+	return ESUCC;
+}
+
+static
+int verify_branch(struct instr *in, const struct instr *ins)
+{
+	const struct label_slot *label;
+	struct op *op;
+	int err;
+
+	op = &in->op;
+	err = resolve_dst_regs(in);
+	if (err)
+		return err;
+
+	if (op->src_label.str == NULL) {
+		// The register should be RF_A [0-31].
+		if (op->src[0].rf != RF_A || op->src[0].num > 31)
+			return -EINVAL;
+		return ESUCC;
+	}
+
+	// Else, check if there is a target instruction.
+	label = lookup_label(ins, &op->src_label);
+
+	// Non-existent label, unless imported.
+	if (label == NULL && !object_mode)
+		return -EINVAL;
+
+	op->src[0].rf = RF_IMM;
+	op->src[0].num = label ? label->pc - (in->pc + 4 * 8) : 0;
+	return ESUCC;
+}
+
+static
+int verify_alu(struct instr *in, const struct instr *ins, int num_instrs)
+{
+	struct op *op;
+	enum op_code code;
+	uint64_t mask[6], t;
+	int is_io_reg, i, err;
+
+	err = resolve_dst_regs(in);
+	if (err)
+		return err;
+
+	op = &in->op;
+
+	// Fold any src expressions into small immediates.
+	for (i = 0; i < 4; ++i) {
+		if (op->src[i].rf != RF_EXPR)
+			continue;
+		err = resolve_src_simm(&op->src[i], ins, num_instrs);
+		if (err)
+			return err;
+	}
+
+	// ALUs do not deal with branch condition codes.
+	if (op->cc[0] >= CC_ALL_Z || op->cc[1] >= CC_ALL_Z)
+		return -EINVAL;
+
+	// Behaviour is undefined if both ALUs write to the same accumulator
+	// or IO register.
+	if (op->dst[0].num == op->dst[1].num &&
+	    op->dst[0].num > 31 && op->dst[0].num != 39)
+		return -EINVAL;
+
+	memset(mask, 0, sizeof(mask));
+	for (i = 0; i < 4; ++i) {
+		if (op->src[i].rf == RF_IMM)
+			continue;
+		mask[op->src[i].rf] |= 1ul << op->src[i].num;
+	}
+
+	code = op->code[1];
+
+	// If mul output is to be rotated, there shouldn't be any small
+	// immediates, or anyone reading from RF_B.
+	if (code >= OP_MUL_V8ADDS_ROTR5 && code <= OP_MUL_V8ADDS_ROT15 &&
+	    (mask[RF_SIMM] || mask[RF_B]))
+		return -EINVAL;
+
+	// If mul output is to be rotated, the sources must be from RF_ACC,
+	// r0-r3.
+	if (code >= OP_MUL_V8ADDS_ROTR5 && code <= OP_MUL_V8ADDS_ROT15 &&
+	    (op->src[2].rf != RF_ACC || op->src[3].rf != RF_ACC ||
+	     op->src[2].num > 3 || op->src[3].num > 3))
+		return -EINVAL;
+
+	// If there are small immediate sources, they should be same, and
+	// raddr_b is not available for RF_B.
+	if (count_ones(mask[RF_SIMM]) > 1)
+		return -EINVAL;
+	if (mask[RF_SIMM] && mask[RF_B])
+		return -EINVAL;
+
+	// If there are small immediate sources, or, if mul output is to be
+	// rotated, any RF_AB source must be converted to RF_A.
+	if ((code >= OP_MUL_V8ADDS_ROTR5 && code <= OP_MUL_V8ADDS_ROT15) ||
+	    mask[RF_SIMM]) {
+		for (i = 0; i < 4; ++i) {
+			if (op->src[i].rf != RF_AB)
+				continue;
+			op->src[i].rf = RF_A;
+			t = 1ul << op->src[i].num;
+			mask[RF_A] |= t;
+		}
+	}
+
+	// If there are RF_A sources, they should be same.
+	// Similarly for RF_B sources.
+	if (count_ones(mask[RF_A]) > 1)
+		return -EINVAL;
+	if (count_ones(mask[RF_B]) > 1)
+		return -EINVAL;
+
+	// If there are RF_AB sources, try to resolve them.
+	for (i = 0; i < 4; ++i) {
+		if (op->src[i].rf != RF_AB)
+			continue;
+
+		t = 1ul << op->src[i].num;
+
+		// Try resolving with RF_A, then RF_B.
+		if (mask[RF_A] & t)
+			op->src[i].rf = RF_A;
+		else if (mask[RF_B] & t)
+			op->src[i].rf = RF_B;
+	}
+
+	for (i = 0; i < 4; ++i) {
+		if (op->src[i].rf != RF_AB)
+			continue;
+
+		t = 1ul << op->src[i].num;
+
+		// Try resolving with RF_A if RF_A is unused, or same.
+		if (!mask[RF_A] || (mask[RF_A] & t)) {
+			op->src[i].rf = RF_A;
+			mask[RF_A] |= t;
+			continue;
+		}
+
+		// Try resolving with RF_B if RF_B is unused, or same,
+		if (!mask[RF_B] || (mask[RF_B] & t)) {
+			op->src[i].rf = RF_B;
+			mask[RF_B] |= t;
+			continue;
+		}
+
+		// Can't be resolved.
+		return -EINVAL;
+	}
+
+	// If the dst is NOP and the sources are not IO registers, change
+	// the cc to CC_NEVER. sf takes the flags from the add ALU unless it
+	// is a NOP or never writes, so keep the cc of the ALU that sets them.
+	is_io_reg = 0;
+	is_io_reg |=
+		(op->src[0].rf == RF_A || op->src[0].rf == RF_B) &&
+		(op->src[0].num > 31);
+	is_io_reg |=
+		(op->src[1].rf == RF_A || op->src[1].rf == RF_B) &&
+		(op->src[1].num > 31);
+	if (op->dst[0].num == 39 && !is_io_reg &&
+	    !(in->sf && op->code[0] != OP_NOP))
+		op->cc[0] = CC_NEVER;
+
+	is_io_reg = 0;
+	is_io_reg |=
+		(op->src[2].rf == RF_A || op->src[2].rf == RF_B) &&
+		(op->src[2].num > 31);
+	is_io_reg |=
+		(op->src[3].rf == RF_A || op->src[3].rf == RF_B) &&
+		(op->src[3].num > 31);
+	if (op->dst[1].num == 39 && !is_io_reg &&
+	    !(in->sf && op->code[0] == OP_NOP))
+		op->cc[1] = CC_NEVER;
+
+	return verify_pack(in);
+}
+
+static
+int verify_load_imm(struct instr *in, const struct instr *ins, int num_instrs)
+{
+	struct op *op;
+	int err;
+
+	err = resolve_dst_regs(in);
+	if (err)
+		return err;
+
+	op = &in->op;
+
+	err = resolve_src_expr(&op->src[0], ins, num_instrs);
+	if (err)
+		return err;
+
+	// If any dst is a NOP, change cc to CC_NEVER, unless it sets the
+	// flags.
+	if (op->dst[0].num == 39 && !in->sf)
+		op->cc[0] = CC_NEVER;
+	if (op->dst[1].num == 39)
+		op->cc[1] = CC_NEVER;
+
+	// Semaphore num should be in range.
+	if ((op->code[0] >= OP_SEM_SEMUP && op->code[0] <= OP_SEM_SEMDN) &&
+	    (op->src[0].num < 0 || op->src[0].num > 15))
+		return -EINVAL;
+	return verify_pack(in);
+}
+
+static
+int verify(struct instr *in, const struct instr *ins, int num_instrs)
+{
+	int err;
+	enum op_code code;
+	struct op *op;
+
+	op = &in->op;
+	code = op->code[0];
+
+	err = -EINVAL;
+	if ((code == OP_NOP) ||
+	    (code >= OP_ADD_FADD && code <= OP_ADD_V8SUBS) ||
+	    (code >= OP_ADD_FADDI && code <= OP_ADD_V8SUBSI)) {
+		err = verify_alu(in, ins, num_instrs);
+	} else if (code >= OP_BR_B && code <= OP_BR_BL) {
+		err = verify_branch(in, ins);
+	} else if ((code >= OP_IMM_LI && code <= OP_IMM_LIU) ||
+		   (code >= OP_SEM_SEMUP && code <= OP_SEM_SEMDN)) {
+		err = verify_load_imm(in, ins, num_instrs);
+	}
+	return err;
+}
+
+static
+int encode_load_imm(struct instr *in)
+{
+	int esig, ecc[2], epack, eunpack;
+	unsigned int val;
+	struct op *op;
+
+	op = &in->op;
+
+	epack = encode_pack(in->pack);
+	eunpack = encode_load_imm_type(op->code[0]);
+	esig = encode_sig(in->sig);
+	ecc[0] = encode_cond(op->cc[0]);
+	ecc[1] = encode_cond(op->cc[1]);
+
+	if (esig < 0 || ecc[0] < 0 || ecc[1] < 0 || epack < 0 || eunpack < 0)
+		return -EINVAL;
+
+	val = 0;
+	val |= bits_set(ENC_SIG, esig);
+	val |= bits_set(ENC_UNPACK, eunpack);
+	val |= bits_set(ENC_PACK, epack);
+	val |= bits_set(ENC_COND_ADD, ecc[0]);
+	val |= bits_set(ENC_COND_MUL, ecc[1]);
+	val |= bits_set(ENC_WADDR_ADD, op->dst[0].num);
+	val |= bits_set(ENC_WADDR_MUL, op->dst[1].num);
+	if (in->pm)
+		val |= bits_on(ENC_PM);
+	if (in->sf)
+		val |= bits_on(ENC_SF);
+	if (in->ws)
+		val |= bits_on(ENC_WS);
+	in->hi = val;
+	in->lo = op->src[0].num;
+
+	// Bit 4 of a semaphore instruction selects the decrement.
+	if (op->code[0] == OP_SEM_SEMDN)
+		in->lo |= 1 << 4;
+	return ESUCC;
+}
+
+static
+int encode_branch(struct instr *in)
+{
+	struct op *op;
+	int ecc, esig;
+	unsigned int val;
+
+	op = &in->op;
+
+	esig = encode_sig(in->sig);
+	ecc = encode_cond_br(op->cc[0]);
+
+	if (esig < 0 || ecc < 0)
+		return -EINVAL;
+
+	val = 0;
+	if (op->src_label.str == NULL) {
+		// Jump to register.
+		val |= bits_on(ENC_BR_REG);
+		val |= bits_set(ENC_BR_RADDR_A, op->src[0].num);
+	} else {
+		// Jump to label.
+		val |= bits_on(ENC_BR_REL);
+		in->lo = op->src[0].num;
+	}
+
+	val |= bits_set(ENC_SIG, esig);
+	val |= bits_set(ENC_BR_COND, ecc);
+	val |= bits_set(ENC_WADDR_ADD, op->dst[0].num);
+	val |= bits_set(ENC_WADDR_MUL, op->dst[1].num);
+	if (in->ws)
+		val |= bits_on(ENC_WS);
+	in->hi = val;
+	return ESUCC;
+}
+
+static
+int encode_alu(struct instr *in)
+{
+	int esig, ecc[2], eop[2], emuxes[4], epack, eunpack;
+	int raddr_a, raddr_b, val, i;
+	struct op *op;
+	enum op_code code;
+
+	op = &in->op;
+
+	epack = encode_pack(in->pack);
+	eunpack = encode_unpack(in->unpack);
+	esig = encode_sig(in->sig);
+	ecc[0] = encode_cond(op->cc[0]);
+	ecc[1] = encode_cond(op->cc[1]);
+	eop[0] = encode_alu_op_add(op->code[0]);
+	eop[1] = encode_alu_op_mul(op->code[1]);
+
+
+	if (esig < 0 || ecc[0] < 0 || ecc[1] < 0 || eop[0] < 0 || eop[1] < 0 ||
+	    epack < 0 || eunpack < 0)
+		return -EINVAL;
+
+	val = 0;
+	val |= bits_set(ENC_SIG, esig);
+	val |= bits_set(ENC_UNPACK, eunpack);
+	val |= bits_set(ENC_PACK, epack);
+	val |= bits_set(ENC_COND_ADD, ecc[0]);
+	val |= bits_set(ENC_COND_MUL, ecc[1]);
+	val |= bits_set(ENC_WADDR_ADD, op->dst[0].num);
+	val |= bits_set(ENC_WADDR_MUL, op->dst[1].num);
+	if (in->pm)
+		val |= bits_on(ENC_PM);
+	if (in->sf)
+		val |= bits_on(ENC_SF);
+	if (in->ws)
+		val |= bits_on(ENC_WS);
+	in->hi = val;
+
+	raddr_a = raddr_b = 39;	// NOP
+
+	for (i = 0; i < 4; ++i) {
+		switch (op->src[i].rf) {
+		case RF_A:
+			raddr_a = op->src[i].num;
+			emuxes[i] = 6;
+			break;
+		case RF_B:
+		case RF_SIMM:
+			raddr_b = op->src[i].num;
+			emuxes[i] = 7;
+			break;
+		case RF_ACC:
+			emuxes[i] = op->src[i].num;
+			break;
+		default:
+			return -EINVAL;
+		}
+	}
+
+	code = op->code[1];
+	if (code >= OP_MUL_V8ADDS_ROTR5 && code <= OP_MUL_V8ADDS_ROT15)
+		raddr_b = 48 + (code - OP_MUL_V8ADDS_ROTR5);
+
+	val = 0;
+	val |= bits_set(ENC_ALU_OP_MUL, eop[1]);
+	val |= bits_set(ENC_ALU_OP_ADD, eop[0]);
+	val |= bits_set(ENC_ALU_RADDR_A, raddr_a);
+	val |= bits_set(ENC_ALU_RADDR_B, raddr_b);
+	val |= bits_set(ENC_ALU_ADD_0, emuxes[0]);
+	val |= bits_set(ENC_ALU_ADD_1, emuxes[1]);
+	val |= bits_set(ENC_ALU_MUL_0, emuxes[2]);
+	val |= bits_set(ENC_ALU_MUL_1, emuxes[3]);
+	in->lo = val;
+	return ESUCC;
+}
+
+static
+int encode(struct instr *in)
+{
+	int err;
+	enum op_code code;
+	struct op *op;
+
+	op = &in->op;
+	code = op->code[0];
+
+	err = -EINVAL;
+	if ((code == OP_NOP) ||
+	    (code >= OP_ADD_FADD && code <= OP_ADD_V8SUBS) ||
+	    (code >= OP_ADD_FADDI && code <= OP_ADD_V8SUBSI)) {
+		err = encode_alu(in);
+	} else if (code >= OP_BR_B && code <= OP_BR_BL) {
+		err = encode_branch(in);
+	} else if ((code >= OP_IMM_LI && code <= OP_IMM_LIU) ||
+		   (code >= OP_SEM_SEMUP && code <= OP_SEM_SEMDN)) {
+		err = encode_load_imm(in);
+	}
+	return err;
+}
+
+// Delimiter classes of (up to) 64 consecutive bytes; bit i describes
+// byte i.
+struct scan_masks {
+	uint64_t			ws;	// isspace()
+	uint64_t			sep;	// , .
+	uint64_t			stop;	// ; # :
+};
+
+static
+void classify_scalar(const char *p, int n, struct scan_masks *m)
+{
+	int i, c;
+
+	m->ws = m->sep = m->stop = 0;
+	for (i = 0; i < n; ++i) {
+		c = char_class(p[i]);
+		m->ws |= (uint64_t)((c & CH_WS) != 0) << i;
+		m->sep |= (uint64_t)((c & CH_SEP) != 0) << i;
+		m->stop |= (uint64_t)((c & CH_STOP) != 0) << i;
+	}
+}
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+
+static inline
+uint32_t classify_eq(__m256i v, char c)
+{
+	return _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(c)));
+}
+
+static inline
+void classify_32(const char *p, uint32_t *ws, uint32_t *sep, uint32_t *stop)
+{
+	__m256i v;
+
+	v = _mm256_loadu_si256((const __m256i *)p);
+	*ws = classify_eq(v, ' ') | classify_eq(v, '\t') |
+		classify_eq(v, '\n') | classify_eq(v, '\v') |
+		classify_eq(v, '\f') | classify_eq(v, '\r');
+	*sep = classify_eq(v, ',') | classify_eq(v, '.');
+	*stop = classify_eq(v, ';') | classify_eq(v, '#') |
+		classify_eq(v, ':');
+}
+
+static
+void classify(const char *p, int n, struct scan_masks *m)
+{
+	uint32_t ws[2], sep[2], stop[2];
+
+	if (n < 64) {
+		classify_scalar(p, n, m);
+		return;
+	}
+
+	classify_32(p, &ws[0], &sep[0], &stop[0]);
+	classify_32(p + 32, &ws[1], &sep[1], &stop[1]);
+	m->ws = (uint64_t)ws[1] << 32 | ws[0];
+	m->sep = (uint64_t)sep[1] << 32 | sep[0];
+	m->stop = (uint64_t)stop[1] << 32 | stop[0];
+}
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+
+static inline
+uint32_t classify_eq(__m128i v, char c)
+{
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(c)));
+}
+
+static inline
+void classify_16(const char *p, uint32_t *ws, uint32_t *sep, uint32_t *stop)
+{
+	__m128i v;
+
+	v = _mm_loadu_si128((const __m128i *)p);
+	*ws = classify_eq(v, ' ') | classify_eq(v, '\t') |
+		classify_eq(v, '\n') | classify_eq(v, '\v') |
+		classify_eq(v, '\f') | classify_eq(v, '\r');
+	*sep = classify_eq(v, ',') | classify_eq(v, '.');
+	*stop = classify_eq(v, ';') | classify_eq(v, '#') |
+		classify_eq(v, ':');
+}
+
+static
+void classify(const char *p, int n, struct scan_masks *m)
+{
+	uint32_t ws, sep, stop;
+	int i;
+
+	if (n < 64) {
+		classify_scalar(p, n, m);
+		return;
+	}
+
+	m->ws = m->sep = m->stop = 0;
+	for (i = 0; i < 4; ++i) {
+		classify_16(p + 16 * i, &ws, &sep, &stop);
+		m->ws |= (uint64_t)ws << (16 * i);
+		m->sep |= (uint64_t)sep << (16 * i);
+		m->stop |= (uint64_t)stop << (16 * i);
+	}
+}
+#else
+static
+void classify(const char *p, int n, struct scan_masks *m)
+{
+	classify_scalar(p, n, m);
+}
+#endif
+
+// Scan [ix, size) for the next instruction. Labels found on the way are
+// added to the instruction, comments are skipped, and the tokens of the
+// instruction are recorded. The bytes are classified 64 at a time, and
+// the token boundaries are computed from the delimiter masks.
+//
+// On return, [*out_ls, *out_le) is the instruction, including its ;.
+// *out_ls is -1 if only whitespace, comments or labels remained.
+static
+int scan(struct instr *in, int ix, int size, int *out_le, int *out_ls)
+{
+	int i, ls, n, f, s, ns, ne, nl, err;
+	uint64_t valid, range, delim, nd, prev, bits;
+	struct scan_masks m;
+	char in_token, ws_in_label;
+	const char *buf, *p;
+	struct token *labels;
+
+	buf = in->buf;
+	*out_ls = *out_le = -1;
+	ls = -1;
+	ns = ne = 0;
+	in_token = ws_in_label = 0;
+
+	for (i = ix; i < size;) {
+		n = size - i;
+		if (n > 64)
+			n = 64;
+		classify(&buf[i], n, &m);
+		valid = n == 64 ? ~0ull : (1ull << n) - 1;
+		f = 0;
+again:
+		// Skip any whitespace.
+		if (ls == -1) {
+			bits = ~m.ws & valid & (~0ull << f);
+			if (!bits)
+				goto next;
+			f = first_one(bits);
+			ls = i + f;
+			ns = ne = 0;
+			in_token = ws_in_label = 0;
+		}
+
+		// Consider the bytes up to, and including, the first ; # :.
+		range = valid & (~0ull << f);
+		s = -1;
+		if (m.stop & range) {
+			s = first_one(m.stop & range);
+			range &= (2ull << s) - 1;
+		}
+
+		delim = (m.ws | m.sep | m.stop) & range;
+		nd = ~delim & range;
+		prev = (nd << 1) | ((uint64_t)in_token << f);
+
+		// A token starts at a non-delim not preceded by a non-delim,
+		// and ends at a delim preceded by a non-delim.
+		for (bits = nd & ~prev; bits; bits &= bits - 1) {
+			if (ns == max_tokens) {
+				err = grow_tokens();
+				if (err)
+					return err;
+			}
+			tokens[ns++].str = &buf[i + first_one(bits)];
+		}
+		for (bits = delim & prev; bits; bits &= bits - 1, ++ne)
+			tokens[ne].len = &buf[i + first_one(bits)] - tokens[ne].str;
+		ws_in_label |= (m.ws & range) != 0;
+
+		if (s == -1) {
+			in_token = (nd >> (n - 1)) & 1;
+			goto next;
+		}
+
+		// Found an instruction. Delim ; is a token.
+		if (buf[i + s] == ';') {
+			if (ns == max_tokens) {
+				err = grow_tokens();
+				if (err)
+					return err;
+			}
+			tokens[ns].str = &buf[i + s];
+			tokens[ns++].len = 1;
+			++ne;
+			assert(ns == ne);
+			num_tokens = ns;
+			stat_add(STAT_TOKENS, ns);
+			*out_ls = ls;
+			*out_le = i + s + 1;
+			return ESUCC;
+		}
+
+		// Found a comment. Ignore till the end of the line.
+		if (buf[i + s] == '#') {
+			ls = -1;
+			p = memchr(&buf[i + s], '\n', size - (i + s));
+			i = p ? p - buf : size;
+			continue;
+		}
+
+		// Else a : was found. A label can't contain whitespace.
+		assert(buf[i + s] == ':');
+		if (ws_in_label)
+			return -EINVAL;
+
+		// Add the label to the current instruction.
+		nl = ++in->num_labels;
+		labels = in->labels;
+		in->labels = labels = realloc(labels, nl * sizeof(*labels));
+		stat_add(STAT_ALLOCS, 1);
+		labels[nl - 1].str = &buf[ls];
+		labels[nl - 1].len = i + s - ls;
+
+		ls = -1;
+		f = s + 1;
+		if (f < n)
+			goto again;
+next:
+		i += n;
+	}
+
+	// Could not find a ;
+	if (ls != -1)
+		return -EINVAL;
+
+	*out_ls = -1;
+	*out_le = size;
+	return ESUCC;
+}
+
+// A source buffer, and the instructions assembled from it.
+struct program {
+	const char			*buf;
+	int				size;
+	struct instr			*instrs;
+	int				num_instrs;
+	int				max_instrs;
+	int				num_encoded;
+	int				pos;		// Of the next scan.
+	int				base;		// Instrs before instrs[0].
+	char				more;		// Input follows buf.
+};
+
+// Forget the previous program; the instrs[] are reused.
+static
+void reset_program(struct program *prog)
+{
+	int i;
+
+	for (i = 0; i < prog->num_instrs; ++i)
+		free(prog->instrs[i].labels);
+	prog->num_instrs = prog->num_encoded = 0;
+	prog->pos = prog->base = 0;
+	if (prog->instrs)
+		memset(&prog->instrs[0], 0, sizeof(*prog->instrs));
+
+	num_syms = 0;
+	num_globals = 0;
+	num_scratch = 0;
+	bl_countdown = 0;
+	num_loop_heads = 0;
+	last_head = -1;
+	loop_end = 0;
+}
+
+// Scan and parse the buffer from pos on, appending to the instructions.
+// Constants are selected as each instruction is parsed.
+static
+int parse_program(struct program *prog)
+{
+	int ls, le, i, err, num_instrs, n;
+	struct instr *instrs, *in;
+	struct stage_clock c;
+	struct stage_span sp;
+	const char *buf;
+
+	buf = prog->buf;
+	instrs = prog->instrs;
+	num_instrs = prog->num_instrs;
+
+	// Room for the instruction, and for the li and the nop that
+	// select_imms() may place ahead of it.
+	if (prog->max_instrs < 1 + MAX_SCRATCH + 1) {
+		prog->max_instrs = 100;
+		instrs = realloc(instrs, prog->max_instrs * sizeof(*instrs));
+		stat_add(STAT_ALLOCS, 1);
+		if (instrs == NULL)
+			return -ENOMEM;
+		prog->instrs = instrs;
+		memset(&instrs[0], 0, sizeof(*instrs));
+	}
+
+	err = ESUCC;
+	span_start(&sp);
+	for (i = prog->pos; i < prog->size;) {
+		if (num_instrs + 1 + MAX_SCRATCH + 1 > prog->max_instrs) {
+			n = prog->max_instrs * 2;
+			in = realloc(instrs, n * sizeof(*instrs));
+			stat_add(STAT_ALLOCS, 1);
+			if (in == NULL) {
+				err = -ENOMEM;
+				break;
+			}
+			prog->instrs = instrs = in;
+			prog->max_instrs = n;
+		}
+
+		// Any labels seen so far belong to this instruction.
+		in = &instrs[num_instrs];
+		in->pc = (prog->base + num_instrs) * 8;
+		in->buf = buf;
+		in->curr_token = 0;
+
+		tick_start(&c);
+		err = scan(in, i, prog->size, &le, &ls);
+		tick_lap(&c, STAGE_SCAN);
+		if (err)
+			break;
+		i = le;
+
+		if (ls == -1)
+			continue;
+
+		// Directives do not produce instructions.
+		if (buf[ls] == '.') {
+			err = parse_directive(in);
+			tick_lap(&c, STAGE_PARSE);
+			if (err)
+				break;
+			continue;
+		}
+
+		in->line_start = ls;
+		in->line_end = le;
+
+		if (verbosity >= VERBOSITY_TOKENS) {
+			out_printf("pc %x: ", in->pc);
+			print_tokens();
+			tick_lap(&c, STAGE_OUTPUT);
+		}
+
+		err = parse(in);
+		tick_lap(&c, STAGE_PARSE);
+		if (err)
+			break;
+
+		err = select_imms(instrs, &num_instrs);
+		tick_lap(&c, STAGE_SELECT);
+		if (err)
+			break;
+		++num_instrs;
+		memset(&instrs[num_instrs], 0, sizeof(*instrs));
+	}
+	span_stop(&sp);
+
+	// Labels not followed by an instruction, or of the one that failed.
+	// Else, they belong to the instruction still to come.
+	if (err || !prog->more) {
+		free(instrs[num_instrs].labels);
+		instrs[num_instrs].labels = NULL;
+		instrs[num_instrs].num_labels = 0;
+	}
+	prog->num_instrs = num_instrs;
+	prog->pos = i;
+	return err;
+}
+
+// Verify and encode the instructions, up to the first that fails.
+static
+int encode_program(struct program *prog)
+{
+	struct instr *instrs;
+	struct stage_clock c;
+	int i, n, e, err;
+
+	instrs = prog->instrs;
+	prog->num_encoded = 0;
+
+	stage_start(&c);
+	err = index_labels(instrs, prog->num_instrs);
+	stage_stop(&c, STAGE_VERIFY);
+	if (err)
+		return err;
+
+	// Each stage over all the instructions, so that the clock is read
+	// once per stage.
+	stage_start(&c);
+	for (i = 0; i < prog->num_instrs; ++i) {
+		err = verify(&instrs[i], instrs, prog->num_instrs);
+		if (err)
+			break;
+	}
+	stage_stop(&c, STAGE_VERIFY);
+	n = i;
+
+	stage_start(&c);
+	for (i = 0; i < n; ++i) {
+		e = encode(&instrs[i]);
+		if (e) {
+			err = e;
+			break;
+		}
+	}
+	stage_stop(&c, STAGE_ENCODE);
+	prog->num_encoded = i;
+	return err;
+}
+
+// The in-process entry point, for the harnesses.
+static inline
+int assemble(struct program *prog, const char *buf, int size)
+{
+	int err;
+
+	reset_program(prog);
+	prog->buf = buf;
+	prog->size = size;
+
+	err = parse_program(prog);
+	if (!err)
+		err = hoist_loop_consts(prog->instrs, prog->num_instrs);
+	if (err)
+		return err;
+	return encode_program(prog);
+}
+
+// The DMA overlap analysis, for --dma. A transfer starts at the write to
+// vdr_addr or vdw_addr, and is estimated to take DMA_LATENCY cycles, and
+// then DMA_ROW_CYCLES plus a cycle per DMA_BYTES_PER_CYCLE for each row
+// in memory. The instructions that issue before its wait hide that time.
+#define DMA_LATENCY			100
+#define DMA_ROW_CYCLES			4
+#define DMA_BYTES_PER_CYCLE		8
+
+struct dma_transfer {
+	int				ix;		// Of the addr write.
+	char				is_store;
+	char				known;		// The setup was an li.
+	uint32_t			setup;
+	uint32_t			pitch;		// Or the stride.
+	int				rows;
+	int				row_bytes;
+	int				cycles;
+};
+
+// The setups written by li, 0 if not known.
+struct dma_setups {
+	uint32_t			vdr;
+	uint32_t			vdr_pitch;
+	uint32_t			vdw;
+	uint32_t			vdw_stride;
+};
+
+static inline
+int is_dma_reg(const struct reg *r, enum reg_file rf, int num)
+{
+	return r->rf == rf && r->num == num;
+}
+
+// Does the instruction wait for (or queue behind) a transfer?
+static
+int is_dma_wait(const struct instr *in, char is_store)
+{
+	const struct op *op;
+	int i;
+
+	op = &in->op;
+	if (in->sig == OP_SIG_BR)
+		return 0;
+	for (i = 0; i < 2; ++i) {
+		if (is_dma_reg(&op->dst[i], is_store ? RF_B : RF_A, 50))
+			return 1;
+	}
+	if (in->sig == OP_SIG_LI)
+		return 0;
+	for (i = 0; i < 4; ++i) {
+		if (is_dma_reg(&op->src[i], is_store ? RF_B : RF_A, 50))
+			return 1;
+	}
+	return 0;
+}
+
+// Instructions that do no work do not hide a transfer.
+static
+int is_compute(const struct instr *in)
+{
+	enum op_code code;
+
+	code = in->op.code[0];
+	if (in->sig == OP_SIG_BR)
+		return 0;
+	if (in->sig == OP_SIG_LI)
+		return code != OP_SEM_SEMUP && code != OP_SEM_SEMDN;
+	return code != OP_NOP || in->op.code[1] != OP_NOP ||
+		in->sig != OP_SIG_NONE;
+}
+
+static
+void track_dma_setup(const struct instr *in, struct dma_setups *s)
+{
+	const struct reg *dst;
+	uint32_t v;
+	int i;
+
+	for (i = 0; i < 2; ++i) {
+		dst = &in->op.dst[i];
+		if (dst->num != 49 || (dst->rf != RF_A && dst->rf != RF_B))
+			continue;
+
+		// Only the setups of a 32-bit li are known.
+		if (in->sig != OP_SIG_LI || in->op.code[0] != OP_IMM_LI) {
+			if (dst->rf == RF_A)
+				s->vdr = s->vdr_pitch = 0;
+			else
+				s->vdw = s->vdw_stride = 0;
+			continue;
+		}
+
+		v = in->op.src[0].num;
+		if (dst->rf == RF_A && (v >> 28) == 9)
+			s->vdr_pitch = v & 0x1fff;
+		else if (dst->rf == RF_A && (v >> 31))
+			s->vdr = v;
+		else if (dst->rf == RF_B && (v >> 30) == 2)
+			s->vdw = v;
+		else if (dst->rf == RF_B && (v >> 30) == 3)
+			s->vdw_stride = v & 0x1fff;
+	}
+}
+
+static inline
+int dma_width(int modew)
+{
+	return modew == 0 ? 4 : modew < 4 ? 2 : 1;
+}
+
+// The store writes units rows of depth elements; the load, nrows rows of
+// rowlen elements. See vdw_store() and vdr_load() of emu.c.
+static
+void size_dma(struct dma_transfer *t, const struct dma_setups *s)
+{
+	uint32_t v;
+	int n;
+
+	v = t->is_store ? s->vdw : s->vdr;
+	t->known = v != 0;
+	t->setup = v;
+	if (t->is_store) {
+		t->pitch = s->vdw_stride;
+		n = (v >> 23) & 0x7f;
+		t->rows = n ? n : 128;
+		n = (v >> 16) & 0x7f;
+		t->row_bytes = (n ? n : 128) * dma_width(v & 7);
+	} else {
+		n = (v >> 24) & 15;
+		t->pitch = n ? 8u << n : s->vdr_pitch;
+		n = (v >> 16) & 15;
+		t->rows = n ? n : 16;
+		n = (v >> 20) & 15;
+		t->row_bytes = (n ? n : 16) * dma_width((v >> 28) & 7);
+	}
+
+	t->cycles = DMA_LATENCY;
+	if (t->known)
+		t->cycles += t->rows * (DMA_ROW_CYCLES + (t->row_bytes +
+				DMA_BYTES_PER_CYCLE - 1) / DMA_BYTES_PER_CYCLE);
+}
+
+// The result of following the paths from a transfer to its waits.
+struct dma_paths {
+	int				hidden;		// On the worst path.
+	char				found;		// Or hid it all.
+	char				no_wait;	// Reached the end.
+	char				reg_br;		// Not followed.
+};
+
+// Relaxes the count of the instructions before ins[to].
+static inline
+void dma_relax(int *dist, int *stack, int *num, char *queued, int to, int d)
+{
+	if (d >= dist[to])
+		return;
+	dist[to] = d;
+	if (!queued[to]) {
+		queued[to] = 1;
+		stack[(*num)++] = to;
+	}
+}
+
+// The fewest compute instructions on any path from the addr write to a
+// wait, up to the estimated cycles. A branch runs its 3 delay slots before
+// it lands; a program end, its 2.
+static
+void follow_dma(const struct instr *ins, int num_instrs,
+		const struct dma_transfer *t, int *dist, int *stack,
+		char *queued, struct dma_paths *p)
+{
+	const struct instr *in;
+	int i, j, k, d, num, slots;
+
+	for (i = 0; i <= num_instrs; ++i) {
+		dist[i] = t->cycles;
+		queued[i] = 0;
+	}
+	p->hidden = t->cycles;
+	p->found = p->no_wait = p->reg_br = 0;
+
+	num = 0;
+	dma_relax(dist, stack, &num, queued, t->ix + 1, 0);
+	while (num) {
+		i = stack[--num];
+		queued[i] = 0;
+		d = dist[i];
+		if (i == num_instrs) {
+			p->no_wait = 1;
+			continue;
+		}
+
+		in = &ins[i];
+		if (is_dma_wait(in, t->is_store)) {
+			p->found = 1;
+			if (d < p->hidden)
+				p->hidden = d;
+			continue;
+		}
+
+		d += is_compute(in);
+		slots = delay_slots(in);
+
+		for (j = 1; j <= slots && i + j < num_instrs; ++j) {
+			if (is_dma_wait(&ins[i + j], t->is_store))
+				break;
+			d += is_compute(&ins[i + j]);
+		}
+		if (j <= slots && i + j < num_instrs) {
+			p->found = 1;
+			if (d < p->hidden)
+				p->hidden = d;
+			continue;
+		}
+		// Far enough from any wait.
+		if (d >= t->cycles) {
+			p->found = 1;
+			continue;
+		}
+
+		if (in->sig == OP_SIG_BR) {
+			if (in->op.src_label.str == NULL) {
+				p->reg_br = 1;
+			} else {
+				k = (in->pc + 4 * 8 + in->op.src[0].num) / 8;
+				if (k >= 0 && k <= num_instrs)
+					dma_relax(dist, stack, &num, queued, k,
+						  d);
+			}
+			if (in->op.cc[0] == CC_ALWAYS)
+				continue;
+		} else if (slots) {
+			p->no_wait = 1;
+			continue;
+		}
+
+		k = i + 1 + slots;
+		dma_relax(dist, stack, &num, queued,
+			  k < num_instrs ? k : num_instrs, d);
+	}
+}
+
+// A transfer whose worst path hides less than its estimate is flagged.
+static
+void print_dma(const struct instr *in, const struct dma_transfer *t,
+	       const struct dma_paths *p)
+{
+	fprintf(stderr, "pc %x: %s", in->pc, t->is_store ? "vdw" : "vdr");
+	if (t->known)
+		fprintf(stderr, " %d x %d bytes, %s %u, ~%d cycles", t->rows,
+			t->row_bytes, t->is_store ? "stride" : "pitch",
+			t->pitch, t->cycles);
+	else
+		fprintf(stderr, " of unknown size, ~%d+ cycles", t->cycles);
+
+	if (!p->found) {
+		fprintf(stderr, ", no wait\n");
+		return;
+	}
+	fprintf(stderr, ", %d%s instrs before the wait", p->hidden,
+		p->hidden == t->cycles ? "+" : "");
+	if (p->no_wait)
+		fprintf(stderr, ", not waited for on some paths");
+	if (p->reg_br)
+		fprintf(stderr, ", register branches not followed");
+	if (p->hidden < t->cycles)
+		fprintf(stderr, ": too little overlap (%d%%)",
+			100 * p->hidden / t->cycles);
+	fprintf(stderr, "\n");
+}
+
+// Reports each transfer to stderr.
+static inline
+int analyze_dma(const struct instr *ins, int num_instrs)
+{
+	struct dma_transfer t;
+	struct dma_setups s;
+	struct dma_paths p;
+	const struct op *op;
+	int *dist, *stack, i, j;
+	enum reg_file rf;
+	char *queued;
+
+	dist = malloc((num_instrs + 1) * sizeof(*dist));
+	stack = malloc((num_instrs + 1) * sizeof(*stack));
+	queued = malloc(num_instrs + 1);
+	stat_add(STAT_ALLOCS, 3);
+	if (dist == NULL || stack == NULL || queued == NULL) {
+		free(dist);
+		free(stack);
+		free(queued);
+		return -ENOMEM;
+	}
+
+	memset(&s, 0, sizeof(s));
+	for (i = 0; i < num_instrs; ++i) {
+		// The setups in program order.
+		track_dma_setup(&ins[i], &s);
+		op = &ins[i].op;
+		for (j = 0; j < 2; ++j) {
+			t.is_store = j;
+			rf = j ? RF_B : RF_A;
+			if (ins[i].sig == OP_SIG_BR ||
+			    (!is_dma_reg(&op->dst[0], rf, 50) &&
+			     !is_dma_reg(&op->dst[1], rf, 50)))
+				continue;
+			t.ix = i;
+			size_dma(&t, &s);
+			follow_dma(ins, num_instrs, &t, dist, stack, queued,
+				   &p);
+			print_dma(&ins[i], &t, &p);
+		}
+	}
+
+	free(dist);
+	free(stack);
+	free(queued);
+	return ESUCC;
+}
+
+// The listing, for --listing. The issue cycles assume that the code runs
+// in program order, with the branches not taken, one instruction a cycle.
+// ldtmu waits TMU_LATENCY cycles from its request, and the DMA waits for
+// the estimate of the DMA overlap analysis.
+#define TMU_LATENCY			20
+
+struct listing {
+	struct dma_setups		setups;
+	uint64_t			cycle;
+	uint64_t			tmu_req[2][8];
+	int				tmu_head[2];
+	int				tmu_num[2];
+	uint64_t			dma_done[2];	// vdr, vdw.
+	int				sfu_countdown;
+
+	// The regfile writes of the previous instruction; -1 if none.
+	int				prev_wa;
+	int				prev_wb;
+};
+
+static const char *g_sig_names[] = {
+	"bkpt", "-", "ts", "pe", "wsb", "usb", "lts", "cvr",
+	"clr", "clrpe", "ldtmu0", "ldtmu1", "lda", "simm", "li", "br",
+};
+
+static const char *g_cond_names[] = {
+	"-", "a", "z", "nz", "n", "nn", "c", "nc",
+};
+
+static const char *g_cond_br_names[] = {
+	"allz", "allnz", "z", "nz", "alln", "allnn", "n", "nn",
+	"allc", "allnc", "c", "nc", "?", "?", "?", "a",
+};
+
+// The cycles the instruction waits before it issues, and why.
+static
+int listing_stalls(struct listing *l, const struct instr *in,
+		   const char **why)
+{
+	uint64_t ready;
+	int sig, tmu, i;
+
+	ready = l->cycle;
+	*why = NULL;
+	sig = bits_get(in->hi, ENC_SIG);
+	if (sig == 10 || sig == 11) {
+		tmu = sig - 10;
+		if (l->tmu_num[tmu]) {
+			i = l->tmu_head[tmu];
+			if (l->tmu_req[tmu][i] + TMU_LATENCY > ready) {
+				ready = l->tmu_req[tmu][i] + TMU_LATENCY;
+				*why = "tmu";
+			}
+		}
+	}
+
+	for (i = 0; i < 2; ++i) {
+		if (l->dma_done[i] > ready && is_dma_wait(in, i)) {
+			ready = l->dma_done[i];
+			*why = i ? "vdw" : "vdr";
+		}
+	}
+	return ready - l->cycle;
+}
+
+// Hazards that the hardware does not stall on.
+static
+const char *listing_hazard(const struct listing *l, const struct instr *in)
+{
+	int sig, muxes, raddr_a, raddr_b, i, m;
+
+	sig = bits_get(in->hi, ENC_SIG);
+	if (sig == 14 || sig == 15)
+		return NULL;
+
+	muxes = 0;
+	if (bits_get(in->lo, ENC_ALU_OP_ADD))
+		muxes |= 1 << bits_get(in->lo, ENC_ALU_ADD_0) |
+			1 << bits_get(in->lo, ENC_ALU_ADD_1);
+	if (bits_get(in->lo, ENC_ALU_OP_MUL))
+		muxes |= 1 << bits_get(in->lo, ENC_ALU_MUL_0) |
+			1 << bits_get(in->lo, ENC_ALU_MUL_1);
+
+	if ((muxes & (1 << 4)) && l->sfu_countdown)
+		return "r4 read before the sfu result";
+
+	raddr_a = bits_get(in->lo, ENC_ALU_RADDR_A);
+	raddr_b = bits_get(in->lo, ENC_ALU_RADDR_B);
+	for (m = 6; m < 8; ++m) {
+		if (!(muxes & (1 << m)))
+			continue;
+		i = m == 6 ? raddr_a : raddr_b;
+		if (m == 7 && sig == 13)
+			continue;
+		if (i == (m == 6 ? l->prev_wa : l->prev_wb))
+			return "reads a register written by the previous instr";
+	}
+	return NULL;
+}
+
+// Record the requests, the transfers and the writes of the instruction,
+// issued at l->cycle.
+static
+void listing_issue(struct listing *l, const struct instr *in)
+{
+	struct dma_transfer t;
+	int sig, ws, waddr[2], file, tmu, i;
+
+	sig = bits_get(in->hi, ENC_SIG);
+	ws = bits_get(in->hi, ENC_WS);
+	waddr[0] = bits_get(in->hi, ENC_WADDR_ADD);
+	waddr[1] = bits_get(in->hi, ENC_WADDR_MUL);
+
+	if (l->sfu_countdown)
+		--l->sfu_countdown;
+	if (sig == 10 || sig == 11) {
+		tmu = sig - 10;
+		if (l->tmu_num[tmu]) {
+			l->tmu_head[tmu] = (l->tmu_head[tmu] + 1) & 7;
+			--l->tmu_num[tmu];
+		}
+	}
+
+	track_dma_setup(in, &l->setups);
+	l->prev_wa = l->prev_wb = -1;
+	for (i = 0; i < 2; ++i) {
+		// The add writes to A, and the mul to B, unless swapped.
+		file = i ^ ws;
+		if (waddr[i] < 32) {
+			if (file)
+				l->prev_wb = waddr[i];
+			else
+				l->prev_wa = waddr[i];
+		} else if (waddr[i] >= 52 && waddr[i] <= 55) {
+			l->sfu_countdown = 2;
+		} else if ((waddr[i] == 56 || waddr[i] == 60) &&
+			   l->tmu_num[waddr[i] == 60] < 8) {
+			tmu = waddr[i] == 60;
+			l->tmu_req[tmu][(l->tmu_head[tmu] + l->tmu_num[tmu]) &
+					7] = l->cycle;
+			++l->tmu_num[tmu];
+		} else if (waddr[i] == 50 && sig != 15) {
+			t.is_store = file;
+			size_dma(&t, &l->setups);
+			l->dma_done[file] = l->cycle + t.cycles;
+		}
+	}
+	++l->cycle;
+}
+
+// pc, the encoding, the fields decoded from it, the issue cycle, the
+// stall, and the source.
+static
+void print_listing_line(struct listing *l, const char *buf,
+			const struct instr *in)
+{
+	const char *why, *hazard;
+	int sig, ws, stall, i, n;
+	char fields[64], note[128];
+
+	sig = bits_get(in->hi, ENC_SIG);
+	ws = bits_get(in->hi, ENC_WS);
+	if (sig == 15) {
+		snprintf(fields, sizeof(fields), "%-6s %-5s %s%-2d %s%-2d "
+			 "%s a%-2d %08x", g_sig_names[sig],
+			 g_cond_br_names[bits_get(in->hi, ENC_BR_COND)],
+			 ws ? "b" : "a", (int)bits_get(in->hi, ENC_WADDR_ADD),
+			 ws ? "a" : "b", (int)bits_get(in->hi, ENC_WADDR_MUL),
+			 bits_get(in->hi, ENC_BR_REL) ? "rel" : "abs",
+			 (int)bits_get(in->hi, ENC_BR_RADDR_A), in->lo);
+	} else if (sig == 14) {
+		snprintf(fields, sizeof(fields), "%-6s %-2s %-2s %s%-2d %s%-2d "
+			 "%08x", g_sig_names[sig],
+			 g_cond_names[bits_get(in->hi, ENC_COND_ADD)],
+			 g_cond_names[bits_get(in->hi, ENC_COND_MUL)],
+			 ws ? "b" : "a", (int)bits_get(in->hi, ENC_WADDR_ADD),
+			 ws ? "a" : "b", (int)bits_get(in->hi, ENC_WADDR_MUL),
+			 in->lo);
+	} else {
+		snprintf(fields, sizeof(fields), "%-6s %-2s %-2s %s%-2d %s%-2d "
+			 "a%-2d b%-2d %d%d%d%d", g_sig_names[sig],
+			 g_cond_names[bits_get(in->hi, ENC_COND_ADD)],
+			 g_cond_names[bits_get(in->hi, ENC_COND_MUL)],
+			 ws ? "b" : "a", (int)bits_get(in->hi, ENC_WADDR_ADD),
+			 ws ? "a" : "b", (int)bits_get(in->hi, ENC_WADDR_MUL),
+			 (int)bits_get(in->lo, ENC_ALU_RADDR_A),
+			 (int)bits_get(in->lo, ENC_ALU_RADDR_B),
+			 (int)bits_get(in->lo, ENC_ALU_ADD_0),
+			 (int)bits_get(in->lo, ENC_ALU_ADD_1),
+			 (int)bits_get(in->lo, ENC_ALU_MUL_0),
+			 (int)bits_get(in->lo, ENC_ALU_MUL_1));
+	}
+
+	stall = listing_stalls(l, in, &why);
+	hazard = listing_hazard(l, in);
+	l->cycle += stall;
+
+	n = fprintf(stderr, "%6x  %08x %08x  %-36s %8llu ", in->pc, in->hi,
+		    in->lo, fields, (unsigned long long)l->cycle);
+	if (stall)
+		n += fprintf(stderr, "%4d %-3s  ", stall, why);
+	else
+		n += fprintf(stderr, "%10s", "");
+	for (i = 0; i < in->num_labels; ++i)
+		n += fprintf(stderr, "%.*s: ", in->labels[i].len,
+			     in->labels[i].str);
+	n += fprintf(stderr, "%.*s", in->line_end - in->line_start,
+		     &buf[in->line_start]);
+	if (instr_note(in, note, sizeof(note)))
+		n += fprintf(stderr, "%s", note);
+	if (hazard)
+		n += fprintf(stderr, "  # %s", hazard);
+	n += fprintf(stderr, "\n");
+	stat_add(STAT_OUTPUT_BYTES, n);
+
+	listing_issue(l, in);
+}
+
+// Writes the listing of the encoded instructions to stderr.
+static inline
+void print_listing(const struct program *prog)
+{
+	struct listing l;
+	char fields[64];
+	int i;
+
+	memset(&l, 0, sizeof(l));
+	l.prev_wa = l.prev_wb = -1;
+	snprintf(fields, sizeof(fields), "%-6s %-2s %-2s %-3s %-3s %-3s %-3s "
+		 "%s", "sig", "ca", "cm", "wa", "wm", "ra", "rb", "mux");
+	fprintf(stderr, "%6s  %-8s %-8s  %-36s %8s %-10s%s\n", "pc", "hi", "lo",
+		fields, "cycle", "stall", "source");
+	for (i = 0; i < prog->num_encoded; ++i)
+		print_listing_line(&l, prog->buf, &prog->instrs[i]);
+}
+
+// The code layout, for --layout. The program is split into basic blocks at
+// the labels, and after the delay slots of the branches and program ends.
+// The blocks that fall through into one another make up a chain, which is
+// moved as a whole, so that no branches have to be added. The chain at the
+// entry stays first; the rest are sorted by their weight, hottest first,
+// so that the cold ones, such as the error paths, end up at the end. The
+// weight of a chain is the largest count that the --profile gives to its
+// instructions, or else the depth of its innermost loop.
+//
+// A conditional branch that the profile finds mostly taken is inverted if
+// its target starts a chain: that chain is glued after the branch, and the
+// old fall-through, which must have a label, becomes the target.
+#define ICACHE_LINE			64	// Bytes.
+#define ICACHE_LINE_INSTRS		(ICACHE_LINE / 8)
+#define HOT_SHIFT			4	// Within 1/16 of the hottest.
+
+// The count of the instruction at offset bytes from the label, and the
+// times it branched, if it is a branch.
+struct profile_entry {
+	struct token			name;
+	char				*line;		// Holds the name.
+	int				offset;
+	uint64_t			count;
+	uint64_t			taken;
+	char				has_taken;
+};
+
+static struct profile_entry *profile;
+static int num_profile;
+
+struct chain {
+	int				start;
+	int				end;		// Exclusive.
+	int				ix;		// In the source.
+	int				next;		// Glued after it, or -1.
+	int				rank;		// Among the heads.
+	char				glued;
+	uint64_t			weight;
+};
+
+// The per-instruction state of the layout.
+struct layout {
+	int				*depth;		// Of the loops.
+	int				*new_ix;
+	int				*chain_of;
+	int				*target;	// Of the inversions.
+	char				*in_slots;
+	char				*heads;		// Of the loops.
+	char				*split;		// For an inversion.
+	char				*seen;		// Per i-cache line.
+	uint64_t			*count;
+	uint64_t			*taken;
+	char				*has_taken;
+
+	struct chain			*chains;
+	struct chain			*seqs;		// The glued chains.
+	int				*order;
+	int				num_chains;
+	int				num_seqs;
+};
+
+// The fields of a line, which stays in place for the name.
+static
+int parse_profile_line(struct profile_entry *e, char *p)
+{
+	char *q, *end;
+
+	e->name.str = p;
+	while (*p && !isspace(*p))
+		++p;
+	e->name.len = p - e->name.str;
+
+	e->offset = 0;
+	q = memchr(e->name.str, '+', e->name.len);
+	if (q) {
+		e->offset = strtol(q + 1, &end, 0);
+		if (end != p || end == q + 1 || e->offset < 0 ||
+		    e->offset % 8)
+			return -EINVAL;
+		e->name.len = q - e->name.str;
+	}
+	if (e->name.len == 0)
+		return -EINVAL;
+
+	e->count = strtoull(p, &end, 10);
+	if (end == p)
+		return -EINVAL;
+	p = end;
+	e->taken = strtoull(p, &end, 10);
+	e->has_taken = end != p;
+	return ESUCC;
+}
+
+// Reads the "label[+offset] count [taken]" lines of a --profile. The
+// offset is in bytes, as the pcs are. Lines that start with a '#' are
+// comments.
+static inline
+int load_profile(const char *path)
+{
+	struct profile_entry *e;
+	char *line, *p;
+	size_t size;
+	ssize_t len;
+	int max, err;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (f == NULL)
+		return -errno;
+
+	max = 0;
+	err = ESUCC;
+	line = NULL;
+	size = 0;
+	while ((len = getline(&line, &size, f)) >= 0) {
+		if (len && line[len - 1] == '\n')
+			line[--len] = 0;
+		for (p = line; isspace(*p); ++p)
+			;
+		if (*p == '#' || *p == 0)
+			continue;
+
+		if (num_profile == max) {
+			max = max ? max * 2 : 64;
+			e = realloc(profile, max * sizeof(*e));
+			stat_add(STAT_ALLOCS, 1);
+			if (e == NULL) {
+				err = -ENOMEM;
+				break;
+			}
+			profile = e;
+		}
+		e = &profile[num_profile];
+		err = parse_profile_line(e, p);
+		if (err) {
+			fprintf(stderr, "profile: %s: bad line: %s\n", path,
+				line);
+			break;
+		}
+
+		// The entry keeps the line.
+		e->line = line;
+		line = NULL;
+		size = 0;
+		++num_profile;
+	}
+	free(line);
+	fclose(f);
+	return err;
+}
+
+// The profile is anchored on the labels, so that it survives edits
+// elsewhere in the source. Returns the hottest count.
+static
+uint64_t apply_profile(const struct instr *ins, int n, struct layout *l)
+{
+	const struct profile_entry *e;
+	uint64_t max;
+	int i, ix;
+
+	max = 0;
+	for (i = 0; i < num_profile; ++i) {
+		e = &profile[i];
+		ix = find_label(ins, &e->name);
+		if (ix >= 0)
+			ix += e->offset / 8;
+		if (ix < 0 || ix >= n ||
+		    (e->has_taken && ins[ix].sig != OP_SIG_BR)) {
+			fprintf(stderr, "profile: %.*s+%d does not match\n",
+				e->name.len, e->name.str, e->offset);
+			continue;
+		}
+		l->count[ix] = e->count;
+		l->taken[ix] = e->taken;
+		l->has_taken[ix] = e->has_taken;
+		if (e->count > max)
+			max = e->count;
+	}
+	return max;
+}
+
+// Control does not fall out of the instruction's delay slots.
+static
+int ends_chain(const struct instr *in)
+{
+	if (in->sig == OP_SIG_BR)
+		return in->op.code[0] == OP_BR_B && in->op.cc[0] == CC_ALWAYS;
+	return in->sig == OP_SIG_PROG_END || in->sig == OP_SIG_COLOUR_PROG_END;
+}
+
+// The head of the loop that the instruction closes, or -1. The head must
+// fall through to the branch; a backward branch to some other chain is not
+// a loop.
+static
+int loop_head(const struct instr *ins, int ix)
+{
+	const struct instr *in;
+	int t, i;
+
+	in = &ins[ix];
+	if (in->sig != OP_SIG_BR || in->op.src_label.str == NULL)
+		return -1;
+	t = find_label(ins, &in->op.src_label);
+	if (t < 0 || t > ix)
+		return -1;
+	for (i = t; i < ix; ++i) {
+		if (ends_chain(&ins[i]))
+			return -1;
+	}
+	return t;
+}
+
+static
+int cmp_chains(const void *a, const void *b)
+{
+	const struct chain *x, *y;
+
+	x = a;
+	y = b;
+	if (x->weight != y->weight)
+		return x->weight < y->weight ? 1 : -1;
+	return x->ix - y->ix;
+}
+
+static
+void free_layout(struct layout *l)
+{
+	free(l->depth);
+	free(l->new_ix);
+	free(l->chain_of);
+	free(l->target);
+	free(l->in_slots);
+	free(l->heads);
+	free(l->split);
+	free(l->seen);
+	free(l->count);
+	free(l->taken);
+	free(l->has_taken);
+	free(l->chains);
+	free(l->seqs);
+	free(l->order);
+}
+
+static
+int alloc_layout(struct layout *l, int n)
+{
+	int i;
+
+	memset(l, 0, sizeof(*l));
+	l->depth = calloc(n + 1, sizeof(*l->depth));
+	l->new_ix = calloc(n, sizeof(*l->new_ix));
+	l->chain_of = calloc(n, sizeof(*l->chain_of));
+	l->target = calloc(n, sizeof(*l->target));
+	l->in_slots = calloc(n, 1);
+	l->heads = calloc(n, 1);
+	l->split = calloc(n, 1);
+	l->count = calloc(n, sizeof(*l->count));
+	l->taken = calloc(n, sizeof(*l->taken));
+	l->has_taken = calloc(n, 1);
+	l->chains = calloc(n, sizeof(*l->chains));
+	l->seqs = calloc(n, sizeof(*l->seqs));
+	l->order = calloc(n, sizeof(*l->order));
+	stat_add(STAT_ALLOCS, 13);
+	if (l->depth == NULL || l->new_ix == NULL || l->chain_of == NULL ||
+	    l->target == NULL || l->in_slots == NULL || l->heads == NULL ||
+	    l->split == NULL || l->count == NULL || l->taken == NULL ||
+	    l->has_taken == NULL || l->chains == NULL || l->seqs == NULL ||
+	    l->order == NULL) {
+		free_layout(l);
+		return -ENOMEM;
+	}
+	for (i = 0; i < n; ++i)
+		l->target[i] = -1;
+	return ESUCC;
+}
+
+// Marks the delay slots, and the loops. Returns the index of a label in
+// the delay slots, which keeps the program in one chain, or -1.
+static
+int mark_loops(const struct instr *ins, int n, struct layout *l)
+{
+	int keep, i, j, t, slots;
+
+	keep = -1;
+	for (i = 0; i < n; ++i) {
+		slots = delay_slots(&ins[i]);
+		for (j = 1; j <= slots && i + j < n; ++j) {
+			l->in_slots[i + j] = 1;
+			if (ins[i + j].num_labels && keep < 0)
+				keep = i + j;
+		}
+		t = loop_head(ins, i);
+		if (t < 0)
+			continue;
+		++l->depth[t];
+		--l->depth[i + 4 < n ? i + 4 : n];
+		l->heads[t] = 1;
+	}
+	for (i = 1; i < n; ++i)
+		l->depth[i] += l->depth[i - 1];
+	return keep;
+}
+
+// The conditional branches taken more often than not; the fall-through of
+// each is split into a chain of its own, for the branch to take instead.
+static
+void pick_inversions(const struct instr *ins, int n, struct layout *l)
+{
+	const struct instr *in;
+	uint64_t not_taken;
+	int i, f;
+
+	for (i = 0; i + 4 < n; ++i) {
+		in = &ins[i];
+		f = i + 4;
+		if (!l->has_taken[i] || in->op.code[0] != OP_BR_B ||
+		    in->op.cc[0] == CC_ALWAYS || in->op.src_label.str == NULL ||
+		    l->in_slots[i] || l->in_slots[f] || !ins[f].num_labels)
+			continue;
+		not_taken = l->count[i] > l->taken[i] ?
+			l->count[i] - l->taken[i] : 0;
+		if (l->taken[i] <= not_taken)
+			continue;
+		l->target[i] = find_label(ins, &in->op.src_label);
+		if (l->target[i] == f)
+			l->target[i] = -1;
+		l->split[f] = l->target[i] >= 0;
+	}
+}
+
+static
+void split_chains(const struct instr *ins, int n, int keep, struct layout *l)
+{
+	struct chain *c;
+	uint64_t w;
+	int i, j, k;
+
+	l->num_chains = 0;
+	for (i = 0; i < n; i = k) {
+		for (k = i; k < n; ++k) {
+			if (k > i && l->split[k])
+				break;
+			if (keep < 0 && ends_chain(&ins[k])) {
+				k += 1 + delay_slots(&ins[k]);
+				break;
+			}
+		}
+		c = &l->chains[l->num_chains];
+		c->start = i;
+		c->end = k < n ? k : n;
+		c->ix = l->num_chains++;
+		c->next = -1;
+		c->weight = 0;
+		for (j = c->start; j < c->end; ++j) {
+			l->chain_of[j] = c->ix;
+			w = num_profile ? l->count[j] : (uint64_t)l->depth[j];
+			if (w > c->weight)
+				c->weight = w;
+		}
+	}
+}
+
+static
+int chain_reaches(const struct layout *l, const struct chain *c,
+		  const struct chain *to)
+{
+	for (; c != to; c = &l->chains[c->next]) {
+		if (c->next < 0)
+			return 0;
+	}
+	return 1;
+}
+
+// Inverts the picked branches whose target starts a chain that nothing
+// falls into, and glues that chain after the branch. The fall-through of
+// the others is glued back.
+static
+void glue_chains(struct instr *ins, int n, struct layout *l)
+{
+	struct chain *a, *c;
+	int i, t;
+
+	for (i = 0; i < n; ++i) {
+		t = l->target[i];
+		if (t < 0)
+			continue;
+		a = &l->chains[l->chain_of[i]];
+		c = &l->chains[l->chain_of[t]];
+		if (c->start == t && c->ix && !c->glued && !l->split[t] &&
+		    !chain_reaches(l, c, a)) {
+			ins[i].op.cc[0] = invert_cond_br(ins[i].op.cc[0]);
+			ins[i].op.src_label = ins[i + 4].labels[0];
+			ins[i].inverted = 1;
+		} else {
+			c = &l->chains[l->chain_of[i + 4]];
+			l->target[i] = -1;
+		}
+		a->next = c->ix;
+		c->glued = 1;
+	}
+}
+
+// Sorts the glued chains by their hottest chain; fills the order of the
+// chains. Returns the number of them that moved up.
+static
+int order_chains(struct layout *l)
+{
+	struct chain *c, *s;
+	int i, j, num, moved;
+
+	l->num_seqs = 0;
+	for (i = 0; i < l->num_chains; ++i) {
+		c = &l->chains[i];
+		if (c->glued)
+			continue;
+		s = &l->seqs[l->num_seqs];
+		*s = *c;
+		s->rank = l->num_seqs++;
+		for (; c->next >= 0; c = &l->chains[c->next]) {
+			if (l->chains[c->next].weight > s->weight)
+				s->weight = l->chains[c->next].weight;
+		}
+	}
+	qsort(l->seqs + 1, l->num_seqs - 1, sizeof(*l->seqs), cmp_chains);
+
+	num = moved = 0;
+	for (j = 0; j < l->num_seqs; ++j) {
+		moved += l->seqs[j].rank > j;
+		c = &l->chains[l->seqs[j].ix];
+		for (;;) {
+			l->order[num++] = c->ix;
+			if (c->next < 0)
+				break;
+			c = &l->chains[c->next];
+		}
+	}
+	return moved;
+}
+
+// The distinct i-cache lines that the hot instructions of the loop from t
+// to e touch. pos is NULL for the source order.
+static
+int loop_lines(const struct layout *l, const int *pos, int t, int e,
+	       int *num_hot)
+{
+	uint64_t w;
+	int i, line, num;
+
+	w = l->chains[l->chain_of[t]].weight;
+	num = *num_hot = 0;
+	for (i = t; i <= e; ++i) {
+		if (l->chains[l->chain_of[i]].weight < w)
+			continue;
+		line = (pos ? pos[i] : i) / ICACHE_LINE_INSTRS;
+		num += !l->seen[line];
+		l->seen[line] = 1;
+		++*num_hot;
+	}
+	for (i = t; i <= e; ++i)
+		l->seen[(pos ? pos[i] : i) / ICACHE_LINE_INSTRS] = 0;
+	return num;
+}
+
+// The i-cache footprint of each loop, to stderr.
+static
+void print_loops(const struct instr *ins, int n, const struct layout *l)
+{
+	const struct token *label;
+	int i, t, e, num, before, after;
+
+	for (i = 0; i < n; ++i) {
+		t = loop_head(ins, i);
+		if (t < 0)
+			continue;
+		e = i + 3 < n ? i + 3 : n - 1;
+		before = loop_lines(l, NULL, t, e, &num);
+		after = loop_lines(l, l->new_ix, t, e, &num);
+		label = &ins[t].labels[0];
+		fprintf(stderr, "loop at %.*s (pc %x): %d instrs, %d i-cache "
+			"lines (%d bytes), was %d\n", label->len, label->str,
+			l->new_ix[t] * 8, num, after, after * ICACHE_LINE,
+			before);
+	}
+}
+
+// The inverted branches, and the hot branches that are still taken, with
+// the nops in their delay slots, to stderr.
+static
+void print_branches(const struct instr *ins, int n, const struct layout *l,
+		    uint64_t hot)
+{
+	const struct instr *in;
+	const struct token *label;
+	int i, j, nops;
+
+	for (i = 0; i < n; ++i) {
+		in = &ins[i];
+		label = &in->op.src_label;
+		if (in->sig != OP_SIG_BR || label->str == NULL ||
+		    !l->has_taken[i])
+			continue;
+		if (l->target[i] >= 0) {
+			fprintf(stderr, "pc %x: inverted to b.%s %.*s\n",
+				l->new_ix[i] * 8, cc_name(in->op.cc[0]),
+				label->len, label->str);
+			continue;
+		}
+		if (l->count[i] < hot || !l->taken[i])
+			continue;
+		nops = 0;
+		for (j = 1; j <= 3 && i + j < n; ++j)
+			nops += !is_compute(&ins[i + j]);
+		fprintf(stderr, "pc %x: b%s%s %.*s taken %llu of %llu, %d nop "
+			"delay slots on a hot path\n", l->new_ix[i] * 8,
+			in->op.cc[0] == CC_ALWAYS ? "" : ".",
+			in->op.cc[0] == CC_ALWAYS ? "" : cc_name(in->op.cc[0]),
+			label->len, label->str,
+			(unsigned long long)l->taken[i],
+			(unsigned long long)l->count[i], nops);
+	}
+}
+
+// Reorders the chains of the program, and pads the loop heads with nops up
+// to an i-cache line if align is set. The pcs are reassigned; the branch
+// offsets are computed from the labels later, by verify_branch().
+static inline
+int layout_program(struct program *prog, char align)
+{
+	struct instr *ins, *out, *in;
+	struct layout l;
+	struct chain *c;
+	uint64_t hot;
+	int n, num, moved, keep, i, j, k, err;
+
+	ins = prog->instrs;
+	n = prog->num_instrs;
+	if (n == 0)
+		return ESUCC;
+	err = index_labels(ins, n);
+	if (err)
+		return err;
+	err = alloc_layout(&l, n);
+	if (err)
+		return err;
+
+	hot = (apply_profile(ins, n, &l) >> HOT_SHIFT) + 1;
+	keep = mark_loops(ins, n, &l);
+	if (keep < 0)
+		pick_inversions(ins, n, &l);
+	split_chains(ins, n, keep, &l);
+	glue_chains(ins, n, &l);
+	moved = order_chains(&l);
+
+	num = 0;
+	for (j = 0; j < l.num_chains; ++j) {
+		c = &l.chains[l.order[j]];
+		for (i = c->start; i < c->end; ++i) {
+			if (align && l.heads[i] && !l.in_slots[i])
+				num += (ICACHE_LINE_INSTRS -
+					num % ICACHE_LINE_INSTRS) %
+					ICACHE_LINE_INSTRS;
+			l.new_ix[i] = num++;
+		}
+	}
+
+	// Room for the nops, and as much slack as parse_program() keeps.
+	out = malloc((num + 1 + 4) * sizeof(*out));
+	l.seen = calloc(num / ICACHE_LINE_INSTRS + 1, 1);
+	stat_add(STAT_ALLOCS, 2);
+	if (out == NULL || l.seen == NULL) {
+		free(out);
+		free_layout(&l);
+		return -ENOMEM;
+	}
+
+	k = 0;
+	for (j = 0; j < l.num_chains; ++j) {
+		c = &l.chains[l.order[j]];
+		for (i = c->start; i < c->end; ++i) {
+			for (; k < l.new_ix[i]; ++k) {
+				in = &out[k];
+				memset(in, 0, sizeof(*in));
+				parse_nop(in);
+				in->buf = ins[i].buf;
+			}
+			out[k++] = ins[i];
+		}
+	}
+	for (k = 0; k < num; ++k)
+		out[k].pc = k * 8;
+
+	if (keep >= 0)
+		fprintf(stderr, "layout: a label in the delay slots at pc %x, "
+			"the order is kept\n", ins[keep].pc);
+	print_loops(ins, n, &l);
+	print_branches(ins, n, &l, hot);
+	fprintf(stderr, "layout: %d chains, %d moved up, %d nops\n",
+		l.num_chains, moved, num - n);
+
+	// The labels move along with their instructions.
+	free(ins);
+	prog->instrs = out;
+	prog->num_instrs = num;
+	prog->max_instrs = num + 1 + 4;
+	free_layout(&l);
+	return ESUCC;
+}
+
+// Software pipelining, for --pipeline. An innermost loop that makes one TMU
+// request, and loads its result with one ldtmu after it, has the slice of
+// the instructions that compute the request run d iterations ahead: the
+// prologue runs the slice d times before the loop, and the epilogue drains
+// the d requests still in flight after it. The loop itself is unchanged,
+// so the slice must not share registers with the rest of the loop, nor be
+// read after it. The last d requests read past the end of the data; the
+// loop has no trip count to run them in a shorter copy of it, so the bytes
+// they read are reported, for the data to be padded by as much.
+// d is the smallest that covers TMU_LATENCY, within the TMU FIFO.
+#define TMU_FIFO			4	// Requests in flight, per QPU.
+
+struct pipeline {
+	int				head;
+	int				br;		// Closes the loop.
+	int				ahead;
+	int				slice;		// Its instrs.
+	int				stride;		// Of the address.
+	char				strided;	// The stride is known.
+	char				unit;
+};
+
+// The paths that is_live() follows, and the points that it remembers.
+#define LIVE_PATHS			64
+
+struct live_path {
+	int				ix;
+	struct reg_use			live;
+};
+
+static
+int is_live_seen(struct live_path *seen, int *num_seen,
+		 const struct live_path *p)
+{
+	int i;
+
+	for (i = 0; i < *num_seen; ++i) {
+		if (seen[i].ix == p->ix && !(p->live.rf & ~seen[i].live.rf) &&
+		    !(p->live.other & ~seen[i].live.other))
+			return 1;
+	}
+	if (*num_seen == LIVE_PATHS)
+		return -1;
+	seen[(*num_seen)++] = *p;
+	return 0;
+}
+
+// Is any of the registers read from the instruction at ix on, before it
+// is written? The branches to labels are followed. A bl, a branch to a
+// register, or too many paths are taken to read them all.
+static
+int is_live(const struct instr *ins, int n, int ix, struct reg_use live)
+{
+	struct live_path stack[LIVE_PATHS], seen[LIVE_PATHS];
+	const struct instr *in;
+	struct reg_use rd, wr;
+	int num, num_seen, i, t, br, stop, err;
+
+	num = num_seen = 0;
+	stack[num].ix = ix;
+	stack[num++].live = live;
+	while (num) {
+		--num;
+		err = is_live_seen(seen, &num_seen, &stack[num]);
+		if (err < 0)
+			return 1;
+		if (err)
+			continue;
+
+		live = stack[num].live;
+		br = stop = -1;
+		for (i = stack[num].ix; i < n; ++i) {
+			if (!live.rf && !live.other)
+				break;
+			in = &ins[i];
+			if (reg_uses(in, &rd, &wr) == 0)
+				wr.rf = wr.other = 0;
+			if (uses_overlap(&rd, &live))
+				return 1;
+			live.rf &= ~wr.rf;
+			live.other &= ~wr.other;
+
+			if (delay_slots(in) && (br >= 0 || stop >= 0))
+				return 1;
+			if (in->sig == OP_SIG_BR) {
+				if (in->op.src_label.str == NULL ||
+				    in->op.code[0] == OP_BR_BL)
+					return 1;
+				br = i;
+			} else if (delay_slots(in)) {
+				stop = i + delay_slots(in);
+			}
+			if (i == stop)
+				break;
+			if (br < 0 || i != br + 3)
+				continue;
+
+			t = find_label(ins, &ins[br].op.src_label);
+			if (t < 0 || num == LIVE_PATHS)
+				return 1;
+			stack[num].ix = t;
+			stack[num++].live = live;
+			if (ins[br].op.cc[0] == CC_ALWAYS)
+				break;
+			br = -1;
+		}
+	}
+	return 0;
+}
+
+// Is the reg the one in u?
+static
+int is_use_reg(const struct reg *r, const struct reg_use *u, char is_dst)
+{
+	struct reg_use v;
+
+	memset(&v, 0, sizeof(v));
+	if (is_dst)
+		use_dst(r, &v);
+	else
+		use_src(r, &v);
+	return v.rf == u->rf && v.other == u->other;
+}
+
+// The alu of the instr that writes the reg in u; -1 if none does, or -2
+// if the write is conditional.
+static
+int writes_reg(const struct instr *in, const struct reg_use *u)
+{
+	const struct op *op;
+	int i;
+
+	op = &in->op;
+	for (i = 0; i < 2; ++i) {
+		if ((in->sig != OP_SIG_LI && op->code[i] == OP_NOP) ||
+		    op->cc[i] == CC_NEVER || !is_use_reg(&op->dst[i], u, 1))
+			continue;
+		return op->cc[i] == CC_ALWAYS ? i : -2;
+	}
+	return -1;
+}
+
+// The value of the li at ix, if it loads the same into each element.
+static
+int li_value(const struct instr *ins, int n, int ix, uint32_t *val)
+{
+	const struct reg *src;
+
+	src = &ins[ix].op.src[0];
+	if (ins[ix].sig != OP_SIG_LI || ins[ix].op.code[0] != OP_IMM_LI ||
+	    ins[ix].pack != OP_PACK_NOP)
+		return -EINVAL;
+	if (src->rf == RF_IMM) {
+		*val = src->num;
+		return ESUCC;
+	}
+	if (src->rf == RF_EXPR)
+		return eval(&src->expr, ins, n, val);
+	return -EINVAL;
+}
+
+// The value that the loop [t, e] reads from the reg in u: that of the one
+// li that writes it in the loop, or, if none does, of the li that writes
+// it last before the loop, in the code that falls through to it.
+static
+int loop_value(const struct instr *ins, int n, int t, int e,
+	       const struct reg_use *u, uint32_t *val)
+{
+	int i, w;
+
+	w = -1;
+	for (i = t; i <= e; ++i) {
+		if (writes_reg(&ins[i], u) == -1)
+			continue;
+		if (w >= 0)
+			return -EINVAL;
+		w = i;
+	}
+	for (i = t - 1; w < 0 && i >= 0; --i) {
+		if (writes_reg(&ins[i], u) != -1)
+			w = i;
+		else if (ins[i].num_labels)
+			return -EINVAL;
+	}
+	if (w < 0 || writes_reg(&ins[w], u) < 0)
+		return -EINVAL;
+	return li_value(ins, n, w, val);
+}
+
+// The bytes by which the request at req moves in each iteration of the
+// loop [t, e]. Its address is a reg, or a reg plus one that the loop does
+// not write, and the one write to that reg in the loop adds or subtracts
+// a small immediate or an li value.
+static
+int tmu_stride(const struct instr *ins, int n, int t, int e, int req,
+	       int *stride)
+{
+	const struct op *op;
+	struct reg_use rd, wr, lwr, addr, c;
+	uint32_t val;
+	int i, k, w, a;
+
+	memset(&lwr, 0, sizeof(lwr));
+	for (i = t; i <= e; ++i) {
+		reg_uses(&ins[i], &rd, &wr);
+		add_uses(&lwr, &wr);
+	}
+
+	// The reg of the address.
+	op = &ins[req].op;
+	if (op->dst[0].num < 56 || ins[req].unpack != OP_UNPACK_NOP ||
+	    (op->code[0] != OP_ADD_OR && op->code[0] != OP_ADD_ADD))
+		return -EINVAL;
+	for (a = 0; a < 2; ++a) {
+		memset(&addr, 0, sizeof(addr));
+		use_src(&op->src[a], &addr);
+		if (uses_overlap(&addr, &lwr))
+			break;
+	}
+	if (a == 2 || (op->code[0] == OP_ADD_OR &&
+		       !is_use_reg(&op->src[!a], &addr, 0)))
+		return -EINVAL;
+	memset(&c, 0, sizeof(c));
+	use_src(&op->src[!a], &c);
+	if (op->code[0] == OP_ADD_ADD && uses_overlap(&c, &lwr))
+		return -EINVAL;
+
+	// Its one write in the loop.
+	w = -1;
+	for (i = t; i <= e; ++i) {
+		reg_uses(&ins[i], &rd, &wr);
+		if (!uses_overlap(&wr, &addr))
+			continue;
+		if (w >= 0)
+			return -EINVAL;
+		w = i;
+	}
+	k = writes_reg(&ins[w], &addr);
+	op = &ins[w].op;
+	if (k < 0 || (ins[w].sig != OP_SIG_NONE && ins[w].sig != OP_SIG_SIMM) ||
+	    ins[w].pack != OP_PACK_NOP || ins[w].unpack != OP_UNPACK_NOP ||
+	    (op->code[k] != OP_ADD_ADD && op->code[k] != OP_ADD_SUB))
+		return -EINVAL;
+	for (a = 2 * k; a < 2 * k + 2; ++a) {
+		if (is_use_reg(&op->src[a], &addr, 0))
+			break;
+	}
+	if (a == 2 * k + 2 || (op->code[k] == OP_ADD_SUB && a != 2 * k))
+		return -EINVAL;
+
+	// The step.
+	a ^= 1;
+	if (op->src[a].rf == RF_SIMM && op->src[a].num < 48) {
+		val = simm_bits(op->src[a].num);
+	} else {
+		memset(&c, 0, sizeof(c));
+		use_src(&op->src[a], &c);
+		if ((!c.rf && !c.other) || (c.other & USE_IO) ||
+		    loop_value(ins, n, t, e, &c, &val))
+			return -EINVAL;
+	}
+	*stride = op->code[k] == OP_ADD_SUB ? -(int32_t)val : (int32_t)val;
+	return ESUCC;
+}
+
+// Plans the pipelining of the loop closed at br; refs counts the branches
+// to each instruction. Returns why it can not be done, or NULL; p->ahead
+// is 0 if there is nothing to do.
+static
+const char *plan_pipeline(const struct instr *ins, int n, int br,
+			  const int *refs, char *in_slice, struct pipeline *p)
+{
+	struct reg_use rd, wr, srd, swr, sall, crd, cwr;
+	int t, e, i, req, ld, gap, more;
+
+	memset(p, 0, sizeof(*p));
+	t = loop_head(ins, br);
+	e = br + 3;
+	if (t < 0 || e >= n)
+		return NULL;
+	p->head = t;
+	p->br = br;
+
+	req = ld = -1;
+	for (i = t; i <= e; ++i) {
+		if (i != br && delay_slots(&ins[i]))
+			return NULL;
+		reg_uses(&ins[i], &rd, &wr);
+		if (wr.other & USE_TMU) {
+			if (req >= 0)
+				return "more than one TMU request";
+			req = i;
+		}
+		if (ins[i].sig == OP_SIG_LD_TMU0 ||
+		    ins[i].sig == OP_SIG_LD_TMU1) {
+			if (ld >= 0)
+				return "more than one ldtmu";
+			ld = i;
+		}
+	}
+	if (req < 0 || ld < req)
+		return NULL;
+	if (ld - req >= TMU_LATENCY)
+		return NULL;
+
+	p->unit = ins[req].op.dst[0].num >= 60 || ins[req].op.dst[1].num >= 60;
+	if (ins[ld].sig != (p->unit ? OP_SIG_LD_TMU1 : OP_SIG_LD_TMU0))
+		return "the ldtmu is of the other TMU";
+	for (i = 0; i < 2; ++i) {
+		if (ins[req].op.code[i] != OP_NOP &&
+		    ins[req].op.dst[i].num >= 56 &&
+		    (ins[req].op.dst[i].num & 3 ||
+		     ins[req].op.cc[i] != CC_ALWAYS))
+			return "not a general memory lookup";
+	}
+	for (i = t + 1; i <= e; ++i) {
+		if (ins[i].num_labels)
+			return "a label inside the loop";
+	}
+	for (i = t - 3; i < t; ++i) {
+		if (i >= 0 && i + delay_slots(&ins[i]) >= t)
+			return "the loop starts in the delay slots";
+	}
+	if (refs[t] > 1)
+		return "the loop is entered by a branch";
+
+	// The slice: the request, and whatever writes what the slice reads.
+	memset(&srd, 0, sizeof(srd));
+	for (i = t; i <= e; ++i)
+		in_slice[i] = i == req;
+	reg_uses(&ins[req], &srd, &wr);
+	do {
+		more = 0;
+		for (i = t; i <= e; ++i) {
+			if (in_slice[i] || i == br)
+				continue;
+			reg_uses(&ins[i], &rd, &wr);
+			if (!uses_overlap(&wr, &srd))
+				continue;
+			in_slice[i] = more = 1;
+			add_uses(&srd, &rd);
+		}
+	} while (more);
+
+	// The constants of li are the same in each iteration, and may be
+	// read by the rest of the loop too.
+	memset(&swr, 0, sizeof(swr));
+	memset(&sall, 0, sizeof(sall));
+	memset(&crd, 0, sizeof(crd));
+	memset(&cwr, 0, sizeof(cwr));
+	for (i = t; i <= e; ++i) {
+		reg_uses(&ins[i], &rd, &wr);
+		if (!in_slice[i]) {
+			add_uses(&crd, &rd);
+			add_uses(&cwr, &wr);
+			continue;
+		}
+		++p->slice;
+		if ((rd.other | wr.other) & (USE_FLAGS | USE_IO | USE_ACC(4)))
+			return "the slice uses the flags, r4 or IO";
+		wr.other &= ~USE_TMU;
+		add_uses(&sall, &wr);
+		if (ins[i].sig == OP_SIG_LI &&
+		    ins[i].op.code[0] != OP_SEM_SEMUP &&
+		    ins[i].op.code[0] != OP_SEM_SEMDN &&
+		    ins[i].op.cc[0] == CC_ALWAYS &&
+		    ins[i].op.cc[1] == CC_ALWAYS)
+			continue;
+		add_uses(&swr, &wr);
+	}
+	if (uses_overlap(&swr, &crd) || uses_overlap(&sall, &cwr))
+		return "the slice shares registers with the loop";
+	swr.other |= USE_ACC(4);
+	if (is_live(ins, n, e + 1, swr))
+		return "the slice or r4 is read after the loop";
+
+	p->strided = !tmu_stride(ins, n, t, e, req, &p->stride);
+	gap = ld - req;
+	p->ahead = (TMU_LATENCY - gap + e - t) / (e - t + 1);
+	if (p->ahead > TMU_FIFO - 1)
+		p->ahead = TMU_FIFO - 1;
+	return NULL;
+}
+
+// Appends the instruction, after a nop if it must wait for the one before.
+// The copies in the prologue do not keep the labels.
+static
+void append_slice(struct instr *out, int *num, const struct instr *in,
+		  char copy)
+{
+	struct instr *nop;
+
+	if (*num && is_rf_hazard(&out[*num - 1], in)) {
+		nop = &out[(*num)++];
+		memset(nop, 0, sizeof(*nop));
+		parse_nop(nop);
+		nop->buf = in->buf;
+	}
+	out[*num] = *in;
+	if (copy) {
+		out[*num].labels = NULL;
+		out[*num].num_labels = 0;
+	}
+	++*num;
+}
+
+// Runs the slice of each loop that can be pipelined ahead of it, and
+// drains the requests after it.
+static inline
+int pipeline_program(struct program *prog)
+{
+	struct pipeline *plans, *p;
+	struct instr *ins, *out, *in;
+	const struct token *label;
+	const char *why;
+	int n, num_plans, size, num, i, j, r, err, *refs;
+	char *in_slice;
+
+	ins = prog->instrs;
+	n = prog->num_instrs;
+	if (n == 0)
+		return ESUCC;
+	err = index_labels(ins, n);
+	if (err)
+		return err;
+
+	plans = malloc(n * sizeof(*plans));
+	refs = calloc(n, sizeof(*refs));
+	in_slice = calloc(n, 1);
+	stat_add(STAT_ALLOCS, 3);
+	if (plans == NULL || refs == NULL || in_slice == NULL) {
+		free(plans);
+		free(refs);
+		free(in_slice);
+		return -ENOMEM;
+	}
+	for (i = 0; i < n; ++i) {
+		if (ins[i].sig != OP_SIG_BR || ins[i].op.src_label.str == NULL)
+			continue;
+		j = find_label(ins, &ins[i].op.src_label);
+		if (j >= 0)
+			++refs[j];
+	}
+
+	num_plans = 0;
+	size = n + 1 + 4;
+	for (i = 0; i < n; ++i) {
+		p = &plans[num_plans];
+		why = plan_pipeline(ins, n, i, refs, in_slice, p);
+		if (why == NULL && p->ahead == 0)
+			continue;
+		label = &ins[p->head].labels[0];
+		if (why) {
+			fprintf(stderr, "pipeline: loop at %.*s: %s\n",
+				label->len, label->str, why);
+			continue;
+		}
+		fprintf(stderr, "pipeline: loop at %.*s: %d ahead, %d instrs "
+			"in the slice\n", label->len, label->str, p->ahead,
+			p->slice);
+		if (!p->strided)
+			fprintf(stderr, "pipeline: loop at %.*s: the last %d "
+				"requests read past the end of the data\n",
+				label->len, label->str, p->ahead);
+		else if (p->stride)
+			fprintf(stderr, "pipeline: loop at %.*s: the last %d "
+				"requests read %lld bytes %s of the data\n",
+				label->len, label->str, p->ahead,
+				llabs((long long)p->stride * p->ahead),
+				p->stride > 0 ? "past the end" :
+				"before the start");
+		// The slices, a nop before each of them and the head, and the
+		// drain.
+		size += 2 * p->slice * p->ahead + 1 + p->ahead;
+		++num_plans;
+	}
+	if (num_plans == 0) {
+		free(plans);
+		free(refs);
+		free(in_slice);
+		return ESUCC;
+	}
+
+	out = malloc(size * sizeof(*out));
+	stat_add(STAT_ALLOCS, 1);
+	if (out == NULL) {
+		free(plans);
+		free(refs);
+		free(in_slice);
+		return -ENOMEM;
+	}
+
+	// The slices of the loops are apart, as no loop holds another branch.
+	num = 0;
+	p = plans;
+	for (i = 0; i < n; ++i) {
+		if (p < plans + num_plans && i == p->head) {
+			for (r = 0; r < p->ahead; ++r) {
+				for (j = p->head; j <= p->br + 3; ++j) {
+					if (in_slice[j])
+						append_slice(out, &num,
+							     &ins[j], 1);
+				}
+			}
+			append_slice(out, &num, &ins[i], 0);
+		} else {
+			out[num++] = ins[i];
+		}
+
+		if (p < plans + num_plans && i == p->br + 3) {
+			for (r = 0; r < p->ahead; ++r) {
+				in = &out[num++];
+				memset(in, 0, sizeof(*in));
+				parse_nop(in);
+				in->sig = p->unit ? OP_SIG_LD_TMU1 :
+					OP_SIG_LD_TMU0;
+				in->buf = ins[i].buf;
+			}
+			++p;
+		}
+	}
+	for (i = 0; i < num; ++i)
+		out[i].pc = i * 8;
+
+	free(ins);
+	free(plans);
+	free(refs);
+	free(in_slice);
+	prog->instrs = out;
+	prog->num_instrs = num;
+	prog->max_instrs = size;
+	return ESUCC;
+}
+
+// Thread switch placement, for --threads. Two threads share a QPU, each
+// with half of each regfile, and a ts switches to the other thread after
+// its two delay slots, which hides the latency of a TMU load. A ts goes
+// three instructions ahead of each ldtmu that would stall otherwise, or
+// earlier, down to its request, where the signal field is free. The
+// accumulators and the flags do not survive a switch, so none may be read
+// after it before it is written. The last switch is made an lts, unless
+// it is inside a loop.
+#define THREAD_REGS			16	// Of each regfile.
+
+static
+int check_thread_regs(const struct instr *ins, int n)
+{
+	struct reg_use rd, wr;
+	uint64_t rf, half;
+	int i, r;
+
+	half = (1ull << THREAD_REGS) - 1;
+	half |= half << 32;
+	rf = 0;
+	for (i = 0; i < n; ++i) {
+		reg_uses(&ins[i], &rd, &wr);
+		rf |= (rd.rf | wr.rf) & ~half;
+	}
+	for (r = 0; r < 64; ++r) {
+		if (rf & (1ull << r))
+			fprintf(stderr, "threads: %c%d is beyond the %d "
+				"registers of a thread\n", r < 32 ? 'a' : 'b',
+				r & 31, THREAD_REGS);
+	}
+	return rf ? -EINVAL : ESUCC;
+}
+
+// The TMU that the instruction makes a general memory request of, or -1.
+static
+int tmu_request(const struct instr *in)
+{
+	const struct op *op;
+	int i;
+
+	op = &in->op;
+	if (in->sig == OP_SIG_BR)
+		return -1;
+	for (i = 0; i < 2; ++i) {
+		if ((in->sig != OP_SIG_LI && op->code[i] == OP_NOP) ||
+		    op->cc[i] == CC_NEVER)
+			continue;
+		if (op->dst[i].num >= 56 && !(op->dst[i].num & 3))
+			return op->dst[i].num >= 60;
+	}
+	return -1;
+}
+
+// Puts a ts between the request at req and its ldtmu at ld, and returns
+// NULL; *out is where, or -1 if there is a switch between them already.
+// Else, returns why not.
+static
+const char *place_ts(struct instr *ins, int n, int req, int ld, int *out)
+{
+	static const char *const live_why[] = {
+		"r0 is live across the switch",
+		"r1 is live across the switch",
+		"r2 is live across the switch",
+		"r3 is live across the switch",
+		"r4 is live across the switch",
+		"r5 is live across the switch",
+		"the flags are live across the switch",
+	};
+	struct reg_use live, all;
+	const char *why;
+	int s, r, named;
+
+	*out = -1;
+	for (s = req; s < ld; ++s) {
+		if (is_thread_switch(&ins[s]))
+			return NULL;
+	}
+
+	all.rf = 0;
+	all.other = USE_ACC(0) | USE_ACC(1) | USE_ACC(2) | USE_ACC(3) |
+		USE_ACC(4) | USE_ACC(5) | USE_FLAGS;
+	why = ld - 3 < req ? "the request is less than 3 instrs ahead" :
+		"no free signal field";
+	named = 0;
+	for (s = ld - 3; s >= req; --s) {
+		if (ins[s].sig != OP_SIG_NONE)
+			continue;
+		if (!is_live(ins, n, s + 3, all))
+			break;
+		if (named)
+			continue;
+
+		// Name a reg that is live, at the latest free spot.
+		named = 1;
+		why = "an accumulator or the flags are live across the switch";
+		for (r = 0; r < NUM_ARR(live_why); ++r) {
+			live.rf = 0;
+			live.other = r < 6 ? USE_ACC(r) : USE_FLAGS;
+			if (is_live(ins, n, s + 3, live)) {
+				why = live_why[r];
+				break;
+			}
+		}
+	}
+	if (s < req)
+		return why;
+
+	ins[s].sig = OP_SIG_THRD_SWITCH;
+	*out = s;
+	return NULL;
+}
+
+static inline
+int place_thread_switches(struct program *prog)
+{
+	struct instr *ins, *in;
+	int n, i, j, u, s, t, err, last, has_lts;
+	int queue[2][TMU_FIFO], head[2], num[2];
+	const char *why;
+	char *in_loop;
+
+	ins = prog->instrs;
+	n = prog->num_instrs;
+	err = index_labels(ins, n);
+	if (err)
+		return err;
+	err = check_thread_regs(ins, n);
+	if (err)
+		return err;
+
+	in_loop = calloc(n + 1, 1);
+	stat_add(STAT_ALLOCS, 1);
+	if (in_loop == NULL)
+		return -ENOMEM;
+	for (i = 0; i < n; ++i) {
+		t = loop_head(ins, i);
+		for (j = t; t >= 0 && j <= i + 3 && j < n; ++j)
+			in_loop[j] = 1;
+	}
+
+	// The requests are paired with the loads within each block.
+	num[0] = num[1] = head[0] = head[1] = 0;
+	for (i = 0; i < n; ++i) {
+		in = &ins[i];
+		if (in->num_labels || in->sig == OP_SIG_BR)
+			num[0] = num[1] = 0;
+
+		u = tmu_request(in);
+		if (u >= 0) {
+			if (num[u] == TMU_FIFO) {
+				head[u] = (head[u] + 1) % TMU_FIFO;
+				--num[u];
+			}
+			queue[u][(head[u] + num[u]++) % TMU_FIFO] = i;
+		}
+
+		u = in->sig == OP_SIG_LD_TMU0 ? 0 :
+			in->sig == OP_SIG_LD_TMU1 ? 1 : -1;
+		if (u < 0 || num[u] == 0)
+			continue;
+		j = queue[u][head[u]];
+		head[u] = (head[u] + 1) % TMU_FIFO;
+		--num[u];
+		if (i - j >= TMU_LATENCY)
+			continue;
+		why = place_ts(ins, n, j, i, &s);
+		if (why)
+			fprintf(stderr, "threads: no ts for the ldtmu at "
+				"pc %x: %s\n", in->pc, why);
+		else if (s >= 0)
+			fprintf(stderr, "threads: ts at pc %x, for the ldtmu at "
+				"pc %x\n", ins[s].pc, in->pc);
+	}
+
+	last = -1;
+	has_lts = 0;
+	for (i = 0; i < n; ++i) {
+		if (is_thread_switch(&ins[i]))
+			last = i;
+		has_lts |= ins[i].sig == OP_SIG_LAST_THRD_SWITCH;
+	}
+	if (last >= 0 && !has_lts && in_loop[last])
+		fprintf(stderr, "threads: the last switch, at pc %x, is in a "
+			"loop; no lts\n", ins[last].pc);
+	else if (last >= 0 && !has_lts)
+		ins[last].sig = OP_SIG_LAST_THRD_SWITCH;
+	free(in_loop);
+	return ESUCC;
+}
+
+// The dataflow analysis. The instrs are split into blocks at the labels,
+// and after the delay slots of the branches and of the program end. A
+// branch leaves from the block of its last delay slot. A bl also returns
+// to the fall-through. A branch to a register, or out of the object, may
+// go anywhere; after a branch to a register, any label may be entered.
+// The regs are numbered as DF_ACC() and DF_FLAGS, after A, then B.
+#define DF_ACC(n)			(64 + (n))
+#define DF_FLAGS			70
+#define DF_OTHER			(USE_FLAGS | (USE_FLAGS - 1))
+
+struct block {
+	int				start;
+	int				end;
+	int				succ[2];	// -1 if none.
+	char				call;		// succ[1] is a return.
+	char				unknown;	// May go anywhere.
+	char				entry;
+	char				reachable;
+	struct reg_use			gen;
+	struct reg_use			kill;
+	struct reg_use			live_in;
+	struct reg_use			live_out;
+	struct reg_use			uniform_in;
+	struct reg_use			uniform_out;
+};
+
+struct dataflow {
+	struct instr			*ins;
+	int				num_instrs;
+	struct block			*blocks;
+	int				num_blocks;
+	int				*block_of;
+	int				*preds;
+	int				*pred_start;	// By block, and one more.
+	int				*stack;
+	int				*mark;
+	int				mark_gen;
+	char				indirect;
+};
+
+static
+void free_dataflow(struct dataflow *df)
+{
+	free(df->blocks);
+	free(df->block_of);
+	free(df->preds);
+	free(df->pred_start);
+	free(df->stack);
+	free(df->mark);
+	memset(df, 0, sizeof(*df));
+}
+
+// What the instr at ix reads, and what it surely writes. A regfile write
+// is not seen by the next instr, and the SFU and TMU write r4 late; those
+// are not taken to kill the regs.
+static
+void df_transfer(const struct dataflow *df, int ix, struct reg_use *rd,
+		 struct reg_use *kill)
+{
+	struct reg_use wr, next, t;
+	int full;
+
+	full = reg_uses(&df->ins[ix], rd, &wr);
+	rd->other &= DF_OTHER;
+	kill->rf = full ? wr.rf : 0;
+	kill->other = full ? wr.other & DF_OTHER : 0;
+	if (wr.other & USE_IO)
+		kill->other &= ~USE_ACC(4);
+	if (ix + 1 == df->num_instrs ||
+	    df->block_of[ix + 1] != df->block_of[ix]) {
+		kill->rf = 0;
+		return;
+	}
+	reg_uses(&df->ins[ix + 1], &next, &t);
+	kill->rf &= ~next.rf;
+}
+
+static
+void df_link(struct dataflow *df, struct block *b)
+{
+	const struct instr *ins;
+	const struct op *op;
+	int e, k, br, fall, t, through;
+
+	ins = df->ins;
+	e = b->end - 1;
+	br = -1;
+	for (k = e; k >= 0 && k >= e - 3; --k) {
+		if (delay_slots(&ins[k]) && k + delay_slots(&ins[k]) == e) {
+			br = k;
+			break;
+		}
+	}
+	fall = b->end < df->num_instrs ? df->block_of[b->end] : -1;
+	b->succ[0] = b->succ[1] = -1;
+	if (br < 0) {
+		b->succ[0] = fall;
+		b->unknown = fall < 0;
+		return;
+	}
+
+	// Entered in the delay slots, the branch is not taken.
+	through = br < b->start;
+	if (ins[br].sig == OP_SIG_BR) {
+		op = &ins[br].op;
+		t = -1;
+		if (op->src_label.str)
+			t = find_label(ins, &op->src_label);
+		else
+			df->indirect = 1;
+		if (t < 0)
+			b->unknown = 1;
+		else
+			b->succ[0] = df->block_of[t];
+		through |= op->cc[0] != CC_ALWAYS;
+		b->call = op->code[0] == OP_BR_BL;
+		through |= b->call;
+	}
+	if (through && fall < 0)
+		b->unknown = 1;
+	else if (through)
+		b->succ[1] = fall;
+}
+
+// The labels named in an expression may be branched to through a reg.
+static
+void df_expr_entries(struct dataflow *df, const struct token *expr)
+{
+	const char *p;
+	int t;
+
+	p = expr->str;
+	while ((t = expr_label(df->ins, expr, &p)) >= 0)
+		df->blocks[df->block_of[t]].entry = 1;
+}
+
+static
+void df_mark_entries(struct dataflow *df)
+{
+	const struct instr *in;
+	struct block *b;
+	int i, j, t;
+
+	df->blocks[0].entry = 1;
+	for (i = 0; i < num_globals; ++i) {
+		t = find_label(df->ins, &globals[i]);
+		if (t >= 0)
+			df->blocks[df->block_of[t]].entry = 1;
+	}
+	for (i = 0; i < num_syms; ++i)
+		df_expr_entries(df, &syms[i].expr);
+	for (i = 0; i < df->num_instrs; ++i) {
+		in = &df->ins[i];
+		for (j = 0; j < 4; ++j) {
+			if (in->op.src[j].rf == RF_EXPR)
+				df_expr_entries(df, &in->op.src[j].expr);
+		}
+	}
+	for (i = 0; i < df->num_blocks && df->indirect; ++i) {
+		b = &df->blocks[i];
+		b->entry |= df->ins[b->start].num_labels > 0;
+	}
+}
+
+static
+void df_reach(struct dataflow *df)
+{
+	struct block *b;
+	int i, j, num, s;
+
+	num = 0;
+	for (i = 0; i < df->num_blocks; ++i) {
+		b = &df->blocks[i];
+		b->reachable = b->entry;
+		if (b->entry)
+			df->stack[num++] = i;
+	}
+	while (num) {
+		b = &df->blocks[df->stack[--num]];
+		for (j = 0; j < 2; ++j) {
+			s = b->succ[j];
+			if (s < 0 || df->blocks[s].reachable)
+				continue;
+			df->blocks[s].reachable = 1;
+			df->stack[num++] = s;
+		}
+	}
+}
+
+static
+void df_link_preds(struct dataflow *df)
+{
+	const struct block *b;
+	int i, j, s;
+
+	for (i = 0; i < df->num_blocks; ++i) {
+		b = &df->blocks[i];
+		for (j = 0; j < 2; ++j) {
+			if (b->succ[j] >= 0)
+				++df->pred_start[b->succ[j] + 1];
+		}
+	}
+	for (i = 0; i < df->num_blocks; ++i)
+		df->pred_start[i + 1] += df->pred_start[i];
+	for (i = 0; i < df->num_blocks; ++i)
+		df->mark[i] = df->pred_start[i];
+	for (i = 0; i < df->num_blocks; ++i) {
+		b = &df->blocks[i];
+		for (j = 0; j < 2; ++j) {
+			s = b->succ[j];
+			if (s >= 0)
+				df->preds[df->mark[s]++] = i;
+		}
+	}
+	memset(df->mark, 0, df->num_blocks * sizeof(*df->mark));
+}
+
+// Solves for the live regs at the block boundaries. It is run again after
+// the instrs are changed; the blocks must not be.
+static
+void solve_liveness(struct dataflow *df)
+{
+	struct reg_use rd, kill, out;
+	struct block *b;
+	int i, j, s, changed;
+
+	for (i = 0; i < df->num_blocks; ++i) {
+		b = &df->blocks[i];
+		memset(&b->gen, 0, sizeof(b->gen));
+		memset(&b->kill, 0, sizeof(b->kill));
+		memset(&b->live_in, 0, sizeof(b->live_in));
+		for (j = b->end - 1; j >= b->start; --j) {
+			df_transfer(df, j, &rd, &kill);
+			b->gen.rf = rd.rf | (b->gen.rf & ~kill.rf);
+			b->gen.other = rd.other | (b->gen.other & ~kill.other);
+			add_uses(&b->kill, &kill);
+		}
+	}
+
+	do {
+		changed = 0;
+		for (i = df->num_blocks - 1; i >= 0; --i) {
+			b = &df->blocks[i];
+			out.rf = b->unknown ? ~0ull : 0;
+			out.other = b->unknown ? DF_OTHER : 0;
+			for (j = 0; j < 2; ++j) {
+				s = b->succ[j];
+				if (s >= 0)
+					add_uses(&out, &df->blocks[s].live_in);
+			}
+			b->live_out = out;
+			out.rf = b->gen.rf | (out.rf & ~b->kill.rf);
+			out.other = b->gen.other | (out.other & ~b->kill.other);
+			if (out.rf == b->live_in.rf &&
+			    out.other == b->live_in.other)
+				continue;
+			b->live_in = out;
+			changed = 1;
+		}
+	} while (changed);
+}
+
+// Builds the blocks over the instrs; the labels must be indexed.
+static
+int build_dataflow(struct dataflow *df, struct instr *ins, int n)
+{
+	struct block *b;
+	int i, ds, end, odd;
+
+	memset(df, 0, sizeof(*df));
+	df->ins = ins;
+	df->num_instrs = n;
+	df->blocks = calloc(n + 1, sizeof(*df->blocks));
+	df->block_of = calloc(n + 1, sizeof(*df->block_of));
+	df->preds = calloc(2 * n + 1, sizeof(*df->preds));
+	df->pred_start = calloc(n + 2, sizeof(*df->pred_start));
+	df->stack = calloc(n + 1, sizeof(*df->stack));
+	df->mark = calloc(n + 1, sizeof(*df->mark));
+	stat_add(STAT_ALLOCS, 6);
+	if (df->blocks == NULL || df->block_of == NULL || df->preds == NULL ||
+	    df->pred_start == NULL || df->stack == NULL || df->mark == NULL) {
+		free_dataflow(df);
+		return -ENOMEM;
+	}
+	if (n == 0)
+		return ESUCC;
+
+	// A branch in the delay slots of another is not followed.
+	odd = 0;
+	end = -1;
+	df->block_of[0] = 1;
+	for (i = 0; i < n; ++i) {
+		df->block_of[i] |= ins[i].num_labels > 0;
+		ds = delay_slots(&ins[i]);
+		if (ds == 0)
+			continue;
+		odd |= i <= end;
+		end = i + ds;
+		if (end + 1 < n)
+			df->block_of[end + 1] = 1;
+	}
+
+	for (i = 0; i < n; ++i) {
+		if (df->block_of[i]) {
+			b = &df->blocks[df->num_blocks++];
+			b->start = i;
+		}
+		df->block_of[i] = df->num_blocks - 1;
+		df->blocks[df->num_blocks - 1].end = i + 1;
+	}
+
+	for (i = 0; i < df->num_blocks; ++i)
+		df_link(df, &df->blocks[i]);
+	df->indirect |= odd;
+	for (i = 0; i < df->num_blocks && odd; ++i)
+		df->blocks[i].unknown = 1;
+
+	df_mark_entries(df);
+	df_reach(df);
+	df_link_preds(df);
+	solve_liveness(df);
+	return ESUCC;
+}
+
+// Does the instr write reg r? 1 if surely, 2 if maybe. The writes to r
+// that the next instr does not see yet are maybes.
+static
+int df_writes(const struct instr *in, int r, char next)
+{
+	struct reg_use rd, wr;
+	int full;
+
+	full = reg_uses(in, &rd, &wr);
+	if (r < 64 && !(wr.rf & (1ull << r)))
+		return 0;
+	if (r >= 64 && !(wr.other & (1u << (r - 64))))
+		return 0;
+	if (!full || (next && (r < 64 || r == DF_ACC(4))))
+		return 2;
+	return 1;
+}
+
+// The last write to r in [from, to): its index, -1 if none, or -2 if it
+// is not known.
+static
+int df_last_def(const struct dataflow *df, int from, int to, int r)
+{
+	int i, w;
+
+	for (i = to - 1; i >= from; --i) {
+		w = df_writes(&df->ins[i], r, i == to - 1);
+		if (w)
+			return w == 1 ? i : -2;
+	}
+	return -1;
+}
+
+// The only instr whose write to r reaches the start of the block b, or -1.
+// The regs are not known on entry to the program, nor after a call.
+static
+int entry_def(struct dataflow *df, int b, int r)
+{
+	const struct block *p;
+	int res, num, i, q, d;
+
+	++df->mark_gen;
+	res = -1;
+	num = 0;
+	df->stack[num++] = b;
+	while (num) {
+		p = &df->blocks[df->stack[--num]];
+		if (p->entry)
+			return -1;
+		for (i = df->pred_start[p - df->blocks];
+		     i < df->pred_start[p - df->blocks + 1]; ++i) {
+			q = df->preds[i];
+			if (df->blocks[q].call &&
+			    df->blocks[q].succ[1] == p - df->blocks)
+				return -1;
+			if (df->mark[q] == df->mark_gen)
+				continue;
+			df->mark[q] = df->mark_gen;
+			d = df_last_def(df, df->blocks[q].start,
+					df->blocks[q].end, r);
+			if (d == -2 || (d >= 0 && res >= 0 && d != res))
+				return -1;
+			if (d >= 0)
+				res = d;
+			else
+				df->stack[num++] = q;
+		}
+	}
+	return res;
+}
+
+// The only instr whose write to r reaches the instr at ix, or -1.
+static
+int reaching_def(struct dataflow *df, int ix, int r)
+{
+	const struct block *p;
+	int d;
+
+	p = &df->blocks[df->block_of[ix]];
+	d = df_last_def(df, p->start, ix, r);
+	if (d != -1)
+		return d < 0 ? -1 : d;
+	return entry_def(df, df->block_of[ix], r);
+}
+
+// The op that sets the flags.
+static
+int flags_op(const struct instr *in)
+{
+	const struct op *op;
+
+	op = &in->op;
+	return op->code[0] != OP_NOP && op->cc[0] != CC_NEVER ? 0 : 1;
+}
+
+// Is the src the same in all the lanes, given the regs u that are?
+static
+int is_uniform_src(const struct reg *r, const struct reg_use *u)
+{
+	if (r->rf == RF_SIMM)
+		return r->num < 48;
+	if (r->rf == RF_IMM || r->rf == RF_EXPR)
+		return 1;
+	if (r->rf == RF_ACC)
+		return (u->other & USE_ACC(r->num)) != 0;
+	if ((r->rf == RF_A || r->rf == RF_B) && r->num < 32)
+		return (u->rf & (1ull << (r->num + 32 * r->rf))) != 0;
+	// uni_rd, qpu_num.
+	return r->num == 32 || (r->rf == RF_B && r->num == 38);
+}
+
+// Steps u over the instr. A regfile write lands in u an instr late; late
+// holds it until then.
+static
+void uniform_step(const struct instr *in, struct reg_use *u, uint64_t *late)
+{
+	const struct op *op;
+	struct reg_use set, clr, d;
+	int i, val[2], flags;
+
+	op = &in->op;
+	memset(&set, 0, sizeof(set));
+	memset(&clr, 0, sizeof(clr));
+	flags = (u->other & USE_FLAGS) != 0;
+	for (i = 0; i < 2; ++i) {
+		val[i] = flags;
+		if (in->sig == OP_SIG_BR) {
+			use_dst(&op->dst[0], &clr);
+			break;
+		}
+		if ((in->sig != OP_SIG_LI && op->code[i] == OP_NOP) ||
+		    op->cc[i] == CC_NEVER)
+			continue;
+		if (in->sig == OP_SIG_LI)
+			val[i] = op->code[0] == OP_IMM_LI;
+		else
+			val[i] = is_uniform_src(&op->src[2 * i], u) &&
+				is_uniform_src(&op->src[2 * i + 1], u);
+		val[i] &= in->pack == OP_PACK_NOP &&
+			in->unpack == OP_UNPACK_NOP;
+
+		// A conditional write keeps the old value in some lanes.
+		memset(&d, 0, sizeof(d));
+		use_dst(&op->dst[i], &d);
+		if ((d.other & USE_IO) ||
+		    (op->cc[i] != CC_ALWAYS &&
+		     (!flags || (d.rf & ~u->rf) || (d.other & ~u->other))))
+			add_uses(&clr, &d);
+		else
+			add_uses(val[i] ? &set : &clr, &d);
+	}
+	if (in->sig == OP_SIG_LD_TMU0 || in->sig == OP_SIG_LD_TMU1)
+		clr.other |= USE_ACC(4);
+
+	u->rf |= *late;
+	u->rf &= ~clr.rf;
+	u->other &= ~clr.other;
+	u->other |= set.other & DF_OTHER;
+	*late = set.rf;
+	if (in->sf && val[flags_op(in)])
+		u->other |= USE_FLAGS;
+	else if (in->sf)
+		u->other &= ~USE_FLAGS;
+}
+
+static
+void uniform_scan(const struct dataflow *df, int from, int to,
+		  struct reg_use *u)
+{
+	uint64_t late;
+	int i;
+
+	late = 0;
+	for (i = from; i < to; ++i)
+		uniform_step(&df->ins[i], u, &late);
+}
+
+// Solves for the regs and the flags that are the same in all the lanes,
+// at the block boundaries. Nothing is, on entry to the program, or after a
+// call. The loops start out optimistic.
+static
+void solve_uniformity(struct dataflow *df)
+{
+	struct reg_use in;
+	struct block *b, *q;
+	int i, j, changed;
+
+	for (i = 0; i < df->num_blocks; ++i) {
+		b = &df->blocks[i];
+		b->uniform_in.rf = b->entry ? 0 : ~0ull;
+		b->uniform_in.other = b->entry ? 0 : DF_OTHER;
+		b->uniform_out = b->uniform_in;
+		uniform_scan(df, b->start, b->end, &b->uniform_out);
+	}
+
+	do {
+		changed = 0;
+		for (i = 0; i < df->num_blocks; ++i) {
+			b = &df->blocks[i];
+			if (b->entry)
+				continue;
+			in.rf = ~0ull;
+			in.other = DF_OTHER;
+			for (j = df->pred_start[i]; j < df->pred_start[i + 1];
+			     ++j) {
+				q = &df->blocks[df->preds[j]];
+				in.rf &= q->uniform_out.rf;
+				in.other &= q->uniform_out.other;
+				if (q->call && q->succ[1] == i)
+					in.rf = in.other = 0;
+			}
+			if (in.rf == b->uniform_in.rf &&
+			    in.other == b->uniform_in.other)
+				continue;
+			b->uniform_in = in;
+			b->uniform_out = in;
+			uniform_scan(df, b->start, b->end, &b->uniform_out);
+			changed = 1;
+		}
+	} while (changed);
+}
+
+// The regs and the flags that are the same in all the lanes, as the
+// instr at ix issues.
+static
+void uniform_before(const struct dataflow *df, int ix, struct reg_use *u)
+{
+	const struct block *b;
+
+	b = &df->blocks[df->block_of[ix]];
+	*u = b->uniform_in;
+	uniform_scan(df, b->start, ix, u);
+}
+
+// Dead code elimination, for --dce. The writes that are never read are
+// removed from the ops, the flag updates that are never read, or that
+// repeat the one before, are removed, and so are the blocks that are
+// never entered. The instrs stay, and with them the timing.
+struct dce {
+	int				writes;
+	int				flags;
+	int				instrs;
+};
+
+static
+int is_dead_dst(const struct reg *dst, const struct reg_use *live)
+{
+	struct reg_use u;
+
+	memset(&u, 0, sizeof(u));
+	use_dst(dst, &u);
+	if (u.other & ~DF_OTHER)
+		return 0;
+	return !uses_overlap(&u, live);
+}
+
+// Does the op read a reg whose read has effects, such as uni_rd?
+static
+int reads_io(const struct op *op, int i)
+{
+	struct reg_use u;
+
+	memset(&u, 0, sizeof(u));
+	use_src(&op->src[2 * i], &u);
+	use_src(&op->src[2 * i + 1], &u);
+	return (u.other & USE_IO) || (i && op->src[3].rf == RF_SIMM &&
+				      op->src[3].num >= 48);
+}
+
+static
+int is_same_flags_op(const struct instr *a, const struct instr *b)
+{
+	const struct reg *s, *t;
+	int i, p;
+
+	p = flags_op(a);
+	if (p != flags_op(b) || a->op.code[p] != b->op.code[p] ||
+	    a->op.cc[p] != CC_ALWAYS || b->op.cc[p] != CC_ALWAYS ||
+	    a->pack != OP_PACK_NOP || b->pack != OP_PACK_NOP ||
+	    a->unpack != OP_UNPACK_NOP || b->unpack != OP_UNPACK_NOP ||
+	    reads_io(&a->op, p))
+		return 0;
+	for (i = 2 * p; i < 2 * p + 2; ++i) {
+		s = &a->op.src[i];
+		t = &b->op.src[i];
+		if (s->rf != t->rf || s->num != t->num || s->rf == RF_EXPR ||
+		    s->rf == RF_IMM)
+			return 0;
+	}
+	return 1;
+}
+
+// Do the flags already hold what the instr at ix would set? The earlier
+// update must be in the same block, and its srcs unchanged since.
+static
+int is_redundant_sf(struct dataflow *df, int ix)
+{
+	const struct instr *ins, *in;
+	struct reg_use rd, wr, t;
+	int j, k, p;
+
+	ins = df->ins;
+	in = &ins[ix];
+	if (in->sig != OP_SIG_NONE && in->sig != OP_SIG_SIMM)
+		return 0;
+	j = reaching_def(df, ix, DF_FLAGS);
+	if (j < 0 || j > ix || df->block_of[j] != df->block_of[ix] ||
+	    j - 2 < df->blocks[df->block_of[ix]].start ||
+	    !is_same_flags_op(&ins[j], in))
+		return 0;
+
+	p = flags_op(in);
+	memset(&rd, 0, sizeof(rd));
+	use_src(&in->op.src[2 * p], &rd);
+	use_src(&in->op.src[2 * p + 1], &rd);
+	for (k = j - 2; k < ix; ++k) {
+		reg_uses(&ins[k], &t, &wr);
+		// Before j, the writes that j does not see yet.
+		if (k < j) {
+			wr.rf = k == j - 1 ? wr.rf : 0;
+			wr.other &= USE_ACC(4);
+		}
+		if (uses_overlap(&rd, &wr))
+			return 0;
+	}
+	return 1;
+}
+
+static
+void dce_li(struct instr *in, const struct reg_use *live, struct dce *s)
+{
+	struct op *op;
+	int i;
+
+	op = &in->op;
+	if (op->code[0] != OP_IMM_LI && op->code[0] != OP_IMM_LIS &&
+	    op->code[0] != OP_IMM_LIU)
+		return;
+	for (i = 0; i < 2; ++i) {
+		if (op->cc[i] == CC_NEVER || op->dst[i].num == 39 ||
+		    !is_dead_dst(&op->dst[i], live))
+			continue;
+		op->cc[i] = CC_NEVER;
+		op->dst[i].rf = RF_AB;
+		op->dst[i].num = 39;
+		++s->writes;
+	}
+	for (i = 0; i < 2; ++i) {
+		if (op->cc[i] != CC_NEVER && op->dst[i].num != 39)
+			return;
+	}
+	if (!in->sf)
+		parse_nop(in);
+}
+
+// Removes the dead writes of the instr at ix; live is after it.
+static
+void dce_instr(struct dataflow *df, int ix, const struct reg_use *live,
+	       struct dce *s)
+{
+	struct instr *in;
+	struct op *op;
+	int i, p;
+
+	in = &df->ins[ix];
+	op = &in->op;
+	if (in->sig == OP_SIG_BR || in->pack != OP_PACK_NOP ||
+	    in->unpack != OP_UNPACK_NOP)
+		return;
+	if (in->sf &&
+	    (!(live->other & USE_FLAGS) || is_redundant_sf(df, ix))) {
+		in->sf = 0;
+		++s->flags;
+	}
+	if (in->sig == OP_SIG_LI) {
+		dce_li(in, live, s);
+		return;
+	}
+
+	p = flags_op(in);
+	for (i = 0; i < 2; ++i) {
+		if (op->code[i] == OP_NOP)
+			continue;
+		if (op->cc[i] != CC_NEVER && !is_dead_dst(&op->dst[i], live))
+			continue;
+		if (in->sf && i == p) {
+			// The flags are still set.
+			if (op->dst[i].num == 39)
+				continue;
+			op->dst[i].rf = RF_AB;
+			op->dst[i].num = 39;
+		} else if (!reads_io(op, i)) {
+			op->code[i] = OP_NOP;
+			op->cc[i] = CC_NEVER;
+			op->dst[i].rf = RF_AB;
+			op->dst[i].num = 39;
+			op->src[2 * i].rf = op->src[2 * i + 1].rf = RF_ACC;
+			op->src[2 * i].num = op->src[2 * i + 1].num = 0;
+		} else {
+			continue;
+		}
+		++s->writes;
+	}
+	if (in->sig == OP_SIG_SIMM && op->src[0].rf != RF_SIMM &&
+	    op->src[1].rf != RF_SIMM && op->src[2].rf != RF_SIMM &&
+	    op->src[3].rf != RF_SIMM)
+		in->sig = OP_SIG_NONE;
+}
+
+static
+void remove_unreachable(struct program *prog, const struct dataflow *df,
+			struct dce *s)
+{
+	const struct block *b;
+	struct instr *ins;
+	int i, k;
+
+	ins = prog->instrs;
+	for (i = 0; i < df->num_blocks; ++i) {
+		b = &df->blocks[i];
+		if (b->reachable)
+			continue;
+		k = b->start;
+		for (; i + 1 < df->num_blocks && !b[1].reachable; ++i)
+			++b;
+		fprintf(stderr, "dce: pc %x-%x is unreachable\n", ins[k].pc,
+			ins[b->end - 1].pc);
+	}
+
+	k = 0;
+	for (i = 0; i < prog->num_instrs; ++i) {
+		if (df->blocks[df->block_of[i]].reachable) {
+			ins[k] = ins[i];
+			ins[k].pc = k * 8;
+			++k;
+			continue;
+		}
+		free(ins[i].labels);
+		++s->instrs;
+	}
+	memset(&ins[k], 0, sizeof(*ins));
+	prog->num_instrs = k;
+}
+
+static inline
+int eliminate_dead_code(struct program *prog)
+{
+	struct dataflow df;
+	struct reg_use live, rd, kill;
+	const struct block *b;
+	struct dce s;
+	int i, j, err, last;
+
+	memset(&s, 0, sizeof(s));
+	err = index_labels(prog->instrs, prog->num_instrs);
+	if (err)
+		return err;
+	err = build_dataflow(&df, prog->instrs, prog->num_instrs);
+	if (err)
+		return err;
+	for (i = 0; i < df.num_blocks && df.blocks[i].reachable; ++i)
+		;
+	if (i < df.num_blocks) {
+		remove_unreachable(prog, &df, &s);
+		free_dataflow(&df);
+		err = index_labels(prog->instrs, prog->num_instrs);
+		if (err)
+			return err;
+		err = build_dataflow(&df, prog->instrs, prog->num_instrs);
+		if (err)
+			return err;
+	}
+
+	// A removed read may make more writes dead.
+	do {
+		last = s.writes + s.flags;
+		for (i = 0; i < df.num_blocks; ++i) {
+			b = &df.blocks[i];
+			live = b->live_out;
+			for (j = b->end - 1; j >= b->start; --j) {
+				dce_instr(&df, j, &live, &s);
+				df_transfer(&df, j, &rd, &kill);
+				live.rf = rd.rf | (live.rf & ~kill.rf);
+				live.other = rd.other |
+					(live.other & ~kill.other);
+			}
+		}
+		solve_liveness(&df);
+	} while (last != s.writes + s.flags);
+
+	fprintf(stderr, "dce: %d writes, %d flag updates, %d unreachable "
+		"instrs removed\n", s.writes, s.flags, s.instrs);
+	free_dataflow(&df);
+	return ESUCC;
+}
+
+// If-conversion, for --if-convert. A conditional branch forward around a
+// few instrs is replaced by those instrs, with their writes made to hold
+// in the lanes where the branch would not have been taken. That is the
+// same only if the flags are the same in all the lanes. The branch issues
+// 4 instrs if taken and 4 more than those it skips if not; without more
+// to go by, each is taken to be as likely. The converted code issues
+// the instrs it kept from the delay slots, and the instrs that it skipped.
+#define IFCONV_MAX			8	// Skipped instrs.
+
+static
+int is_nop_instr(const struct instr *in)
+{
+	return in->sig == OP_SIG_NONE && !in->sf &&
+		in->op.code[0] == OP_NOP && in->op.code[1] == OP_NOP;
+}
+
+// Can the writes of the instr be made conditional?
+static
+int can_predicate(const struct instr *in)
+{
+	const struct op *op;
+	struct reg_use d;
+	int i;
+
+	op = &in->op;
+	if (in->sig == OP_SIG_LI && op->code[0] != OP_IMM_LI &&
+	    op->code[0] != OP_IMM_LIS && op->code[0] != OP_IMM_LIU)
+		return 0;
+	if ((in->sig != OP_SIG_NONE && in->sig != OP_SIG_SIMM &&
+	     in->sig != OP_SIG_LI) || in->sf || in->pack != OP_PACK_NOP ||
+	    in->unpack != OP_UNPACK_NOP)
+		return 0;
+	for (i = 0; i < 2; ++i) {
+		if ((in->sig != OP_SIG_LI && op->code[i] == OP_NOP) ||
+		    op->cc[i] == CC_NEVER)
+			continue;
+		memset(&d, 0, sizeof(d));
+		use_dst(&op->dst[i], &d);
+		if (op->cc[i] != CC_ALWAYS || (d.other & ~DF_OTHER) ||
+		    (in->sig != OP_SIG_LI && reads_io(op, i)))
+			return 0;
+	}
+	return 1;
+}
+
+// Why the branch at br, to t, can not be converted, or NULL.
+static
+const char *plan_if_convert(const struct dataflow *df, int br, int t)
+{
+	const struct instr *in;
+	struct reg_use u;
+	int i, k, kept;
+
+	kept = 0;
+	for (i = br + 1; i < t; ++i) {
+		in = &df->ins[i];
+		if (in->num_labels)
+			return "a label in the skipped instrs";
+		if (delay_slots(in))
+			return "a branch in the skipped instrs";
+		if (in->sf)
+			return "the flags are set in the skipped instrs";
+		if (i <= br + 3)
+			kept += !is_nop_instr(in);
+		else if (!can_predicate(in))
+			return "an instr that can not be made conditional";
+	}
+	uniform_before(df, br, &u);
+	if (!(u.other & USE_FLAGS))
+		return "the flags may differ between the lanes";
+
+	// In halves of an instr.
+	k = t - br - 4;
+	if (2 * (kept + k) >= 2 * 4 + k)
+		return "not cheaper";
+	return NULL;
+}
+
+// Must the instr wait for those already in out[]?
+static
+int must_wait(const struct instr *out, int num, const struct instr *in)
+{
+	struct reg_use rd, wr;
+	int i;
+
+	if (num && is_rf_hazard(&out[num - 1], in))
+		return 1;
+	reg_uses(in, &rd, &wr);
+	if (!(rd.other & USE_ACC(4)))
+		return 0;
+	// The SFU writes r4 two instrs later.
+	for (i = num - 1; i >= 0 && i >= num - 2; --i) {
+		reg_uses(&out[i], &rd, &wr);
+		if ((wr.other & USE_ACC(4)) && (wr.other & USE_IO))
+			return 1;
+	}
+	return 0;
+}
+
+// Appends the instr; if the one before it has moved, after the nops that
+// it must wait for.
+static
+void append_moved(struct instr *out, int *num, const struct instr *in)
+{
+	struct instr *nop;
+
+	while (must_wait(out, *num, in)) {
+		nop = &out[(*num)++];
+		memset(nop, 0, sizeof(*nop));
+		parse_nop(nop);
+		nop->buf = in->buf;
+		nop->inserted = 1;
+	}
+	out[(*num)++] = *in;
+}
+
+static inline
+int if_convert_program(struct program *prog)
+{
+	struct dataflow df;
+	struct instr *ins, *out, *in;
+	const char *why;
+	char *conv;
+	int n, i, j, t, num, first, last, err, count, num_br;
+	enum cc cc;
+
+	ins = prog->instrs;
+	n = prog->num_instrs;
+	err = index_labels(ins, n);
+	if (err)
+		return err;
+	err = build_dataflow(&df, ins, n);
+	if (err)
+		return err;
+	solve_uniformity(&df);
+
+	// Each instr may need up to 2 nops ahead of it, once moved.
+	conv = calloc(n + 1, 1);
+	out = malloc((3 * n + 1 + 4) * sizeof(*out));
+	stat_add(STAT_ALLOCS, 2);
+	if (conv == NULL || out == NULL) {
+		free(conv);
+		free(out);
+		free_dataflow(&df);
+		return -ENOMEM;
+	}
+
+	count = num_br = 0;
+	last = -1;
+	for (i = 0; i < n; ++i) {
+		in = &ins[i];
+		if (i <= last || in->sig != OP_SIG_BR ||
+		    in->op.src_label.str == NULL ||
+		    in->op.code[0] == OP_BR_BL || in->op.cc[0] == CC_ALWAYS)
+			continue;
+		t = find_label(ins, &in->op.src_label);
+		if (t < i + 5 || t > i + 4 + IFCONV_MAX)
+			continue;
+		++num_br;
+		why = plan_if_convert(&df, i, t);
+		if (why) {
+			fprintf(stderr, "ifconv: branch at pc %x: %s\n",
+				in->pc, why);
+			continue;
+		}
+		fprintf(stderr, "ifconv: branch at pc %x: %d instrs made "
+			"conditional\n", in->pc, t - i - 4);
+		conv[i] = 1;
+		last = t - 1;
+		++count;
+	}
+
+	num = 0;
+	for (i = 0; i < n; ++i) {
+		if (!conv[i]) {
+			out[num++] = ins[i];
+			continue;
+		}
+
+		// The labels of the branch go to the first instr in its
+		// place.
+		first = num;
+		cc = lane_cond_br(ins[i].op.cc[0]);
+		t = i + 4;
+		for (j = i + 1; j < t; ++j) {
+			if (!is_nop_instr(&ins[j]))
+				append_moved(out, &num, &ins[j]);
+		}
+		for (t = find_label(ins, &ins[i].op.src_label); j < t; ++j) {
+			in = &ins[j];
+			if (in->op.cc[0] != CC_NEVER)
+				in->op.cc[0] = cc;
+			if (in->op.cc[1] != CC_NEVER)
+				in->op.cc[1] = cc;
+			if (in->op.cc[0] != CC_NEVER ||
+			    in->op.cc[1] != CC_NEVER)
+				in->converted = 1;
+			append_moved(out, &num, in);
+		}
+		out[first].labels = ins[i].labels;
+		out[first].num_labels = ins[i].num_labels;
+		i = t - 1;
+	}
+	for (i = 0; i < num; ++i)
+		out[i].pc = i * 8;
+
+	fprintf(stderr, "ifconv: %d of %d short branches converted\n", count,
+		num_br);
+	free(ins);
+	prog->instrs = out;
+	prog->num_instrs = num;
+	prog->max_instrs = 3 * n + 1 + 4;
+	free(conv);
+	free_dataflow(&df);
+	return ESUCC;
+}
+
+// Value numbering, for --cse. The values that the ALU ops and the li
+// compute are numbered, so that two ops with the same number compute the
+// same. A value built only from constants, li, ele_num and qpu_num is the
+// same wherever it is computed; one that reads any other reg is only
+// compared with the ops after it in its block. An op whose value an
+// earlier op left in a reg is dropped, and the reads of its dst read that
+// reg instead. If the earlier value is no longer held, it may be copied to
+// a reg that the program does not use, into a free slot of an instr just
+// after it; that keeps it live instead of recomputing it. A copy is only
+// made while each regfile has more than VN_RESERVE regs to spare, and if
+// it saves more ops than it adds. The instrs emptied are then removed.
+#define VN_PASSES			4	// Depth of the values.
+#define VN_CANDIDATES			8	// Earlier ops tried.
+#define VN_RESERVE			2	// Spare regs, per regfile.
+
+// The leaves of the values; the other values are op codes.
+#define VN_SIMM				-1
+#define VN_IMM				-2
+#define VN_EXPR				-3
+#define VN_FIXED			-4	// ele_num or qpu_num.
+#define VN_DEF				-5	// A reg, and its def.
+
+struct vn {
+	int				code;
+	int				a;
+	int				b;
+	struct token			expr;
+	char				inv;	// The same everywhere.
+};
+
+struct vn_comp {
+	int				ix;
+	int				slot;
+	int				val;
+	int				def[2];		// Of the srcs.
+	int				copy;		// A reg, or -1.
+	int				copy_def;
+};
+
+struct cse {
+	struct dataflow			df;
+	struct vn			*vals;
+	int				num_vals;
+	int				max_vals;
+	int				*hash;		// 2 * max_vals.
+	struct vn_comp			*comps;
+	int				num_comps;
+	int				*comp_of;	// By 2 * ix + slot.
+	uint64_t			used;		// Regfile regs.
+	int				err;
+	int				ops;
+	int				lis;
+	int				kept;
+	int				instrs;
+};
+
+static
+void free_cse(struct cse *s)
+{
+	free_dataflow(&s->df);
+	free(s->vals);
+	free(s->hash);
+	free(s->comps);
+	free(s->comp_of);
+}
+
+// The reg of a src or a dst, as the dataflow numbers them, or -1. r4 and
+// r5 are not taken.
+static
+int vn_src_reg(const struct reg *r)
+{
+	if ((r->rf == RF_A || r->rf == RF_B) && r->num < 32)
+		return r->num + 32 * (r->rf == RF_B);
+	if (r->rf == RF_ACC && r->num < 4)
+		return DF_ACC(r->num);
+	return -1;
+}
+
+static
+int vn_dst_reg(const struct reg *r)
+{
+	if (r->num < 32)
+		return r->num + 32 * (r->rf == RF_B);
+	if (r->num < 36)
+		return DF_ACC(r->num - 32);
+	return -1;
+}
+
+static
+void vn_to_src(int r, struct reg *out)
+{
+	memset(out, 0, sizeof(*out));
+	out->rf = r >= 64 ? RF_ACC : r >= 32 ? RF_B : RF_A;
+	out->num = r >= 64 ? r - 64 : r % 32;
+}
+
+static
+void vn_to_dst(int r, struct reg *out)
+{
+	struct reg t;
+
+	vn_to_src(r, &t);
+	scratch_to_dst(&t, out);
+}
+
+static
+enum op_code vn_code(enum op_code code)
+{
+	if (is_simm_op(code))
+		return code - OP_ADD_FADDI + OP_ADD_FADD;
+	return code;
+}
+
+// Does the op give its src, when both srcs are the same?
+static
+int is_move(enum op_code code)
+{
+	return code == OP_ADD_OR || code == OP_ADD_AND ||
+		code == OP_ADD_MIN || code == OP_ADD_MAX ||
+		code == OP_MUL_V8MIN || code == OP_MUL_V8MAX;
+}
+
+static
+uint32_t vn_hash(const struct vn *v)
+{
+	uint32_t h;
+
+	h = hash_token(&v->expr);
+	h = (h ^ v->code) * 16777619u;
+	h = (h ^ v->a) * 16777619u;
+	return (h ^ v->b) * 16777619u;
+}
+
+static
+int vn_grow(struct cse *s)
+{
+	struct vn *vals;
+	uint32_t h, mask;
+	int i, max;
+
+	max = s->max_vals ? 2 * s->max_vals : 1024;
+	vals = realloc(s->vals, max * sizeof(*vals));
+	stat_add(STAT_ALLOCS, 1);
+	if (vals == NULL)
+		return -ENOMEM;
+	s->vals = vals;
+	free(s->hash);
+	s->hash = malloc(2 * max * sizeof(*s->hash));
+	stat_add(STAT_ALLOCS, 1);
+	if (s->hash == NULL)
+		return -ENOMEM;
+	s->max_vals = max;
+	memset(s->hash, -1, 2 * max * sizeof(*s->hash));
+
+	mask = 2 * max - 1;
+	for (i = 0; i < s->num_vals; ++i) {
+		for (h = vn_hash(&vals[i]) & mask; s->hash[h] >= 0;
+		     h = (h + 1) & mask)
+			;
+		s->hash[h] = i;
+	}
+	return ESUCC;
+}
+
+// The number of the value, or -1, with s->err set, if out of memory.
+static
+int vn_intern(struct cse *s, const struct vn *v)
+{
+	const struct vn *t;
+	uint32_t h, mask;
+	int id;
+
+	if (s->num_vals == s->max_vals) {
+		s->err = vn_grow(s);
+		if (s->err)
+			return -1;
+	}
+	mask = 2 * s->max_vals - 1;
+	for (h = vn_hash(v) & mask; (id = s->hash[h]) >= 0;
+	     h = (h + 1) & mask) {
+		t = &s->vals[id];
+		if (t->code == v->code && t->a == v->a && t->b == v->b &&
+		    (t->code != VN_EXPR || token_eq(&t->expr, &v->expr)))
+			return id;
+	}
+	s->vals[s->num_vals] = *v;
+	s->hash[h] = s->num_vals;
+	return s->num_vals++;
+}
+
+// The comp of the instr at d that writes reg r, or -1.
+static
+int vn_def_comp(const struct cse *s, int d, int r)
+{
+	const struct instr *in;
+	int i, c;
+
+	in = &s->df.ins[d];
+	for (i = 0; i < 2; ++i) {
+		c = s->comp_of[2 * d + i];
+		if (c < 0)
+			continue;
+		if (vn_dst_reg(&in->op.dst[i]) == r ||
+		    (in->sig == OP_SIG_LI && vn_dst_reg(&in->op.dst[1]) == r))
+			return c;
+	}
+	return -1;
+}
+
+// The value of the src; d is the def of its reg, if it reads one.
+static
+int vn_src(struct cse *s, const struct reg *r, int d)
+{
+	struct vn v;
+	int c, reg;
+
+	memset(&v, 0, sizeof(v));
+	v.inv = 1;
+	if (r->rf == RF_SIMM && r->num < 48) {
+		v.code = VN_SIMM;
+		v.a = r->num;
+	} else if ((r->rf == RF_A || r->rf == RF_B) && r->num == 38) {
+		v.code = VN_FIXED;
+		v.a = r->rf;
 	} else {
-		// Jump to label.
-		val |= bits_on(ENC_BR_REL);
-		in->lo = op->src[0].num;
+		reg = vn_src_reg(r);
+		if (reg < 0 || d < 0)
+			return -1;
+		c = vn_def_comp(s, d, reg);
+		if (c >= 0 && s->comps[c].val >= 0 &&
+		    s->vals[s->comps[c].val].inv)
+			return s->comps[c].val;
+		v.code = VN_DEF;
+		v.a = reg;
+		v.b = d;
+		v.inv = 0;
+	}
+	return vn_intern(s, &v);
+}
+
+static
+int vn_value(struct cse *s, const struct vn_comp *c)
+{
+	const struct instr *in;
+	const struct reg *src;
+	struct vn v;
+	int a, b, t;
+
+	in = &s->df.ins[c->ix];
+	memset(&v, 0, sizeof(v));
+	v.inv = 1;
+	if (in->sig == OP_SIG_LI) {
+		src = &in->op.src[0];
+		v.code = src->rf == RF_EXPR ? VN_EXPR : VN_IMM;
+		if (src->rf == RF_EXPR)
+			v.expr = src->expr;
+		else
+			v.a = src->num;
+		a = vn_intern(s, &v);
+		if (a < 0)
+			return -1;
+		memset(&v.expr, 0, sizeof(v.expr));
+		v.code = in->op.code[0];
+		v.a = a;
+		return vn_intern(s, &v);
+	}
+
+	a = vn_src(s, &in->op.src[2 * c->slot], c->def[0]);
+	b = vn_src(s, &in->op.src[2 * c->slot + 1], c->def[1]);
+	if (a < 0 || b < 0)
+		return -1;
+	v.code = vn_code(in->op.code[c->slot]);
+	if (a == b && is_move(v.code))
+		return a;
+	if (b < a && is_commutative(v.code)) {
+		t = a;
+		a = b;
+		b = t;
+	}
+	v.a = a;
+	v.b = b;
+	v.inv = s->vals[a].inv && s->vals[b].inv;
+	return vn_intern(s, &v);
+}
+
+// Can the op in slot i of the instr be numbered, and dropped?
+static
+int is_vn_op(const struct instr *in, int i)
+{
+	const struct op *op;
+	enum op_code code;
+	int j, num;
+
+	op = &in->op;
+	if (in->sf || in->pack != OP_PACK_NOP || in->unpack != OP_UNPACK_NOP)
+		return 0;
+	if (in->sig == OP_SIG_LI) {
+		code = op->code[0];
+		if (i || (code != OP_IMM_LI && code != OP_IMM_LIS &&
+			  code != OP_IMM_LIU) ||
+		    (op->src[0].rf != RF_IMM && op->src[0].rf != RF_EXPR))
+			return 0;
+		num = 0;
+		for (j = 0; j < 2; ++j) {
+			if (op->cc[j] == CC_NEVER || op->dst[j].num == 39)
+				continue;
+			if (op->cc[j] != CC_ALWAYS ||
+			    vn_dst_reg(&op->dst[j]) < 0)
+				return 0;
+			++num;
+		}
+		return num > 0;
+	}
+	if (in->sig != OP_SIG_NONE && in->sig != OP_SIG_SIMM)
+		return 0;
+	code = op->code[i];
+	return code != OP_NOP && op->cc[i] == CC_ALWAYS &&
+		!(code >= OP_MUL_V8ADDS_ROTR5 && code <= OP_MUL_V8ADDS_ROT15) &&
+		!reads_io(op, i) && vn_dst_reg(&op->dst[i]) >= 0;
+}
+
+// Finds the reaching defs of the srcs of the comps, a block at a time.
+static
+void vn_find_defs(struct cse *s)
+{
+	struct dataflow *df;
+	const struct block *b;
+	const struct instr *in;
+	struct vn_comp *c;
+	struct reg_use rd, wr;
+	int last[DF_FLAGS + 1];
+	int i, j, k, r, w, x;
+
+	df = &s->df;
+	for (i = 0; i < df->num_blocks; ++i) {
+		b = &df->blocks[i];
+		for (r = 0; r <= DF_FLAGS; ++r)
+			last[r] = -1;
+		for (j = b->start; j < b->end; ++j) {
+			in = &df->ins[j];
+			for (k = 0; k < 2 && in->sig != OP_SIG_LI; ++k) {
+				if (s->comp_of[2 * j + k] < 0)
+					continue;
+				c = &s->comps[s->comp_of[2 * j + k]];
+				for (x = 0; x < 2; ++x) {
+					r = vn_src_reg(&in->op.src[2 * k + x]);
+					w = r < 0 ? -1 : last[r];
+					if (r < 0)
+						c->def[x] = -1;
+					else if (w < 0)
+						c->def[x] = entry_def(df, i, r);
+					else if (df_writes(&df->ins[w], r,
+							   w == j - 1) == 1)
+						c->def[x] = w;
+					else
+						c->def[x] = -1;
+				}
+			}
+			reg_uses(in, &rd, &wr);
+			for (r = 0; r < 64; ++r) {
+				if (wr.rf & (1ull << r))
+					last[r] = j;
+			}
+			for (r = 64; r <= DF_FLAGS; ++r) {
+				if (wr.other & (1u << (r - 64)))
+					last[r] = j;
+			}
+		}
+	}
+}
+
+// Does reg r hold, at ix, what the instr at d wrote?
+static
+int vn_holds(struct dataflow *df, int ix, int r, int d)
+{
+	if (d < ix && df->block_of[d] == df->block_of[ix])
+		return df_last_def(df, d, ix, r) == d;
+	return reaching_def(df, ix, r) == d;
+}
+
+static
+int vn_reads(const struct instr *in, int r)
+{
+	struct reg_use rd, wr;
+
+	reg_uses(in, &rd, &wr);
+	if (r < 64)
+		return (rd.rf >> r) & 1;
+	return (rd.other >> (r - 64)) & 1;
+}
+
+static
+int vn_rotates(const struct instr *in)
+{
+	int i;
+
+	if (in->op.code[1] >= OP_MUL_V8ADDS_ROTR5 &&
+	    in->op.code[1] <= OP_MUL_V8ADDS_ROT15)
+		return 1;
+	for (i = 0; i < 4 && in->sig == OP_SIG_SIMM; ++i) {
+		if (in->op.src[i].rf == RF_SIMM && in->op.src[i].num >= 48)
+			return 1;
+	}
+	return 0;
+}
+
+// Can the instr read its srcs?
+static
+int vn_ports_ok(const struct instr *in)
+{
+	const struct reg *r;
+	enum op_code code;
+	int i;
+
+	code = in->op.code[1];
+	if (code >= OP_MUL_V8ADDS_ROTR5 && code <= OP_MUL_V8ADDS_ROT15) {
+		for (i = 2; i < 4; ++i) {
+			r = &in->op.src[i];
+			if (r->rf != RF_ACC || r->num > 3)
+				return 0;
+		}
+	}
+	return can_read_srcs(&in->op, in->sig == OP_SIG_SIMM ||
+			     vn_rotates(in));
+}
+
+// Can the write of the instr at ix to reg r go, with its reads made to
+// read reg h, which holds the same since the instr at d? Those reads are
+// changed if apply. Returns 0 if not, else 1 + the number of reads.
+static
+int vn_replace(struct cse *s, int ix, int r, int h, int d, char apply)
+{
+	struct dataflow *df;
+	const struct block *b;
+	struct instr *in, t;
+	struct reg src;
+	int m, w, i, seen, live, num;
+
+	df = &s->df;
+	if (r == h)
+		return 1;
+	b = &df->blocks[df->block_of[ix]];
+	vn_to_src(h, &src);
+	w = -1;
+	num = 1;
+	for (m = ix + 1; m < b->end; ++m) {
+		in = &df->ins[m];
+		// 0 if m does not see the write yet, 2 if in part.
+		seen = r >= 64 || m > ix + 1;
+		if (w >= 0 && df_writes(&df->ins[w], r, w == m - 1) == 1)
+			return num;
+		if (w >= 0)
+			seen = 2;
+		if (seen && vn_reads(in, r)) {
+			if (seen == 2 || in->sig == OP_SIG_BR ||
+			    in->unpack != OP_UNPACK_NOP ||
+			    !vn_holds(df, m, h, d))
+				return 0;
+			t = *in;
+			for (i = 0; i < 4; ++i) {
+				if (t.op.code[i / 2] != OP_NOP &&
+				    vn_src_reg(&t.op.src[i]) == r)
+					t.op.src[i] = src;
+			}
+			if (!vn_ports_ok(&t))
+				return 0;
+			if (apply) {
+				*in = t;
+				in->rewritten = 1;
+			}
+			++num;
+		}
+		if (df_writes(in, r, 0))
+			w = m;
+	}
+
+	// The write may still be seen past the block.
+	if (w >= 0 && df_writes(&df->ins[w], r, w == b->end - 1) == 1)
+		return num;
+	if (r < 64)
+		live = (b->live_out.rf >> r) & 1;
+	else
+		live = (b->live_out.other >> (r - 64)) & 1;
+	return live ? 0 : num;
+}
+
+// Drops the write of the comp to reg r.
+static
+void vn_drop(struct instr *in, int slot, int r)
+{
+	struct op *op;
+	int i;
+
+	op = &in->op;
+	in->rewritten = 1;
+	if (in->sig == OP_SIG_LI) {
+		for (i = 0; i < 2; ++i) {
+			if (op->cc[i] == CC_NEVER ||
+			    vn_dst_reg(&op->dst[i]) != r)
+				continue;
+			op->cc[i] = CC_NEVER;
+			op->dst[i].rf = RF_AB;
+			op->dst[i].num = 39;
+		}
+		for (i = 0; i < 2; ++i) {
+			if (op->cc[i] != CC_NEVER && op->dst[i].num != 39)
+				return;
+		}
+		parse_nop(in);
+		return;
+	}
+
+	op->code[slot] = OP_NOP;
+	op->cc[slot] = CC_NEVER;
+	op->dst[slot].rf = RF_AB;
+	op->dst[slot].num = 39;
+	op->src[2 * slot].rf = op->src[2 * slot + 1].rf = RF_ACC;
+	op->src[2 * slot].num = op->src[2 * slot + 1].num = 0;
+	if (in->sig == OP_SIG_SIMM && op->src[0].rf != RF_SIMM &&
+	    op->src[1].rf != RF_SIMM && op->src[2].rf != RF_SIMM &&
+	    op->src[3].rf != RF_SIMM)
+		in->sig = OP_SIG_NONE;
+}
+
+// The regs that the comp writes.
+static
+int vn_dsts(const struct cse *s, const struct vn_comp *c, int *r)
+{
+	const struct op *op;
+	int i, num;
+
+	op = &s->df.ins[c->ix].op;
+	if (s->df.ins[c->ix].sig != OP_SIG_LI) {
+		r[0] = vn_dst_reg(&op->dst[c->slot]);
+		return 1;
+	}
+	num = 0;
+	for (i = 0; i < 2; ++i) {
+		if (op->cc[i] != CC_NEVER && op->dst[i].num != 39)
+			r[num++] = vn_dst_reg(&op->dst[i]);
+	}
+	return num;
+}
+
+// Drops the comp k, whose value reg h holds since the instr at d. Returns
+// 0 if it can not, else 1 + the number of reads made to read h.
+static
+int vn_drop_via(struct cse *s, const struct vn_comp *k, int h, int d,
+		char apply)
+{
+	struct instr *in;
+	int r[2], i, n, num, res, is_li;
+
+	// Else, d may have written another value.
+	if (!s->vals[k->val].inv && d >= k->ix)
+		return 0;
+	if (!vn_holds(&s->df, k->ix, h, d))
+		return 0;
+	num = vn_dsts(s, k, r);
+	res = 1;
+	for (i = 0; i < num; ++i) {
+		n = vn_replace(s, k->ix, r[i], h, d, 0);
+		if (!n)
+			return 0;
+		res += n - 1;
+	}
+	if (!apply)
+		return res;
+
+	in = &s->df.ins[k->ix];
+	is_li = in->sig == OP_SIG_LI;
+	for (i = 0; i < num; ++i) {
+		// The reads of the first dst may now be on the ports.
+		if (!vn_replace(s, k->ix, r[i], h, d, 0))
+			continue;
+		vn_replace(s, k->ix, r[i], h, d, 1);
+		vn_drop(in, k->slot, r[i]);
+	}
+	if (!is_li)
+		++s->ops;
+	else if (in->sig != OP_SIG_LI)
+		++s->lis;
+	return res;
+}
+
+// A value that reads a reg is only the same later in the block.
+static
+int vn_related(const struct cse *s, const struct vn_comp *j,
+	       const struct vn_comp *k)
+{
+	return s->vals[k->val].inv || (j->ix < k->ix &&
+				       s->df.block_of[j->ix] ==
+				       s->df.block_of[k->ix]);
+}
+
+// Drops the comp k, if a reg still holds the value of the comp j.
+static
+int vn_drop_from(struct cse *s, const struct vn_comp *j,
+		 const struct vn_comp *k)
+{
+	int h[2], i, num;
+
+	if (!vn_related(s, j, k))
+		return 0;
+	num = vn_dsts(s, j, h);
+	for (i = 0; i < num; ++i) {
+		if (h[i] >= 0 && vn_drop_via(s, k, h[i], j->ix, 1))
+			return 1;
+	}
+	return j->copy >= 0 && vn_drop_via(s, k, j->copy, j->copy_def, 1);
+}
+
+// Drops the comp t, if an earlier comp of its group, from g0, is held.
+static
+int vn_drop_comp(struct cse *s, int g0, int t, int keep)
+{
+	int u;
+
+	for (u = t - 1; u >= g0 && u >= t - VN_CANDIDATES; --u) {
+		if (vn_drop_from(s, &s->comps[u], &s->comps[t]))
+			return 1;
+	}
+	return keep >= 0 && keep < t - VN_CANDIDATES &&
+		vn_drop_from(s, &s->comps[keep], &s->comps[t]);
+}
+
+// The number of regs of the file (1 for B) that no instr uses. Only the
+// regs that a thread may use are counted, so that the program may still
+// be threaded.
+static
+int vn_free(const struct cse *s, int file)
+{
+	int i, num;
+
+	num = 0;
+	for (i = 0; i < THREAD_REGS; ++i)
+		num += !(s->used & (1ull << (i + 32 * file)));
+	return num;
+}
+
+// A reg of the file for a copy, or -1 if the file is short of regs.
+static
+int vn_spare(const struct cse *s, int file)
+{
+	int i;
+
+	if (file < 0 || vn_free(s, file) <= VN_RESERVE)
+		return -1;
+	for (i = THREAD_REGS - 1; s->used & (1ull << (i + 32 * file)); --i)
+		;
+	return i + 32 * file;
+}
+
+// The regfile of a copy written along with the dst, or -1.
+static
+int vn_file(const struct cse *s, const struct reg *dst)
+{
+	if (dst && dst->num < 32)
+		return dst->rf == RF_A ? 1 : dst->rf == RF_B ? 0 : -1;
+	if (dst && dst->num >= 36 && dst->num != 39)
+		return -1;
+	return vn_free(s, 1) > vn_free(s, 0);
+}
+
+// Moves reg x to a spare reg, in a free slot of the instr. Returns the
+// reg, or -1.
+static
+int vn_fill_slot(const struct cse *s, struct instr *in, int x)
+{
+	const struct reg *dst;
+	struct instr t;
+	int e, r;
+
+	if ((in->sig != OP_SIG_NONE && in->sig != OP_SIG_SIMM) || in->sf ||
+	    in->pack != OP_PACK_NOP || in->unpack != OP_UNPACK_NOP)
+		return -1;
+	for (e = 0; e < 2; ++e) {
+		if (in->op.code[e] != OP_NOP || (e && vn_rotates(in)))
+			continue;
+		dst = in->op.code[1 - e] == OP_NOP ? NULL : &in->op.dst[1 - e];
+		r = vn_spare(s, vn_file(s, dst));
+		if (r < 0)
+			continue;
+		t = *in;
+		t.op.code[e] = e ? OP_MUL_V8MIN : OP_ADD_OR;
+		t.op.cc[e] = CC_ALWAYS;
+		vn_to_dst(r, &t.op.dst[e]);
+		vn_to_src(x, &t.op.src[2 * e]);
+		t.op.src[2 * e + 1] = t.op.src[2 * e];
+		if (!vn_ports_ok(&t))
+			continue;
+		*in = t;
+		in->rewritten = 1;
+		return r;
+	}
+	return -1;
+}
+
+// Copies the value of the comp j to a spare reg: by the free dst of its
+// li, or by a move in one of the next instrs. Returns the instr changed,
+// or -1.
+static
+int vn_copy(struct cse *s, struct vn_comp *j, struct instr *undo)
+{
+	struct dataflow *df;
+	struct instr *in;
+	int p, e, x, r, end;
+
+	df = &s->df;
+	in = &df->ins[j->ix];
+	if (!is_vn_op(in, j->slot))
+		return -1;
+	r = -1;
+	p = j->ix;
+	if (in->sig == OP_SIG_LI) {
+		for (e = 1; e >= 0; --e) {
+			if (in->op.cc[e] == CC_NEVER || in->op.dst[e].num == 39)
+				break;
+		}
+		if (e >= 0)
+			r = vn_spare(s, vn_file(s, &in->op.dst[1 - e]));
+		if (r >= 0) {
+			*undo = *in;
+			vn_to_dst(r, &in->op.dst[e]);
+			in->op.cc[e] = CC_ALWAYS;
+			in->rewritten = 1;
+		}
+	} else {
+		x = vn_dst_reg(&in->op.dst[j->slot]);
+		end = df->blocks[df->block_of[j->ix]].end;
+		for (p = j->ix + 1; p < end && p <= j->ix + 4 && r < 0; ++p) {
+			if (!vn_holds(df, p, x, j->ix))
+				continue;
+			*undo = df->ins[p];
+			r = vn_fill_slot(s, &df->ins[p], x);
+		}
+		--p;
+	}
+	if (r < 0)
+		return -1;
+	s->used |= 1ull << r;
+	j->copy = r;
+	j->copy_def = p;
+	return p;
+}
+
+// Keeps the value of an earlier comp of the group [g0, g1) in a spare
+// reg, if that drops the comp t, and more ops than the copy adds. Returns
+// the comp kept, or -1.
+static
+int vn_keep(struct cse *s, int g0, int t, int g1)
+{
+	struct instr undo;
+	struct vn_comp *j, *k;
+	int u, v, p, num, need;
+
+	for (u = t - 1; u >= g0 && u >= t - VN_CANDIDATES; --u) {
+		j = &s->comps[u];
+		if (!vn_related(s, j, &s->comps[t]))
+			continue;
+		// The li writes the copy for free.
+		need = s->df.ins[j->ix].sig == OP_SIG_LI ? 1 : 2;
+		p = vn_copy(s, j, &undo);
+		if (p < 0)
+			continue;
+		num = 0;
+		for (v = t; v < g1 && num < need; ++v) {
+			k = &s->comps[v];
+			// Not if no read is made to read the copy.
+			num += vn_related(s, j, k) &&
+				vn_drop_via(s, k, j->copy, j->copy_def, 0) > 1;
+		}
+		if (num >= need) {
+			++s->kept;
+			return u;
+		}
+		s->df.ins[p] = undo;
+		s->used &= ~(1ull << j->copy);
+		j->copy = -1;
+	}
+	return -1;
+}
+
+static
+int cmp_comps(const void *a, const void *b)
+{
+	const struct vn_comp *x, *y;
+
+	x = a;
+	y = b;
+	if (x->val != y->val)
+		return x->val < y->val ? -1 : 1;
+	if (x->ix != y->ix)
+		return x->ix < y->ix ? -1 : 1;
+	return x->slot - y->slot;
+}
+
+// Can an instr go from between out[0, num) and next[0, num_next), without
+// the next instrs having to wait?
+static
+int vn_can_close(const struct instr *out, int num, const struct instr *next,
+		 int num_next)
+{
+	struct instr t[4];
+	int i, k;
+
+	k = 0;
+	for (i = num < 2 ? 0 : num - 2; i < num; ++i)
+		t[k++] = out[i];
+	for (i = 0; i < num_next && i < 2; ++i) {
+		if (must_wait(t, k, &next[i]))
+			return 0;
+		t[k++] = next[i];
+	}
+	return 1;
+}
+
+// Removes the instrs that the pass emptied; not those in delay slots,
+// which would then shift.
+static
+void vn_remove_empty(struct program *prog, const char *empty, struct cse *s)
+{
+	struct instr *ins;
+	int i, k, n, end;
+
+	ins = prog->instrs;
+	n = prog->num_instrs;
+	k = 0;
+	end = -1;
+	for (i = 0; i < n; ++i) {
+		if (!empty[i] && is_nop_instr(&ins[i]) && !ins[i].num_labels &&
+		    i > end && vn_can_close(ins, k, &ins[i + 1], n - i - 1)) {
+			++s->instrs;
+			continue;
+		}
+		if (delay_slots(&ins[i]) && i + delay_slots(&ins[i]) > end)
+			end = i + delay_slots(&ins[i]);
+		ins[k] = ins[i];
+		ins[k].pc = k * 8;
+		++k;
+	}
+	if (k < n)
+		memset(&ins[k], 0, sizeof(*ins));
+	prog->num_instrs = k;
+}
+
+static inline
+int cse_program(struct program *prog)
+{
+	struct cse s;
+	struct vn_comp *c;
+	struct reg_use rd, wr;
+	char *empty;
+	int n, i, j, g, t, keep, err, changed;
+
+	memset(&s, 0, sizeof(s));
+	n = prog->num_instrs;
+	err = index_labels(prog->instrs, n);
+	if (err)
+		return err;
+	err = build_dataflow(&s.df, prog->instrs, n);
+	if (err)
+		return err;
+	s.comps = malloc((2 * n + 1) * sizeof(*s.comps));
+	s.comp_of = malloc((2 * n + 1) * sizeof(*s.comp_of));
+	empty = malloc(n + 1);
+	stat_add(STAT_ALLOCS, 3);
+	err = vn_grow(&s);
+	if (s.comps == NULL || s.comp_of == NULL || empty == NULL || err) {
+		free(empty);
+		free_cse(&s);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < n; ++i) {
+		reg_uses(&prog->instrs[i], &rd, &wr);
+		s.used |= rd.rf | wr.rf;
+		empty[i] = is_nop_instr(&prog->instrs[i]);
+		for (j = 0; j < 2; ++j) {
+			s.comp_of[2 * i + j] = -1;
+			if (!s.df.blocks[s.df.block_of[i]].reachable ||
+			    !is_vn_op(&prog->instrs[i], j))
+				continue;
+			c = &s.comps[s.num_comps];
+			memset(c, 0, sizeof(*c));
+			c->ix = i;
+			c->slot = j;
+			c->val = c->copy = c->def[0] = c->def[1] = -1;
+			s.comp_of[2 * i + j] = s.num_comps++;
+		}
+	}
+	vn_find_defs(&s);
+
+	// A value is the same everywhere once the values of its srcs are.
+	changed = 1;
+	for (g = 0; g < VN_PASSES && changed && !s.err; ++g) {
+		changed = 0;
+		for (i = 0; i < s.num_comps && !s.err; ++i) {
+			t = vn_value(&s, &s.comps[i]);
+			changed |= t != s.comps[i].val;
+			s.comps[i].val = t;
+		}
+	}
+	err = s.err;
+	if (err) {
+		free(empty);
+		free_cse(&s);
+		return err;
 	}
 
-	val |= bits_set(ENC_SIG, esig);
-	val |= bits_set(ENC_BR_COND, ecc);
-	val |= bits_set(ENC_WADDR_ADD, op->dst[0].num);
-	val |= bits_set(ENC_WADDR_MUL, op->dst[1].num);
-	if (in->ws)
-		val |= bits_on(ENC_WS);
-	in->hi = val;
+	qsort(s.comps, s.num_comps, sizeof(*s.comps), cmp_comps);
+	for (g = 0; g < s.num_comps; g = i) {
+		for (i = g + 1; i < s.num_comps &&
+		     s.comps[i].val == s.comps[g].val; ++i)
+			;
+		if (s.comps[g].val < 0)
+			continue;
+		keep = -1;
+		for (t = g + 1; t < i; ++t) {
+			if (vn_drop_comp(&s, g, t, keep) || keep >= 0)
+				continue;
+			keep = vn_keep(&s, g, t, i);
+			if (keep >= 0)
+				vn_drop_comp(&s, g, t, keep);
+		}
+	}
+	vn_remove_empty(prog, empty, &s);
+
+	fprintf(stderr, "cse: %d ALU ops and %d li removed, %d values kept in "
+		"spare regs, %d instrs removed\n", s.ops, s.lis, s.kept,
+		s.instrs);
+	free(empty);
+	free_cse(&s);
 	return ESUCC;
 }
 
+// The encoding, and the source, of an instruction.
 static
-int encode_alu(struct instr *in)
+void out_instr(const struct instr *in)
 {
-	int esig, ecc[2], eop[2], emuxes[4], epack;
-	int raddr_a, raddr_b, val, i;
-	struct op *op;
-	enum op_code code;
+	char note[128];
+	int j;
 
-	op = &in->op;
+	out_hex(in->lo);
+	out_write(", ", 2);
+	out_hex(in->hi);
+	out_write(", // ", 5);
 
-	epack = encode_pack(in->pack);
-	esig = encode_sig(in->sig);
-	ecc[0] = encode_cond(op->cc[0]);
-	ecc[1] = encode_cond(op->cc[1]);
-	eop[0] = encode_alu_op_add(op->code[0]);
-	eop[1] = encode_alu_op_mul(op->code[1]);
+	for (j = 0; j < in->num_labels; ++j) {
+		out_write(in->labels[j].str, in->labels[j].len);
+		out_write(": ", 2);
+	}
 
+	out_write(&in->buf[in->line_start], in->line_end - in->line_start);
+	out_write(note, instr_note(in, note, sizeof(note)));
+	out_write("\n", 1);
+}
 
-	if (esig < 0 || ecc[0] < 0 || ecc[1] < 0 || eop[0] < 0 || eop[1] < 0 ||
-	    epack < 0)
-		return -EINVAL;
+// Streaming, for the input -. A generator can pipe its program in, and the
+// encoding comes out as it goes. Each instruction is parsed once its ;
+// arrives, and printed once no li can be placed ahead of it, and the
+// labels and symbols it refers to are known. The li of a loop stay in it,
+// as the loop is not known until its end. Only a window of the source
+// is kept: the text of the instructions not yet printed, and of the
+// statement still arriving. Labels and symbols are copied out of it.
+// The instructions that wait for a label are kept in a fixup table.
+#define STREAM_CHUNK			4096
+
+struct stream {
+	struct program			prog;
+	char				*text;
+	int				len;
+	int				size;		// Of text[].
+	int				seen;		// Bytes looked at for a ;
+	int				safe;		// Past the last ;
+	char				in_comment;
+	int				settled;	// Instrs that can't move.
+	int				*fixups;	// Into instrs[], ascending.
+	int				num_fixups;
+	int				max_fixups;
+	int				num_names;	// At the last retry.
+};
+
+// Copy the name out of the window; NUL-terminated, for strtof.
+static
+int own_token(struct token *t)
+{
+	char *s;
+
+	s = malloc(t->len + 1);
+	stat_add(STAT_ALLOCS, 1);
+	if (s == NULL)
+		return -ENOMEM;
+	memcpy(s, t->str, t->len);
+	s[t->len] = 0;
+	t->str = s;
+	return ESUCC;
+}
 
-	val = 0;
-	val |= bits_set(ENC_SIG, esig);
-	val |= bits_set(ENC_UNPACK, in->unpack);
-	val |= bits_set(ENC_PACK, epack);
-	val |= bits_set(ENC_COND_ADD, ecc[0]);
-	val |= bits_set(ENC_COND_MUL, ecc[1]);
-	val |= bits_set(ENC_WADDR_ADD, op->dst[0].num);
-	val |= bits_set(ENC_WADDR_MUL, op->dst[1].num);
-	if (in->pm)
-		val |= bits_on(ENC_PM);
-	if (in->sf)
-		val |= bits_on(ENC_SF);
-	if (in->ws)
-		val |= bits_on(ENC_WS);
-	in->hi = val;
+// Parse the complete statements, and copy out the new symbols.
+static
+int stream_parse(struct stream *st)
+{
+	int i, err, s, g;
+
+	st->prog.buf = st->text;
+	st->prog.size = st->safe;
+	s = num_syms;
+	g = num_globals;
+
+	err = parse_program(&st->prog);
+	// The loops are not hoisted; the window moves under their indices.
+	num_loop_heads = 0;
+	last_head = -1;
+	loop_end = 0;
+	for (i = s; i < num_syms && !err; ++i) {
+		err = own_token(&syms[i].name);
+		if (!err)
+			err = own_token(&syms[i].expr);
+	}
+	for (i = g; i < num_globals && !err; ++i)
+		err = own_token(&globals[i]);
+	return err;
+}
 
-	raddr_a = raddr_b = 39;	// NOP
+// Does the instruction refer to a name not seen yet?
+static
+int stream_waits(const struct instr *in, const struct instr *ins,
+		 int num_instrs)
+{
+	uint32_t val;
+	int i;
 
+	if (in->op.src_label.str && !lookup_label(ins, &in->op.src_label))
+		return 1;
 	for (i = 0; i < 4; ++i) {
-		switch (op->src[i].rf) {
-		case RF_A:
-			raddr_a = op->src[i].num;
-			emuxes[i] = 6;
-			break;
-		case RF_B:
-		case RF_SIMM:
-			raddr_b = op->src[i].num;
-			emuxes[i] = 7;
-			break;
-		case RF_ACC:
-			emuxes[i] = op->src[i].num;
-			break;
-		default:
-			assert(0);
-			break;
-		}
+		if (in->op.src[i].rf == RF_EXPR &&
+		    eval(&in->op.src[i].expr, ins, num_instrs, &val) == -ENOENT)
+			return 1;
 	}
-
-	code = op->code[1];
-	if (code >= OP_MUL_V8ADDS_ROTR5 && code <= OP_MUL_V8ADDS_ROT15)
-		raddr_b = 48 + (code - OP_MUL_V8ADDS_ROTR5);
-
-	val = 0;
-	val |= bits_set(ENC_ALU_OP_MUL, eop[1]);
-	val |= bits_set(ENC_ALU_OP_ADD, eop[0]);
-	val |= bits_set(ENC_ALU_RADDR_A, raddr_a);
-	val |= bits_set(ENC_ALU_RADDR_B, raddr_b);
-	val |= bits_set(ENC_ALU_ADD_0, emuxes[0]);
-	val |= bits_set(ENC_ALU_ADD_1, emuxes[1]);
-	val |= bits_set(ENC_ALU_MUL_0, emuxes[2]);
-	val |= bits_set(ENC_ALU_MUL_1, emuxes[3]);
-	in->lo = val;
-	return ESUCC;
+	return 0;
 }
 
 static
-int encode(struct instr *in)
+int stream_encode(struct program *prog, int ix)
 {
+	struct instr *in;
+	struct stage_clock c;
 	int err;
-	enum op_code code;
-	struct op *op;
 
-	op = &in->op;
-	code = op->code[0];
+	in = &prog->instrs[ix];
+	tick_start(&c);
+	err = verify(in, prog->instrs, prog->num_instrs);
+	tick_lap(&c, STAGE_VERIFY);
+	if (err)
+		return err;
 
-	err = -EINVAL;
-	if ((code == OP_NOP) ||
-	    (code >= OP_ADD_FADD && code <= OP_ADD_V8SUBS) ||
-	    (code >= OP_ADD_FADDI && code <= OP_ADD_V8SUBSI)) {
-		err = encode_alu(in);
-	} else if (code >= OP_BR_B && code <= OP_BR_BL) {
-		err = encode_branch(in);
-	} else if ((code >= OP_IMM_LI && code <= OP_IMM_LIU) ||
-		   (code >= OP_SEM_SEMUP && code <= OP_SEM_SEMDN)) {
-		err = encode_load_imm(in);
-	}
+	err = encode(in);
+	tick_lap(&c, STAGE_ENCODE);
 	return err;
 }
 
-// [ls, le)
 static
-int tokenize(const char *buf, int ls, int le)
+int add_fixup(struct stream *st, int ix)
 {
-	char in_token, is_delim;
-	int nt, i;
-
-	in_token = num_tokens = nt = 0;
-	for (i = ls; i < le; ++i) {
-		// Is it a delimiter?
-		is_delim = 0;
-		is_delim |= isspace(buf[i]) ? 1 : 0;
-		is_delim |= buf[i] == ',' ? 1 : 0;
-		is_delim |= buf[i] == '.' ? 1 : 0;
-		is_delim |= buf[i] == ';' ? 1 : 0;
-
-		if (is_delim) {
-			// It is a delimiter; close any previous token.
-			if (in_token) {
-				in_token = 0;
-				token_end[nt++] = i;
-			}
+	int *f, num;
+
+	if (st->num_fixups == st->max_fixups) {
+		num = st->max_fixups ? st->max_fixups * 2 : 16;
+		f = realloc(st->fixups, num * sizeof(*f));
+		stat_add(STAT_ALLOCS, 1);
+		if (f == NULL)
+			return -ENOMEM;
+		st->fixups = f;
+		st->max_fixups = num;
+	}
+	st->fixups[st->num_fixups++] = ix;
+	return ESUCC;
+}
 
-			if (isspace(buf[i]) || buf[i] == ',' || buf[i] == '.')
+// The instructions before s no longer move. Index their labels, then
+// encode the instructions whose names are now known. At the end of the
+// input, nothing waits any longer. On failure, *fault is the index of the
+// instruction.
+static
+int stream_settle(struct stream *st, int s, char eof, int *fault)
+{
+	struct program *prog;
+	struct instr *ins;
+	struct token label;
+	int i, j, n, num, err;
+
+	prog = &st->prog;
+	ins = prog->instrs;
+	num = prog->num_instrs;
+	for (i = st->settled; i < s; ++i) {
+		for (j = 0; j < ins[i].num_labels; ++j) {
+			label = ins[i].labels[j];
+			if (lookup_label(ins, &label))
 				continue;
+			err = own_token(&label);
+			if (!err)
+				err = add_label(&label, prog->base + i,
+						ins[i].pc);
+			if (err)
+				return err;
+		}
+	}
 
-			// Delim ; is a token.
-			assert(nt < MAX_TOKENS);
-			token_start[nt] = i;
-			token_end[nt++] = i + 1;
+	// Retry the fixups, if any names were added.
+	if (eof || num_syms + num_labels != st->num_names) {
+		st->num_names = num_syms + num_labels;
+		for (i = n = 0; i < st->num_fixups; ++i) {
+			j = st->fixups[i];
+			if (!eof && stream_waits(&ins[j], ins, num)) {
+				st->fixups[n++] = j;
+				continue;
+			}
+			err = stream_encode(prog, j);
+			if (err) {
+				*fault = j;
+				return err;
+			}
+		}
+		st->num_fixups = n;
+	}
 
-			assert(buf[i] == ';');
-			break;
-		} else if (!in_token) {
-			// Else it is a non-delim non-space char. Begin a
-			// token if not already begun.
-			assert(nt < MAX_TOKENS);
-			token_start[nt] = i;
-			in_token = 1;
+	for (i = st->settled; i < s; ++i) {
+		if (!eof && stream_waits(&ins[i], ins, num)) {
+			err = add_fixup(st, i);
+			if (err)
+				return err;
+			continue;
+		}
+		err = stream_encode(prog, i);
+		if (err) {
+			*fault = i;
+			return err;
 		}
 	}
+	st->settled = s;
+	return ESUCC;
+}
 
-	assert(i < le);
+// Print, and drop from the window, the instructions before n.
+static
+void stream_print(struct stream *st, int n)
+{
+	struct program *prog;
+	int i;
+
+	prog = &st->prog;
+	for (i = 0; i < n; ++i) {
+		if (verbosity >= VERBOSITY_NORMAL)
+			out_instr(&prog->instrs[i]);
+		free(prog->instrs[i].labels);
+	}
 
-	// We must see a ;, otherwise invalid instruction.
-	if (i == le)
-		return -EINVAL;
+	// Along with the empty instruction past the end.
+	memmove(&prog->instrs[0], &prog->instrs[n],
+		(prog->num_instrs + 1 - n) * sizeof(*prog->instrs));
+	prog->num_instrs -= n;
+	prog->num_encoded += n;
+	prog->base += n;
+	st->settled -= n;
+	for (i = 0; i < st->num_fixups; ++i)
+		st->fixups[i] -= n;
+}
+
+static inline
+const char *rebase(const char *p, const char *old, int drop, const char *text)
+{
+	return text + (p - old - drop);
+}
+
+static inline
+int low_water(const char *p, const char *text, int lw)
+{
+	return p && p - text < lw ? p - text : lw;
+}
+
+// Make room for the next read: drop the text that the window no longer
+// refers to, or else grow the buffer. The tokens move along.
+static
+int stream_make_room(struct stream *st)
+{
+	struct program *prog;
+	struct instr *in;
+	const char *old;
+	char *text;
+	int i, j, lw, drop;
+
+	prog = &st->prog;
+	old = st->text;
+	// Along with the labels of the instruction still to come.
+	lw = prog->pos;
+	for (i = 0; i <= prog->num_instrs; ++i) {
+		in = &prog->instrs[i];
+		if (in->line_end > in->line_start)
+			lw = in->line_start < lw ? in->line_start : lw;
+		for (j = 0; j < in->num_labels; ++j)
+			lw = low_water(in->labels[j].str, old, lw);
+		lw = low_water(in->op.src_label.str, old, lw);
+		for (j = 0; j < 4; ++j) {
+			if (in->op.src[j].rf == RF_EXPR)
+				lw = low_water(in->op.src[j].expr.str, old, lw);
+		}
+	}
+	drop = lw;
+
+	text = st->text;
+	if (drop < st->size / 2) {
+		text = malloc(st->size * 2);
+		stat_add(STAT_ALLOCS, 1);
+		if (text == NULL)
+			return -ENOMEM;
+	}
+	memmove(text, &old[drop], st->len - drop);
+
+	for (i = 0; i <= prog->num_instrs; ++i) {
+		in = &prog->instrs[i];
+		in->buf = text;
+		if (in->line_end > in->line_start) {
+			in->line_start -= drop;
+			in->line_end -= drop;
+		}
+		for (j = 0; j < in->num_labels; ++j)
+			in->labels[j].str = rebase(in->labels[j].str, old,
+						   drop, text);
+		if (in->op.src_label.str)
+			in->op.src_label.str = rebase(in->op.src_label.str,
+						      old, drop, text);
+		for (j = 0; j < 4; ++j) {
+			if (in->op.src[j].rf != RF_EXPR)
+				continue;
+			in->op.src[j].expr.str = rebase(in->op.src[j].expr.str,
+							old, drop, text);
+		}
+	}
 
-	assert(nt <= MAX_TOKENS);
-	num_tokens = nt;
+	if (text != st->text) {
+		free(st->text);
+		st->text = text;
+		st->size *= 2;
+	}
+	prog->buf = text;
+	prog->pos -= drop;
+	st->len -= drop;
+	st->seen -= drop;
+	st->safe -= drop;
 	return ESUCC;
 }
 
 static
-int parse_labels(struct instr *in, int ix, int size, int *out_le,
-		 int *out_ls)
+void free_stream(struct stream *st)
 {
-	int i, ls, j, nl;
-	const char *buf;
-	char **p;
+	int i;
 
-	buf = in->buf;
+	for (i = 0; i <= st->prog.num_instrs && st->prog.instrs; ++i)
+		free(st->prog.instrs[i].labels);
+	free(st->prog.instrs);
+	free(st->text);
+	free(st->fixups);
+}
 
-	i = ix;
-	for (;;) {
-		//Skip any whitespace.
-		for (i = i; i < size; ++i) {
-			if (!isspace(buf[i]))
+// Assemble what arrives on fd, printing as it goes.
+static inline
+int stream_program(int fd)
+{
+	struct stream st;
+	struct stage_clock c;
+	struct stage_span sp;
+	int err, n, fault, pc;
+	char eof;
+
+	memset(&st, 0, sizeof(st));
+	free(label_slots);
+	label_slots = NULL;
+	num_labels = 0;
+
+	st.size = STREAM_CHUNK;
+	st.text = malloc(st.size);
+	stat_add(STAT_ALLOCS, 1);
+	if (st.text == NULL)
+		return -ENOMEM;
+
+	fault = -1;
+	err = ESUCC;
+	for (eof = 0; !eof && !err;) {
+		if (st.len == st.size) {
+			err = stream_make_room(&st);
+			if (err)
 				break;
 		}
 
-		if (i == size) {
-			*out_ls = -1;
-			*out_le = i;
-			return ESUCC;
+		stage_start(&c);
+		n = read(fd, &st.text[st.len], st.size - st.len);
+		stage_stop(&c, STAGE_READ);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			err = -errno;
+			break;
 		}
-
-		// Scan for delims.
-		ls = i;
-		for (i = i; i < size; ++i) {
-			if (buf[i] == ';')
-				break;
-			if (buf[i] == '#')
-				break;
-			if (buf[i] == ':')
-				break;
+		eof = n == 0;
+		st.len += n;
+
+		// Only the statements that are complete can be parsed.
+		for (; st.seen < st.len; ++st.seen) {
+			if (st.in_comment)
+				st.in_comment = st.text[st.seen] != '\n';
+			else if (st.text[st.seen] == '#')
+				st.in_comment = 1;
+			else if (st.text[st.seen] == ';')
+				st.safe = st.seen + 1;
 		}
+		if (eof)
+			st.safe = st.len;
+		st.prog.more = !eof;
 
-		// Could not find a ;
-		if (i == size)
-			return -EINVAL;
+		err = stream_parse(&st);
+		if (err)
+			break;
 
-		// Found an instruction
-		if (buf[i] == ';') {
-			*out_ls = ls;
-			*out_le = i + 1;
-			return ESUCC;
-		}
+		// An li of the next instruction may go ahead of the last one.
+		n = st.prog.num_instrs;
+		if (!eof && n)
+			n = hoist_point(st.prog.instrs, n - 1);
+		span_start(&sp);
+		err = stream_settle(&st, n, eof, &fault);
+		span_stop(&sp);
+		if (err)
+			break;
 
-		// Found a comment. Ignore till the end of the line.
-		if (buf[i] == '#') {
-			for (i = i; i < size; ++i) {
-				if (buf[i] == '\n')
-					break;
-			}
-			continue;
-		}
+		stage_start(&c);
+		stream_print(&st, st.num_fixups ? st.fixups[0] : st.settled);
+		out_flush();
+		fflush(stdout);
+		stage_stop(&c, STAGE_OUTPUT);
+	}
 
-		// Else a : was found.
-		assert(buf[i] == ':');
-		for (j = ls; j < i; ++j) {
-			if (isspace(buf[j]))
-				return -EINVAL;
+	// Print up to the instruction that failed to encode.
+	if (err && fault >= 0) {
+		pc = st.prog.instrs[fault].pc;
+		n = fault;
+		if (st.num_fixups && st.fixups[0] < n)
+			n = st.fixups[0];
+		stream_print(&st, n);
+		if (verbosity >= VERBOSITY_NORMAL)
+			out_printf("fault at pc %x\n", pc);
+	}
+	if (verbosity >= VERBOSITY_NORMAL && !err)
+		out_str("done\n");
+	out_flush();
+	free_stream(&st);
+	return err;
+}
+
+#ifndef QAS_NO_MAIN
+static
+void print_stats(void)
+{
+	uint64_t ns, cycles;
+	int i;
+
+	ns = cycles = 0;
+	fprintf(stderr, "%-16s %14s %16s\n", "stage", "ns", "cycles");
+	for (i = 0; i < NUM_STAGES; ++i) {
+		fprintf(stderr, "%-16s %14llu %16llu\n", stage_name(i),
+			(unsigned long long)stage_times[i].ns,
+			(unsigned long long)stage_times[i].cycles);
+		ns += stage_times[i].ns;
+		cycles += stage_times[i].cycles;
+	}
+	fprintf(stderr, "%-16s %14llu %16llu\n", "total",
+		(unsigned long long)ns, (unsigned long long)cycles);
+
+#ifdef QAS_STATS
+	static const char *names[NUM_STATS] = {
+		"tokens",
+		"op_probes",
+		"reg_probes",
+		"label_probes",
+		"allocs",
+		"output_bytes",
+	};
+
+	for (i = 0; i < NUM_STATS; ++i)
+		fprintf(stderr, "%-16s %14llu\n", names[i],
+			(unsigned long long)stats[i]);
+#endif
+}
+
+// The symbols and relocations of an object, ahead of its instructions:
+// ".global name ix" for each exported label, and ".reloc ix name", or
+// ".reloc ix @target" for a local target, for each branch that leaves its
+// routine. A routine runs from a global label to the next; qas-link moves
+// each as a whole.
+static
+int print_object(const struct program *prog)
+{
+	const struct instr *ins, *in;
+	const struct token *label;
+	int *routine, i, t, r, n;
+
+	ins = prog->instrs;
+	n = prog->num_instrs;
+	routine = calloc(n + 1, sizeof(*routine));
+	stat_add(STAT_ALLOCS, 1);
+	if (routine == NULL)
+		return -ENOMEM;
+
+	for (i = 0; i < num_globals; ++i) {
+		t = find_label(ins, &globals[i]);
+		if (t < 0) {
+			free(routine);
+			return -EINVAL;
 		}
+		routine[t] = 1;
+		out_str(".global ");
+		out_write(globals[i].str, globals[i].len);
+		out_printf(" %d\n", t);
+	}
 
-		// Add the label to the current instruction.
-		nl = ++in->num_labels;
-		p = in->labels;
-		in->labels = p = realloc(p, nl * sizeof(char *));
-		p[nl - 1] = calloc(i - ls + 1, sizeof(char));
-		memcpy(p[nl - 1], &buf[ls], i - ls);
-		++i;
+	for (i = r = 0; i < n; ++i) {
+		r += routine[i];
+		routine[i] = r;
 	}
+
+	for (i = 0; i < n; ++i) {
+		in = &ins[i];
+		label = &in->op.src_label;
+		if (in->sig != OP_SIG_BR || label->str == NULL)
+			continue;
+		t = find_label(ins, label);
+		if (t >= 0 && routine[t] == routine[i])
+			continue;
+		if (t >= 0) {
+			out_printf(".reloc %d @%d\n", i, t);
+			continue;
+		}
+		out_printf(".reloc %d ", i);
+		out_write(label->str, label->len);
+		out_write("\n", 1);
+	}
+	free(routine);
+	return ESUCC;
 }
 
 int main(int argc, char **argv)
 {
-	int ls, le, i, err, num_instrs, j;
+	int i, err, n;
 	char *buf;
 	FILE *f;
-	long size, sz;
-	struct instr *instrs, *in;
-
-	if (argc != 2) {
-		printf("Usage: %s input.s\n", argv[0]);
+	long size;
+	struct program prog;
+	struct stage_clock c;
+	char show_dma, show_listing, layout, align, pipeline, threads, dce;
+	char if_convert, cse, stream;
+
+	show_dma = show_listing = layout = align = pipeline = threads = 0;
+	dce = if_convert = cse = 0;
+	err = ESUCC;
+	verbosity = VERBOSITY_NORMAL;
+	for (i = 1; i < argc - 1; ++i) {
+		if (!strcmp(argv[i], "-q"))
+			verbosity = VERBOSITY_QUIET;
+		else if (!strcmp(argv[i], "-v"))
+			verbosity = VERBOSITY_TOKENS;
+		else if (!strcmp(argv[i], "-c"))
+			object_mode = 1;
+		else if (!strcmp(argv[i], "--stats"))
+			show_stats = 1;
+		else if (!strcmp(argv[i], "--dma"))
+			show_dma = 1;
+		else if (!strcmp(argv[i], "--listing"))
+			show_listing = 1;
+		else if (!strcmp(argv[i], "--cse"))
+			cse = 1;
+		else if (!strcmp(argv[i], "--dce"))
+			dce = 1;
+		else if (!strcmp(argv[i], "--if-convert"))
+			if_convert = 1;
+		else if (!strcmp(argv[i], "--pipeline"))
+			pipeline = 1;
+		else if (!strcmp(argv[i], "--threads"))
+			threads = 1;
+		else if (!strcmp(argv[i], "--layout"))
+			layout = 1;
+		else if (!strcmp(argv[i], "--align"))
+			layout = align = 1;
+		else if (!strcmp(argv[i], "--profile") && i + 1 < argc - 1)
+			err = load_profile(argv[++i]);
+		else
+			break;
+		if (err)
+			return err;
+	}
+	layout |= num_profile > 0;
+
+	// The passes, and -c, need the whole program at once.
+	stream = i == argc - 1 && !strcmp(argv[i], "-");
+	if (stream && (object_mode || show_dma || show_listing || cse ||
+		       dce || if_convert || pipeline || threads || layout))
+		i = 0;
+	if (argc < 2 || i != argc - 1) {
+		printf("Usage: %s [-q | -v] [-c] [--stats] [--dma] [--listing] "
+		       "[--cse] [--dce] [--if-convert] [--pipeline] "
+		       "[--threads] [--layout] [--align] [--profile file] "
+		       "input.s\n"
+		       "       %s [-q | -v] [--stats] -\n"
+		       "With -, the input is assembled as it arrives. The li "
+		       "of the constants of a loop\n"
+		       "stay in it, as the branches to it are not all known; "
+		       "from a file, they go\n"
+		       "ahead of it, so the output may differ.\n",
+		       argv[0], argv[0]);
 		return -EINVAL;
 	}
 
-	f = fopen(argv[1], "rb");
+	if (stream) {
+		err = stream_program(STDIN_FILENO);
+		fflush(stdout);
+		if (show_stats)
+			print_stats();
+		return err;
+	}
+
+	stage_start(&c);
+	f = fopen(argv[argc - 1], "rb");
 	if (f == NULL)
 		return errno;
 
@@ -1090,73 +8098,97 @@ int main(int argc, char **argv)
 	fseek(f, 0, SEEK_SET);
 
 	buf = malloc(size);
+	stat_add(STAT_ALLOCS, 1);
 	if (buf == NULL)
 		return ENOMEM;
 	fread(buf, 1, size, f);
 	fclose(f);
+	stage_stop(&c, STAGE_READ);
 
-	num_instrs = 0;
-	instrs = malloc(100 * sizeof(*instrs));
-	for (i = 0; i < size;) {
-		in = &instrs[num_instrs];
-		memset(in, 0, sizeof(*in));
-		in->pc = num_instrs * 8;
-		in->buf = buf;
+	memset(&prog, 0, sizeof(prog));
+	prog.buf = buf;
+	prog.size = size;
 
-		err = parse_labels(in, i, size, &le, &ls);
-		if (err)
-			break;
-		i = le;
+	err = parse_program(&prog);
+	if (err) {
+		out_flush();
+		return err;
+	}
 
-		if (ls == -1)
-			continue;
+	err = hoist_loop_consts(prog.instrs, prog.num_instrs);
+	if (err)
+		return err;
 
-		err = tokenize(buf, ls, le);
+	if (cse) {
+		err = cse_program(&prog);
 		if (err)
-			break;
-
-		in->line_start = ls;
-		in->line_end = le;
-
-		printf("pc %x: ", in->pc);
-		print_tokens(buf);
+			return err;
+	}
 
-		err = parse(in);
+	if (dce) {
+		err = eliminate_dead_code(&prog);
 		if (err)
-			break;
-
-		++num_instrs;
-		if (num_instrs % 100)
-			continue;
-		sz = (num_instrs + 100) * sizeof(*instrs);
-		instrs = realloc(instrs, sz);
+			return err;
 	}
 
-	if (err)
-		return err;
+	if (if_convert) {
+		err = if_convert_program(&prog);
+		if (err)
+			return err;
+	}
 
-	for (i = 0; i < num_instrs; ++i) {
-		in = &instrs[i];
-		err = verify(in, instrs, num_instrs);
+	if (pipeline) {
+		err = pipeline_program(&prog);
 		if (err)
-			break;
-		err = encode(in);
+			return err;
+	}
+
+	if (threads) {
+		err = place_thread_switches(&prog);
 		if (err)
-			break;
-		printf("0x%08x, 0x%08x, // ", in->lo, in->hi);
+			return err;
+	}
 
-		for (j = 0; j < in->num_labels; ++j)
-			printf("%s: ", in->labels[j]);
+	if (layout) {
+		err = layout_program(&prog, align);
+		if (err)
+			return err;
+	}
 
-		for (j = in->line_start; j < in->line_end; ++j)
-			printf("%c", buf[j]);
-		printf("\n");
+	err = encode_program(&prog);
 
+	stage_start(&c);
+	n = verbosity >= VERBOSITY_NORMAL ? prog.num_encoded : 0;
+	if (object_mode && n && !err) {
+		// A .global of a label that is not defined.
+		err = print_object(&prog);
+		if (err)
+			n = 0;
+	}
+	for (i = 0; i < n; ++i)
+		out_instr(&prog.instrs[i]);
+
+	if (verbosity >= VERBOSITY_NORMAL && !err)
+		out_str("done\n");
+	else if (verbosity >= VERBOSITY_NORMAL &&
+		 prog.num_encoded < prog.num_instrs)
+		out_printf("fault at pc %x\n",
+			   prog.instrs[prog.num_encoded].pc);
+	out_flush();
+	stage_stop(&c, STAGE_OUTPUT);
+
+	if (show_listing) {
+		fflush(stdout);
+		print_listing(&prog);
+	}
+	if (show_dma && !err) {
+		fflush(stdout);
+		err = analyze_dma(prog.instrs, prog.num_instrs);
+	}
+	if (show_stats) {
+		fflush(stdout);
+		print_stats();
 	}
-
-	if (i == num_instrs)
-		printf("done\n");
-	else
-		printf("fault at pc %x\n", in->pc);
 	return err;
 }
+#endif
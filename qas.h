@@ -5,6 +5,7 @@
 #define QAS_H
 
 #include <stdint.h>
+#include <string.h>
 #include <errno.h>
 
 #include "bits.h"
@@ -12,7 +13,13 @@
 #define NUM_ARR(a)			((int)(sizeof(a)/sizeof(a[0])))
 
 #define ESUCC				0
-#define MAX_TOKENS			256
+
+// The encoders below are constexpr for qas.hpp.
+#ifdef __cplusplus
+#define QAS_CONSTEXPR			constexpr
+#else
+#define QAS_CONSTEXPR
+#endif
 
 enum op_code {
 	OP_INVALID,
@@ -125,6 +132,37 @@ enum op_code {
 	OP_PACK_MUL_8B,
 	OP_PACK_MUL_8C,
 	OP_PACK_MUL_8D,
+	OP_PACK_A_16A,
+	OP_PACK_A_16B,
+	OP_PACK_A_8888,
+	OP_PACK_A_8A,
+	OP_PACK_A_8B,
+	OP_PACK_A_8C,
+	OP_PACK_A_8D,
+	OP_PACK_A_32_SAT,
+	OP_PACK_A_16A_SAT,
+	OP_PACK_A_16B_SAT,
+	OP_PACK_A_8888_SAT,
+	OP_PACK_A_8A_SAT,
+	OP_PACK_A_8B_SAT,
+	OP_PACK_A_8C_SAT,
+	OP_PACK_A_8D_SAT,
+
+	OP_UNPACK_NOP,
+	OP_UNPACK_A_16A,
+	OP_UNPACK_A_16B,
+	OP_UNPACK_A_8D_REP,
+	OP_UNPACK_A_8A,
+	OP_UNPACK_A_8B,
+	OP_UNPACK_A_8C,
+	OP_UNPACK_A_8D,
+	OP_UNPACK_R4_16A,
+	OP_UNPACK_R4_16B,
+	OP_UNPACK_R4_8D_REP,
+	OP_UNPACK_R4_8A,
+	OP_UNPACK_R4_8B,
+	OP_UNPACK_R4_8C,
+	OP_UNPACK_R4_8D,
 
 	// These signals cannot be specified explicitly.
 	// They are used to set in->sig.
@@ -140,6 +178,7 @@ enum reg_file {
 	RF_SIMM,
 	RF_ACC,
 	RF_IMM,
+	RF_EXPR,	// A constant expression, folded by verify().
 };
 
 enum cc {
@@ -525,7 +564,7 @@ const struct op_info g_op_info[] = {
 	{"mul24i",	OP_MUL_MUL24I},
 	{"v8muldi",	OP_MUL_V8MULDI},
 	{"v8mini",	OP_MUL_V8MINI},
-	{"v8maxi",	OP_MUL_V8MAX},
+	{"v8maxi",	OP_MUL_V8MAXI},
 
 	{"v8asrotr5",	OP_MUL_V8ADDS_ROTR5},
 	{"v8asrot1",	OP_MUL_V8ADDS_ROT1},
@@ -574,11 +613,82 @@ const struct op_info g_op_info[] = {
 	{"pm8b",	OP_PACK_MUL_8B},
 	{"pm8c",	OP_PACK_MUL_8C},
 	{"pm8d",	OP_PACK_MUL_8D},
+	{"pa16a",	OP_PACK_A_16A},
+	{"pa16b",	OP_PACK_A_16B},
+	{"pa8888",	OP_PACK_A_8888},
+	{"pa8a",	OP_PACK_A_8A},
+	{"pa8b",	OP_PACK_A_8B},
+	{"pa8c",	OP_PACK_A_8C},
+	{"pa8d",	OP_PACK_A_8D},
+	{"pa32s",	OP_PACK_A_32_SAT},
+	{"pa16as",	OP_PACK_A_16A_SAT},
+	{"pa16bs",	OP_PACK_A_16B_SAT},
+	{"pa8888s",	OP_PACK_A_8888_SAT},
+	{"pa8as",	OP_PACK_A_8A_SAT},
+	{"pa8bs",	OP_PACK_A_8B_SAT},
+	{"pa8cs",	OP_PACK_A_8C_SAT},
+	{"pa8ds",	OP_PACK_A_8D_SAT},
+
+	{"ua16a",	OP_UNPACK_A_16A},
+	{"ua16b",	OP_UNPACK_A_16B},
+	{"ua8dr",	OP_UNPACK_A_8D_REP},
+	{"ua8a",	OP_UNPACK_A_8A},
+	{"ua8b",	OP_UNPACK_A_8B},
+	{"ua8c",	OP_UNPACK_A_8C},
+	{"ua8d",	OP_UNPACK_A_8D},
+	{"ur16a",	OP_UNPACK_R4_16A},
+	{"ur16b",	OP_UNPACK_R4_16B},
+	{"ur8dr",	OP_UNPACK_R4_8D_REP},
+	{"ur8a",	OP_UNPACK_R4_8A},
+	{"ur8b",	OP_UNPACK_R4_8B},
+	{"ur8c",	OP_UNPACK_R4_8C},
+	{"ur8d",	OP_UNPACK_R4_8D},
+};
+
+// The classes of the chars, for scan(), and for the names and numbers.
+#define CH_WS				0x01	// isspace()
+#define CH_SEP				0x02	// , .
+#define CH_STOP				0x04	// ; # :
+#define CH_DIGIT			0x08
+#define CH_ALPHA			0x10	// And _.
+#define CH_HEX				0x20
+
+#define CW				CH_WS
+#define CS				CH_SEP
+#define CP				CH_STOP
+#define CD				(CH_DIGIT | CH_HEX)
+#define CX				(CH_ALPHA | CH_HEX)
+#define CL				CH_ALPHA
+
+static
+const uint8_t g_char_class[256] = {
+	0,  0,  0,  0,  0,  0,  0,  0,  0,  CW, CW, CW, CW, CW, 0,  0,
+	0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	CW, 0,  0,  CP, 0,  0,  0,  0,  0,  0,  0,  0,  CS, 0,  CS, 0,
+	CD, CD, CD, CD, CD, CD, CD, CD, CD, CD, CP, CP, 0,  0,  0,  0,
+	0,  CX, CX, CX, CX, CX, CX, CL, CL, CL, CL, CL, CL, CL, CL, CL,
+	CL, CL, CL, CL, CL, CL, CL, CL, CL, CL, CL, 0,  0,  0,  0,  CL,
+	0,  CX, CX, CX, CX, CX, CX, CL, CL, CL, CL, CL, CL, CL, CL, CL,
+	CL, CL, CL, CL, CL, CL, CL, CL, CL, CL, CL, 0,  0,  0,  0,  0,
+};
+
+#undef CW
+#undef CS
+#undef CP
+#undef CD
+#undef CX
+#undef CL
+
+// A view into the source buffer; not NUL-terminated.
+struct token {
+	const char			*str;
+	int				len;
 };
 
 struct reg {
 	enum reg_file			rf;
 	int				num;
+	struct token			expr;
 };
 
 struct op {
@@ -586,7 +696,7 @@ struct op {
 	enum cc			cc[2];
 	struct reg		dst[2];
 	struct reg		src[4];
-	char			*src_label;
+	struct token		src_label;
 };
 
 struct instr {
@@ -596,19 +706,23 @@ struct instr {
 
 	enum op_code			sig;
 	enum op_code			pack;
+	enum op_code			unpack;
 
 	char				sf;
 	char				pm;
 	char				ws;
-	char				unpack;
 	char				rel_br;
 	char				reg_br;
+	char				inverted;	// By --layout.
+	char				inserted;	// By select_imms().
+	char				converted;	// By --if-convert.
+	char				rewritten;	// By --cse.
 
 	struct op			op;
 
 	const char			*buf;
 	int				curr_token;
-	char				**labels;
+	struct token			*labels;
 	int				num_labels;
 	int				line_start;
 	int				line_end;
@@ -661,7 +775,7 @@ struct instr {
 #define ENC_BR_REL_BITS			1
 #define ENC_BR_COND_BITS		4
 
-static
+static QAS_CONSTEXPR
 int encode_cond(enum cc code)
 {
 	switch (code) {
@@ -677,7 +791,7 @@ int encode_cond(enum cc code)
 	}
 }
 
-static
+static QAS_CONSTEXPR
 int encode_cond_br(enum cc code)
 {
 	switch (code) {
@@ -698,7 +812,77 @@ int encode_cond_br(enum cc code)
 	}
 }
 
-static
+// The branch condition that holds exactly when the given one does not.
+static QAS_CONSTEXPR
+enum cc invert_cond_br(enum cc code)
+{
+	switch (code) {
+	case CC_ALL_Z:			return CC_NZ;
+	case CC_ALL_NZ:			return CC_Z;
+	case CC_Z:			return CC_ALL_NZ;
+	case CC_NZ:			return CC_ALL_Z;
+	case CC_ALL_N:			return CC_NN;
+	case CC_ALL_NN:			return CC_N;
+	case CC_N:			return CC_ALL_NN;
+	case CC_NN:			return CC_ALL_N;
+	case CC_ALL_C:			return CC_NC;
+	case CC_ALL_NC:			return CC_C;
+	case CC_C:			return CC_ALL_NC;
+	case CC_NC:			return CC_ALL_C;
+	case CC_ALWAYS:			return CC_NEVER;
+	default:			return CC_ALWAYS;
+	}
+}
+
+// The per-lane condition under which a branch on flags that are the same
+// in all the lanes is not taken.
+static QAS_CONSTEXPR
+enum cc lane_cond_br(enum cc code)
+{
+	switch (code) {
+	case CC_ALL_Z:			return CC_NZ;
+	case CC_ALL_NZ:			return CC_Z;
+	case CC_Z:			return CC_NZ;
+	case CC_NZ:			return CC_Z;
+	case CC_ALL_N:			return CC_NN;
+	case CC_ALL_NN:			return CC_N;
+	case CC_N:			return CC_NN;
+	case CC_NN:			return CC_N;
+	case CC_ALL_C:			return CC_NC;
+	case CC_ALL_NC:			return CC_C;
+	case CC_C:			return CC_NC;
+	case CC_NC:			return CC_C;
+	default:			return CC_NEVER;
+	}
+}
+
+// Does the op give the same result with its srcs swapped?
+static QAS_CONSTEXPR
+int is_commutative(enum op_code code)
+{
+	switch (code) {
+	case OP_ADD_FADD:
+	case OP_ADD_FMIN:
+	case OP_ADD_FMAX:
+	case OP_ADD_FMINABS:
+	case OP_ADD_FMAXABS:
+	case OP_ADD_ADD:
+	case OP_ADD_MIN:
+	case OP_ADD_MAX:
+	case OP_ADD_AND:
+	case OP_ADD_OR:
+	case OP_ADD_XOR:
+	case OP_ADD_V8ADDS:
+	case OP_MUL_FMUL:
+	case OP_MUL_MUL24:
+	case OP_MUL_V8MULD:
+	case OP_MUL_V8MIN:
+	case OP_MUL_V8MAX:		return 1;
+	default:			return 0;
+	}
+}
+
+static QAS_CONSTEXPR
 int encode_pack(enum op_code pack)
 {
 	switch (pack) {
@@ -708,11 +892,64 @@ int encode_pack(enum op_code pack)
 	case OP_PACK_MUL_8B:		return 5;
 	case OP_PACK_MUL_8C:		return 6;
 	case OP_PACK_MUL_8D:		return 7;
+	case OP_PACK_A_16A:		return 1;
+	case OP_PACK_A_16B:		return 2;
+	case OP_PACK_A_8888:		return 3;
+	case OP_PACK_A_8A:		return 4;
+	case OP_PACK_A_8B:		return 5;
+	case OP_PACK_A_8C:		return 6;
+	case OP_PACK_A_8D:		return 7;
+	case OP_PACK_A_32_SAT:		return 8;
+	case OP_PACK_A_16A_SAT:		return 9;
+	case OP_PACK_A_16B_SAT:		return 10;
+	case OP_PACK_A_8888_SAT:	return 11;
+	case OP_PACK_A_8A_SAT:		return 12;
+	case OP_PACK_A_8B_SAT:		return 13;
+	case OP_PACK_A_8C_SAT:		return 14;
+	case OP_PACK_A_8D_SAT:		return 15;
 	default:			return -EINVAL;
 	}
 }
 
-static
+// The pm bit selects between the regfile A and the r4 unpack.
+static QAS_CONSTEXPR
+int encode_unpack(enum op_code unpack)
+{
+	switch (unpack) {
+	case OP_UNPACK_NOP:		return 0;
+	case OP_UNPACK_A_16A:
+	case OP_UNPACK_R4_16A:		return 1;
+	case OP_UNPACK_A_16B:
+	case OP_UNPACK_R4_16B:		return 2;
+	case OP_UNPACK_A_8D_REP:
+	case OP_UNPACK_R4_8D_REP:	return 3;
+	case OP_UNPACK_A_8A:
+	case OP_UNPACK_R4_8A:		return 4;
+	case OP_UNPACK_A_8B:
+	case OP_UNPACK_R4_8B:		return 5;
+	case OP_UNPACK_A_8C:
+	case OP_UNPACK_R4_8C:		return 6;
+	case OP_UNPACK_A_8D:
+	case OP_UNPACK_R4_8D:		return 7;
+	default:			return -EINVAL;
+	}
+}
+
+// Load immediates reuse the unpack field for their type.
+static QAS_CONSTEXPR
+int encode_load_imm_type(enum op_code code)
+{
+	switch (code) {
+	case OP_IMM_LI:			return 0;
+	case OP_IMM_LIS:		return 1;
+	case OP_IMM_LIU:		return 3;
+	case OP_SEM_SEMUP:
+	case OP_SEM_SEMDN:		return 4;
+	default:			return -EINVAL;
+	}
+}
+
+static QAS_CONSTEXPR
 int encode_sig(enum op_code sig)
 {
 	switch (sig) {
@@ -736,7 +973,7 @@ int encode_sig(enum op_code sig)
 	}
 }
 
-static
+static QAS_CONSTEXPR
 int encode_alu_op_mul(enum op_code code)
 {
 	switch (code) {
@@ -774,7 +1011,7 @@ int encode_alu_op_mul(enum op_code code)
 	}
 }
 
-static
+static QAS_CONSTEXPR
 int encode_alu_op_add(enum op_code code)
 {
 	switch (code) {
@@ -831,30 +1068,53 @@ int encode_alu_op_add(enum op_code code)
 	}
 }
 
-static
+static inline
 int is_hex_digit(int c)
 {
-	int i;
-	static const char *hex = "0123456789abcdef";
-	static const char *HEX = "0123456789ABCDEF";
-
-	for (i = 0; i < 16; ++i)
-		if (c == hex[i] || c == HEX[i])
-			return 1;
-	return 0;
+	return (unsigned int)c < 256 && (g_char_class[c] & CH_HEX);
 }
 
-static
+static inline
 int count_ones(uint64_t mask)
 {
+#if defined(__GNUC__)
+	return __builtin_popcountll(mask);
+#else
 	int num;
 
-	num = 0;
-	while (mask) {
-		if (mask & 1)
-			++num;
+	for (num = 0; mask; ++num)
+		mask &= mask - 1;
+	return num;
+#endif
+}
+
+static inline
+int token_is(const struct token *tok, const char *str)
+{
+	int len;
+
+	len = strlen(str);
+	return tok->len == len && !memcmp(tok->str, str, len);
+}
+
+static inline
+int token_eq(const struct token *a, const struct token *b)
+{
+	return a->len == b->len && !memcmp(a->str, b->str, a->len);
+}
+
+// Index of the least significant set bit. mask must be non-zero.
+static inline
+int first_one(uint64_t mask)
+{
+#if defined(__GNUC__)
+	return __builtin_ctzll(mask);
+#else
+	int num;
+
+	for (num = 0; !(mask & 1); ++num)
 		mask >>= 1;
-	}
 	return num;
+#endif
 }
 #endif
@@ -0,0 +1,373 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright (c) 2021 Amol Surati
+
+#ifndef QAS_HPP
+#define QAS_HPP
+
+// Builds the 64-bit words of instructions from C++17, without the text,
+// with the ENC_* layout and the encoders of qas.h. The builders are
+// constexpr: an instruction that breaks the rules of verify_alu() fails
+// to compile when built in a constant expression, and throws
+// std::invalid_argument when built at run time.
+//
+//	constexpr uint64_t w = qas::alu(qas::add(qas::r0, qas::ra(5),
+//						 qas::simm(3)),
+//					qas::fmul(qas::r1, qas::r2, qas::r3));
+//
+// The words are those of the qas output, hi << 32 | lo. Packs, unpacks
+// and the v8adds rotations are not built here.
+
+#include <cstdint>
+#include <stdexcept>
+
+#include "qas.h"
+
+namespace qas {
+
+enum access : uint8_t {
+	READ				= 1,
+	WRITE				= 2,
+};
+
+// The accumulators, regfile A or B, either regfile (the I/O registers
+// that are at the same address in both), and the small immediates.
+enum class file : uint8_t {
+	acc,
+	a,
+	b,
+	ab,
+	simm,
+};
+
+struct reg {
+	file				f;
+	uint8_t				num;
+	uint8_t				access;
+};
+
+constexpr void check(bool ok, const char *why)
+{
+	if (!ok)
+		throw std::invalid_argument(why);
+}
+
+constexpr reg r0			{file::acc, 0, READ | WRITE};
+constexpr reg r1			{file::acc, 1, READ | WRITE};
+constexpr reg r2			{file::acc, 2, READ | WRITE};
+constexpr reg r3			{file::acc, 3, READ | WRITE};
+constexpr reg r4			{file::acc, 4, READ};
+constexpr reg r5			{file::acc, 5, READ | WRITE};
+
+// The I/O registers; see g_src_reg_info[] and g_dst_reg_info[] of qas.h.
+constexpr reg uni_rd			{file::ab, 32, READ};
+constexpr reg ele_num			{file::a, 38, READ};
+constexpr reg qpu_num			{file::b, 38, READ};
+constexpr reg host_int			{file::ab, 38, WRITE};
+constexpr reg nop			{file::ab, 39, READ | WRITE};
+constexpr reg vpm			{file::ab, 48, READ | WRITE};
+constexpr reg vpm_rd_setup		{file::a, 49, WRITE};
+constexpr reg vpm_wr_setup		{file::b, 49, WRITE};
+constexpr reg vdr_addr			{file::a, 50, WRITE};
+constexpr reg vdw_addr			{file::b, 50, WRITE};
+constexpr reg vdr_wait			{file::a, 50, READ};
+constexpr reg vdw_wait			{file::b, 50, READ};
+constexpr reg mutex			{file::ab, 51, READ | WRITE};
+constexpr reg sfu_recip			{file::ab, 52, WRITE};
+constexpr reg sfu_rsqrt			{file::ab, 53, WRITE};
+constexpr reg sfu_exp			{file::ab, 54, WRITE};
+constexpr reg sfu_log			{file::ab, 55, WRITE};
+constexpr reg tmu0_s			{file::ab, 56, WRITE};
+constexpr reg tmu1_s			{file::ab, 60, WRITE};
+
+constexpr reg ra(int num)
+{
+	check(num >= 0 && num < 32, "no such regfile register");
+	return reg{file::a, (uint8_t)num, READ | WRITE};
+}
+
+constexpr reg rb(int num)
+{
+	check(num >= 0 && num < 32, "no such regfile register");
+	return reg{file::b, (uint8_t)num, READ | WRITE};
+}
+
+// The integer small immediates, -16 to 15.
+constexpr reg simm(int val)
+{
+	check(val >= -16 && val < 16, "not a small immediate");
+	return reg{file::simm, (uint8_t)(val & 31), READ};
+}
+
+// An op of the add or the mul ALU. The cond defaults to always, or to
+// never for a nop.
+struct op {
+	enum op_code			code;
+	enum cc				cc;
+	reg				dst;
+	reg				a;
+	reg				b;
+	bool				mul;
+
+	constexpr op cond(enum cc c) const
+	{
+		op o = *this;
+
+		o.cc = c;
+		return o;
+	}
+};
+
+constexpr op add_nop			{OP_NOP, CC_NEVER, nop, r0, r0, false};
+constexpr op mul_nop			{OP_NOP, CC_NEVER, nop, r0, r0, true};
+
+#define QAS_OP(name, code, mul)						\
+constexpr op name(reg dst, reg a, reg b)				\
+{									\
+	return op{code, CC_ALWAYS, dst, a, b, mul};			\
+}
+
+QAS_OP(fadd,	OP_ADD_FADD,	false)
+QAS_OP(fsub,	OP_ADD_FSUB,	false)
+QAS_OP(fmin,	OP_ADD_FMIN,	false)
+QAS_OP(fmax,	OP_ADD_FMAX,	false)
+QAS_OP(fminabs,	OP_ADD_FMINABS,	false)
+QAS_OP(fmaxabs,	OP_ADD_FMAXABS,	false)
+QAS_OP(ftoi,	OP_ADD_FTOI,	false)
+QAS_OP(itof,	OP_ADD_ITOF,	false)
+QAS_OP(add,	OP_ADD_ADD,	false)
+QAS_OP(sub,	OP_ADD_SUB,	false)
+QAS_OP(shr,	OP_ADD_SHR,	false)
+QAS_OP(asr,	OP_ADD_ASR,	false)
+QAS_OP(ror,	OP_ADD_ROR,	false)
+QAS_OP(shl,	OP_ADD_SHL,	false)
+QAS_OP(min,	OP_ADD_MIN,	false)
+QAS_OP(max,	OP_ADD_MAX,	false)
+QAS_OP(and_,	OP_ADD_AND,	false)
+QAS_OP(or_,	OP_ADD_OR,	false)
+QAS_OP(xor_,	OP_ADD_XOR,	false)
+QAS_OP(not_,	OP_ADD_NOT,	false)
+QAS_OP(clz,	OP_ADD_CLZ,	false)
+QAS_OP(v8adds,	OP_ADD_V8ADDS,	false)
+QAS_OP(v8subs,	OP_ADD_V8SUBS,	false)
+QAS_OP(fmul,	OP_MUL_FMUL,	true)
+QAS_OP(mul24,	OP_MUL_MUL24,	true)
+QAS_OP(v8muld,	OP_MUL_V8MULD,	true)
+QAS_OP(v8min,	OP_MUL_V8MIN,	true)
+QAS_OP(v8max,	OP_MUL_V8MAX,	true)
+#undef QAS_OP
+
+constexpr op mov(reg dst, reg src)
+{
+	return or_(dst, src, src);
+}
+
+// The write address of a destination, in its regfile.
+constexpr int waddr(const reg &r)
+{
+	check(r.access & WRITE, "not a writable register");
+	if (r.f == file::acc)
+		return r.num == 5 ? 37 : 32 + r.num;
+	return r.num;
+}
+
+// Both ALUs cannot write to the same regfile. ws swaps the add to B and
+// the mul to A. As resolve_dst_regs().
+constexpr bool write_swap(const reg &add_dst, const reg &mul_dst)
+{
+	check(!(add_dst.f == file::a && mul_dst.f == file::a) &&
+	      !(add_dst.f == file::b && mul_dst.f == file::b),
+	      "both ALUs write to the same regfile");
+	return add_dst.f == file::b || mul_dst.f == file::a;
+}
+
+constexpr uint64_t word(uint32_t hi, uint32_t lo)
+{
+	return (uint64_t)hi << 32 | lo;
+}
+
+// The regfile reads of an instruction: one address from each, with the
+// small immediate in place of B. The registers in both files go to A
+// unless it is taken. Returns the mux of the source.
+struct reads {
+	int				raddr_a = -1;
+	int				raddr_b = -1;
+	bool				simm = false;
+
+	constexpr int read_a(int num)
+	{
+		check(raddr_a < 0 || raddr_a == num,
+		      "two regfile A reads of different registers");
+		raddr_a = num;
+		return 6;
+	}
+
+	constexpr int read_b(int num, bool is_simm)
+	{
+		check(raddr_b < 0 || (raddr_b == num && simm == is_simm),
+		      "two regfile B reads, or one with a small immediate");
+		raddr_b = num;
+		simm = is_simm;
+		return 7;
+	}
+
+	constexpr int fixed(const reg &r)
+	{
+		check(r.access & READ, "not a readable register");
+		switch (r.f) {
+		case file::acc:		return r.num;
+		case file::a:		return read_a(r.num);
+		case file::b:		return read_b(r.num, false);
+		case file::simm:	return read_b(r.num, true);
+		default:		return -1;
+		}
+	}
+
+	constexpr int either(const reg &r)
+	{
+		if (raddr_a < 0 || raddr_a == r.num)
+			return read_a(r.num);
+		return read_b(r.num, false);
+	}
+};
+
+constexpr uint64_t alu(const op &add, const op &mul,
+		       enum op_code sig = OP_SIG_NONE, bool sf = false)
+{
+	const reg *srcs[4] = {&add.a, &add.b, &mul.a, &mul.b};
+	int muxes[4] = {0, 0, 0, 0};
+	int ecc[2] = {0, 0}, eop[2] = {0, 0}, esig = 0, i = 0;
+	uint32_t hi = 0, lo = 0;
+	bool ws = false;
+	reads r;
+
+	check(!add.mul && mul.mul, "an add op, then a mul op");
+	check(sig != OP_SIG_SIMM && sig != OP_SIG_LI && sig != OP_SIG_BR,
+	      "not an ALU signal");
+
+	for (i = 0; i < 4; ++i)
+		muxes[i] = r.fixed(*srcs[i]);
+	for (i = 0; i < 4; ++i) {
+		if (muxes[i] < 0)
+			muxes[i] = r.either(*srcs[i]);
+	}
+	check(!r.simm || sig == OP_SIG_NONE,
+	      "a small immediate takes the signal");
+
+	ws = write_swap(add.dst, mul.dst);
+	ecc[0] = encode_cond(add.code == OP_NOP ? CC_NEVER : add.cc);
+	ecc[1] = encode_cond(mul.code == OP_NOP ? CC_NEVER : mul.cc);
+	eop[0] = encode_alu_op_add(add.code);
+	eop[1] = encode_alu_op_mul(mul.code);
+	esig = encode_sig(r.simm ? OP_SIG_SIMM : sig);
+	check(ecc[0] >= 0 && ecc[1] >= 0, "not an ALU condition");
+	check(eop[0] >= 0 && eop[1] >= 0 && esig >= 0, "not encodable");
+
+	hi = 0;
+	hi |= bits_set(ENC_SIG, esig);
+	hi |= bits_set(ENC_COND_ADD, ecc[0]);
+	hi |= bits_set(ENC_COND_MUL, ecc[1]);
+	hi |= bits_set(ENC_WADDR_ADD, waddr(add.dst));
+	hi |= bits_set(ENC_WADDR_MUL, waddr(mul.dst));
+	if (sf)
+		hi |= bits_on(ENC_SF);
+	if (ws)
+		hi |= bits_on(ENC_WS);
+
+	lo = 0;
+	lo |= bits_set(ENC_ALU_OP_MUL, eop[1]);
+	lo |= bits_set(ENC_ALU_OP_ADD, eop[0]);
+	lo |= bits_set(ENC_ALU_RADDR_A, r.raddr_a < 0 ? 39 : r.raddr_a);
+	lo |= bits_set(ENC_ALU_RADDR_B, r.raddr_b < 0 ? 39 : r.raddr_b);
+	lo |= bits_set(ENC_ALU_ADD_0, muxes[0]);
+	lo |= bits_set(ENC_ALU_ADD_1, muxes[1]);
+	lo |= bits_set(ENC_ALU_MUL_0, muxes[2]);
+	lo |= bits_set(ENC_ALU_MUL_1, muxes[3]);
+	return word(hi, lo);
+}
+
+// A single op, on its own ALU.
+constexpr uint64_t alu(const op &o, enum op_code sig = OP_SIG_NONE,
+		       bool sf = false)
+{
+	return o.mul ? alu(add_nop, o, sig, sf) : alu(o, mul_nop, sig, sf);
+}
+
+constexpr uint64_t signal(enum op_code sig)
+{
+	return alu(add_nop, mul_nop, sig);
+}
+
+// li writes imm through both ALUs; a nop destination is not written.
+constexpr uint64_t load_imm(enum op_code type, reg add_dst, reg mul_dst,
+			    uint32_t imm, bool sf = false)
+{
+	int etype = 0;
+	uint32_t hi = 0;
+
+	etype = encode_load_imm_type(type);
+	check(etype >= 0, "not a load immediate");
+
+	hi = 0;
+	hi |= bits_set(ENC_SIG, encode_sig(OP_SIG_LI));
+	hi |= bits_set(ENC_UNPACK, etype);
+	hi |= bits_set(ENC_COND_ADD, encode_cond(add_dst.num == 39 &&
+						 add_dst.f == file::ab &&
+						 !sf ? CC_NEVER : CC_ALWAYS));
+	hi |= bits_set(ENC_COND_MUL, encode_cond(mul_dst.num == 39 &&
+						 mul_dst.f == file::ab ?
+						 CC_NEVER : CC_ALWAYS));
+	hi |= bits_set(ENC_WADDR_ADD, waddr(add_dst));
+	hi |= bits_set(ENC_WADDR_MUL, waddr(mul_dst));
+	if (sf)
+		hi |= bits_on(ENC_SF);
+	if (write_swap(add_dst, mul_dst))
+		hi |= bits_on(ENC_WS);
+	return word(hi, imm);
+}
+
+constexpr uint64_t li(reg add_dst, reg mul_dst, uint32_t imm,
+		      bool sf = false)
+{
+	return load_imm(OP_IMM_LI, add_dst, mul_dst, imm, sf);
+}
+
+// Bit 4 selects the decrement.
+constexpr uint64_t semup(int sem)
+{
+	check(sem >= 0 && sem < 16, "no such semaphore");
+	return load_imm(OP_SEM_SEMUP, nop, nop, sem);
+}
+
+constexpr uint64_t semdn(int sem)
+{
+	check(sem >= 0 && sem < 16, "no such semaphore");
+	return load_imm(OP_SEM_SEMDN, nop, nop, sem | 1 << 4);
+}
+
+// A branch to rel bytes from the pc of its fourth successor, the pc + 32,
+// as the verified branches of qas. bl writes that pc to link.
+constexpr uint64_t bl(enum cc c, reg link, int32_t rel)
+{
+	int ecc = 0;
+	uint32_t hi = 0;
+
+	ecc = encode_cond_br(c);
+	check(ecc >= 0, "not a branch condition");
+
+	hi = 0;
+	hi |= bits_set(ENC_SIG, encode_sig(OP_SIG_BR));
+	hi |= bits_set(ENC_BR_COND, ecc);
+	hi |= bits_on(ENC_BR_REL);
+	hi |= bits_set(ENC_WADDR_ADD, waddr(link));
+	hi |= bits_set(ENC_WADDR_MUL, 39);
+	if (link.f == file::b)
+		hi |= bits_on(ENC_WS);
+	return word(hi, (uint32_t)rel);
+}
+
+constexpr uint64_t b(enum cc c, int32_t rel)
+{
+	return bl(c, nop, rel);
+}
+} // namespace qas
+#endif